@@ -1,9 +1,18 @@
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <ctype.h>
 #include <stdarg.h>
+#include <setjmp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 typedef unsigned char u8;
 
@@ -50,9 +59,96 @@ struct AsmIns
     int op2;
 };
 
-struct AsmIns isa[200];
+#define ISASZ 200
+
+struct AsmIns isa[ISASZ];
 int isasz;
 
+/*
+ * Index of the opcode table on (mnemonic, operand types): open addressing,
+ * at most half full. Only the first of equal entries is indexed, which is
+ * the one a linear scan would find.
+ */
+#define ISAIDXSZ 512
+
+struct AsmIns *isaidx[ISAIDXSZ];
+
+unsigned int
+strhash(char *s)
+{
+    unsigned int h;
+
+    h = 2166136261u;
+    while(*s)
+    {
+        h = (h ^ (unsigned char)*s++)*16777619u;
+    }
+
+    return(h);
+}
+
+unsigned int
+inshash(char *mnem, int numop, int op1, int op2)
+{
+    unsigned int h;
+
+    h = strhash(mnem);
+    h = (h ^ (unsigned int)numop)*16777619u;
+    h = (h ^ (unsigned int)op1)*16777619u;
+    h = (h ^ (unsigned int)op2)*16777619u;
+
+    return(h);
+}
+
+int
+insmatch(struct AsmIns *ins, char *mnem, int numop, int op1, int op2)
+{
+    return(ins->numop == numop &&
+           (numop < 1 || ins->op1 == op1) &&
+           (numop < 2 || ins->op2 == op2) &&
+           !strcmp(ins->mnem, mnem));
+}
+
+struct AsmIns *
+getins(char *mnem, int numop, int op1, int op2)
+{
+    unsigned int i;
+
+    i = inshash(mnem, numop, op1, op2) & (ISAIDXSZ - 1);
+    while(isaidx[i])
+    {
+        if(insmatch(isaidx[i], mnem, numop, op1, op2))
+        {
+            return(isaidx[i]);
+        }
+        i = (i + 1) & (ISAIDXSZ - 1);
+    }
+
+    return(0);
+}
+
+void
+indexins(struct AsmIns *ins)
+{
+    int op1;
+    int op2;
+    unsigned int i;
+
+    op1 = (ins->numop >= 1) ? ins->op1 : 0;
+    op2 = (ins->numop >= 2) ? ins->op2 : 0;
+
+    i = inshash(ins->mnem, ins->numop, op1, op2) & (ISAIDXSZ - 1);
+    while(isaidx[i])
+    {
+        if(insmatch(isaidx[i], ins->mnem, ins->numop, op1, op2))
+        {
+            return;
+        }
+        i = (i + 1) & (ISAIDXSZ - 1);
+    }
+    isaidx[i] = ins;
+}
+
 void
 addins0(
     char *mnem,
@@ -64,7 +160,7 @@ addins0(
     int mnemlen;
     struct AsmIns *ins;
 
-    assert(isasz < 100);
+    assert(isasz < ISASZ);
     ins = &isa[isasz++];
     ins->size = size;
     ins->opcsz = opcsz;
@@ -80,6 +176,7 @@ addins0(
     ins->enc = enc;
 
     ins->numop = 0;
+    indexins(ins);
 }
 
 void
@@ -95,7 +192,7 @@ addins1(
     int mnemlen;
     struct AsmIns *ins;
 
-    assert(isasz < 100);
+    assert(isasz < ISASZ);
     ins = &isa[isasz++];
     ins->size = size;
     ins->opcsz = opcsz;
@@ -113,6 +210,7 @@ addins1(
 
     ins->numop = 1;
     ins->op1 = op1;
+    indexins(ins);
 }
 
 void
@@ -129,7 +227,7 @@ addins2(
     int mnemlen;
     struct AsmIns *ins;
 
-    assert(isasz < 100);
+    assert(isasz < ISASZ);
     ins = &isa[isasz++];
     ins->size = size;
     ins->opcsz = opcsz;
@@ -148,136 +246,189 @@ addins2(
     ins->numop = 2;
     ins->op1 = op1;
     ins->op2 = op2;
+    indexins(ins);
 }
 
-struct AsmIns*
-getins0(char *mnem)
+struct Lbl
 {
-    int i;
+    char name[33];
+    unsigned int hash;
+    unsigned int addr;
+    int def;
+};
 
-    for(i = 0;
-        i < isasz;
-        ++i)
-    {
-        if(isa[i].numop == 0 &&
-           !strcmp(isa[i].mnem, mnem))
-        {
-            return(&isa[i]);
-        }
-    }
+/* Labels are allocated in blocks too: the lines point to them */
+#define LBBLKSZ 256
 
-    return(0);
-}
+struct Lbblk
+{
+    struct Lbblk *next;
+    int used;
+    struct Lbl lbls[LBBLKSZ];
+};
 
-struct AsmIns *
-getins1(char *mnem, int optype)
+/*
+ * State of one assembly. Every function which needs it takes it as first
+ * argument, so several files can be assembled at the same time. The
+ * opcode table (isa) is shared: it is only written by isainit().
+ */
+struct Asm
 {
-    int i;
+    struct Lbl **ltbl;
+    int ltblcap;
+    int ltblsz;
+    struct Lbblk *lbblk;
 
-    for(i = 0;
-        i < isasz;
-        ++i)
-    {
-        if(isa[i].numop == 1 &&
-           !strcmp(isa[i].mnem, mnem) &&
-           isa[i].op1 == optype)
-        {
-            return(&isa[i]);
-        }
-    }
+    char *srcf;
+    char *src;
+    int srcl;
 
-    return(0);
-}
+    unsigned int caddr;
+    unsigned int csize;
 
-struct AsmIns *
-getins2(char *mnem, int op1type, int op2type)
+    /* Output image: its size is known after the first pass */
+    u8 *img;
+    unsigned int imgsz;
+    unsigned int imgpos;
+
+    struct Line *firstline;
+    struct Line *lastline;
+    struct Lblk *lblk;
+
+    FILE *diag;
+    jmp_buf *onfatal;
+};
+
+void asmfatal(struct Asm *as, char *fmt, ...);
+
+/* Label table: open addressing on the name hash, at most half full */
+void
+growltbl(struct Asm *as)
 {
+    struct Lbl **old;
+    int oldcap;
     int i;
+    int j;
+
+    old = as->ltbl;
+    oldcap = as->ltblcap;
+
+    as->ltblcap = oldcap ? oldcap*2 : 1024;
+    as->ltbl = (struct Lbl **)calloc(as->ltblcap, sizeof(struct Lbl *));
+    if(!as->ltbl)
+    {
+        as->ltbl = old;
+        as->ltblcap = oldcap;
+        asmfatal(as, "Out of memory");
+    }
 
     for(i = 0;
-        i < isasz;
+        i < oldcap;
         ++i)
     {
-        if(isa[i].numop == 2 &&
-           !strcmp(isa[i].mnem, mnem) &&
-           isa[i].op1 == op1type &&
-           isa[i].op2 == op2type)
+        if(old[i])
         {
-            return(&isa[i]);
+            j = old[i]->hash & (as->ltblcap - 1);
+            while(as->ltbl[j])
+            {
+                j = (j + 1) & (as->ltblcap - 1);
+            }
+            as->ltbl[j] = old[i];
         }
     }
 
-    return(0);
+    free(old);
 }
 
-struct Lbl
-{
-    char name[33];
-    unsigned int addr;
-    int def;
-};
-
-struct Lbl ltbl[400];
-int ltblsz;
-
 struct Lbl *
-addlbl(char *name, unsigned int addr)
+addlbl(struct Asm *as, char *name, unsigned int addr)
 {
     struct Lbl *lbl;
+    struct Lbblk *b;
     int len;
+    int i;
+
+    if(2*(as->ltblsz + 1) > as->ltblcap)
+    {
+        growltbl(as);
+    }
 
-    assert(ltblsz < 100);
+    if(!as->lbblk || as->lbblk->used == LBBLKSZ)
+    {
+        b = (struct Lbblk *)malloc(sizeof(struct Lbblk));
+        if(!b)
+        {
+            asmfatal(as, "Out of memory");
+        }
+        b->next = as->lbblk;
+        b->used = 0;
+        as->lbblk = b;
+    }
 
-    lbl = &ltbl[ltblsz++];
+    lbl = &as->lbblk->lbls[as->lbblk->used++];
 
     len = strlen(name);
     assert(len < 33);
     strncpy(lbl->name, name, 33);
     lbl->name[len] = 0;
+    lbl->hash = strhash(name);
     lbl->addr = addr;
     lbl->def = 0;
 
+    i = lbl->hash & (as->ltblcap - 1);
+    while(as->ltbl[i])
+    {
+        i = (i + 1) & (as->ltblcap - 1);
+    }
+    as->ltbl[i] = lbl;
+    ++as->ltblsz;
+
     return(lbl);
 }
 
 struct Lbl*
-getlbl(char *name)
+getlbl(struct Asm *as, char *name)
 {
+    unsigned int h;
     int i;
 
-    for(i = 0;
-        i < ltblsz;
-        ++i)
+    if(!as->ltblcap)
+    {
+        return(0);
+    }
+
+    h = strhash(name);
+    i = h & (as->ltblcap - 1);
+    while(as->ltbl[i])
     {
-        if(!strcmp(name, ltbl[i].name))
+        if(as->ltbl[i]->hash == h && !strcmp(name, as->ltbl[i]->name))
         {
-            return(&ltbl[i]);
+            return(as->ltbl[i]);
         }
+        i = (i + 1) & (as->ltblcap - 1);
     }
     return(0);
 }
 
-char *srcf;
-char *src;
-int srcl;
-
 void
-asmfatal(char *fmt, ...)
+asmfatal(struct Asm *as, char *fmt, ...)
 {
     va_list ap;
 
-    printf("[!] ERROR: Line %d: ", srcl);
+    fprintf(as->diag, "[!] ERROR: Line %d: ", as->srcl);
     va_start(ap, fmt);
-    vprintf(fmt, ap);
+    vfprintf(as->diag, fmt, ap);
     va_end(ap);
-    printf("\n");
+    fprintf(as->diag, "\n");
 
+    if(as->onfatal)
+    {
+        longjmp(*as->onfatal, 1);
+    }
     exit(1);
 }
 
 char buff[256];
-unsigned int caddr;
-unsigned int csize;
 
 enum
 {
@@ -302,10 +453,30 @@ struct Op
     struct Lbl *lbl;
 };
 
+enum
+{
+    REG_EAX,
+    REG_ECX,
+    REG_EDX,
+    REG_EBX,
+    REG_ESP,
+    REG_EBP,
+    REG_ESI,
+    REG_EDI,
+
+    REG_COUNT
+};
+
+char *regname[REG_COUNT] = {
+    "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi"
+};
+
+/* A label line only records where the label is, for the printer */
 enum
 {
     DIR_ZERO,
     DIR_LONG,
+    DIR_LABEL,
 
     DIR_COUNT
 };
@@ -318,14 +489,24 @@ struct Line
     struct AsmIns *ins;
     struct Op op1;
     struct Op op2;
-    struct Op op3;
     struct Line *next;
     int dir;
     int val;
 };
 
+/* Lines are allocated in blocks, all freed at the end of the assembly */
+#define LBLKSZ 512
+
+struct Lblk
+{
+    struct Lblk *next;
+    int used;
+    struct Line lines[LBLKSZ];
+};
+
 struct Line*
 mkline(
+    struct Asm *as,
     int num,
     unsigned int addr,
     struct AsmIns *ins,
@@ -333,130 +514,176 @@ mkline(
     struct Op op2)
 {
     struct Line *l;
+    struct Lblk *b;
 
-    l = (struct Line*)malloc(sizeof(struct Line));
-    if(l)
+    if(!as->lblk || as->lblk->used == LBLKSZ)
     {
-        l->num = num;
-        l->addr = addr;
-        l->ins = ins;
-        l->op1 = op1;
-        l->op2 = op2;
-        l->next = 0;
+        b = (struct Lblk *)malloc(sizeof(struct Lblk));
+        if(!b)
+        {
+            asmfatal(as, "Out of memory");
+        }
+        b->next = as->lblk;
+        b->used = 0;
+        as->lblk = b;
     }
 
+    l = &as->lblk->lines[as->lblk->used++];
+    l->num = num;
+    l->addr = addr;
+    l->ins = ins;
+    l->op1 = op1;
+    l->op2 = op2;
+    l->next = 0;
+
     return(l);
 }
 
-struct Line *firstline;
-struct Line *lastline;
-
 #define hexval(d) (((d) >= '0' && (d) <= '9') ? ((d) - '0') : ((d) - 'a' + 10))
 
 int
 getreg(char *rbuff)
 {
-    if(!strcmp(rbuff, "eax"))
-    {
-        return(0);
-    }
-    else if(!strcmp(rbuff, "ecx"))
-    {
-        return(1);
-    }
-    else if(!strcmp(rbuff, "edx"))
-    {
-        return(2);
-    }
-    else if(!strcmp(rbuff, "ebx"))
-    {
-        return(3);
-    }
-    else if(!strcmp(rbuff, "esp"))
-    {
-        return(4);
-    }
-    else if(!strcmp(rbuff, "ebp"))
-    {
-        return(5);
-    }
-    else if(!strcmp(rbuff, "esi"))
+    int i;
+
+    for(i = 0;
+        i < REG_COUNT;
+        ++i)
     {
-        return(6);
+        if(!strcmp(rbuff, regname[i]))
+        {
+            return(i);
+        }
     }
-    else if(!strcmp(rbuff, "edi"))
+    return(-1);
+}
+
+/*
+ * Operands. The parser fills them from the text, a code generator can
+ * build them directly and append lines with asmins0/1/2.
+ */
+struct Op
+opreg(int reg)
+{
+    struct Op op = {0};
+
+    op.type = OP_REG;
+    op.val = reg;
+
+    return(op);
+}
+
+struct Op
+opimm(int val)
+{
+    struct Op op = {0};
+
+    op.type = OP_IMM;
+    op.subtype = OP_IMM;
+    op.val = val;
+
+    return(op);
+}
+
+/* disp(%reg), or (%reg) if disp is 0 */
+struct Op
+opind(int reg, int disp)
+{
+    struct Op op = {0};
+
+    op.type = disp ? OP_IND_DISP : OP_IND;
+    op.val = reg;
+    op.disp = disp;
+
+    return(op);
+}
+
+/* The address of a label, which can be defined later */
+struct Op
+oplbl(struct Asm *as, char *name)
+{
+    struct Op op = {0};
+    struct Lbl *lbl;
+
+    lbl = getlbl(as, name);
+    if(!lbl)
     {
-        return(7);
+        lbl = addlbl(as, name, 0);
     }
-    return(-1);
+
+    op.type = OP_IMM;
+    op.subtype = OP_LBL;
+    op.lbl = lbl;
+
+    return(op);
 }
 
 int
-getop(struct Op *op)
+getop(struct Asm *as, struct Op *op)
 {
     char rbuff[8];
     int i;
 
-    while(*src && isspace(*src) && *src != '\n')
+    while(*as->src && isspace(*as->src) && *as->src != '\n')
     {
-        ++src;
+        ++as->src;
     }
 
-    if(!*src || *src == '\n')
+    if(!*as->src || *as->src == '\n')
     {
         return(0);
     }
 
-    switch(*src)
+    switch(*as->src)
     {
         case '$':
         {
             int isneg;
             int base;
 
-            ++src;
+            ++as->src;
             isneg = 0;
             base = 10;
             op->val = 0;
-            if(*src == '-')
+            if(*as->src == '-')
             {
-                ++src;
+                ++as->src;
                 isneg = 1;
             }
-            if(*src == '0' && *(src+1) == 'x')
+            if(*as->src == '0' && *(as->src+1) == 'x')
             {
-                src += 2;
+                as->src += 2;
                 base = 16;
             }
             if(base == 10)
             {
-                if(!isdigit(*src))
+                if(!isdigit(*as->src))
                 {
-                    asmfatal("Invalid immediate");
+                    asmfatal(as, "Invalid immediate");
                 }
-                while(isdigit(*src))
+                while(isdigit(*as->src))
                 {
-                    op->val = op->val*base + (*src - '0');
-                    ++src;
+                    op->val = op->val*base + (*as->src - '0');
+                    ++as->src;
                 }
             }
             else if(base == 16)
             {
-                if(!isdigit(*src) && !isxdigit(*src))
+                if(!isdigit(*as->src) && !isxdigit(*as->src))
                 {
-                    asmfatal("Invalid immediate");
+                    asmfatal(as, "Invalid immediate");
                 }
-                while(isxdigit(*src))
+                while(isxdigit(*as->src))
                 {
                     char d;
-                    d = tolower(*src);
+                    d = tolower(*as->src);
                     op->val = op->val*base + hexval(d);
-                    ++src;
+                    ++as->src;
                 }
             }
             else
             {
-                asmfatal("Invalid base for immediate");
+                asmfatal(as, "Invalid base for immediate");
             }
 
             if(isneg)
@@ -469,26 +696,26 @@ getop(struct Op *op)
 
         case '%':
         {
-            ++src;
+            ++as->src;
             rbuff[0] = 0;
             i = 0;
-            while(*src != ',' && !isspace(*src))
+            while(*as->src != ',' && !isspace(*as->src))
             {
-                rbuff[i++] = *src;
-                ++src;
+                rbuff[i++] = *as->src;
+                ++as->src;
             }
             rbuff[i] = 0;
 
             if(i == 0)
             {
-                asmfatal("Invalid register");
+                asmfatal(as, "Invalid register");
             }
 
             op->type = OP_REG;
             op->val = getreg(rbuff);
             if(op->val < 0)
             {
-                asmfatal("Invalid register '%s'", rbuff);
+                asmfatal(as, "Invalid register '%s'", rbuff);
             }
         } break;
 
@@ -502,26 +729,17 @@ getop(struct Op *op)
         case 'Q':case 'R':case 'S':case 'T':case 'U':case 'V':case 'W':case 'X':
         case 'Y':case 'Z':
         {
-            struct Lbl *lbl;
             char lbuff[33];
 
             lbuff[0] = 0;
             i = 0;
-            while(*src == '.' || *src == '_' || isalnum(*src))
+            while(*as->src == '.' || *as->src == '_' || isalnum(*as->src))
             {
-                lbuff[i++] = *src++;
+                lbuff[i++] = *as->src++;
             }
             lbuff[i] = 0;
 
-            lbl = getlbl(lbuff);
-            if(!lbl)
-            {
-                lbl = addlbl(lbuff, 0);
-            }
-
-            op->type = OP_IMM;
-            op->subtype = OP_LBL;
-            op->lbl = lbl;
+            *op = oplbl(as, lbuff);
         } break;
 
         default:
@@ -531,22 +749,22 @@ getop(struct Op *op)
 
             isneg = 0;
             disp = 0;
-            if(*src == '-')
+            if(*as->src == '-')
             {
                 isneg = 1;
-                ++src;
+                ++as->src;
             }
 
-            if(isneg && !isdigit(*src))
+            if(isneg && !isdigit(*as->src))
             {
-                asmfatal("Invalid displacement");
+                asmfatal(as, "Invalid displacement");
             }
 
             /* TODO: hexadecimal displacement */
-            while(isdigit(*src))
+            while(isdigit(*as->src))
             {
-                disp = disp*10 + (*src - '0');
-                ++src;
+                disp = disp*10 + (*as->src - '0');
+                ++as->src;
             }
 
             if(isneg)
@@ -554,50 +772,50 @@ getop(struct Op *op)
                 disp = -disp;
             }
 
-            if(*src == '(')
+            if(*as->src == '(')
             {
-                ++src;
+                ++as->src;
 
-                while(*src && *src != '%')
+                while(*as->src && *as->src != '%')
                 {
-                    ++src;
+                    ++as->src;
                 }
 
-                if(*src != '%')
+                if(*as->src != '%')
                 {
-                    asmfatal("Invalid indirect operand (expected register)");
+                    asmfatal(as, "Invalid indirect operand (expected register)");
                 }
-                ++src;
+                ++as->src;
 
                 rbuff[0] = 0;
                 i = 0;
-                while(*src && *src != ',' && !isspace(*src) && *src != ')')
+                while(*as->src && *as->src != ',' && !isspace(*as->src) && *as->src != ')')
                 {
-                    rbuff[i++] = *src;
-                    ++src;
+                    rbuff[i++] = *as->src;
+                    ++as->src;
                 }
                 rbuff[i] = 0;
 
                 if(i == 0)
                 {
-                    asmfatal("Invalid register");
+                    asmfatal(as, "Invalid register");
                 }
 
-                while(*src && isspace(*src) && *src != ')')
+                while(*as->src && isspace(*as->src) && *as->src != ')')
                 {
-                    ++src;
+                    ++as->src;
                 }
 
-                if(*src != ')')
+                if(*as->src != ')')
                 {
-                    asmfatal("Invalid indirect operand");
+                    asmfatal(as, "Invalid indirect operand");
                 }
-                ++src;
+                ++as->src;
 
                 op->val = getreg(rbuff);
                 if(op->val < 0)
                 {
-                    asmfatal("Invalid register '%s'", rbuff);
+                    asmfatal(as, "Invalid register '%s'", rbuff);
                 }
                 op->type = OP_IND;
                 if(disp)
@@ -608,7 +826,7 @@ getop(struct Op *op)
             }
             else
             {
-                asmfatal("Invalid operand");
+                asmfatal(as, "Invalid operand");
             }
         } break;
     }
@@ -617,49 +835,142 @@ getop(struct Op *op)
 }
 
 struct Line *
-addline(struct AsmIns *ins, struct Op op1, struct Op op2)
+addline(struct Asm *as, struct AsmIns *ins, struct Op op1, struct Op op2)
 {
     struct Line *l;
 
-    l = mkline(srcl, caddr, ins, op1, op2);
-    if(!lastline)
+    l = mkline(as, as->srcl, as->caddr, ins, op1, op2);
+    if(!as->lastline)
     {
-        firstline = l;
-        lastline = firstline;
+        as->firstline = l;
+        as->lastline = as->firstline;
     }
     else
     {
-        lastline->next = l;
-        lastline = lastline->next;
+        as->lastline->next = l;
+        as->lastline = as->lastline->next;
     }
 
     return(l);
 }
 
-int
-asmline()
+/* Appends the instruction ins, whose operands have already been checked */
+struct Line *
+putins(struct Asm *as, struct AsmIns *ins, struct Op op1, struct Op op2)
+{
+    struct Line *l;
+
+    l = addline(as, ins, op1, op2);
+    as->caddr += ins->size;
+    as->csize += ins->size;
+
+    return(l);
+}
+
+/* Looks up mnem with numop operands in the opcode table and appends it */
+struct Line *
+asmins(struct Asm *as, char *mnem, int numop, struct Op op1, struct Op op2)
 {
-    int i;
     struct AsmIns *ins;
+
+    ins = getins(mnem, numop,
+                 (numop >= 1) ? op1.type : 0,
+                 (numop >= 2) ? op2.type : 0);
+    if(!ins)
+    {
+        asmfatal(as, "Invalid instruction '%s'", mnem);
+    }
+
+    return(putins(as, ins, op1, op2));
+}
+
+struct Line *
+asmins0(struct Asm *as, char *mnem)
+{
+    struct Op none = {0};
+
+    return(asmins(as, mnem, 0, none, none));
+}
+
+struct Line *
+asmins1(struct Asm *as, char *mnem, struct Op op1)
+{
+    struct Op none = {0};
+
+    return(asmins(as, mnem, 1, op1, none));
+}
+
+struct Line *
+asmins2(struct Asm *as, char *mnem, struct Op op1, struct Op op2)
+{
+    return(asmins(as, mnem, 2, op1, op2));
+}
+
+/* Defines the label name at the current address */
+void
+asmlabel(struct Asm *as, char *name)
+{
     struct Lbl *lbl;
     struct Line *l;
+    struct Op none = {0};
+
+    lbl = getlbl(as, name);
+    if(lbl && lbl->def)
+    {
+        asmfatal(as, "Label '%s' already defined", name);
+    }
+    if(!lbl)
+    {
+        lbl = addlbl(as, name, as->caddr);
+    }
+    else
+    {
+        lbl->addr = as->caddr;
+    }
+    lbl->def = 1;
+
+    l = addline(as, 0, oplbl(as, name), none);
+    l->dir = DIR_LABEL;
+}
+
+/* Appends the directive .zero (val bytes) or .long (val) */
+void
+asmdir(struct Asm *as, int dir, int val)
+{
+    struct Line *l;
+    struct Op none = {0};
+    unsigned int size;
+
+    l = addline(as, 0, opimm(val), none);
+    l->dir = dir;
+    l->val = val;
+
+    size = (dir == DIR_ZERO) ? (unsigned int)val : 4;
+    as->caddr += size;
+    as->csize += size;
+}
+
+int
+asmline(struct Asm *as)
+{
+    int i;
     char mnem[33];
     int numop;
     struct Op op1 = {0};
     struct Op op2 = {0};
 
-    if(!*src)
+    if(!*as->src)
     {
         return(0);
     }
 
-    while(isspace(*src))
+    while(isspace(*as->src))
     {
-        if(*src == '\n')
+        if(*as->src == '\n')
         {
-            ++srcl;
+            ++as->srcl;
         }
-        ++src;
+        ++as->src;
     }
 
     mnem[0] = 0;
@@ -667,9 +978,9 @@ asmline()
     op1.type = OP_INV;
     op2.type = OP_INV;
     i = 0;
-    while(*src && !isspace(*src))
+    while(*as->src && !isspace(*as->src))
     {
-        mnem[i++] = *src++;
+        mnem[i++] = *as->src++;
     }
     if(i == 0)
     {
@@ -680,120 +991,99 @@ asmline()
     if(mnem[i-1] == ':')
     {
         mnem[i-1] = 0;
-        lbl = getlbl(mnem);
-        if(lbl && lbl->def)
-        {
-            asmfatal("Label '%s' already defined", mnem);
-        }
-        if(!lbl)
-        {
-            lbl = addlbl(mnem, caddr);
-        }
-        else
-        {
-            lbl->addr = caddr;
-        }
-        lbl->def = 1;
+        asmlabel(as, mnem);
     }
     else
     {
-        if(getop(&op1))
+        if(getop(as, &op1))
         {
             ++numop;
         }
-        while(*src && isspace(*src) && *src != '\n')
+        while(*as->src && isspace(*as->src) && *as->src != '\n')
         {
-            ++src;
+            ++as->src;
         }
-        if(*src == ',')
+        if(*as->src == ',')
         {
-            ++src;
-            if(getop(&op2))
+            ++as->src;
+            if(getop(as, &op2))
             {
                 ++numop;
             }
         }
 
-        ins = 0;
         if(!strcmp(mnem, ".zero"))
         {
             if(numop != 1 || op1.type != OP_IMM || op1.val <= 0)
             {
-                asmfatal("Invalid operand for directive '.zero'");
+                asmfatal(as, "Invalid operand for directive '.zero'");
             }
 
-            l = addline(0, op1, op2);
-            l->dir = DIR_ZERO;
-            l->val = op1.val;
-            caddr += op1.val;
-            csize += op1.val;
+            asmdir(as, DIR_ZERO, op1.val);
         }
         else if(!strcmp(mnem, ".long"))
         {
             if(numop != 1 || op1.type != OP_IMM || op1.val <= 0)
             {
-                asmfatal("Invalid operand for directive '.long'");
+                asmfatal(as, "Invalid operand for directive '.long'");
             }
 
-            l = addline(0, op1, op2);
-            l->dir = DIR_LONG;
-            l->val = op1.val;
-            caddr += 4;
-            csize += 4;
+            asmdir(as, DIR_LONG, op1.val);
         }
         else
         {
-            if(numop == 0)
-            {
-                ins = getins0(mnem);
-            }
-            else if(numop == 1)
+            if(numop > 2)
             {
-                ins = getins1(mnem, op1.type);
-            }
-            else if(numop == 2)
-            {
-                ins = getins2(mnem, op1.type, op2.type);
-            }
-            else
-            {
-                asmfatal("Invalid number of operands");
+                asmfatal(as, "Invalid number of operands");
             }
 
-            if(!ins)
-            {
-                asmfatal("Invalid instruction '%s'", mnem);
-            }
-            addline(ins, op1, op2);
-            caddr += ins->size;
-            csize += ins->size;
+            asmins(as, mnem, numop, op1, op2);
         }
     }
 
     return(1);
 }
 
+/* Reserves n bytes of the image, which is zeroed */
+u8 *
+emitsz(struct Asm *as, unsigned int n)
+{
+    u8 *p;
+
+    if(n > as->imgsz - as->imgpos)
+    {
+        asmfatal(as, "Code is bigger than its computed size");
+    }
+    p = as->img + as->imgpos;
+    as->imgpos += n;
+
+    return(p);
+}
+
 void
-emit(FILE *f, u8 b)
+emit(struct Asm *as, u8 b)
 {
-    fputc((int)b, f);
+    *emitsz(as, 1) = b;
 }
 
 void
-emitd(FILE *f, int dw)
+emitd(struct Asm *as, int dw)
 {
-    emit(f, (u8)((dw & 0x000000ff) >>  0));
-    emit(f, (u8)((dw & 0x0000ff00) >>  8));
-    emit(f, (u8)((dw & 0x00ff0000) >> 16));
-    emit(f, (u8)((dw & 0xff000000) >> 24));
+    u8 *p;
+
+    p = emitsz(as, 4);
+    p[0] = (u8)((dw & 0x000000ff) >>  0);
+    p[1] = (u8)((dw & 0x0000ff00) >>  8);
+    p[2] = (u8)((dw & 0x00ff0000) >> 16);
+    p[3] = (u8)((dw & 0xff000000) >> 24);
 }
 
 int
-immval(struct Op *op)
+immval(struct Asm *as, struct Op *op)
 {
     if(op->type != OP_IMM)
     {
-        asmfatal("Invalid immediate operand");
+        asmfatal(as, "Invalid immediate operand");
     }
 
     if(op->subtype == OP_IMM)
@@ -806,7 +1096,7 @@ immval(struct Op *op)
     }
     else
     {
-        asmfatal("Invalid immediate operand subtype");
+        asmfatal(as, "Invalid immediate operand subtype");
     }
 
     return(op->val);
@@ -818,7 +1108,7 @@ immval(struct Op *op)
     (((rm)  & 0x07) << 0)))
 
 u8
-getmodregrm(struct Line *l)
+getmodregrm(struct Asm *as, struct Line *l)
 {
     u8 mod;
     u8 reg;
@@ -828,8 +1118,17 @@ getmodregrm(struct Line *l)
     if(l->op1.type == OP_REG && l->op2.type == OP_REG)
     {
         mod = 3;
-        reg = l->op1.val;
-        rm = l->op2.val;
+        /* ENC_RM: the destination (op2) goes in the reg field */
+        if(l->ins->enc == ENC_RM)
+        {
+            reg = l->op2.val;
+            rm = l->op1.val;
+        }
+        else
+        {
+            reg = l->op1.val;
+            rm = l->op2.val;
+        }
     }
     else if((l->op1.type == OP_IND && l->op2.type == OP_REG) ||
             (l->op1.type == OP_REG && l->op2.type == OP_IND))
@@ -875,7 +1174,7 @@ getmodregrm(struct Line *l)
     }
     else
     {
-        asmfatal("Unhandled Mod Reg R/M encryption");
+        asmfatal(as, "Unhandled Mod Reg R/M encryption");
     }
         
     modregrm = packmodregrm(mod, reg, rm);
@@ -883,17 +1182,17 @@ getmodregrm(struct Line *l)
 }
 
 void
-codegen(FILE *f)
+codegen(struct Asm *as)
 {
     struct Line *l;
     int i;
     struct AsmIns *ins;
     u8 modregrm;
 
-    l = firstline;
+    l = as->firstline;
     while(l)
     {
-        srcl = l->num;
+        as->srcl = l->num;
         ins = l->ins;
         if(ins)
         {
@@ -905,7 +1204,7 @@ codegen(FILE *f)
                         i < ins->opcsz;
                         ++i)
                     {
-                        emit(f, ins->opc[i]);
+                        emit(as, ins->opc[i]);
                     }
                 } break;
 
@@ -915,9 +1214,9 @@ codegen(FILE *f)
                         i < ins->opcsz - 1;
                         ++i)
                     {
-                        emit(f, ins->opc[i]);
+                        emit(as, ins->opc[i]);
                     }
-                    emit(f, ins->opc[ins->opcsz-1] + l->op1.val);
+                    emit(as, ins->opc[ins->opcsz-1] + l->op1.val);
                 } break;
 
                 case ENC_M:
@@ -928,7 +1227,7 @@ codegen(FILE *f)
                         i < ins->opcsz;
                         ++i)
                     {
-                        emit(f, ins->opc[i]);
+                        emit(as, ins->opc[i]);
                     }
 
                     if(l->op1.type == OP_REG)
@@ -945,7 +1244,7 @@ codegen(FILE *f)
                     }
 
                     modregrm = packmodregrm(mod, l->ins->reg, l->op1.val);
-                    emit(f, modregrm);
+                    emit(as, modregrm);
                 } break;
 
                 case ENC_M_DISP:
@@ -956,7 +1255,7 @@ codegen(FILE *f)
                         i < ins->opcsz;
                         ++i)
                     {
-                        emit(f, ins->opc[i]);
+                        emit(as, ins->opc[i]);
                     }
 
                     if(l->op1.type == OP_REG)
@@ -973,9 +1272,9 @@ codegen(FILE *f)
                     }
 
                     modregrm = packmodregrm(mod, l->ins->reg, l->op1.val);
-                    emit(f, modregrm);
+                    emit(as, modregrm);
 
-                    emitd(f, l->op1.disp);
+                    emitd(as, l->op1.disp);
                 } break;
 
                 case ENC_IMM:
@@ -984,9 +1283,9 @@ codegen(FILE *f)
                         i < ins->opcsz;
                         ++i)
                     {
-                        emit(f, ins->opc[i]);
+                        emit(as, ins->opc[i]);
                     }
-                    emitd(f, immval(&l->op1));
+                    emitd(as, immval(as, &l->op1));
                 } break;
 
                 case ENC_REL:
@@ -995,9 +1294,9 @@ codegen(FILE *f)
                         i < ins->opcsz;
                         ++i)
                     {
-                        emit(f, ins->opc[i]);
+                        emit(as, ins->opc[i]);
                     }
-                    emitd(f, immval(&l->op1) - (l->addr + ins->size));
+                    emitd(as, immval(as, &l->op1) - (l->addr + ins->size));
                 } break;
 
                 case ENC_RM:
@@ -1007,11 +1306,11 @@ codegen(FILE *f)
                         i < ins->opcsz;
                         ++i)
                     {
-                        emit(f, ins->opc[i]);
+                        emit(as, ins->opc[i]);
                     }
 
-                    modregrm = getmodregrm(l);
-                    emit(f, modregrm);
+                    modregrm = getmodregrm(as, l);
+                    emit(as, modregrm);
                 } break;
 
                 case ENC_RM_DISP:
@@ -1021,19 +1320,19 @@ codegen(FILE *f)
                         i < ins->opcsz;
                         ++i)
                     {
-                        emit(f, ins->opc[i]);
+                        emit(as, ins->opc[i]);
                     }
 
-                    modregrm = getmodregrm(l);
-                    emit(f, modregrm);
+                    modregrm = getmodregrm(as, l);
+                    emit(as, modregrm);
 
                     if(l->op1.type == OP_IND_DISP)
                     {
-                        emitd(f, l->op1.disp);
+                        emitd(as, l->op1.disp);
                     }
                     else if(l->op2.type == OP_IND_DISP)
                     {
-                        emitd(f, l->op2.disp);
+                        emitd(as, l->op2.disp);
                     }
                 } break;
 
@@ -1043,19 +1342,19 @@ codegen(FILE *f)
                         i < ins->opcsz;
                         ++i)
                     {
-                        emit(f, ins->opc[i]);
+                        emit(as, ins->opc[i]);
                     }
 
-                    modregrm = getmodregrm(l);
-                    emit(f, modregrm);
+                    modregrm = getmodregrm(as, l);
+                    emit(as, modregrm);
 
                     if(l->op1.type == OP_IMM)
                     {
-                        emitd(f, immval(&l->op1));
+                        emitd(as, immval(as, &l->op1));
                     }
                     else if(l->op2.type == OP_IMM)
                     {
-                        emitd(f, immval(&l->op2));
+                        emitd(as, immval(as, &l->op2));
                     }
                 } break;
 
@@ -1065,15 +1364,15 @@ codegen(FILE *f)
                         i < ins->opcsz - 1;
                         ++i)
                     {
-                        emit(f, ins->opc[i]);
+                        emit(as, ins->opc[i]);
                     }
-                    emit(f, ins->opc[ins->opcsz-1] + l->op2.val);
-                    emitd(f, immval(&l->op1));
+                    emit(as, ins->opc[ins->opcsz-1] + l->op2.val);
+                    emitd(as, immval(as, &l->op1));
                 } break;
 
                 default:
                 {
-                    asmfatal("Unhandled encryption");
+                    asmfatal(as, "Unhandled encryption");
                 } break;
             }
         }
@@ -1083,22 +1382,21 @@ codegen(FILE *f)
             {
                 case DIR_ZERO:
                 {
-                    for(i = 0;
-                        i < l->val;
-                        ++i)
-                    {
-                        emit(f, 0);
-                    }
+                    emitsz(as, l->val);
                 } break;
 
                 case DIR_LONG:
                 {
-                    emitd(f, l->val);
+                    emitd(as, l->val);
+                } break;
+
+                case DIR_LABEL:
+                {
                 } break;
 
                 default:
                 {
-                    asmfatal("Unhandled directive");
+                    asmfatal(as, "Unhandled directive");
                 } break;
             }
         }
@@ -1130,30 +1428,77 @@ u8 elfhdr[0x54] = {
     /* 50 */ 0x00,0x10,0x00,0x00
 };
 
-int
-assemble(char *fnamein, char *fnameout)
+/*
+ * The source is mapped read-only and assembled in place. The file mapping
+ * is placed over an anonymous zero mapping one byte larger, so there is
+ * always a NUL right after the last byte of the file. If sz is not null
+ * it receives the size of the file. ezc maps its sources with this too.
+ */
+char *
+mapsrc(char *fname, long *sz)
 {
-    FILE *fin;
-    FILE *fout;
-    char *_src;
-    int i;
+    char *m;
+    int fd;
+    struct stat st;
+    long mapsz;
+    long pgsz;
+
+    fd = open(fname, O_RDONLY);
+    if(fd < 0)
+    {
+        return(0);
+    }
+    if(fstat(fd, &st) < 0)
+    {
+        close(fd);
+        return(0);
+    }
 
-    srcf = fnamein;
-    fin = fopen(srcf, "r");
-    fseek(fin, 0, SEEK_END);
-    i = ftell(fin);
-    fseek(fin, 0, SEEK_SET);
-    _src = (char*)malloc(i+1);
-    if(!_src)
+    pgsz = sysconf(_SC_PAGESIZE);
+    mapsz = ((long)st.st_size + pgsz) & ~(pgsz - 1);
+    m = (char*)mmap(0, mapsz, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(m != MAP_FAILED && st.st_size > 0 &&
+       mmap(m, st.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
     {
-        printf("[!] ERROR: Cannot read from file '%s'", srcf);
-        exit(1);
+        munmap(m, mapsz);
+        m = MAP_FAILED;
+    }
+    close(fd);
+
+    if(m == MAP_FAILED)
+    {
+        return(0);
+    }
+    if(sz)
+    {
+        *sz = (long)st.st_size;
+    }
+
+    return(m);
+}
+
+/* Unmaps a source of sz bytes mapped by mapsrc */
+void
+unmapsrc(char *src, long sz)
+{
+    long pgsz;
+
+    pgsz = sysconf(_SC_PAGESIZE);
+    munmap(src, (sz + pgsz) & ~(pgsz - 1));
+}
+
+/*
+ * Bootstraping opcode table. It is filled only once and then only read,
+ * so call this before assembling from several threads.
+ */
+void
+isainit()
+{
+    if(isasz)
+    {
+        return;
     }
-    i = fread(_src, 1, i, fin);
-    _src[i] = 0;
-    fclose(fin);
 
-    /* Bootstraping opcode table */
     addins0("syscall", 2, 2, 0xcd, 0x80, 0x00, 0x00, ENC_NONE);
     addins0("leave",   1, 1, 0xc9, 0x00, 0x00, 0x00, ENC_NONE);
     addins0("ret",     1, 1, 0xc3, 0x00, 0x00, 0x00, ENC_NONE);
@@ -1220,7 +1565,7 @@ assemble(char *fnamein, char *fnameout)
     addins1("js",      6, 2, 0x0f, 0x88, 0x00, 0x00, ENC_REL, 0x00, OP_IMM);
     addins1("jz",      6, 2, 0x0f, 0x84, 0x00, 0x00, ENC_REL, 0x00, OP_IMM);
 
-    addins2("movl",    2, 1, 0x89, 0x00, 0x00, 0x00, ENC_RM,      0x00, OP_REG, OP_REG);
+    addins2("movl",    2, 1, 0x89, 0x00, 0x00, 0x00, ENC_MR,      0x00, OP_REG, OP_REG);
     addins2("movl",    2, 1, 0x8b, 0x00, 0x00, 0x00, ENC_RM,      0x00, OP_IND, OP_REG);
     addins2("movl",    6, 1, 0x8b, 0x00, 0x00, 0x00, ENC_RM_DISP, 0x00, OP_IND_DISP, OP_REG);
     addins2("movl",    5, 1, 0xb8, 0x00, 0x00, 0x00, ENC_PR_IMM,  0x00, OP_IMM, OP_REG);
@@ -1228,55 +1573,341 @@ assemble(char *fnamein, char *fnameout)
     addins2("movl",    6, 1, 0x89, 0x00, 0x00, 0x00, ENC_MR_DISP, 0x00, OP_REG, OP_IND_DISP);
     addins2("movl",    6, 1, 0xc7, 0x00, 0x00, 0x00, ENC_RM_IMM,  0x00, OP_IMM, OP_IND);
 
-    addins2("addl",    2, 1, 0x01, 0x00, 0x00, 0x00, ENC_RM,      0x00, OP_REG, OP_REG);
+    addins2("addl",    2, 1, 0x01, 0x00, 0x00, 0x00, ENC_MR,      0x00, OP_REG, OP_REG);
     addins2("addl",    2, 1, 0x01, 0x00, 0x00, 0x00, ENC_RM,      0x00, OP_IND, OP_REG);
     addins2("addl",    6, 1, 0x01, 0x00, 0x00, 0x00, ENC_RM_DISP, 0x00, OP_IND_DISP, OP_REG);
     addins2("addl",    6, 1, 0x81, 0x00, 0x00, 0x00, ENC_RM_IMM,  0x00, OP_IMM, OP_REG);
 
-    addins2("subl",    2, 1, 0x29, 0x00, 0x00, 0x00, ENC_RM,      0x00, OP_REG, OP_REG);
+    addins2("subl",    2, 1, 0x29, 0x00, 0x00, 0x00, ENC_MR,      0x00, OP_REG, OP_REG);
     addins2("subl",    2, 1, 0x29, 0x00, 0x00, 0x00, ENC_RM,      0x00, OP_IND, OP_REG);
     addins2("subl",    6, 1, 0x29, 0x00, 0x00, 0x00, ENC_RM_DISP, 0x00, OP_IND_DISP, OP_REG);
     addins2("subl",    6, 1, 0x81, 0x00, 0x00, 0x00, ENC_RM_IMM,  0x05, OP_IMM, OP_REG);
 
-    addins2("cmpl",    2, 1, 0x39, 0x00, 0x00, 0x00, ENC_RM,      0x00, OP_REG, OP_REG);
+    addins2("cmpl",    2, 1, 0x39, 0x00, 0x00, 0x00, ENC_MR,      0x00, OP_REG, OP_REG);
     addins2("cmpl",    2, 1, 0x39, 0x00, 0x00, 0x00, ENC_RM,      0x00, OP_IND, OP_REG);
     addins2("cmpl",    6, 1, 0x39, 0x00, 0x00, 0x00, ENC_RM_DISP, 0x00, OP_IND_DISP, OP_REG);
     addins2("cmpl",    6, 1, 0x81, 0x00, 0x00, 0x00, ENC_RM_IMM,  0x07, OP_IMM, OP_REG);
 
-    caddr = 0x08048054;
+    addins0("cltd",    1, 1, 0x99, 0x00, 0x00, 0x00, ENC_NONE);
 
-    src = _src;
-    srcl = 1;
-    while(asmline());
+    addins2("movzbl",  3, 2, 0x0f, 0xb6, 0x00, 0x00, ENC_RM,      0x00, OP_REG, OP_REG);
+    addins2("movzbl",  3, 2, 0x0f, 0xb6, 0x00, 0x00, ENC_RM,      0x00, OP_IND, OP_REG);
+    addins2("movzbl",  7, 2, 0x0f, 0xb6, 0x00, 0x00, ENC_RM_DISP, 0x00, OP_IND_DISP, OP_REG);
+    addins2("movzwl",  3, 2, 0x0f, 0xb7, 0x00, 0x00, ENC_RM,      0x00, OP_REG, OP_REG);
+    addins2("movzwl",  3, 2, 0x0f, 0xb7, 0x00, 0x00, ENC_RM,      0x00, OP_IND, OP_REG);
+    addins2("movzwl",  7, 2, 0x0f, 0xb7, 0x00, 0x00, ENC_RM_DISP, 0x00, OP_IND_DISP, OP_REG);
+    addins2("movzbw",  4, 3, 0x66, 0x0f, 0xb6, 0x00, ENC_RM,      0x00, OP_REG, OP_REG);
 
-#if 0
-    for(i = 0;
-        i < ltblsz;
-        ++i)
+    addins2("movb",    2, 1, 0x88, 0x00, 0x00, 0x00, ENC_MR,      0x00, OP_REG, OP_IND);
+    addins2("movb",    6, 1, 0x88, 0x00, 0x00, 0x00, ENC_MR_DISP, 0x00, OP_REG, OP_IND_DISP);
+    addins2("movw",    3, 2, 0x66, 0x89, 0x00, 0x00, ENC_MR,      0x00, OP_REG, OP_IND);
+    addins2("movw",    7, 2, 0x66, 0x89, 0x00, 0x00, ENC_MR_DISP, 0x00, OP_REG, OP_IND_DISP);
+
+    addins2("xorl",    2, 1, 0x31, 0x00, 0x00, 0x00, ENC_MR,      0x00, OP_REG, OP_REG);
+}
+
+/* Writes the whole image at once, returns 0 on success */
+int
+writeimg(struct Asm *as, char *fnameout)
+{
+    unsigned int done;
+    long n;
+    int fd;
+
+    fd = open(fnameout, O_WRONLY | O_CREAT | O_TRUNC, 0777);
+    if(fd < 0)
     {
-        printf("%s:\t\t0x%.8x\n", ltbl[i].name, ltbl[i].addr);
+        return(1);
     }
-#endif
 
-    fout = fopen(fnameout, "w");
-    for(i = 0x00;
-        i < 0x44;
-        ++i)
+    done = 0;
+    while(done < as->imgpos)
     {
-        emit(fout, elfhdr[i]);
+        n = write(fd, as->img + done, as->imgpos - done);
+        if(n <= 0)
+        {
+            close(fd);
+            return(1);
+        }
+        done += n;
     }
-    emitd(fout, csize + 0x54);
-    emitd(fout, csize + 0x54);
-    for(i = 0x4c;
-        i < 0x54;
-        ++i)
+
+    return(close(fd) != 0);
+}
+
+/* Address of the first line: the code follows the ELF headers */
+#define ORGADDR 0x08048054
+
+struct Asm *
+asmnew(char *srcname, FILE *diag)
+{
+    struct Asm *as;
+
+    isainit();
+
+    as = (struct Asm *)calloc(1, sizeof(struct Asm));
+    if(as)
     {
-        emit(fout, elfhdr[i]);
+        as->srcf = srcname;
+        as->caddr = ORGADDR;
+        as->srcl = 1;
+        as->diag = diag;
     }
-    codegen(fout);
-    fclose(fout);
 
-    return(0);
+    return(as);
+}
+
+void
+asmfree(struct Asm *as)
+{
+    struct Lblk *b;
+    struct Lbblk *lb;
+
+    if(!as)
+    {
+        return;
+    }
+
+    free(as->img);
+    while(as->lblk)
+    {
+        b = as->lblk;
+        as->lblk = b->next;
+        free(b);
+    }
+    while(as->lbblk)
+    {
+        lb = as->lbblk;
+        as->lbblk = lb->next;
+        free(lb);
+    }
+    free(as->ltbl);
+    free(as);
+}
+
+/*
+ * Gives the lines and the labels their addresses again, for a pass which
+ * has relinked the lines (removing some, or changing their instructions)
+ * after they were appended.
+ */
+void
+asmlayout(struct Asm *as)
+{
+    struct Line *l;
+
+    as->caddr = ORGADDR;
+    as->csize = 0;
+    as->lastline = 0;
+
+    l = as->firstline;
+    while(l)
+    {
+        l->addr = as->caddr;
+        if(l->ins)
+        {
+            as->caddr += l->ins->size;
+            as->csize += l->ins->size;
+        }
+        else if(l->dir == DIR_LABEL)
+        {
+            l->op1.lbl->addr = as->caddr;
+        }
+        else
+        {
+            as->caddr += (l->dir == DIR_ZERO) ? (unsigned int)l->val : 4;
+            as->csize += (l->dir == DIR_ZERO) ? (unsigned int)l->val : 4;
+        }
+        as->lastline = l;
+        l = l->next;
+    }
+}
+
+/* Parses the text src, terminated by a NUL byte, and appends its lines */
+void
+asmtext(struct Asm *as, char *src)
+{
+    as->src = src;
+    while(asmline(as));
+}
+
+void
+printop(FILE *fout, struct Op *op)
+{
+    switch(op->type)
+    {
+        case OP_REG:
+        {
+            putc('%', fout);
+            fputs(regname[op->val], fout);
+        } break;
+
+        case OP_IMM:
+        {
+            if(op->subtype == OP_LBL)
+            {
+                fputs(op->lbl->name, fout);
+            }
+            else
+            {
+                fprintf(fout, "$%d", op->val);
+            }
+        } break;
+
+        case OP_IND:
+        {
+            fprintf(fout, "(%%%s)", regname[op->val]);
+        } break;
+
+        case OP_IND_DISP:
+        {
+            fprintf(fout, "%d(%%%s)", op->disp, regname[op->val]);
+        } break;
+    }
+}
+
+/* Writes the lines as text, which asmtext reads back */
+void
+asmprint(struct Asm *as, FILE *fout)
+{
+    struct Line *l;
+
+    l = as->firstline;
+    while(l)
+    {
+        if(l->ins)
+        {
+            putc('\t', fout);
+            fputs(l->ins->mnem, fout);
+            if(l->ins->numop >= 1)
+            {
+                putc(' ', fout);
+                printop(fout, &l->op1);
+            }
+            if(l->ins->numop >= 2)
+            {
+                putc(',', fout);
+                printop(fout, &l->op2);
+            }
+            putc('\n', fout);
+        }
+        else if(l->dir == DIR_LABEL)
+        {
+            fprintf(fout, "%s:\n", l->op1.lbl->name);
+        }
+        else
+        {
+            fprintf(fout, "\t%s $%d\n",
+                    (l->dir == DIR_ZERO) ? ".zero" : ".long", l->val);
+        }
+        l = l->next;
+    }
+}
+
+/*
+ * Lays out the image of the lines and writes it to the executable
+ * fnameout. Returns 0 on success and 1 on error.
+ */
+int
+asmwrite(struct Asm *as, char *fnameout)
+{
+    jmp_buf onfatal;
+    jmp_buf *prevonfatal;
+    int res;
+
+    prevonfatal = as->onfatal;
+    res = 1;
+    if(setjmp(onfatal) == 0)
+    {
+        as->onfatal = &onfatal;
+
+        as->imgsz = as->csize + 0x54;
+        as->img = (u8 *)calloc(as->imgsz, 1);
+        if(!as->img)
+        {
+            asmfatal(as, "Out of memory");
+        }
+        memcpy(emitsz(as, 0x44), elfhdr, 0x44);
+        emitd(as, as->csize + 0x54);
+        emitd(as, as->csize + 0x54);
+        memcpy(emitsz(as, 0x54 - 0x4c), elfhdr + 0x4c, 0x54 - 0x4c);
+        codegen(as);
+
+        if(writeimg(as, fnameout))
+        {
+            fprintf(as->diag,
+                    "[!] ERROR: Cannot write to file '%s'\n", fnameout);
+        }
+        else
+        {
+            res = 0;
+        }
+    }
+    as->onfatal = prevonfatal;
+
+    return(res);
+}
+
+/*
+ * Assembles src, which must be terminated by a NUL byte, into the
+ * executable fnameout. srcname is the name of the source, the messages go
+ * to diag. Returns 0 on success and 1 on error.
+ */
+int
+assemble_src(char *src, char *srcname, char *fnameout, FILE *diag)
+{
+    struct Asm *as;
+    jmp_buf onfatal;
+    int res;
+
+    as = asmnew(srcname, diag);
+    if(!as)
+    {
+        return(1);
+    }
+
+    res = 1;
+    if(setjmp(onfatal) == 0)
+    {
+        as->onfatal = &onfatal;
+        asmtext(as, src);
+        as->onfatal = 0;
+
+#if 0
+        for(i = 0;
+            i < as->ltblcap;
+            ++i)
+        {
+            if(as->ltbl[i])
+            {
+                printf("%s:\t\t0x%.8x\n", as->ltbl[i]->name, as->ltbl[i]->addr);
+            }
+        }
+#endif
+
+        res = asmwrite(as, fnameout);
+    }
+    asmfree(as);
+
+    return(res);
+}
+
+/*
+ * Assembles the source file fnamein into the executable fnameout.
+ * Returns 0 on success and 1 on error.
+ */
+int
+assemble(char *fnamein, char *fnameout)
+{
+    char *src;
+
+    src = mapsrc(fnamein, 0);
+    if(!src)
+    {
+        printf("[!] ERROR: Cannot read from file '%s'", fnamein);
+        return(1);
+    }
+
+    return(assemble_src(src, fnamein, fnameout, stdout));
 }
 
 #ifndef ASMORG_API
@@ -1302,8 +1933,7 @@ int main(int argc, char *argv[])
         fout = argv[2];
     }
 
-    assemble(fin, fout);
-    return(0);
+    return(assemble(fin, fout));
 }
 
 #endif
@@ -37,6 +37,8 @@
 /**                                  UTILS                                   **/
 /******************************************************************************/
 
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -44,97 +46,477 @@
 
 #define ALIGN(n, a) ((((n)%(a))>0)?((n)+((a)-((n)%(a)))):(n))
 
-#define MALLOC_TYPE(_Type_) ((_Type_ *)malloc(sizeof(_Type_)))
+/* AST and IR-C nodes come from the arena of the current phase (ctx->arena) */
+#define ALLOC_TYPE(_Type_)\
+    ((_Type_ *)arena_alloc(ctx, ctx->arena, sizeof(_Type_)))
 #define DUP_OBJ(_Type_, dest, src)\
     ((_Type_*)\
-        (dest=MALLOC_TYPE(_Type_),\
+        (dest=ALLOC_TYPE(_Type_),\
         memcpy((void*)(dest),(const void *)(src),sizeof(_Type_))))
 
+/******************************************************************************/
+/**                                 ARENAS                                   **/
+/******************************************************************************/
+
+/*
+ * Bump-pointer arenas. Memory comes from big chunks and is given back all
+ * together: arena_reset rewinds an arena to a mark and keeps the chunks
+ * for the next allocations, arena_free releases them.
+ */
+
+#define ARENA_CHUNK_SIZE (64*1024)
+#define ARENA_ALIGN 8
+
+typedef struct ArenaChunk ArenaChunk;
+
+struct
+ArenaChunk
+{
+    ArenaChunk *next;
+    long size;
+};
+
+#define ARENA_CHUNK_HEADER ALIGN((long)sizeof(ArenaChunk), ARENA_ALIGN)
+
+typedef struct
+{
+    ArenaChunk *chunks; /* In use, the newest first */
+    ArenaChunk *free;   /* Kept by arena_reset */
+    char *ptr;
+    char *end;
+
+    /* Statistics */
+    long allocs_count;
+    long allocs_size;
+    long mallocs_count;
+} Arena;
+
+typedef struct
+{
+    ArenaChunk *chunk;
+    char *ptr;
+} ArenaMark;
+
+typedef struct EzcCtx EzcCtx;
+
+void fatal(EzcCtx *ctx, char *fmt, ...);
+
+void *
+arena_alloc(EzcCtx *ctx, Arena *a, long size)
+{
+    void *res;
+    ArenaChunk *chunk;
+    long chunk_size;
+
+    size = ALIGN(size, ARENA_ALIGN);
+    if(a->end - a->ptr < size)
+    {
+        chunk = a->free;
+        if(chunk && chunk->size >= size)
+        {
+            a->free = chunk->next;
+        }
+        else
+        {
+            chunk_size = ARENA_CHUNK_SIZE;
+            if(size > chunk_size)
+            {
+                chunk_size = size;
+            }
+
+            chunk = (ArenaChunk *)malloc(ARENA_CHUNK_HEADER + chunk_size);
+            if(!chunk)
+            {
+                fatal(ctx, "Cannot allocate memory");
+            }
+            chunk->size = chunk_size;
+            ++a->mallocs_count;
+        }
+
+        chunk->next = a->chunks;
+        a->chunks = chunk;
+        a->ptr = (char *)chunk + ARENA_CHUNK_HEADER;
+        a->end = a->ptr + chunk->size;
+    }
+
+    res = a->ptr;
+    a->ptr += size;
+    ++a->allocs_count;
+    a->allocs_size += size;
+
+    return(res);
+}
+
+ArenaMark
+arena_mark(Arena *a)
+{
+    ArenaMark res;
+
+    res.chunk = a->chunks;
+    res.ptr = a->ptr;
+
+    return(res);
+}
+
+/* Frees everything allocated after the mark (everything for a zero mark) */
+void
+arena_reset(Arena *a, ArenaMark mark)
+{
+    ArenaChunk *chunk;
+
+    while(a->chunks != mark.chunk)
+    {
+        chunk = a->chunks;
+        a->chunks = chunk->next;
+        chunk->next = a->free;
+        a->free = chunk;
+    }
+
+    if(mark.chunk)
+    {
+        a->ptr = mark.ptr;
+        a->end = (char *)mark.chunk + ARENA_CHUNK_HEADER + mark.chunk->size;
+    }
+    else
+    {
+        a->ptr = 0;
+        a->end = 0;
+    }
+}
+
+void
+arena_free(Arena *a)
+{
+    ArenaChunk *chunk;
+
+    while(a->chunks)
+    {
+        chunk = a->chunks;
+        a->chunks = chunk->next;
+        free(chunk);
+    }
+    while(a->free)
+    {
+        chunk = a->free;
+        a->free = chunk->next;
+        free(chunk);
+    }
+    memset(a, 0, sizeof(*a));
+}
+
+/******************************************************************************/
+/**                                CONTEXT                                   **/
+/******************************************************************************/
+
+/*
+ * All the state of a compilation lives in an EzcCtx, so several units can
+ * be compiled in the same process, even at the same time on different
+ * threads. The context is handed to ezc_compile and from there to every
+ * phase of the pipeline: nothing of a compilation is global.
+ */
+
+#include <setjmp.h>
+#include <pthread.h>
+
+typedef struct StrInterned StrInterned;
+typedef struct Type Type;
+typedef struct Label Label;
+typedef struct Sym Sym;
+typedef struct SymSlot SymSlot;
+typedef struct Token Token;
+typedef struct Stmt Stmt;
+typedef struct RegLive RegLive;
+typedef struct RegMark RegMark;
+
+/* Rules of the peephole pass (see peep_rules) */
+#define PEEP_RULES_COUNT 12
+
+struct
+EzcCtx
+{
+    /* Diagnostics (stdout if null) and where fatal errors jump to */
+    FILE *diag;
+    jmp_buf *on_fatal;
+
+    /*
+     * Arena of the current phase: the AST (and the types) live until the
+     * next unit, the IR-C until the next unit or, for a backend worker,
+     * until its function is emitted.
+     */
+    Arena *arena;
+    Arena ast_arena;
+    Arena irc_arena;
+
+    /*
+     * The context itself, or the unit's context for a backend worker. A
+     * worker looks strings and types up in the unit's tables first, which
+     * nobody changes while the workers run, and adds the missing ones to
+     * its own tables (see str_intern_range and type_get).
+     */
+    EzcCtx *shared;
+
+    /* String interning */
+    Arena str_arena;
+    StrInterned **str_intern_table;
+    int str_intern_table_cap;
+    int str_intern_table_count;
+
+    /* Types */
+    Type **type_table;
+    int type_table_cap;
+    int type_table_count;
+
+    /* Symbols */
+    Label *label_table;
+    int label_table_count;
+    int label_table_cap;
+    int *label_index;
+    int label_index_cap;
+    Sym *sym_table;
+    int sym_table_count;
+    int sym_table_cap;
+    SymSlot *sym_index;
+    int sym_index_cap;
+    int sym_index_count;
+
+    /* A backend worker also sees this many symbols of the unit's table */
+    int shared_syms_count;
+
+    /* Parser */
+    char *source;
+    int source_line;
+    int func_var_offset;
+    Token *tokens;
+    int tokens_count;
+    int tokens_cap;
+    int tok_pos;
+
+    char *kword_void;
+    char *kword_char;
+    char *kword_int;
+    char *kword_struct;
+    char *kword_return;
+    char *kword_goto;
+    char *kword_if;
+    char *kword_else;
+    char *kword_while;
+    char *kword_for;
+    char *kword_attribute;
+    char *kword_regparm;
+
+    /* Semantic analysis */
+    Type *curr_func_type;
+
+    /* AST -> IR-C */
+    int lbl_local;
+    int lbl_count;
+    char tmp_var_buff[64];
+    int tmp_vars_count;
+    Stmt *curr_block;
+    Stmt *curr_block_last;
+    Sym *tmp_vars_pool;
+    int tmp_vars_pool_count;
+
+    /* Code gen: register allocation of the current function */
+    RegLive *reg_lives;
+    int reg_lives_count;
+    int reg_lives_cap;
+    RegMark *reg_marks;
+    int reg_marks_count;
+    int reg_marks_cap;
+    int func_regs;
+
+    /* Code gen: peephole pass (on unless -O0) and how often each rule fired */
+    int peephole;
+    int peep_fired[PEEP_RULES_COUNT];
+
+    /* Threads for the functions of a unit (serial if less than 2) */
+    int backend_jobs;
+
+    /* Arguments passed in registers to the functions defined in a unit */
+    int regparm;
+
+    /* Write the assembly text instead of the executable */
+    int emit_asm;
+};
+
+FILE *
+diag_stream(EzcCtx *ctx)
+{
+    FILE *res;
+
+    res = stdout;
+    if(ctx && ctx->diag)
+    {
+        res = ctx->diag;
+    }
+
+    return(res);
+}
+
+/* Aborts the current compilation */
+void
+ezc_abort(EzcCtx *ctx)
+{
+    if(ctx && ctx->on_fatal)
+    {
+        longjmp(*(ctx->on_fatal), 1);
+    }
+
+    exit(1);
+}
+
 #include <stdarg.h>
 
 void
-error(char *fmt, ...)
+error(EzcCtx *ctx, char *fmt, ...)
 {
     va_list ap;
 
-    printf("[!] ERROR: ");
+    fprintf(diag_stream(ctx), "[!] ERROR: ");
     va_start(ap, fmt);
-    vprintf(fmt, ap);
+    vfprintf(diag_stream(ctx), fmt, ap);
     va_end(ap);
-    printf("\n");
+    fprintf(diag_stream(ctx), "\n");
 }
 
 void
-fatal(char *fmt, ...)
+fatal(EzcCtx *ctx, char *fmt, ...)
 {
     va_list ap;
 
-    printf("[!] ERROR: ");
+    fprintf(diag_stream(ctx), "[!] ERROR: ");
     va_start(ap, fmt);
-    vprintf(fmt, ap);
+    vfprintf(diag_stream(ctx), fmt, ap);
     va_end(ap);
-    printf("\n");
+    fprintf(diag_stream(ctx), "\n");
 
-    exit(1);
+    ezc_abort(ctx);
 }
 
 /******************************************************************************/
 /**                            STRING INTERNING                              **/
 /******************************************************************************/
 
+/*
+ * Interned strings live in an arena (a list of big chunks, so pointers
+ * never move) and are indexed by an open-addressing hash table.
+ * Every entry keeps its hash, so the table can grow without re-hashing
+ * the strings.
+ *
+ * An entry also carries a kind: the parser tags keywords with their token
+ * kind, so the lexer classifies an identifier with the same lookup that
+ * interns it.
+ */
+
 #include <stddef.h> /* offsetof macro */
 
-typedef struct
+struct
 StrInterned
 {
-    struct StrInterned *next;
+    unsigned int hash;
+    int kind;
     int len;
     char str[1];
-} StrInterned;
+};
+
+unsigned int
+str_hash(char *s, int len)
+{
+    unsigned int h;
+    int i;
+
+    /* FNV-1a */
+    h = 2166136261u;
+    for(i = 0;
+        i < len;
+        ++i)
+    {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
 
-StrInterned *str_intern_table;
+    return(h);
+}
 
 StrInterned *
-str_intern_create(char *s)
+str_intern_create(EzcCtx *ctx, char *s, int s_len, unsigned int hash)
 {
     StrInterned *res;
-    int s_len = strlen(s);
-    res = (StrInterned *)malloc(sizeof(StrInterned) + s_len);
-    res->next = 0;
+
+    res = (StrInterned *)arena_alloc(ctx, &ctx->str_arena,
+                                     offsetof(StrInterned, str) + s_len + 1);
+
+    res->hash = hash;
+    res->kind = 0;
     res->len = s_len;
-    strcpy(res->str, s);
+    memcpy(res->str, s, s_len);
     res->str[s_len] = 0;
+
     return(res);
 }
 
 void
-str_intern_add(StrInterned *si)
+str_intern_grow(EzcCtx *ctx)
 {
-    StrInterned *s;
+    StrInterned **old_table;
+    int old_cap;
+    int i;
+    int j;
+
+    old_table = ctx->str_intern_table;
+    old_cap = ctx->str_intern_table_cap;
+
+    ctx->str_intern_table_cap = old_cap ? old_cap*2 : 1024;
+    ctx->str_intern_table = (StrInterned **)calloc(ctx->str_intern_table_cap, sizeof(StrInterned *));
+    if(!ctx->str_intern_table)
+    {
+        fatal(ctx, "Cannot allocate memory for string interning");
+    }
 
-    if(str_intern_table)
+    for(i = 0;
+        i < old_cap;
+        ++i)
     {
-        s = str_intern_table;
-        while(s->next)
+        if(old_table[i])
         {
-            s = s->next;
+            j = old_table[i]->hash & (ctx->str_intern_table_cap - 1);
+            while(ctx->str_intern_table[j])
+            {
+                j = (j + 1) & (ctx->str_intern_table_cap - 1);
+            }
+            ctx->str_intern_table[j] = old_table[i];
         }
-        s->next = si;
+    }
+
+    free(old_table);
+}
+
+int
+str_intern_len(char *s)
+{
+    int res = 0;
+    if(s)
+    {
+        StrInterned *tmp = (StrInterned *)(s - offsetof(StrInterned, str));
+        res = tmp->len;
     }
     else
     {
-        str_intern_table = si;
+        res = 0;
     }
+
+    return(res);
 }
 
 int
-str_intern_len(char *s)
+str_intern_kind(char *s)
 {
     int res = 0;
     if(s)
     {
         StrInterned *tmp = (StrInterned *)(s - offsetof(StrInterned, str));
-        res = tmp->len;
+        res = tmp->kind;
     }
     else
     {
@@ -144,32 +526,92 @@ str_intern_len(char *s)
     return(res);
 }
 
+unsigned int
+str_intern_hash(char *s)
+{
+    StrInterned *tmp;
+
+    assert(s);
+    tmp = (StrInterned *)(s - offsetof(StrInterned, str));
+    return(tmp->hash);
+}
+
+void
+str_intern_set_kind(char *s, int kind)
+{
+    StrInterned *tmp;
+
+    assert(s);
+    tmp = (StrInterned *)(s - offsetof(StrInterned, str));
+    tmp->kind = kind;
+}
+
+/*
+ * Looks s up in the table of c. If it is not there returns null, and the
+ * free slot where it goes in *slot.
+ */
+StrInterned *
+str_intern_lookup(EzcCtx *ctx, char *s, int s_len, unsigned int hash, int *slot)
+{
+    StrInterned *res;
+    int i;
+
+    *slot = -1;
+    if(!ctx->str_intern_table_cap)
+    {
+        return(0);
+    }
+
+    i = hash & (ctx->str_intern_table_cap - 1);
+    res = ctx->str_intern_table[i];
+    while(res)
+    {
+        if(res->hash == hash && res->len == s_len &&
+           memcmp(res->str, s, s_len) == 0)
+        {
+            break;
+        }
+        i = (i + 1) & (ctx->str_intern_table_cap - 1);
+        res = ctx->str_intern_table[i];
+    }
+    *slot = i;
+
+    return(res);
+}
+
 char *
-str_intern(char *s)
+str_intern_range(EzcCtx *ctx, char *s, int s_len)
 {
     char *res = 0;
-    int found;
     StrInterned *ptr;
-    int s_len;
+    unsigned int hash;
+    int i;
 
-    if(s && *s)
+    if(s && s_len > 0)
     {
-        found = 0;
-        ptr = str_intern_table;
-        s_len = strlen(s);
-        while(!found && ptr)
+        hash = str_hash(s, s_len);
+
+        /* A backend worker: the unit's strings are read-only */
+        ptr = 0;
+        if(ctx->shared != ctx)
         {
-            found = (ptr->len == s_len && strcmp(ptr->str, s) == 0);
-            if(!found)
-            {
-                ptr = ptr->next;
-            }
+            ptr = str_intern_lookup(ctx->shared, s, s_len, hash, &i);
         }
 
-        if(!found)
+        if(!ptr)
         {
-            ptr = str_intern_create(s);
-            str_intern_add(ptr);
+            if(2*(ctx->str_intern_table_count + 1) > ctx->str_intern_table_cap)
+            {
+                str_intern_grow(ctx);
+            }
+
+            ptr = str_intern_lookup(ctx, s, s_len, hash, &i);
+            if(!ptr)
+            {
+                ptr = str_intern_create(ctx, s, s_len, hash);
+                ctx->str_intern_table[i] = ptr;
+                ++ctx->str_intern_table_count;
+            }
         }
 
         res = (char *)ptr->str;
@@ -182,6 +624,23 @@ str_intern(char *s)
     return(res);
 }
 
+char *
+str_intern(EzcCtx *ctx, char *s)
+{
+    char *res = 0;
+
+    if(s && *s)
+    {
+        res = str_intern_range(ctx, s, strlen(s));
+    }
+    else
+    {
+        res = 0;
+    }
+
+    return(res);
+}
+
 /******************************************************************************/
 /**                                 TYPES                                    **/
 /******************************************************************************/
@@ -197,8 +656,6 @@ str_intern(char *s)
  * 
  */
 
-typedef struct Type Type;
-
 typedef struct
 FuncParam
 {
@@ -208,11 +665,11 @@ FuncParam
 } FuncParam;
 
 FuncParam *
-make_func_param(char *id, Type *type)
+make_func_param(EzcCtx *ctx, char *id, Type *type)
 {
     FuncParam *res;
 
-    res = MALLOC_TYPE(FuncParam);
+    res = ALLOC_TYPE(FuncParam);
     if(res)
     {
         res->id = id;
@@ -253,11 +710,11 @@ AggrElement
 } AggrElement;
 
 AggrElement *
-make_aggr_element(char *id, Type *type, int offset)
+make_aggr_element(EzcCtx *ctx, char *id, Type *type, int offset)
 {
     AggrElement *res;
 
-    res = MALLOC_TYPE(AggrElement);
+    res = ALLOC_TYPE(AggrElement);
     if(res)
     {
         res->id = id;
@@ -292,6 +749,8 @@ Type
     FuncParam *params;
     char *id;
     AggrElement *def;
+    AggrElement **members;
+    int members_cap;
 };
 
 Type _type_void = { TYPE_VOID, 0, 0 };
@@ -322,142 +781,277 @@ type_is_arithmetic(Type *type)
     return(type == type_char() || type == type_int());
 }
 
-#define TYPE_PTR_CACHE_SIZE 100
-Type type_ptr_cache[TYPE_PTR_CACHE_SIZE];
-int type_ptr_cache_count = 0;
+/*
+ * Composed types are hash-consed: a type is identified by its kind, its
+ * base type (pointed, element or return type), its length (arrays), its
+ * parameter types (functions) and its tag (structs). The table is an
+ * open-addressing hash table, grown at half load. Types live in the AST
+ * arena of the unit; the ones a backend worker adds live in its own until
+ * its next function.
+ */
 
-Type *
-type_ptr(Type *base_type)
+unsigned int
+type_hash(int kind, Type *base_type, int length, FuncParam *params, char *id)
 {
-    Type *res = 0;
-    int i;
-
-    for(i = 0;
-        i < type_ptr_cache_count;
-        ++i)
-    {
-        if(type_ptr_cache[i].base_type == base_type)
-        {
-            res = &(type_ptr_cache[i]);
-            break;
-        }
-    }
+    unsigned int h;
 
-    if (!res)
+    h = 2166136261u;
+    h = (h ^ (unsigned int)kind)*16777619u;
+    h = (h ^ (unsigned int)(unsigned long)base_type)*16777619u;
+    h = (h ^ (unsigned int)length)*16777619u;
+    h = (h ^ (unsigned int)(unsigned long)id)*16777619u;
+    while(params)
     {
-        res = &(type_ptr_cache[type_ptr_cache_count]);
-        ++type_ptr_cache_count;
-        res->kind = TYPE_PTR;
-        res->size = 4;
-        res->base_type = base_type;
+        h = (h ^ (unsigned int)(unsigned long)params->type)*16777619u;
+        params = params->next;
     }
 
-    return(res);
+    return(h ^ (h >> 15));
 }
 
-Type *
-type_func(Type *ret_type, FuncParam *params)
+int
+type_match(Type *type, int kind, Type *base_type, int length,
+           FuncParam *params, char *id)
 {
-    Type *res;
+    FuncParam *param;
 
-    res = MALLOC_TYPE(Type);
-    if(res)
+    if(type->kind != kind || type->base_type != base_type ||
+       type->length != length || type->id != id)
     {
-        res->kind = TYPE_FUNC;
-        res->base_type = ret_type;
-        res->params = params;
+        return(0);
     }
 
-    return(res);
-}
+    param = type->params;
+    while(param && params && param->type == params->type)
+    {
+        param = param->next;
+        params = params->next;
+    }
 
-#define TYPE_ARRAY_CACHE_SIZE 100
-Type type_array_cache[TYPE_ARRAY_CACHE_SIZE];
-int type_array_cache_count = 0;
+    return(!param && !params);
+}
 
-Type *
-type_array(Type *base_type, int length)
+void
+type_table_grow(EzcCtx *ctx)
 {
-    Type *res = 0;
+    Type **old_table;
+    int old_cap;
+    Type *type;
     int i;
+    int j;
+
+    old_table = ctx->type_table;
+    old_cap = ctx->type_table_cap;
+
+    ctx->type_table_cap = old_cap ? old_cap*2 : 256;
+    ctx->type_table = (Type **)calloc(ctx->type_table_cap, sizeof(Type *));
+    if(!ctx->type_table)
+    {
+        fatal(ctx, "Cannot allocate memory for the types");
+    }
 
     for(i = 0;
-        i < type_array_cache_count;
+        i < old_cap;
         ++i)
     {
-        if(type_array_cache[i].base_type == base_type &&
-           type_array_cache[i].length == length)
+        type = old_table[i];
+        if(type)
         {
-            res = &(type_array_cache[i]);
-            break;
+            j = type_hash(type->kind, type->base_type, type->length,
+                          type->params, type->id) & (ctx->type_table_cap - 1);
+            while(ctx->type_table[j])
+            {
+                j = (j + 1) & (ctx->type_table_cap - 1);
+            }
+            ctx->type_table[j] = type;
         }
     }
 
-    if (!res)
+    free(old_table);
+}
+
+/*
+ * Looks the type up in the table of c. If it is not there returns null,
+ * and the free slot where it goes in *slot.
+ */
+Type *
+type_lookup(EzcCtx *ctx, int kind, Type *base_type, int length,
+            FuncParam *params, char *id, int *slot)
+{
+    Type *res;
+    int i;
+
+    *slot = -1;
+    if(!ctx->type_table_cap)
+    {
+        return(0);
+    }
+
+    i = type_hash(kind, base_type, length, params, id) & (ctx->type_table_cap - 1);
+    res = ctx->type_table[i];
+    while(res && !type_match(res, kind, base_type, length, params, id))
     {
-        res = &(type_array_cache[type_array_cache_count]);
-        ++type_array_cache_count;
-        res->kind = TYPE_ARRAY;
-        res->base_type = base_type;
-        res->length = length;
-        res->size = length*base_type->size;
+        i = (i + 1) & (ctx->type_table_cap - 1);
+        res = ctx->type_table[i];
     }
+    *slot = i;
 
     return(res);
 }
 
-#define TYPE_STRUCT_CACHE_SIZE 100
-Type type_struct_cache[TYPE_STRUCT_CACHE_SIZE];
-int type_struct_cache_count = 0;
-
+/* Returns the unique type with the given key, making it if needed */
 Type *
-type_struct(char *id, AggrElement *def)
+type_get(EzcCtx *ctx, int kind, Type *base_type, int length,
+         FuncParam *params, char *id)
 {
-    Type *res = 0;
-    AggrElement *e;
+    Type *res;
+    FuncParam *param;
+    FuncParam *last;
     int i;
 
-    for(i = 0;
-        i < type_struct_cache_count;
-        ++i)
+    /* A backend worker: the unit's types are read-only */
+    if(ctx->shared != ctx)
     {
-        if(type_struct_cache[i].id == id)
+        res = type_lookup(ctx->shared, kind, base_type, length, params, id, &i);
+        if(res)
         {
-            res = &(type_struct_cache[i]);
-            break;
+            return(res);
         }
     }
 
-    if (!res)
+    if(2*(ctx->type_table_count + 1) > ctx->type_table_cap)
+    {
+        type_table_grow(ctx);
+    }
+
+    res = type_lookup(ctx, kind, base_type, length, params, id, &i);
+    if(!res)
     {
-        res = &(type_struct_cache[type_struct_cache_count]);
-        ++type_struct_cache_count;
-        res->kind = TYPE_STRUCT;
+        res = (Type *)arena_alloc(ctx, &ctx->ast_arena, sizeof(Type));
+        memset(res, 0, sizeof(Type));
+        res->kind = kind;
+        res->base_type = base_type;
+        res->length = length;
         res->id = id;
+        if(kind == TYPE_PTR)
+        {
+            res->size = 4;
+        }
+        else if(kind == TYPE_ARRAY)
+        {
+            res->size = length*base_type->size;
+        }
+
+        /* Parameter names belong to the declaration, not to the type */
+        last = 0;
+        while(params)
+        {
+            param = (FuncParam *)arena_alloc(ctx, &ctx->ast_arena, sizeof(FuncParam));
+            param->id = 0;
+            param->type = params->type;
+            param->next = 0;
+            if(last)
+            {
+                last->next = param;
+            }
+            else
+            {
+                res->params = param;
+            }
+            last = param;
+            params = params->next;
+        }
+
+        ctx->type_table[i] = res;
+        ++ctx->type_table_count;
     }
-    else if(res->def && def)
+
+    return(res);
+}
+
+Type *
+type_ptr(EzcCtx *ctx, Type *base_type)
+{
+    return(type_get(ctx, TYPE_PTR, base_type, 0, 0, 0));
+}
+
+Type *
+type_func(EzcCtx *ctx, Type *ret_type, FuncParam *params)
+{
+    return(type_get(ctx, TYPE_FUNC, ret_type, 0, params, 0));
+}
+
+Type *
+type_array(EzcCtx *ctx, Type *base_type, int length)
+{
+    return(type_get(ctx, TYPE_ARRAY, base_type, length, 0, 0));
+}
+
+Type *
+type_struct(EzcCtx *ctx, char *id, AggrElement *def)
+{
+    Type *res = 0;
+    AggrElement *e;
+    AggrElement **members;
+    int members_count;
+    int cap;
+    int i;
+
+    res = type_get(ctx, TYPE_STRUCT, 0, 0, 0, id);
+    if(res->def && def)
     {
-        fatal("Cannot redefine a structure");
+        fatal(ctx, "Cannot redefine a structure");
     }
 
     if(!res->def && def)
     {
-        res->def = def;
-
         /* Compute struct size */
         res->size = 0;
+        members_count = 0;
         e = def;
         while(e)
         {
             if(e->type->size == 0)
             {
-                fatal("Invalid structure member type");
+                fatal(ctx, "Invalid structure member type");
             }
             res->size += ALIGN(e->type->size, 4);
+            ++members_count;
             e = e->next;
         }
 
         assert(res->size);
+
+        /*
+         * Member index: open addressing on the interned id hash, at most
+         * half full. On duplicate ids the first member wins, as the list
+         * walk did.
+         */
+        cap = 4;
+        while(cap < 2*members_count)
+        {
+            cap *= 2;
+        }
+        members = (AggrElement **)arena_alloc(ctx, &ctx->ast_arena, cap*sizeof(AggrElement *));
+        memset(members, 0, cap*sizeof(AggrElement *));
+        e = def;
+        while(e)
+        {
+            i = str_intern_hash(e->id) & (cap - 1);
+            while(members[i] && members[i]->id != e->id)
+            {
+                i = (i + 1) & (cap - 1);
+            }
+            if(!members[i])
+            {
+                members[i] = e;
+            }
+            e = e->next;
+        }
+
+        res->members = members;
+        res->members_cap = cap;
+        res->def = def;
     }
 
     return(res);
@@ -467,20 +1061,20 @@ AggrElement *
 get_struct_member(Type *stype, char *id)
 {
     AggrElement *res;
-    AggrElement *curr;
+    int i;
 
     res = 0;
-    if(stype->def)
+    if(stype->members && id)
     {
-        curr = stype->def;
-        while(curr)
+        i = str_intern_hash(id) & (stype->members_cap - 1);
+        while(stype->members[i])
         {
-            if(curr->id == id)
+            if(stype->members[i]->id == id)
             {
-                res = curr;
+                res = stype->members[i];
                 break;
             }
-            curr = curr->next;
+            i = (i + 1) & (stype->members_cap - 1);
         }
     }
 
@@ -515,65 +1109,120 @@ enum
     LABEL_STATUS_COUNT
 };
 
-typedef struct
+struct
+Label
 {
     int status;
     char *id;
-} Label;
+};
+
+#define LBL_TABLE_SIZE 1024
+
+/*
+ * The labels are kept in definition order for the diagnostics. The index
+ * maps an interned id to its position in the table plus one (0 is empty).
+ */
+int *
+label_index_find(EzcCtx *ctx, char *id)
+{
+    int *res = 0;
+    int i;
+
+    i = str_intern_hash(id) & (ctx->label_index_cap - 1);
+    while(ctx->label_index[i])
+    {
+        if(ctx->label_table[ctx->label_index[i] - 1].id == id)
+        {
+            break;
+        }
+        i = (i + 1) & (ctx->label_index_cap - 1);
+    }
+    res = &(ctx->label_index[i]);
+
+    return(res);
+}
+
+void
+label_table_grow(EzcCtx *ctx)
+{
+    Label *label_table;
+    int i;
+
+    ctx->label_table_cap *= 2;
+    label_table = (Label *)realloc(ctx->label_table, ctx->label_table_cap*sizeof(Label));
+    if(!label_table)
+    {
+        fatal(ctx, "Cannot allocate memory for the label table");
+    }
+    ctx->label_table = label_table;
 
-#define LBL_TABLE_SIZE 1000
-Label label_table[LBL_TABLE_SIZE];
-int label_table_count = 0;
+    free(ctx->label_index);
+    ctx->label_index_cap = 2*ctx->label_table_cap;
+    ctx->label_index = (int *)calloc(ctx->label_index_cap, sizeof(int));
+    if(!ctx->label_index)
+    {
+        fatal(ctx, "Cannot allocate memory for the label table");
+    }
+
+    for(i = 0;
+        i < ctx->label_table_count;
+        ++i)
+    {
+        *label_index_find(ctx, ctx->label_table[i].id) = i + 1;
+    }
+}
 
 Label *
-label_add(char *id)
+label_add(EzcCtx *ctx, char *id)
 {
     Label *res = 0;
 
-    res = &(label_table[label_table_count]);
-    ++label_table_count;
+    if(ctx->label_table_count == ctx->label_table_cap)
+    {
+        label_table_grow(ctx);
+    }
+
+    res = &(ctx->label_table[ctx->label_table_count]);
+    ++ctx->label_table_count;
     res->id = id;
     res->status = LABEL_UNDEFINED;
+    *label_index_find(ctx, id) = ctx->label_table_count;
 
     return(res);
 }
 
 Label *
-label_get(char *id)
+label_get(EzcCtx *ctx, char *id)
 {
     Label *res = 0;
-    int i;
+    int *slot;
 
-    for(i = 0;
-        i < label_table_count;
-        ++i)
+    slot = label_index_find(ctx, id);
+    if(*slot)
     {
-        if(id == label_table[i].id)
-        {
-            res = &(label_table[i]);
-            break;
-        }
+        res = &(ctx->label_table[*slot - 1]);
     }
 
     return(res);
 }
 
 Label *
-label_get_or_add(char *id)
+label_get_or_add(EzcCtx *ctx, char *id)
 {
     Label *res = 0;
 
-    res = label_get(id);
+    res = label_get(ctx, id);
     if(!res)
     {
-        res = label_add(id);
+        res = label_add(ctx, id);
         res->status = LABEL_UNDEFINED;
     }
 
     return(res);
 }
 
-typedef struct
+struct
+Sym
 {
     char *id;
     Type *type;
@@ -582,19 +1231,161 @@ typedef struct
     void *func;
     int is_const;
     int value;
-} Sym;
 
-#define SYM_TABLE_SIZE 1000
-Sym sym_table[SYM_TABLE_SIZE];
-int sym_table_count = 0;
+    /* The symbol with the same id in an outer scope (-1 if none) */
+    int shadowed;
+
+    /*
+     * Register holding a local (-1 if it lives in its frame slot) and,
+     * while the allocator scans its function, its live interval (-1 if
+     * it cannot be kept in a register)
+     */
+    int reg;
+    int live;
+
+    /* Arguments a function takes in registers (see compile_call) */
+    int regparm;
+};
+
+/*
+ * The index maps an interned id to its innermost symbol. Slots are never
+ * removed until the next unit: when a scope is popped the slot just goes
+ * back to the shadowed symbol.
+ */
+struct
+SymSlot
+{
+    char *id;
+    int top;
+};
+
+#define SYM_TABLE_SIZE 1024
+
+SymSlot *
+sym_slot_lookup(EzcCtx *ctx, char *id)
+{
+    SymSlot *res = 0;
+    int i;
+
+    if(ctx->sym_index_cap)
+    {
+        i = str_intern_hash(id) & (ctx->sym_index_cap - 1);
+        while(ctx->sym_index[i].id)
+        {
+            if(ctx->sym_index[i].id == id)
+            {
+                res = &(ctx->sym_index[i]);
+                break;
+            }
+            i = (i + 1) & (ctx->sym_index_cap - 1);
+        }
+    }
+
+    return(res);
+}
+
+SymSlot *
+sym_slot_find(EzcCtx *ctx, char *id)
+{
+    return(sym_slot_lookup(ctx, id));
+}
+
+void
+sym_index_grow(EzcCtx *ctx)
+{
+    SymSlot *old_index;
+    int old_cap;
+    int i;
+    int j;
+
+    old_index = ctx->sym_index;
+    old_cap = ctx->sym_index_cap;
+
+    ctx->sym_index_cap = old_cap ? old_cap*2 : SYM_TABLE_SIZE;
+    ctx->sym_index = (SymSlot *)calloc(ctx->sym_index_cap, sizeof(SymSlot));
+    if(!ctx->sym_index)
+    {
+        fatal(ctx, "Cannot allocate memory for the symbol table");
+    }
+
+    for(i = 0;
+        i < old_cap;
+        ++i)
+    {
+        if(old_index[i].id)
+        {
+            j = str_intern_hash(old_index[i].id) & (ctx->sym_index_cap - 1);
+            while(ctx->sym_index[j].id)
+            {
+                j = (j + 1) & (ctx->sym_index_cap - 1);
+            }
+            ctx->sym_index[j] = old_index[i];
+        }
+    }
+
+    free(old_index);
+}
+
+/* Makes sure there is room for n more symbols */
+void
+sym_table_reserve(EzcCtx *ctx, int n)
+{
+    Sym *sym_table;
+
+    if(ctx->sym_table_count + n > ctx->sym_table_cap)
+    {
+        while(ctx->sym_table_count + n > ctx->sym_table_cap)
+        {
+            ctx->sym_table_cap *= 2;
+        }
+        sym_table = (Sym *)realloc(ctx->sym_table, ctx->sym_table_cap*sizeof(Sym));
+        if(!sym_table)
+        {
+            fatal(ctx, "Cannot allocate memory for the symbol table");
+        }
+        ctx->sym_table = sym_table;
+    }
+}
+
+/* Makes the i-th symbol the innermost one with its id */
+void
+sym_link(EzcCtx *ctx, int i)
+{
+    SymSlot *slot;
+    char *id;
+    int j;
+
+    id = ctx->sym_table[i].id;
+    slot = sym_slot_find(ctx, id);
+    if(!slot)
+    {
+        if(2*(ctx->sym_index_count + 1) > ctx->sym_index_cap)
+        {
+            sym_index_grow(ctx);
+        }
+
+        j = str_intern_hash(id) & (ctx->sym_index_cap - 1);
+        while(ctx->sym_index[j].id)
+        {
+            j = (j + 1) & (ctx->sym_index_cap - 1);
+        }
+        slot = &(ctx->sym_index[j]);
+        slot->id = id;
+        slot->top = -1;
+        ++ctx->sym_index_count;
+    }
+
+    ctx->sym_table[i].shadowed = slot->top;
+    slot->top = i;
+}
 
 Sym *
-sym_add(char *id, Type *type)
+sym_add(EzcCtx *ctx, char *id, Type *type)
 {
     Sym *res = 0;
 
-    res = &(sym_table[sym_table_count]);
-    ++sym_table_count;
+    sym_table_reserve(ctx, 1);
+    res = &(ctx->sym_table[ctx->sym_table_count]);
     res->id = id;
     res->type = type;
     res->global = 0;
@@ -602,24 +1393,42 @@ sym_add(char *id, Type *type)
     res->func = 0;
     res->is_const = 0;
     res->value = 0;
+    res->reg = -1;
+    res->live = -1;
+    res->regparm = 0;
+    sym_link(ctx, ctx->sym_table_count);
+    ++ctx->sym_table_count;
 
     return(res);
 }
 
 Sym *
-sym_get(char *id)
+sym_get(EzcCtx *ctx, char *id)
 {
     Sym *res = 0;
+    SymSlot *slot;
     int i;
 
-    for(i = sym_table_count - 1;
-        i >= 0;
-        --i)
+    slot = sym_slot_find(ctx, id);
+    if(slot && slot->top >= 0)
+    {
+        res = &(ctx->sym_table[slot->top]);
+    }
+    else if(ctx->shared != ctx)
     {
-        if(id == sym_table[i].id)
+        /*
+         * A backend worker: the globals declared before its function, in
+         * the unit's table (which nobody changes while the workers run)
+         */
+        slot = sym_slot_lookup(ctx->shared, id);
+        i = slot ? slot->top : -1;
+        while(i >= ctx->shared_syms_count)
         {
-            res = &(sym_table[i]);
-            break;
+            i = ctx->shared->sym_table[i].shadowed;
+        }
+        if(i >= 0)
+        {
+            res = &(ctx->shared->sym_table[i]);
         }
     }
 
@@ -627,37 +1436,44 @@ sym_get(char *id)
 }
 
 Sym *
-sym_add_func_param(char *id, Type *type, int offset)
+sym_add_func_param(EzcCtx *ctx, char *id, Type *type, int offset)
 {
     Sym *res = 0;
 
-    res = &(sym_table[sym_table_count]);
-    ++sym_table_count;
-    res->id = id;
-    res->type = type;
-    res->global = 0;
+    res = sym_add(ctx, id, type);
     res->offset = offset;
-    res->func = 0;
-    res->is_const = 0;
-    res->value = 0;
 
     return(res);
 }
 
+/* Leaves the scopes opened after the first count symbols */
+void
+sym_pop(EzcCtx *ctx, int count)
+{
+    Sym *sym;
+
+    while(ctx->sym_table_count > count)
+    {
+        --ctx->sym_table_count;
+        sym = &(ctx->sym_table[ctx->sym_table_count]);
+        sym_slot_find(ctx, sym->id)->top = sym->shadowed;
+    }
+}
+
 void
-init_builtin_sym()
+init_builtin_sym(EzcCtx *ctx)
 {
 #if 0
     /* TODO: This is a type function not int */
-    sym_add("putchar", type_int());
+    sym_add(ctx, "putchar", type_int());
 #endif
 }
 
 void
-sym_reset()
+sym_reset(EzcCtx *ctx)
 {
-    sym_table_count = 0;
-    init_builtin_sym();
+    sym_pop(ctx, 0);
+    init_builtin_sym(ctx);
 }
 
 /******************************************************************************/
@@ -716,25 +1532,43 @@ Expr
     struct Expr *m;
     Type *cast_to;
     struct Expr *next;
+
+    /* Resolved by resolve_expr_type, null until then */
+    Type *type;
 } Expr;
 
 Expr *
-dup_expr(Expr *expr)
+alloc_expr(EzcCtx *ctx, int kind)
+{
+    Expr *res;
+
+    res = (Expr *)arena_alloc(ctx, ctx->arena, sizeof(Expr));
+    memset(res, 0, sizeof(Expr));
+    res->kind = kind;
+
+    return(res);
+}
+
+/* The copy also gets the type resolved for the original */
+Expr *
+dup_expr(EzcCtx *ctx, Expr *expr)
 {
     Expr *new;
-    new = DUP_OBJ(Expr, new, expr);
+
+    new = alloc_expr(ctx, expr->kind);
+    memcpy(new, expr, sizeof(Expr));
+
     return(new);
 }
 
 Expr *
-make_expr_intlit(int value)
+make_expr_intlit(EzcCtx *ctx, int value)
 {
     Expr *res = 0;
 
-    res = MALLOC_TYPE(Expr);
+    res = alloc_expr(ctx, EXPR_INTLIT);
     if(res)
     {
-        res->kind = EXPR_INTLIT;
         res->value = value;
         res->next = 0;
     }
@@ -743,14 +1577,13 @@ make_expr_intlit(int value)
 }
 
 Expr *
-make_expr_id(char *id)
+make_expr_id(EzcCtx *ctx, char *id)
 {
     Expr *res = 0;
 
-    res = MALLOC_TYPE(Expr);
+    res = alloc_expr(ctx, EXPR_ID);
     if(res)
     {
-        res->kind = EXPR_ID;
         res->id = id;
         res->next = 0;
     }
@@ -759,14 +1592,13 @@ make_expr_id(char *id)
 }
 
 Expr *
-make_expr_cast(Expr *l, Type *type)
+make_expr_cast(EzcCtx *ctx, Expr *l, Type *type)
 {
     Expr *res = 0;
 
-    res = MALLOC_TYPE(Expr);
+    res = alloc_expr(ctx, EXPR_CAST);
     if(res)
     {
-        res->kind = EXPR_CAST;
         res->l = l;
         res->cast_to = type;
         res->next = 0;
@@ -776,14 +1608,13 @@ make_expr_cast(Expr *l, Type *type)
 }
 
 Expr *
-make_expr_member_access(Expr *l, char *member)
+make_expr_member_access(EzcCtx *ctx, Expr *l, char *member)
 {
     Expr *res = 0;
 
-    res = MALLOC_TYPE(Expr);
+    res = alloc_expr(ctx, EXPR_MEMB_ACCESS);
     if(res)
     {
-        res->kind = EXPR_MEMB_ACCESS;
         res->l = l;
         res->id = member;
         res->next = 0;
@@ -793,14 +1624,13 @@ make_expr_member_access(Expr *l, char *member)
 }
 
 Expr *
-make_expr_member_access_ptr(Expr *l, char *member)
+make_expr_member_access_ptr(EzcCtx *ctx, Expr *l, char *member)
 {
     Expr *res = 0;
 
-    res = MALLOC_TYPE(Expr);
+    res = alloc_expr(ctx, EXPR_MEMB_ACCESS_PTR);
     if(res)
     {
-        res->kind = EXPR_MEMB_ACCESS_PTR;
         res->l = l;
         res->id = member;
         res->next = 0;
@@ -810,16 +1640,14 @@ make_expr_member_access_ptr(Expr *l, char *member)
 }
 
 Expr *
-make_expr_unary(int kind, Expr *l)
+make_expr_unary(EzcCtx *ctx, int kind, Expr *l)
 {
     Expr *res = 0;
 
-    res = MALLOC_TYPE(Expr);
+    res = alloc_expr(ctx, kind);
     if(res)
     {
-        res->kind = kind;
         res->l = l;
-        res->r = 0;
         res->next = 0;
     }
 
@@ -827,14 +1655,13 @@ make_expr_unary(int kind, Expr *l)
 }
 
 Expr *
-make_expr_binary(int kind, Expr *l, Expr *r)
+make_expr_binary(EzcCtx *ctx, int kind, Expr *l, Expr *r)
 {
     Expr *res = 0;
 
-    res = MALLOC_TYPE(Expr);
+    res = alloc_expr(ctx, kind);
     if(res)
     {
-        res->kind = kind;
         res->l = l;
         res->r = r;
         res->next = 0;
@@ -844,14 +1671,13 @@ make_expr_binary(int kind, Expr *l, Expr *r)
 }
 
 Expr *
-make_expr_ternary(Expr *l, Expr *m, Expr *r)
+make_expr_ternary(EzcCtx *ctx, Expr *l, Expr *m, Expr *r)
 {
     Expr *res = 0;
 
-    res = MALLOC_TYPE(Expr);
+    res = alloc_expr(ctx, EXPR_TERNARY);
     if(res)
     {
-        res->kind = EXPR_TERNARY;
         res->l = l;
         res->m = m;
         res->r = r;
@@ -862,14 +1688,13 @@ make_expr_ternary(Expr *l, Expr *m, Expr *r)
 }
 
 Expr *
-make_expr_compound(Expr *l)
+make_expr_compound(EzcCtx *ctx, Expr *l)
 {
     Expr *res = 0;
 
-    res = MALLOC_TYPE(Expr);
+    res = alloc_expr(ctx, EXPR_COMPOUND);
     if(res)
     {
-        res->kind = EXPR_COMPOUND;
         res->l = l;
         res->next = 0;
     }
@@ -877,28 +1702,28 @@ make_expr_compound(Expr *l)
     return(res);
 }
 
-void print_type(Type *type);
+void print_type(EzcCtx *ctx, Type *type);
 
 void
-print_sym_table()
+print_sym_table(EzcCtx *ctx)
 {
     int i;
     Sym *s;
 
     for(i = 0;
-        i < sym_table_count;
+        i < ctx->sym_table_count;
         ++i)
     {
-        s = &sym_table[i];
+        s = &ctx->sym_table[i];
         printf("%d - %s => ", i, s->id);
-        print_type(s->type);
+        print_type(ctx, s->type);
         printf("\n");
     }
-    print_type(s->type);
+    print_type(ctx, s->type);
 }
 
 void
-print_expr(Expr *expr)
+print_expr(EzcCtx *ctx, Expr *expr)
 {
     char *op = 0;
 
@@ -922,67 +1747,67 @@ print_expr(Expr *expr)
         case EXPR_ARR_SUB:
         {
             printf("(");
-            print_expr(expr->l);
+            print_expr(ctx, expr->l);
             printf("[");
-            print_expr(expr->r);
+            print_expr(ctx, expr->r);
             printf("])");
         } break;
 
         case EXPR_MEMB_ACCESS:
         {
             printf("(");
-            print_expr(expr->l);
+            print_expr(ctx, expr->l);
             printf(".%s)", expr->id);
         } break;
 
         case EXPR_MEMB_ACCESS_PTR:
         {
             printf("(");
-            print_expr(expr->l);
+            print_expr(ctx, expr->l);
             printf("->%s)", expr->id);
         } break;
 
         case EXPR_INC_PRE:
         {
             printf("(inc ");
-            print_expr(expr->l);
+            print_expr(ctx, expr->l);
             printf(")");
         } break;
 
         case EXPR_DEC_PRE:
         {
             printf("(dec ");
-            print_expr(expr->l);
+            print_expr(ctx, expr->l);
             printf(")");
         } break;
 
         case EXPR_CAST:
         {
             printf("(cast (");
-            print_type(expr->cast_to);
+            print_type(ctx, expr->cast_to);
             printf(") ");
-            print_expr(expr->l);
+            print_expr(ctx, expr->l);
             printf(")");
         } break;
 
         case EXPR_DEREF:
         {
             printf("(deref ");
-            print_expr(expr->l);
+            print_expr(ctx, expr->l);
             printf(")");
         } break;
 
         case EXPR_ADDR_OF:
         {
             printf("(addrof ");
-            print_expr(expr->l);
+            print_expr(ctx, expr->l);
             printf(")");
         } break;
 
         case EXPR_NEG:
         {
             printf("(-");
-            print_expr(expr->l);
+            print_expr(ctx, expr->l);
             printf(")");
         } break;
 
@@ -1000,11 +1825,11 @@ print_expr(Expr *expr)
         case EXPR_TERNARY:
         {
             printf("(");
-            print_expr(expr->l);
+            print_expr(ctx, expr->l);
             printf(" ? ");
-            print_expr(expr->m);
+            print_expr(ctx, expr->m);
             printf(" : ");
-            print_expr(expr->r);
+            print_expr(ctx, expr->r);
             printf(")");
         } break;
 
@@ -1015,7 +1840,7 @@ print_expr(Expr *expr)
             expr = expr->l;
             while(expr)
             {
-                print_expr(expr);
+                print_expr(ctx, expr);
                 if(expr->next)
                 {
                     printf(", ");
@@ -1033,9 +1858,9 @@ print_expr(Expr *expr)
     if(op)
     {
         printf("(%s ", op);
-        print_expr(expr->l);
+        print_expr(ctx, expr->l);
         printf(" ");
-        print_expr(expr->r);
+        print_expr(ctx, expr->r);
         printf(")");
     }
 }
@@ -1045,25 +1870,29 @@ Decl
 {
     Type *type;
     char *id;
+
+    /* Register chosen by the allocator for a local (-1 if none) */
+    int reg;
 } Decl;
 
 Decl *
-make_decl(Type *type, char *id)
+make_decl(EzcCtx *ctx, Type *type, char *id)
 {
     Decl *res = 0;
 
-    res = MALLOC_TYPE(Decl);
+    res = ALLOC_TYPE(Decl);
     if(res)
     {
         res->type = type;
         res->id = id;
+        res->reg = -1;
     }
 
     return(res);
 }
 
 void
-print_type(Type *type)
+print_type(EzcCtx *ctx, Type *type)
 {
     FuncParam *param;
 
@@ -1082,12 +1911,12 @@ print_type(Type *type)
     else if(type->kind == TYPE_PTR)
     {
         printf("ptr to ");
-        print_type(type->base_type);
+        print_type(ctx, type->base_type);
     }
     else if(type->kind == TYPE_ARRAY)
     {
         printf("array of %d of ", type->length);
-        print_type(type->base_type);
+        print_type(ctx, type->base_type);
     }
     else if(type->kind == TYPE_STRUCT)
     {
@@ -1099,7 +1928,7 @@ print_type(Type *type)
         param = type->params;
         while(param)
         {
-            print_type(param->type);
+            print_type(ctx, param->type);
             if(param->next)
             {
                 printf(", ");
@@ -1107,19 +1936,19 @@ print_type(Type *type)
             param = param->next;
         }
         printf(") => ");
-        print_type(type->base_type);
+        print_type(ctx, type->base_type);
     }
     else
     {
-        fatal("Invalid type to print");
+        fatal(ctx, "Invalid type to print");
     }
 }
 
 void
-print_decl(Decl *decl)
+print_decl(EzcCtx *ctx, Decl *decl)
 {
     printf("(var %s ", decl->id);
-    print_type(decl->type);
+    print_type(ctx, decl->type);
     printf(")");
 }
 
@@ -1139,7 +1968,7 @@ enum
     STMT_COUNT
 };
 
-typedef struct
+struct
 Stmt
 {
     int kind;
@@ -1156,37 +1985,40 @@ Stmt
     struct Stmt *then_stmt;
     struct Stmt *else_stmt;
     struct Stmt *next;
-} Stmt;
+};
 
 Stmt *
-make_stmt(int kind)
+make_stmt(EzcCtx *ctx, int kind)
 {
     Stmt *res = 0;
 
-    res = MALLOC_TYPE(Stmt);
+    res = (Stmt *)arena_alloc(ctx, ctx->arena, sizeof(Stmt));
     if(res)
     {
+        memset(res, 0, sizeof(Stmt));
         res->kind = kind;
-        res->next = 0;
     }
 
     return(res);
 }
 
 Stmt *
-dup_stmt(Stmt *stmt)
+dup_stmt(EzcCtx *ctx, Stmt *stmt)
 {
     Stmt *new;
-    new = DUP_OBJ(Stmt, new, stmt);
+
+    new = make_stmt(ctx, stmt->kind);
+    memcpy(new, stmt, sizeof(Stmt));
+
     return(new);
 }
 
 Stmt *
-make_stmt_decl(Decl *decl)
+make_stmt_decl(EzcCtx *ctx, Decl *decl)
 {
     Stmt *res = 0;
 
-    res = make_stmt(STMT_DECL);
+    res = make_stmt(ctx, STMT_DECL);
     if(res)
     {
         res->u.decl = decl;
@@ -1196,11 +2028,11 @@ make_stmt_decl(Decl *decl)
 }
 
 Stmt *
-make_stmt_expr(Expr *expr)
+make_stmt_expr(EzcCtx *ctx, Expr *expr)
 {
     Stmt *res = 0;
 
-    res = make_stmt(STMT_EXPR);
+    res = make_stmt(ctx, STMT_EXPR);
     if(res)
     {
         res->u.expr = expr;
@@ -1210,11 +2042,11 @@ make_stmt_expr(Expr *expr)
 }
 
 Stmt *
-make_stmt_if(Expr *cond, Stmt *then_stmt, Stmt *else_stmt)
+make_stmt_if(EzcCtx *ctx, Expr *cond, Stmt *then_stmt, Stmt *else_stmt)
 {
     Stmt *res = 0;
 
-    res = make_stmt(STMT_IF);
+    res = make_stmt(ctx, STMT_IF);
     if(res)
     {
         res->cond = cond;
@@ -1226,11 +2058,11 @@ make_stmt_if(Expr *cond, Stmt *then_stmt, Stmt *else_stmt)
 }
 
 Stmt *
-make_stmt_while(Expr *cond, Stmt *then_stmt)
+make_stmt_while(EzcCtx *ctx, Expr *cond, Stmt *then_stmt)
 {
     Stmt *res = 0;
 
-    res = make_stmt(STMT_WHILE);
+    res = make_stmt(ctx, STMT_WHILE);
     if(res)
     {
         res->cond = cond;
@@ -1242,11 +2074,11 @@ make_stmt_while(Expr *cond, Stmt *then_stmt)
 }
 
 Stmt *
-make_stmt_for(Expr *init, Expr *cond, Expr *post, Stmt *then_stmt)
+make_stmt_for(EzcCtx *ctx, Expr *init, Expr *cond, Expr *post, Stmt *then_stmt)
 {
     Stmt *res = 0;
 
-    res = make_stmt(STMT_FOR);
+    res = make_stmt(ctx, STMT_FOR);
     if(res)
     {
         res->init = init;
@@ -1260,7 +2092,7 @@ make_stmt_for(Expr *init, Expr *cond, Expr *post, Stmt *then_stmt)
 }
 
 void
-print_stmt(Stmt *stmt)
+print_stmt(EzcCtx *ctx, Stmt *stmt)
 {
     Stmt *sub_stmt;
 
@@ -1268,12 +2100,12 @@ print_stmt(Stmt *stmt)
     {
         case STMT_DECL:
         {
-            print_decl(stmt->u.decl);
+            print_decl(ctx, stmt->u.decl);
         } break;
 
         case STMT_EXPR:
         {
-            print_expr(stmt->u.expr);
+            print_expr(ctx, stmt->u.expr);
         } break;
 
         case STMT_BLOCK:
@@ -1283,7 +2115,7 @@ print_stmt(Stmt *stmt)
             while(sub_stmt)
             {
                 printf("  ");
-                print_stmt(sub_stmt);
+                print_stmt(ctx, sub_stmt);
                 sub_stmt = sub_stmt->next;
             }
             printf(")");
@@ -1294,7 +2126,7 @@ print_stmt(Stmt *stmt)
             printf("(ret ");
             if(stmt->u.expr)
             {
-                print_expr(stmt->u.expr);
+                print_expr(ctx, stmt->u.expr);
             }
             printf(")");
         } break;
@@ -1312,14 +2144,14 @@ print_stmt(Stmt *stmt)
         case STMT_IF:
         {
             printf("(if ");
-            print_expr(stmt->cond);
+            print_expr(ctx, stmt->cond);
             if(stmt->then_stmt)
             {
-                print_stmt(stmt->then_stmt);
+                print_stmt(ctx, stmt->then_stmt);
                 if(stmt->else_stmt)
                 {
                     printf(" else ");
-                    print_stmt(stmt->else_stmt);
+                    print_stmt(ctx, stmt->else_stmt);
                 }
                 printf(")");
             }
@@ -1332,27 +2164,27 @@ print_stmt(Stmt *stmt)
         case STMT_WHILE:
         {
             printf("(while ");
-            print_expr(stmt->cond);
+            print_expr(ctx, stmt->cond);
             printf(" ");
-            print_stmt(stmt->then_stmt);
+            print_stmt(ctx, stmt->then_stmt);
             printf(")");
         } break;
 
         case STMT_FOR:
         {
             printf("(for ");
-            print_expr(stmt->init);
+            print_expr(ctx, stmt->init);
             printf(" ");
-            print_expr(stmt->cond);
+            print_expr(ctx, stmt->cond);
             printf(" ");
-            print_expr(stmt->post);
-            print_stmt(stmt->then_stmt);
+            print_expr(ctx, stmt->post);
+            print_stmt(ctx, stmt->then_stmt);
             printf(")");
         } break;
 
         default:
         {
-            fatal("Invalid statement to print");
+            fatal(ctx, "Invalid statement to print");
         } break;
     }
 
@@ -1367,6 +2199,9 @@ enum
     GLOB_DECL_COUNT
 };
 
+/* Arguments a function can take in registers: %eax, %edx and %ecx */
+#define REGPARM_MAX 3
+
 typedef struct
 GlobDecl
 {
@@ -1374,28 +2209,33 @@ GlobDecl
     struct GlobDecl *next;
     char *id;
     Type *type;
+    FuncParam *params;
     Stmt *func_def;
+
+    /* Arguments passed in registers (functions) */
+    int regparm;
 } GlobDecl;
 
 GlobDecl *
-make_glob_decl(int kind)
+make_glob_decl(EzcCtx *ctx, int kind)
 {
     GlobDecl *res = 0;
 
-    res = MALLOC_TYPE(GlobDecl);
+    res = ALLOC_TYPE(GlobDecl);
     if(res)
     {
         res->kind = kind;
         res->next = 0;
+        res->regparm = 0;
     }
 
     return(res);
 }
 
 GlobDecl *
-make_glob_decl_var(char *id, Type *type)
+make_glob_decl_var(EzcCtx *ctx, char *id, Type *type)
 {
-    GlobDecl *res = make_glob_decl(GLOB_DECL_VAR);
+    GlobDecl *res = make_glob_decl(ctx, GLOB_DECL_VAR);
 
     if(res)
     {
@@ -1407,14 +2247,16 @@ make_glob_decl_var(char *id, Type *type)
 }
 
 GlobDecl *
-make_glob_decl_func(char *id, Type *type, Stmt *func_def)
+make_glob_decl_func(EzcCtx *ctx, char *id, Type *type, FuncParam *params,
+                    Stmt *func_def)
 {
-    GlobDecl *res = make_glob_decl(GLOB_DECL_FUNC);
+    GlobDecl *res = make_glob_decl(ctx, GLOB_DECL_FUNC);
 
     if(res)
     {
         res->id = id;
         res->type = type;
+        res->params = params;
         res->func_def = func_def;
     }
 
@@ -1422,32 +2264,32 @@ make_glob_decl_func(char *id, Type *type, Stmt *func_def)
 }
 
 void
-print_glob_decl(GlobDecl *decl)
+print_glob_decl(EzcCtx *ctx, GlobDecl *decl)
 {
     switch(decl->kind)
     {
         case GLOB_DECL_VAR:
         {
             printf("(var %s ", decl->id);
-            print_type(decl->type);
+            print_type(ctx, decl->type);
             printf(")");
         } break;
 
         case GLOB_DECL_FUNC:
         {
             printf("(func %s ", decl->id);
-            print_type(decl->type->base_type);
+            print_type(ctx, decl->type->base_type);
             if(decl->func_def)
             {
                 printf("\n");
-                print_stmt(decl->func_def);
+                print_stmt(ctx, decl->func_def);
             }
             printf(")\n");
         } break;
 
         default:
         {
-            fatal("Invalid global declaration to print");
+            fatal(ctx, "Invalid global declaration to print");
         } break;
     }
 
@@ -1455,14 +2297,14 @@ print_glob_decl(GlobDecl *decl)
 }
 
 void
-print_unit(GlobDecl *unit)
+print_unit(EzcCtx *ctx, GlobDecl *unit)
 {
     GlobDecl *curr;
 
     curr = unit;
     while(curr)
     {
-        print_glob_decl(curr);
+        print_glob_decl(ctx, curr);
         curr = curr->next;
     }
 }
@@ -1471,69 +2313,34 @@ print_unit(GlobDecl *unit)
 /**                                 PARSER                                   **/
 /******************************************************************************/
 
-#include <ctype.h>
 #include <assert.h>
 
-char *source;
-int source_line;
-
-int func_var_offset;
-
-char *kword_void;
-char *kword_char;
-char *kword_int;
-char *kword_struct;
-char *kword_return;
-char *kword_goto;
-char *kword_if;
-char *kword_else;
-char *kword_while;
-char *kword_for;
-
 #include <stdarg.h>
 
 void
-syntax_error(char *fmt, ...)
+syntax_error(EzcCtx *ctx, char *fmt, ...)
 {
     va_list ap;
 
-    printf("[!] SYNTAX ERROR: Line %d: ", source_line);
+    fprintf(diag_stream(ctx), "[!] SYNTAX ERROR: Line %d: ", ctx->source_line);
     va_start(ap, fmt);
-    vprintf(fmt, ap);
+    vfprintf(diag_stream(ctx), fmt, ap);
     va_end(ap);
-    printf("\n");
+    fprintf(diag_stream(ctx), "\n");
 }
 
 void
-syntax_fatal(char *fmt, ...)
+syntax_fatal(EzcCtx *ctx, char *fmt, ...)
 {
     va_list ap;
 
-    printf("[!] SYNTAX ERROR: Line %d: ", source_line);
+    fprintf(diag_stream(ctx), "[!] SYNTAX ERROR: Line %d: ", ctx->source_line);
     va_start(ap, fmt);
-    vprintf(fmt, ap);
+    vfprintf(diag_stream(ctx), fmt, ap);
     va_end(ap);
-    printf("\n");
-
-    exit(1);
-}
-
-void
-parser_init(char *src)
-{
-    source = src;
-    source_line = 1;
+    fprintf(diag_stream(ctx), "\n");
 
-    kword_void = str_intern("void");
-    kword_char = str_intern("char");
-    kword_int = str_intern("int");
-    kword_struct = str_intern("struct");
-    kword_return = str_intern("return");
-    kword_goto = str_intern("goto");
-    kword_if = str_intern("if");
-    kword_else = str_intern("else");
-    kword_while = str_intern("while");
-    kword_for = str_intern("for");
+    ezc_abort(ctx);
 }
 
 enum
@@ -1590,58 +2397,122 @@ enum
     TOK_KW_WHILE,
     TOK_KW_FOR,
 
+    TOK_KW_ATTRIBUTE,
+
     TOK_COUNT
 };
 
-#define MAX_ID_LEN 33
+/*
+ * Character classification for the lexer. We use our own table instead of
+ * the <ctype.h> functions: those are locale-dependent library calls and
+ * the lexer calls them for every byte of the source.
+ */
 
-typedef struct Token
+enum
 {
-    int kind;
-    int value;
-    char *id;
-} Token;
+    CHAR_SPACE = 1,
+    CHAR_DIGIT = 2,
+    CHAR_ALPHA = 4,
 
-Token putback;
+    CHAR_IDENT = CHAR_DIGIT | CHAR_ALPHA
+};
 
-void
-tok_putback(Token tok)
-{
-    putback = tok;
-}
+unsigned char char_class[256];
 
-Token
-_tok_next(int update_source)
+void
+char_class_init()
 {
-    Token tok;
-    char *src = source;
-    int srcl = source_line;
+    int c;
 
-    if(putback.kind != TOK_EOF)
+    for(c = 0;
+        c < 256;
+        ++c)
     {
-        tok = putback;
-        if(update_source)
+        char_class[c] = 0;
+        if(c == ' ' || (c >= '\t' && c <= '\r'))
         {
-            putback.kind = TOK_EOF;
+            char_class[c] |= CHAR_SPACE;
         }
-        return(tok);
-    }
+        if(c >= '0' && c <= '9')
+        {
+            char_class[c] |= CHAR_DIGIT;
+        }
+        if((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_')
+        {
+            char_class[c] |= CHAR_ALPHA;
+        }
+    }
+}
 
-    if(!*src)
+#define char_is(c, cls) (char_class[(unsigned char)(c)] & (cls))
+
+/* Returns the first character of src which is not in cls */
+char *
+lex_skip(char *src, int cls)
+{
+    while(char_is(*src, cls))
     {
-        tok.kind = TOK_EOF;
+        ++src;
     }
-    else
+
+    return(src);
+}
+
+/* Skips whitespace, counting the newlines into *line */
+char *
+lex_skip_space(char *src, int *line)
+{
+    while(char_is(*src, CHAR_SPACE))
     {
-        while(isspace(*src))
+        if(*src == '\n')
         {
-            if(*src == '\n')
-            {
-                ++srcl;
-            }
-            ++src;
+            ++(*line);
         }
+        ++src;
+    }
+
+    return(src);
+}
+
+#define MAX_ID_LEN 33
+
+struct
+Token
+{
+    int kind;
+    int line;
+
+    /* TOK_INTLIT has a value, TOK_ID and the keywords an interned id */
+    union
+    {
+        int value;
+        char *id;
+    } u;
+};
+
+/*
+ * The whole source is lexed once, up front, into a flat array of tokens.
+ * The parser walks that array, so it can look ahead as far as it needs
+ * without re-scanning the source.
+ */
+
+Token
+tok_lex(EzcCtx *ctx)
+{
+    Token tok;
+    char *src = ctx->source;
+    int srcl = ctx->source_line;
+
+    src = lex_skip_space(src, &srcl);
 
+    ctx->source_line = srcl;
+    tok.line = srcl;
+    if(!*src)
+    {
+        tok.kind = TOK_EOF;
+    }
+    else
+    {
         switch(*src)
         {
             case '_':
@@ -1654,43 +2525,37 @@ _tok_next(int update_source)
             case 'O':case 'P':case 'Q':case 'R':case 'S':case 'T':case 'U':
             case 'V':case 'W':case 'X':case 'Y':case 'Z':
             {
-                char buff[MAX_ID_LEN];
-                int buffsize = 0;
+                char *start = src;
 
-                tok.kind = TOK_ID;
+                src = lex_skip(src, CHAR_IDENT);
+                if(src - start >= MAX_ID_LEN)
+                {
+                    syntax_fatal(ctx, "Identifier longer than %d characters",
+                                 MAX_ID_LEN - 1);
+                }
 
-                while(isalnum(*src) || *src == '_')
+                tok.u.id = str_intern_range(ctx, start, src - start);
+
+                /* Keywords are tagged with their token kind by parser_init */
+                tok.kind = str_intern_kind(tok.u.id);
+                if(!tok.kind)
                 {
-                    buff[buffsize++] = *src;
-                    ++src;
-                    assert(buffsize < MAX_ID_LEN);
+                    tok.kind = TOK_ID;
                 }
-                buff[buffsize] = 0;
-
-                tok.id = str_intern(buff);
-
-                     if(tok.id == kword_void) { tok.kind = TOK_KW_VOID; }
-                else if(tok.id == kword_char) { tok.kind = TOK_KW_CHAR; }
-                else if(tok.id == kword_int) { tok.kind = TOK_KW_INT; }
-                else if(tok.id == kword_struct) { tok.kind = TOK_KW_STRUCT; }
-                else if(tok.id == kword_return) { tok.kind = TOK_KW_RETURN; }
-                else if(tok.id == kword_goto) { tok.kind = TOK_KW_GOTO; }
-                else if(tok.id == kword_if) { tok.kind = TOK_KW_IF; }
-                else if(tok.id == kword_else) { tok.kind = TOK_KW_ELSE; }
-                else if(tok.id == kword_while) { tok.kind = TOK_KW_WHILE; }
-                else if(tok.id == kword_for) { tok.kind = TOK_KW_FOR; }
             } break;
 
             case '0':case '1':case '2':case '3':case '4':
             case '5':case '6':case '7':case '8':case '9':
             {
+                char *end = lex_skip(src, CHAR_DIGIT);
+
                 tok.kind = TOK_INTLIT;
 
                 /* TODO: Hexadecimal */
-                tok.value = 0;
-                while(isdigit(*src))
+                tok.u.value = 0;
+                while(src < end)
                 {
-                    tok.value = tok.value*10 + (*src - '0');
+                    tok.u.value = tok.u.value*10 + (*src - '0');
                     ++src;
                 }
             } break;
@@ -1766,40 +2631,129 @@ _tok_next(int update_source)
 
             default:
             {
-                syntax_fatal("Invalid token");
+                syntax_fatal(ctx, "Invalid token");
             } break;
         }
     }
 
-    if(update_source)
+    ctx->source = src;
+
+    return(tok);
+}
+
+void
+tok_lex_all(EzcCtx *ctx)
+{
+    Token tok;
+
+    ctx->tokens_count = 0;
+    ctx->tok_pos = 0;
+    do
+    {
+        tok = tok_lex(ctx);
+        if(ctx->tokens_count == ctx->tokens_cap)
+        {
+            ctx->tokens_cap = ctx->tokens_cap ? ctx->tokens_cap*2 : 1024;
+            ctx->tokens = (Token *)realloc(ctx->tokens, ctx->tokens_cap*sizeof(Token));
+            if(!ctx->tokens)
+            {
+                fatal(ctx, "Cannot allocate memory for tokens");
+            }
+        }
+        ctx->tokens[ctx->tokens_count++] = tok;
+    }
+    while(tok.kind != TOK_EOF);
+}
+
+Token
+tok_peek_n(EzcCtx *ctx, int n)
+{
+    int i;
+
+    i = ctx->tok_pos + n;
+    if(i >= ctx->tokens_count)
     {
-        source = src;
-        source_line = srcl;
+        i = ctx->tokens_count - 1;
     }
 
-    return(tok);
+    return(ctx->tokens[i]);
 }
 
 Token
-tok_peek()
+tok_peek(EzcCtx *ctx)
 {
-    return(_tok_next(0));
+    return(ctx->tokens[ctx->tok_pos]);
 }
 
 Token
-tok_next()
+tok_next(EzcCtx *ctx)
+{
+    Token tok;
+
+    tok = ctx->tokens[ctx->tok_pos];
+    ctx->source_line = tok.line;
+    if(tok.kind != TOK_EOF)
+    {
+        ++ctx->tok_pos;
+    }
+
+    return(tok);
+}
+
+char *
+kword_add(EzcCtx *ctx, char *s, int kind)
+{
+    char *res;
+
+    res = str_intern(ctx, s);
+    str_intern_set_kind(res, kind);
+
+    return(res);
+}
+
+/* Keywords stay interned for the whole life of the context */
+void
+kword_init(EzcCtx *ctx)
+{
+    if(!ctx->kword_void)
+    {
+        ctx->kword_void = kword_add(ctx, "void", TOK_KW_VOID);
+        ctx->kword_char = kword_add(ctx, "char", TOK_KW_CHAR);
+        ctx->kword_int = kword_add(ctx, "int", TOK_KW_INT);
+        ctx->kword_struct = kword_add(ctx, "struct", TOK_KW_STRUCT);
+        ctx->kword_return = kword_add(ctx, "return", TOK_KW_RETURN);
+        ctx->kword_goto = kword_add(ctx, "goto", TOK_KW_GOTO);
+        ctx->kword_if = kword_add(ctx, "if", TOK_KW_IF);
+        ctx->kword_else = kword_add(ctx, "else", TOK_KW_ELSE);
+        ctx->kword_while = kword_add(ctx, "while", TOK_KW_WHILE);
+        ctx->kword_for = kword_add(ctx, "for", TOK_KW_FOR);
+        ctx->kword_attribute =
+            kword_add(ctx, "__attribute__", TOK_KW_ATTRIBUTE);
+
+        /* Only an attribute name, still a valid identifier */
+        ctx->kword_regparm = str_intern(ctx, "regparm");
+    }
+}
+
+void
+parser_init(EzcCtx *ctx, char *src)
 {
-    return(_tok_next(1));
+    ctx->source = src;
+    ctx->source_line = 1;
+    kword_init(ctx);
+    tok_lex_all(ctx);
+    ctx->source_line = 1;
 }
 
+
 Token
-tok_expect(int tok_kind)
+tok_expect(EzcCtx *ctx, int tok_kind)
 {
     Token tok;
-    tok = tok_next();
+    tok = tok_next(ctx);
     if(tok.kind != tok_kind)
     {
-        syntax_fatal("Expected token %d, found %d\n", tok_kind, tok.kind);
+        syntax_fatal(ctx, "Expected token %d, found %d\n", tok_kind, tok.kind);
     }
     assert(tok.kind == tok_kind);
     return(tok);
@@ -1873,7 +2827,7 @@ int op_precedence_table[TOK_BIN_OP_END - TOK_BIN_OP] = {
 };
 
 int
-expr_is_const(Expr *expr)
+expr_is_const(EzcCtx *ctx, Expr *expr)
 {
     int res = 0;
     Sym *sym;
@@ -1888,10 +2842,10 @@ expr_is_const(Expr *expr)
     }
     else if(expr->kind == EXPR_ID)
     {
-        sym = sym_get(expr->id);
+        sym = sym_get(ctx, expr->id);
         if(!sym)
         {
-            fatal("Invalid symbol '%s'", expr->id);
+            fatal(ctx, "Invalid symbol '%s'", expr->id);
         }
 
         res = sym->is_const;
@@ -1902,7 +2856,7 @@ expr_is_const(Expr *expr)
         {
             case EXPR_NEG:
             {
-                res = expr_is_const(expr->l);
+                res = expr_is_const(ctx, expr->l);
             } break;
 
             default:
@@ -1920,8 +2874,8 @@ expr_is_const(Expr *expr)
             case EXPR_LT: case EXPR_LE:
             case EXPR_GT: case EXPR_GE:
             {
-                res = expr_is_const(expr->l);
-                res = res && expr_is_const(expr->r);
+                res = expr_is_const(ctx, expr->l);
+                res = res && expr_is_const(ctx, expr->r);
             } break;
 
             default:
@@ -1932,16 +2886,16 @@ expr_is_const(Expr *expr)
     }
     else if(expr->kind == EXPR_TERNARY)
     {
-        res = expr_is_const(expr->l);
-        res = res && expr_is_const(expr->m);
-        res = res && expr_is_const(expr->r);
+        res = expr_is_const(ctx, expr->l);
+        res = res && expr_is_const(ctx, expr->m);
+        res = res && expr_is_const(ctx, expr->r);
     }
 
     return(res);
 }
 
 int
-eval_expr(Expr *expr)
+eval_expr(EzcCtx *ctx, Expr *expr)
 {
     int res = 0;
     int l = 0;
@@ -1951,7 +2905,7 @@ eval_expr(Expr *expr)
 
     if(expr->kind > EXPR_TERNARY)
     {
-        assert(0);
+        fatal(ctx, "Not a constant expression");
     }
     else if(expr->kind == EXPR_INTLIT)
     {
@@ -1959,13 +2913,16 @@ eval_expr(Expr *expr)
     }
     else if(expr->kind == EXPR_ID)
     {
-        sym = sym_get(expr->id);
+        sym = sym_get(ctx, expr->id);
         if(!sym)
         {
-            fatal("Invalid symbol '%s'", expr->id);
+            fatal(ctx, "Invalid symbol '%s'", expr->id);
         }
 
-        assert(sym->is_const);
+        if(!sym->is_const)
+        {
+            fatal(ctx, "'%s' is not a constant", expr->id);
+        }
         res = sym->value;
     }
     else if(expr->kind >= EXPR_UNARY && expr->kind <= EXPR_UNARY_END)
@@ -1974,19 +2931,19 @@ eval_expr(Expr *expr)
         {
             case EXPR_NEG:
             {
-                res = -eval_expr(expr->l);
+                res = -eval_expr(ctx, expr->l);
             } break;
 
             default:
             {
-                assert(0);
+                fatal(ctx, "Not a constant expression");
             } break;
         }
     }
     else if(expr->kind >= EXPR_BINARY && expr->kind <= EXPR_BINARY_END)
     {
-        l = eval_expr(expr->l);
-        r = eval_expr(expr->r);
+        l = eval_expr(ctx, expr->l);
+        r = eval_expr(ctx, expr->r);
         switch(expr->kind)
         {
             case EXPR_MUL: { res = l*r; } break;
@@ -2002,15 +2959,15 @@ eval_expr(Expr *expr)
 
             default:
             {
-                assert(0);
+                fatal(ctx, "Not a constant expression");
             } break;
         }
     }
     else if(expr->kind == EXPR_TERNARY)
     {
-        l = eval_expr(expr->l);
-        m = eval_expr(expr->m);
-        r = eval_expr(expr->r);
+        l = eval_expr(ctx, expr->l);
+        m = eval_expr(ctx, expr->m);
+        r = eval_expr(ctx, expr->r);
         if(l)
         {
             res = m;
@@ -2022,44 +2979,44 @@ eval_expr(Expr *expr)
     }
     else
     {
-        assert(0);
+        fatal(ctx, "Not a constant expression");
     }
 
     return(res);
 }
 
-Expr *parse_expr_assign();
-Expr *parse_expr();
-Type *parse_type(Type *type);
+Expr *parse_expr_assign(EzcCtx *ctx);
+Expr *parse_expr(EzcCtx *ctx);
+Type *parse_type(EzcCtx *ctx, Type *type);
 
 Expr *
-parse_expr_base()
+parse_expr_base(EzcCtx *ctx)
 {
     Expr *expr = 0;
     Token tok;
 
-    tok = tok_next();
+    tok = tok_next(ctx);
     switch(tok.kind)
     {
         case TOK_INTLIT:
         {
-            expr = make_expr_intlit(tok.value);
+            expr = make_expr_intlit(ctx, tok.u.value);
         } break;
 
         case TOK_ID:
         {
-            expr = make_expr_id(tok.id);
+            expr = make_expr_id(ctx, tok.u.id);
         } break;
 
         case TOK_LPAREN:
         {
-            expr = parse_expr();
-            tok_expect(TOK_RPAREN);
+            expr = parse_expr(ctx);
+            tok_expect(ctx, TOK_RPAREN);
         } break;
 
         default:
         {
-            syntax_fatal("Invalid base expression");
+            syntax_fatal(ctx, "Invalid base expression");
         } break;
     }
 
@@ -2087,74 +3044,74 @@ reverse_args_list(Expr *args)
 }
 
 Expr *
-parse_expr_first_level()
+parse_expr_first_level(EzcCtx *ctx)
 {
     Expr *expr = 0;
     Expr *args = 0;
     Expr *arg = 0;
     Token tok;
 
-    expr = parse_expr_base();
+    expr = parse_expr_base(ctx);
 
-    tok = tok_peek();
+    tok = tok_peek(ctx);
     switch(tok.kind)
     {
         case TOK_LPAREN:
         {
-            tok_next();
-            tok = tok_peek();
+            tok_next(ctx);
+            tok = tok_peek(ctx);
             if(tok.kind != TOK_RPAREN)
             {
                 do
                 {
                     if(tok.kind == TOK_COMMA)
                     {
-                        tok_next();
+                        tok_next(ctx);
                     }
                     if(arg)
                     {
-                        arg->next = parse_expr_assign();
+                        arg->next = parse_expr_assign(ctx);
                         arg = arg->next;
                     }
                     else
                     {
-                        arg = parse_expr_assign();
+                        arg = parse_expr_assign(ctx);
                         args = arg;
                     }
-                    tok = tok_peek();
+                    tok = tok_peek(ctx);
                 }
                 while(tok.kind == TOK_COMMA);
             }
-            tok_expect(TOK_RPAREN);
+            tok_expect(ctx, TOK_RPAREN);
 
             if(args)
             {
                 args = reverse_args_list(args);
             }
-            expr = make_expr_binary(EXPR_CALL, expr, args);
+            expr = make_expr_binary(ctx, EXPR_CALL, expr, args);
         } break;
 
         case TOK_LBRACK:
         {
-            tok_next();
-            expr = make_expr_binary(EXPR_ARR_SUB, expr, parse_expr());
-            tok_expect(TOK_RBRACK);
+            tok_next(ctx);
+            expr = make_expr_binary(ctx, EXPR_ARR_SUB, expr, parse_expr(ctx));
+            tok_expect(ctx, TOK_RBRACK);
         } break;
 
         case TOK_DOT:
         {
-            tok_next();
+            tok_next(ctx);
 
-            tok = tok_expect(TOK_ID);
-            expr = make_expr_member_access(expr, tok.id);
+            tok = tok_expect(ctx, TOK_ID);
+            expr = make_expr_member_access(ctx, expr, tok.u.id);
         } break;
 
         case TOK_MEMB_ACCESS_PTR:
         {
-            tok_next();
+            tok_next(ctx);
 
-            tok = tok_expect(TOK_ID);
-            expr = make_expr_member_access_ptr(expr, tok.id);
+            tok = tok_expect(ctx, TOK_ID);
+            expr = make_expr_member_access_ptr(ctx, expr, tok.u.id);
         } break;
     }
 
@@ -2162,78 +3119,78 @@ parse_expr_first_level()
 }
 
 Expr *
-parse_expr_unary()
+parse_expr_unary(EzcCtx *ctx)
 {
     Expr *expr = 0;
     Token tok;
     Type *type;
 
-    tok = tok_peek();
+    tok = tok_peek(ctx);
     switch(tok.kind)
     {
         case TOK_PLUS_PLUS:
         {
-            tok_next();
-            expr = parse_expr_unary();
-            expr = make_expr_unary(EXPR_INC_PRE, expr);
+            tok_next(ctx);
+            expr = parse_expr_unary(ctx);
+            expr = make_expr_unary(ctx, EXPR_INC_PRE, expr);
         } break;
 
         case TOK_MINUS_MINUS:
         {
-            tok_next();
-            expr = parse_expr_unary();
-            expr = make_expr_unary(EXPR_DEC_PRE, expr);
+            tok_next(ctx);
+            expr = parse_expr_unary(ctx);
+            expr = make_expr_unary(ctx, EXPR_DEC_PRE, expr);
         } break;
 
         case TOK_PLUS:
         {
-            tok_next();
-            expr = parse_expr_unary();
+            tok_next(ctx);
+            expr = parse_expr_unary(ctx);
         } break;
 
         case TOK_MINUS:
         {
-            tok_next();
-            expr = parse_expr_unary();
-            expr = make_expr_unary(EXPR_NEG, expr);
+            tok_next(ctx);
+            expr = parse_expr_unary(ctx);
+            expr = make_expr_unary(ctx, EXPR_NEG, expr);
         } break;
 
         case TOK_LPAREN:
         {
-            tok_next();
+            tok_next(ctx);
 
-            tok = tok_peek();
+            tok = tok_peek(ctx);
             if(tok_is_type(tok))
             {
-                type = parse_type(0);
-                tok_expect(TOK_RPAREN);
+                type = parse_type(ctx, 0);
+                tok_expect(ctx, TOK_RPAREN);
 
-                expr = make_expr_cast(parse_expr_unary(), type);
+                expr = make_expr_cast(ctx, parse_expr_unary(ctx), type);
             }
             else
             {
-                expr = parse_expr();
-                tok_expect(TOK_RPAREN);
+                expr = parse_expr(ctx);
+                tok_expect(ctx, TOK_RPAREN);
             }
         } break;
 
         case TOK_ASTERISK:
         {
-            tok_next();
-            expr = parse_expr_unary();
-            expr = make_expr_unary(EXPR_DEREF, expr);
+            tok_next(ctx);
+            expr = parse_expr_unary(ctx);
+            expr = make_expr_unary(ctx, EXPR_DEREF, expr);
         } break;
 
         case TOK_AMPERSAND:
         {
-            tok_next();
-            expr = parse_expr_unary();
-            expr = make_expr_unary(EXPR_ADDR_OF, expr);
+            tok_next(ctx);
+            expr = parse_expr_unary(ctx);
+            expr = make_expr_unary(ctx, EXPR_ADDR_OF, expr);
         } break;
 
         default:
         {
-            expr = parse_expr_first_level();
+            expr = parse_expr_first_level(ctx);
         } break;
     }
 
@@ -2241,22 +3198,23 @@ parse_expr_unary()
 }
 
 Expr *
-parse_expr_binary(int precedence)
+parse_expr_binary(EzcCtx *ctx, int precedence)
 {
     Expr *l = 0;
     Expr *r = 0;
     Token tok;
     int new_precedence;
+    int kind;
 
-    l = parse_expr_unary();
-    tok = tok_peek();
+    l = parse_expr_unary(ctx);
+    tok = tok_peek(ctx);
     while(tok.kind >= TOK_BIN_OP && tok.kind < TOK_BIN_OP_END)
     {
         new_precedence = op_precedence_table[tok.kind - TOK_BIN_OP];
         if(new_precedence < precedence)
         {
-            tok_next();
-            r = parse_expr_binary(new_precedence);
+            tok_next(ctx);
+            r = parse_expr_binary(ctx, new_precedence);
         }
         else
         {
@@ -2265,90 +3223,91 @@ parse_expr_binary(int precedence)
 
         switch(tok.kind)
         {
-            case TOK_ASTERISK:{ l = make_expr_binary(EXPR_MUL, l, r); } break;
-            case TOK_SLASH:   { l = make_expr_binary(EXPR_DIV, l, r); } break;
-            case TOK_PERCENT: { l = make_expr_binary(EXPR_MOD, l, r); } break;
-            case TOK_PLUS:    { l = make_expr_binary(EXPR_ADD, l, r); } break;
-            case TOK_MINUS:   { l = make_expr_binary(EXPR_SUB, l, r); } break;
-            case TOK_LT:      { l = make_expr_binary(EXPR_LT, l, r); } break;
-            case TOK_LE:      { l = make_expr_binary(EXPR_LE, l, r); } break;
-            case TOK_GT:      { l = make_expr_binary(EXPR_GT, l, r); } break;
-            case TOK_GE:      { l = make_expr_binary(EXPR_GE, l, r); } break;
+            case TOK_ASTERISK:{ kind = EXPR_MUL; } break;
+            case TOK_SLASH:   { kind = EXPR_DIV; } break;
+            case TOK_PERCENT: { kind = EXPR_MOD; } break;
+            case TOK_PLUS:    { kind = EXPR_ADD; } break;
+            case TOK_MINUS:   { kind = EXPR_SUB; } break;
+            case TOK_LT:      { kind = EXPR_LT; } break;
+            case TOK_LE:      { kind = EXPR_LE; } break;
+            case TOK_GT:      { kind = EXPR_GT; } break;
+            case TOK_GE:      { kind = EXPR_GE; } break;
 
             default:
             {
-                syntax_fatal("Invalid binary expression");
+                syntax_fatal(ctx, "Invalid binary expression");
             } break;
         }
+        l = make_expr_binary(ctx, kind, l, r);
 
-        tok = tok_peek();
+        tok = tok_peek(ctx);
     }
 
     return(l);
 }
 
 Expr *
-parse_expr_ternary()
+parse_expr_ternary(EzcCtx *ctx)
 {
     Expr *l;
     Expr *m;
     Expr *r;
     Token tok;
 
-    l = parse_expr_binary(999);
-    tok = tok_peek();
+    l = parse_expr_binary(ctx, 999);
+    tok = tok_peek(ctx);
     if(tok.kind == TOK_QMARK)
     {
-        tok_next();
-        m = parse_expr();
-        tok_expect(TOK_COLON);
-        r = parse_expr_ternary();
-        l = make_expr_ternary(l, m, r);
+        tok_next(ctx);
+        m = parse_expr(ctx);
+        tok_expect(ctx, TOK_COLON);
+        r = parse_expr_ternary(ctx);
+        l = make_expr_ternary(ctx, l, m, r);
     }
 
     return(l);
 }
 
 Expr *
-parse_expr_assign()
+parse_expr_assign(EzcCtx *ctx)
 {
     Expr *expr;
     Token tok;
 
-    expr = parse_expr_ternary();
-    tok = tok_peek();
+    expr = parse_expr_ternary(ctx);
+    tok = tok_peek(ctx);
     if(tok.kind == TOK_EQUAL)
     {
-        tok_next();
-        expr = make_expr_binary(EXPR_ASSIGN, expr, parse_expr_assign());
+        tok_next(ctx);
+        expr = make_expr_binary(ctx, EXPR_ASSIGN, expr, parse_expr_assign(ctx));
     }
 
     return(expr);
 }
 
 Expr *
-parse_expr()
+parse_expr(EzcCtx *ctx)
 {
     Expr *expr = 0;
     Expr *curr = 0;
     Token tok;
 
-    expr = parse_expr_assign();
+    expr = parse_expr_assign(ctx);
     curr = expr;
 
-    tok = tok_peek();
+    tok = tok_peek(ctx);
     while(tok.kind == TOK_COMMA)
     {
-        tok_next();
+        tok_next(ctx);
 
-        curr->next = parse_expr_assign();
+        curr->next = parse_expr_assign(ctx);
         curr = curr->next;
 
-        tok = tok_peek();
+        tok = tok_peek(ctx);
     }
     if(expr != curr)
     {
-        expr = make_expr_compound(expr);
+        expr = make_expr_compound(ctx, expr);
     }
 
     return(expr);
@@ -2363,12 +3322,12 @@ parse_expr()
  *          | 'struct' <ident> <struct-definition>?
  */
 
-Type *parse_base_type();
-Type *parse_type(Type *base_type);
-AggrElement *parse_struct_def();
+Type *parse_base_type(EzcCtx *ctx);
+Type *parse_type(EzcCtx *ctx, Type *base_type);
+AggrElement *parse_struct_def(EzcCtx *ctx);
 
 AggrElement *
-parse_struct_def()
+parse_struct_def(EzcCtx *ctx)
 {
     AggrElement *res = 0;
     AggrElement *curr = 0;
@@ -2377,83 +3336,83 @@ parse_struct_def()
     char *id;
     int offset;
 
-    tok_expect(TOK_LBRACE);
+    tok_expect(ctx, TOK_LBRACE);
 
     offset = 0;
-    tok = tok_peek();
+    tok = tok_peek(ctx);
     while(tok.kind != TOK_RBRACE)
     {
-        type = parse_type(0);
-        tok = tok_expect(TOK_ID);
-        id = tok.id;
+        type = parse_type(ctx, 0);
+        tok = tok_expect(ctx, TOK_ID);
+        id = tok.u.id;
         if(curr)
         {
-            curr->next = make_aggr_element(id, type, offset);
+            curr->next = make_aggr_element(ctx, id, type, offset);
             curr = curr->next;
         }
         else
         {
-            curr = make_aggr_element(id, type, offset);
+            curr = make_aggr_element(ctx, id, type, offset);
             res = curr;
         }
         offset += ALIGN(type->size, 4);
-        tok_expect(TOK_SEMI);
-        tok = tok_peek();
+        tok_expect(ctx, TOK_SEMI);
+        tok = tok_peek(ctx);
     }
 
-    tok_expect(TOK_RBRACE);
+    tok_expect(ctx, TOK_RBRACE);
 
     if(!res)
     {
-        syntax_fatal("Invalid struct definition");
+        syntax_fatal(ctx, "Invalid struct definition");
     }
 
     return(res);
 }
 
 Type *
-parse_base_type()
+parse_base_type(EzcCtx *ctx)
 {
     Type *type = 0;
     Token tok;
     char *id;
     AggrElement *sdef;
 
-    tok = tok_peek();
+    tok = tok_peek(ctx);
     switch(tok.kind)
     {
         case TOK_KW_VOID:
         {
-            tok_next();
+            tok_next(ctx);
             type = type_void();
         } break;
 
         case TOK_KW_CHAR:
         {
-            tok_next();
+            tok_next(ctx);
             type = type_char();
         } break;
 
         case TOK_KW_INT:
         {
-            tok_next();
+            tok_next(ctx);
             type = type_int();
         } break;
 
         case TOK_KW_STRUCT:
         {
-            tok_next();
-            tok = tok_expect(TOK_ID);
-            id = tok.id;
+            tok_next(ctx);
+            tok = tok_expect(ctx, TOK_ID);
+            id = tok.u.id;
 
             sdef = 0;
-            tok = tok_peek();
+            tok = tok_peek(ctx);
             if(tok.kind == TOK_LBRACE)
             {
-                sdef = parse_struct_def();
+                sdef = parse_struct_def(ctx);
             }
 
-            type = type_struct(id, sdef);
+            type = type_struct(ctx, id, sdef);
         } break;
     }
 
@@ -2461,30 +3420,30 @@ parse_base_type()
 }
 
 Type *
-parse_type(Type *base_type)
+parse_type(EzcCtx *ctx, Type *base_type)
 {
     Type *type = 0;
     Token tok;
 
     if(!base_type)
     {
-        base_type = parse_base_type();
+        base_type = parse_base_type(ctx);
     }
     type = base_type;
 
-    tok = tok_peek();
+    tok = tok_peek(ctx);
     while(tok.kind == TOK_ASTERISK)
     {
-        tok_next();
-        type = type_ptr(type);
-        tok = tok_peek();
+        tok_next(ctx);
+        type = type_ptr(ctx, type);
+        tok = tok_peek(ctx);
     }
 
     return(type);
 }
 
 Decl *
-parse_decl()
+parse_decl(EzcCtx *ctx)
 {
     Decl *decl;
     Type *type;
@@ -2493,39 +3452,39 @@ parse_decl()
     Expr *expr;
     int length;
 
-    type = parse_base_type();
+    type = parse_base_type(ctx);
     if(!type)
     {
-        syntax_fatal("Invalid type for variable declaration");
+        syntax_fatal(ctx, "Invalid type for variable declaration");
     }
 
-    type = parse_type(type);
+    type = parse_type(ctx, type);
 
-    tok = tok_expect(TOK_ID);
-    id = tok.id;
+    tok = tok_expect(ctx, TOK_ID);
+    id = tok.u.id;
 
-    tok = tok_peek();
+    tok = tok_peek(ctx);
     if(tok.kind == TOK_LBRACK)
     {
-        tok_next();
+        tok_next(ctx);
 
-        expr = parse_expr();
-        if(!expr_is_const(expr))
+        expr = parse_expr(ctx);
+        if(!expr_is_const(ctx, expr))
         {
-            syntax_fatal("Invalid constant expression for array length");
+            syntax_fatal(ctx, "Invalid constant expression for array length");
         }
-        length = eval_expr(expr);
+        length = eval_expr(ctx, expr);
 
-        type = type_array(type, length);
+        type = type_array(ctx, type, length);
 
-        tok_expect(TOK_RBRACK);
+        tok_expect(ctx, TOK_RBRACK);
     }
 
-    decl = make_decl(type, id);
+    decl = make_decl(ctx, type, id);
 
     /* TODO: Parse variable initialization */
 
-    tok_expect(TOK_SEMI);
+    tok_expect(ctx, TOK_SEMI);
 
     return(decl);
 }
@@ -2541,43 +3500,43 @@ parse_decl()
  *          | 'while' '(' <expr> ')' <stmt>
  */
 
-Stmt *parse_stmt();
+Stmt *parse_stmt(EzcCtx *ctx);
 
 Stmt *
-parse_stmt_block()
+parse_stmt_block(EzcCtx *ctx)
 {
     Stmt *stmt;
     Stmt *sub_stmt;
     Token tok;
 
-    tok_expect(TOK_LBRACE);
+    tok_expect(ctx, TOK_LBRACE);
 
-    stmt = make_stmt(STMT_BLOCK);
+    stmt = make_stmt(ctx, STMT_BLOCK);
 
-    tok = tok_peek();
+    tok = tok_peek(ctx);
     sub_stmt = 0;
     while(tok.kind != TOK_RBRACE)
     {
         if(sub_stmt)
         {
-            sub_stmt->next = parse_stmt();
+            sub_stmt->next = parse_stmt(ctx);
             sub_stmt = sub_stmt->next;
         }
         else
         {
-            sub_stmt = parse_stmt();
+            sub_stmt = parse_stmt(ctx);
             stmt->u.block = sub_stmt;
         }
-        tok = tok_peek();
+        tok = tok_peek(ctx);
     }
 
-    tok_expect(TOK_RBRACE);
+    tok_expect(ctx, TOK_RBRACE);
 
     return(stmt);
 }
 
 Stmt *
-parse_stmt()
+parse_stmt(EzcCtx *ctx)
 {
     Stmt *stmt;
     Token tok;
@@ -2591,17 +3550,17 @@ parse_stmt()
     Expr *cond;
     Expr *post;
 
-    tok = tok_peek();
+    tok = tok_peek(ctx);
     while(tok.kind == TOK_SEMI)
     {
-        tok_next();
-        tok = tok_peek();
+        tok_next(ctx);
+        tok = tok_peek(ctx);
     }
 
     if(tok_is_type(tok))
     {
-        stmt = make_stmt(STMT_DECL);
-        stmt->u.decl = parse_decl();
+        stmt = make_stmt(ctx, STMT_DECL);
+        stmt->u.decl = parse_decl(ctx);
     }
     else
     {
@@ -2609,108 +3568,107 @@ parse_stmt()
         {
             case TOK_ID:
             {
-                label = tok.id;
-                tok_next();
+                label = tok.u.id;
 
-                tok2 = tok_peek();
+                tok2 = tok_peek_n(ctx, 1);
                 if(tok2.kind == TOK_COLON)
                 {
-                    tok_next();
-                    stmt = make_stmt(STMT_LABEL);
+                    tok_next(ctx);
+                    tok_next(ctx);
+                    stmt = make_stmt(ctx, STMT_LABEL);
                     stmt->u.label = label;
                 }
                 else
                 {
-                    tok_putback(tok);
-                    stmt = make_stmt(STMT_EXPR);
-                    stmt->u.expr = parse_expr();
-                    tok_expect(TOK_SEMI);
+                    stmt = make_stmt(ctx, STMT_EXPR);
+                    stmt->u.expr = parse_expr(ctx);
+                    tok_expect(ctx, TOK_SEMI);
                 }
             } break;
 
             case TOK_LBRACE:
             {
-                stmt = parse_stmt_block();
+                stmt = parse_stmt_block(ctx);
             } break;
 
             case TOK_KW_RETURN:
             {
-                tok_next();
-                stmt = make_stmt(STMT_RET);
+                tok_next(ctx);
+                stmt = make_stmt(ctx, STMT_RET);
                 stmt->u.expr = 0;
-                tok = tok_peek();
+                tok = tok_peek(ctx);
                 if(tok.kind != TOK_SEMI)
                 {
-                    stmt->u.expr = parse_expr();
+                    stmt->u.expr = parse_expr(ctx);
                 }
-                tok_expect(TOK_SEMI);
+                tok_expect(ctx, TOK_SEMI);
             } break;
 
             case TOK_KW_GOTO:
             {
-                tok_next();
-                tok = tok_expect(TOK_ID);
-                stmt = make_stmt(STMT_GOTO);
-                stmt->u.label = tok.id;
-                tok_expect(TOK_SEMI);
+                tok_next(ctx);
+                tok = tok_expect(ctx, TOK_ID);
+                stmt = make_stmt(ctx, STMT_GOTO);
+                stmt->u.label = tok.u.id;
+                tok_expect(ctx, TOK_SEMI);
             } break;
 
             case TOK_KW_IF:
             {
-                tok_next();
+                tok_next(ctx);
 
-                tok_expect(TOK_LPAREN);
-                expr = parse_expr();
-                tok_expect(TOK_RPAREN);
+                tok_expect(ctx, TOK_LPAREN);
+                expr = parse_expr(ctx);
+                tok_expect(ctx, TOK_RPAREN);
 
-                then_stmt = parse_stmt();
+                then_stmt = parse_stmt(ctx);
                 else_stmt = 0;
 
-                tok = tok_peek();
+                tok = tok_peek(ctx);
                 if(tok.kind == TOK_KW_ELSE)
                 {
-                    tok_next();
-                    else_stmt = parse_stmt();
+                    tok_next(ctx);
+                    else_stmt = parse_stmt(ctx);
                 }
 
-                stmt = make_stmt_if(expr, then_stmt, else_stmt);
+                stmt = make_stmt_if(ctx, expr, then_stmt, else_stmt);
             } break;
 
             case TOK_KW_WHILE:
             {
-                tok_next();
+                tok_next(ctx);
 
-                tok_expect(TOK_LPAREN);
-                expr = parse_expr();
-                tok_expect(TOK_RPAREN);
+                tok_expect(ctx, TOK_LPAREN);
+                expr = parse_expr(ctx);
+                tok_expect(ctx, TOK_RPAREN);
 
-                then_stmt = parse_stmt();
+                then_stmt = parse_stmt(ctx);
 
-                stmt = make_stmt_while(expr, then_stmt);
+                stmt = make_stmt_while(ctx, expr, then_stmt);
             } break;
 
             case TOK_KW_FOR:
             {
-                tok_next();
+                tok_next(ctx);
 
-                tok_expect(TOK_LPAREN);
-                init = parse_expr();
-                tok_expect(TOK_SEMI);
-                cond = parse_expr();
-                tok_expect(TOK_SEMI);
-                post = parse_expr();
-                tok_expect(TOK_RPAREN);
+                tok_expect(ctx, TOK_LPAREN);
+                init = parse_expr(ctx);
+                tok_expect(ctx, TOK_SEMI);
+                cond = parse_expr(ctx);
+                tok_expect(ctx, TOK_SEMI);
+                post = parse_expr(ctx);
+                tok_expect(ctx, TOK_RPAREN);
 
-                then_stmt = parse_stmt();
+                then_stmt = parse_stmt(ctx);
 
-                stmt = make_stmt_for(init, cond, post, then_stmt);
+                stmt = make_stmt_for(ctx, init, cond, post, then_stmt);
             } break;
 
             default:
             {
-                stmt = make_stmt(STMT_EXPR);
-                stmt->u.expr = parse_expr();
-                tok_expect(TOK_SEMI);
+                stmt = make_stmt(ctx, STMT_EXPR);
+                stmt->u.expr = parse_expr(ctx);
+                tok_expect(ctx, TOK_SEMI);
             } break;
         }
     }
@@ -2719,40 +3677,76 @@ parse_stmt()
 }
 
 /*
- * <glob_decl> ::= <type> <ident> ['(' <func_params>? ')' [<stmt_block>|';']]?
+ * <glob_decl> ::= <attribute>? <type> <ident>
+ *                 ['(' <func_params>? ')' [<stmt_block>|';']]?
  * <func_params> ::= <type> <ident>
+ * <attribute> ::= '__attribute__' '(' '(' 'regparm' '(' <intlit> ')' ')' ')'
  */
 
 FuncParam *
-parse_func_param()
+parse_func_param(EzcCtx *ctx)
 {
     FuncParam *param;
     char *id;
     Type *type;
     Token tok;
 
-    type = parse_type(0);
+    type = parse_type(ctx, 0);
 
 #if 0
-    type = parse_base_type();
+    type = parse_base_type(ctx);
     if(!type)
     {
-        syntax_fatal("Invalid type for function parameter");
+        syntax_fatal(ctx, "Invalid type for function parameter");
     }
 
-    type = parse_type(type);
+    type = parse_type(ctx, type);
 #endif
 
-    tok = tok_expect(TOK_ID);
-    id = tok.id;
+    tok = tok_expect(ctx, TOK_ID);
+    id = tok.u.id;
 
-    param = make_func_param(id, type);
+    param = make_func_param(ctx, id, type);
 
     return(param);
 }
 
+/* The regparm attribute of a function (-1 if there is none) */
+int
+parse_attribute(EzcCtx *ctx)
+{
+    int regparm;
+    Token tok;
+
+    regparm = -1;
+    tok = tok_peek(ctx);
+    if(tok.kind == TOK_KW_ATTRIBUTE)
+    {
+        tok_expect(ctx, TOK_KW_ATTRIBUTE);
+        tok_expect(ctx, TOK_LPAREN);
+        tok_expect(ctx, TOK_LPAREN);
+        tok = tok_expect(ctx, TOK_ID);
+        if(tok.u.id != ctx->kword_regparm)
+        {
+            syntax_fatal(ctx, "Unknown attribute '%s'", tok.u.id);
+        }
+        tok_expect(ctx, TOK_LPAREN);
+        tok = tok_expect(ctx, TOK_INTLIT);
+        regparm = tok.u.value;
+        if(regparm < 0 || regparm > REGPARM_MAX)
+        {
+            syntax_fatal(ctx, "regparm must be between 0 and %d", REGPARM_MAX);
+        }
+        tok_expect(ctx, TOK_RPAREN);
+        tok_expect(ctx, TOK_RPAREN);
+        tok_expect(ctx, TOK_RPAREN);
+    }
+
+    return(regparm);
+}
+
 GlobDecl *
-parse_glob_decl()
+parse_glob_decl(EzcCtx *ctx)
 {
     GlobDecl *glob_decl = 0;
 
@@ -2762,72 +3756,91 @@ parse_glob_decl()
     FuncParam *params;
     FuncParam *curr_param;
     Stmt *func_def;
+    int regparm;
 
+    regparm = parse_attribute(ctx);
 
-    type = parse_base_type();
+    type = parse_base_type(ctx);
     if(!type)
     {
-        syntax_fatal("Invalid type for global declaration");
+        syntax_fatal(ctx, "Invalid type for global declaration");
     }
 
-    type = parse_type(type);
+    type = parse_type(ctx, type);
 
-    tok = tok_expect(TOK_ID);
-    id = tok.id;
+    tok = tok_expect(ctx, TOK_ID);
+    id = tok.u.id;
 
-    tok = tok_peek();
+    tok = tok_peek(ctx);
     if(tok.kind == TOK_SEMI)
     {
-        tok_expect(TOK_SEMI);
-        glob_decl = make_glob_decl_var(id, type);
+        if(regparm >= 0)
+        {
+            syntax_fatal(ctx, "regparm on the variable '%s'", id);
+        }
+        tok_expect(ctx, TOK_SEMI);
+        glob_decl = make_glob_decl_var(ctx, id, type);
     }
     else
     {
         params = 0;
         curr_param = 0;
 
-        tok_expect(TOK_LPAREN);
-        tok = tok_peek();
+        tok_expect(ctx, TOK_LPAREN);
+        tok = tok_peek(ctx);
         while(tok.kind != TOK_RPAREN)
         {
             if(curr_param)
             {
-                curr_param->next = parse_func_param();
+                curr_param->next = parse_func_param(ctx);
                 curr_param = curr_param->next;
             }
             else
             {
-                curr_param = parse_func_param();
+                curr_param = parse_func_param(ctx);
                 curr_param->next = 0;
                 params = curr_param;
             }
 
-            tok = tok_peek();
+            tok = tok_peek(ctx);
             if(tok.kind != TOK_COMMA)
             {
                 break;
             }
             else
             {
-                tok = tok_next();
+                tok = tok_next(ctx);
             }
         }
-        tok_expect(TOK_RPAREN);
+        tok_expect(ctx, TOK_RPAREN);
 
         params = reverse_func_params_list(params);
-        type = type_func(type, params);
+        type = type_func(ctx, type, params);
 
         func_def = 0;
-        tok = tok_peek();
+        tok = tok_peek(ctx);
         if(tok.kind == TOK_LBRACE)
         {
-            func_def = parse_stmt_block();
+            func_def = parse_stmt_block(ctx);
         }
         else
         {
-            tok_expect(TOK_SEMI);
+            tok_expect(ctx, TOK_SEMI);
+        }
+        glob_decl = make_glob_decl_func(ctx, id, type, params, func_def);
+
+        /*
+         * -mregparm only covers the functions defined here: a prototype
+         * alone is implemented somewhere else, with the stack convention
+         */
+        if(regparm >= 0)
+        {
+            glob_decl->regparm = regparm;
+        }
+        else if(func_def)
+        {
+            glob_decl->regparm = ctx->regparm;
         }
-        glob_decl = make_glob_decl_func(id, type, func_def);
     }
 
     return(glob_decl);
@@ -2838,23 +3851,23 @@ parse_glob_decl()
  */
 
 GlobDecl *
-parse_unit()
+parse_unit(EzcCtx *ctx)
 {
     GlobDecl *first = 0;
     GlobDecl *last = 0;
     Token tok;
 
-    tok = tok_peek();
+    tok = tok_peek(ctx);
     while(tok.kind != TOK_EOF)
     {
         if(last)
         {
-            last->next = parse_glob_decl();
+            last->next = parse_glob_decl(ctx);
             last = last->next;
         }
         else
         {
-            last = parse_glob_decl();
+            last = parse_glob_decl(ctx);
         }
 
         if(!first)
@@ -2862,7 +3875,7 @@ parse_unit()
             first = last;
         }
 
-        tok = tok_peek();
+        tok = tok_peek(ctx);
     }
 
     return(first);
@@ -2875,35 +3888,35 @@ parse_unit()
 #include <stdarg.h>
 
 void
-semantic_error(char *fmt, ...)
+semantic_error(EzcCtx *ctx, char *fmt, ...)
 {
     va_list ap;
 
-    printf("[!] SEMANTIC ERROR: ");
+    fprintf(diag_stream(ctx), "[!] SEMANTIC ERROR: ");
     va_start(ap, fmt);
-    vprintf(fmt, ap);
+    vfprintf(diag_stream(ctx), fmt, ap);
     va_end(ap);
-    printf("\n");
+    fprintf(diag_stream(ctx), "\n");
 }
 
 void
-semantic_fatal(char *fmt, ...)
+semantic_fatal(EzcCtx *ctx, char *fmt, ...)
 {
     va_list ap;
 
-    printf("[!] SEMANTIC ERROR: ");
+    fprintf(diag_stream(ctx), "[!] SEMANTIC ERROR: ");
     va_start(ap, fmt);
-    vprintf(fmt, ap);
+    vfprintf(diag_stream(ctx), fmt, ap);
     va_end(ap);
-    printf("\n");
+    fprintf(diag_stream(ctx), "\n");
 
-    exit(1);
+    ezc_abort(ctx);
 }
 
-Sym *curr_func;
+Type *resolve_expr_type(EzcCtx *ctx, Expr *expr, Type *wanted);
 
 Type *
-resolve_expr_type(Expr *expr, Type *wanted)
+compute_expr_type(EzcCtx *ctx, Expr *expr)
 {
     Type *type = 0;
     Sym *sym;
@@ -2917,56 +3930,47 @@ resolve_expr_type(Expr *expr, Type *wanted)
     {
         case EXPR_INTLIT:
         {
-            if(wanted && wanted == type_char())
-            {
-                type = type_char();
-            }
-            else
-            {
-                type = type_int();
-            }
+            type = type_int();
         } break;
 
         case EXPR_ID:
         {
-            sym = sym_get(expr->id);
+            sym = sym_get(ctx, expr->id);
             if(!sym)
             {
-                /* DEBUG TODO: to delete */
-                print_sym_table();
-                printf("\n\n");
-
-                semantic_fatal("Invalid symbol %s in expression", expr->id);
+                semantic_fatal(ctx,
+                               "Invalid symbol %s in expression", expr->id);
             }
             type = sym->type;
         } break;
 
         case EXPR_CALL:
         {
-            type = resolve_expr_type(expr->l, wanted);
+            type = resolve_expr_type(ctx, expr->l, 0);
             type = type->base_type;
         } break;
 
         case EXPR_ARR_SUB:
         {
-            type = resolve_expr_type(expr->l, 0);
+            type = resolve_expr_type(ctx, expr->l, 0);
             if(!type || (type->kind != TYPE_ARRAY && type->kind != TYPE_PTR))
             {
-                semantic_fatal("Cannot operate array subscription on non-array or non-ptr");
+                semantic_fatal(ctx, "Cannot operate array subscription on non-array or non-ptr");
             }
             type = type->base_type;
         } break;
 
         case EXPR_MEMB_ACCESS:
         {
-            type = resolve_expr_type(expr->l, 0);
+            type = resolve_expr_type(ctx, expr->l, 0);
             if(!type || type->kind != TYPE_STRUCT)
             {
-                semantic_fatal("Cannot access a member of a non-struct");
+                semantic_fatal(ctx, "Cannot access a member of a non-struct");
             }
             if(!type->def)
             {
-                semantic_fatal("Cannot access a member of an undefined struct");
+                semantic_fatal(ctx,
+                               "Cannot access a member of an undefined struct");
             }
 
             curr_el = get_struct_member(type, expr->id);
@@ -2977,20 +3981,21 @@ resolve_expr_type(Expr *expr, Type *wanted)
             }
             if(!type)
             {
-                semantic_fatal("Tried to access an invalid struct member");
+                semantic_fatal(ctx, "Tried to access an invalid struct member");
             }
         } break;
 
         case EXPR_MEMB_ACCESS_PTR:
         {
-            type = resolve_expr_type(expr->l, 0);
+            type = resolve_expr_type(ctx, expr->l, 0);
             if(!type || type->kind != TYPE_PTR || type->base_type->kind != TYPE_STRUCT)
             {
-                semantic_fatal("Cannot access a member of a non-pointer-to-struct");
+                semantic_fatal(ctx, "Cannot access a member of a non-pointer-to-struct");
             }
             if(!type->base_type->def)
             {
-                semantic_fatal("Cannot access a member of an undefined struct");
+                semantic_fatal(ctx,
+                               "Cannot access a member of an undefined struct");
             }
 
             curr_el = get_struct_member(type->base_type, expr->id);
@@ -3001,7 +4006,7 @@ resolve_expr_type(Expr *expr, Type *wanted)
             }
             if(!type)
             {
-                semantic_fatal("Tried to access an invalid struct member");
+                semantic_fatal(ctx, "Tried to access an invalid struct member");
             }
         } break;
 
@@ -3009,32 +4014,32 @@ resolve_expr_type(Expr *expr, Type *wanted)
         {
             if(expr->kind == EXPR_CALL)
             {
-                type = resolve_expr_type(expr->l, wanted);
+                type = resolve_expr_type(ctx, expr->l, 0);
                 type = type->base_type;
             }
             else if(expr->kind == EXPR_CAST)
             {
-                type = resolve_expr_type(expr->l, wanted);
+                type = resolve_expr_type(ctx, expr->l, 0);
                 type = expr->cast_to;
             }
             else if(expr->kind == EXPR_DEREF)
             {
-                type = resolve_expr_type(expr->l, wanted);
+                type = resolve_expr_type(ctx, expr->l, 0);
                 type = type->base_type;
             }
             else if(expr->kind == EXPR_ADDR_OF)
             {
-                type = resolve_expr_type(expr->l, wanted);
-                type = type_ptr(type);
+                type = resolve_expr_type(ctx, expr->l, 0);
+                type = type_ptr(ctx, type);
             }
             else if(expr->kind >= EXPR_UNARY && expr->kind < EXPR_UNARY_END)
             {
-                type = resolve_expr_type(expr->l, wanted);
+                type = resolve_expr_type(ctx, expr->l, 0);
             }
             else if(expr->kind >= EXPR_BINARY && expr->kind < EXPR_BINARY_END)
             {
-                lt = resolve_expr_type(expr->l, wanted);
-                rt = resolve_expr_type(expr->l, lt);
+                lt = resolve_expr_type(ctx, expr->l, 0);
+                rt = resolve_expr_type(ctx, expr->l, lt);
 
                 if(lt->kind == TYPE_PTR && (rt == type_char() || rt == type_int()))
                 {
@@ -3046,36 +4051,36 @@ resolve_expr_type(Expr *expr, Type *wanted)
                 }
                 else if(lt != rt)
                 {
-                    semantic_fatal("Cannot operate on 2 different types");
+                    semantic_fatal(ctx, "Cannot operate on 2 different types");
                 }
 
                 type = lt;
             }
             else if(expr->kind == EXPR_TERNARY)
             {
-                mt = resolve_expr_type(expr->m, wanted);
-                rt = resolve_expr_type(expr->r, mt);
+                mt = resolve_expr_type(ctx, expr->m, 0);
+                rt = resolve_expr_type(ctx, expr->r, mt);
 
                 if(mt != rt)
                 {
-                    semantic_fatal("Type mismatch in ternary expression");
+                    semantic_fatal(ctx, "Type mismatch in ternary expression");
                 }
 
                 type = rt;
             }
             else if(expr->kind == EXPR_ASSIGN)
             {
-                lt = resolve_expr_type(expr->l, wanted);
-                rt = resolve_expr_type(expr->l, lt);
+                lt = resolve_expr_type(ctx, expr->l, 0);
+                rt = resolve_expr_type(ctx, expr->l, lt);
 
                 if( lt->kind == TYPE_PTR && (rt == type_char() || rt == type_int()) &&
-                    expr_is_const(expr->r) && eval_expr(expr->r) == 0)
+                    expr_is_const(ctx, expr->r) && eval_expr(ctx, expr->r) == 0)
                 {
                     rt = lt;
                 }
                 else if(lt != rt)
                 {
-                    semantic_fatal("Cannot assign a different type");
+                    semantic_fatal(ctx, "Cannot assign a different type");
                 }
 
                 type = lt;
@@ -3085,36 +4090,93 @@ resolve_expr_type(Expr *expr, Type *wanted)
                 curr = expr->l;
                 while(curr)
                 {
-                    type = resolve_expr_type(curr, 0);
+                    type = resolve_expr_type(ctx, curr, 0);
                     curr = curr->next;
                 }
             }
             else
             {
-                assert(0);
+                semantic_fatal(ctx, "Invalid expression");
             }
         } break;
     }
 
     if(!type)
     {
-        semantic_fatal("Invalid expression type");
-    }
-
-    if(type && wanted && type == type_char() && wanted == type_int())
-    {
-        type = type_int();
+        semantic_fatal(ctx, "Invalid expression type");
     }
 
     /* Array decays into a pointer */
     if(type->kind == TYPE_ARRAY && expr->kind != EXPR_ADDR_OF)
     {
-        type = type_ptr(type->base_type);
+        type = type_ptr(ctx, type->base_type);
     }
 
     return(type);
 }
 
+/*
+ * The type of a node is resolved once, without a wanted type, and kept on
+ * the node: check_unit resolves the whole AST and the later phases read
+ * it. A wanted type of char or int only changes what the checker sees:
+ * an int where a char is wanted is a char if its value is an integer
+ * literal (5, -1, 1 + c), a char where an int is wanted is an int.
+ *
+ * A backend worker fills in the types of the nodes of its own function,
+ * which no other worker reads.
+ */
+
+/* Whether the int expr takes the type char where a char is wanted */
+int
+expr_is_char_lit(EzcCtx *ctx, Expr *expr)
+{
+    Type *mt;
+    int res;
+
+    while((expr->kind >= EXPR_INC_PRE && expr->kind <= EXPR_NEG) ||
+          (expr->kind >= EXPR_BINARY && expr->kind < EXPR_BINARY_END) ||
+          expr->kind == EXPR_ASSIGN)
+    {
+        expr = expr->l;
+    }
+
+    if(expr->kind == EXPR_TERNARY)
+    {
+        mt = resolve_expr_type(ctx, expr->m, type_char());
+        res = (resolve_expr_type(ctx, expr->r, mt) == type_char());
+    }
+    else
+    {
+        res = (expr->kind == EXPR_INTLIT);
+    }
+
+    return(res);
+}
+
+Type *
+resolve_expr_type(EzcCtx *ctx, Expr *expr, Type *wanted)
+{
+    Type *res;
+
+    if(!expr->type)
+    {
+        expr->type = compute_expr_type(ctx, expr);
+    }
+
+    res = expr->type;
+    if(wanted == type_int() && res == type_char())
+    {
+        res = type_int();
+    }
+    else if(wanted == type_char() && res == type_int() &&
+            expr_is_char_lit(ctx, expr))
+    {
+        res = type_char();
+    }
+
+    return(res);
+}
+
 int
 check_lvalue(Expr *expr)
 {
@@ -3145,7 +4207,7 @@ check_lvalue(Expr *expr)
 }
 
 void
-check_expr(Expr *expr)
+check_expr(EzcCtx *ctx, Expr *expr)
 {
     Type *type;
     Type *lt;
@@ -3166,12 +4228,12 @@ check_expr(Expr *expr)
 
         case EXPR_CALL:
         {
-            type = resolve_expr_type(expr->l, 0);
+            type = resolve_expr_type(ctx, expr->l, 0);
             if(type->kind != TYPE_FUNC &&
                type->kind != TYPE_PTR &&
                type->base_type->kind != TYPE_FUNC)
             {
-                semantic_fatal("Invalid function call");
+                semantic_fatal(ctx, "Invalid function call");
             }
             if(type->kind == TYPE_PTR)
             {
@@ -3184,15 +4246,17 @@ check_expr(Expr *expr)
             if((arg != 0 && param == 0) ||
                (arg == 0 && param != 0))
             {
-                semantic_fatal("Invalid number of arguments in function call");
+                semantic_fatal(ctx,
+                               "Invalid number of arguments in function call");
             }
             while(arg)
             {
                 lt = param->type;
-                rt = resolve_expr_type(arg, lt);
+                rt = resolve_expr_type(ctx, arg, lt);
                 if(lt != rt)
                 {
-                    semantic_fatal("Invalid type of argument in function call");
+                    semantic_fatal(ctx,
+                                   "Invalid type of argument in function call");
                 }
 
                 arg = arg->next;
@@ -3200,94 +4264,79 @@ check_expr(Expr *expr)
                 if((arg != 0 && param == 0) ||
                    (arg == 0 && param != 0))
                 {
-                    semantic_fatal("Invalid number of arguments in function call");
+                    semantic_fatal(ctx, "Invalid number of arguments in function call");
                 }
             }
         } break;
 
         case EXPR_ARR_SUB:
         {
-            lt = resolve_expr_type(expr->r, 0);
+            lt = resolve_expr_type(ctx, expr->r, 0);
             if(lt->kind != TYPE_ARRAY && lt->kind != TYPE_PTR)
             {
-                semantic_fatal("Array subscription used to non-array and non-pointer");
+                semantic_fatal(ctx, "Array subscription used to non-array and non-pointer");
             }
 
             if(lt->base_type == type_void())
             {
-                semantic_fatal("Subscription on a void pointer");
+                semantic_fatal(ctx, "Subscription on a void pointer");
             }
 
-            rt = resolve_expr_type(expr->r, type_int());
+            rt = resolve_expr_type(ctx, expr->r, type_int());
             if(rt != type_int())
             {
-                semantic_fatal("Array subscription operand must be an integer");
+                semantic_fatal(ctx,
+                               "Array subscription operand must be an integer");
             }
         } break;
 
         case EXPR_MEMB_ACCESS:
         {
-            lt = resolve_expr_type(expr->l, 0);
+            lt = resolve_expr_type(ctx, expr->l, 0);
             if(!lt || lt->kind != TYPE_STRUCT)
             {
-                semantic_fatal("Cannot access a member of a non-struct");
+                semantic_fatal(ctx, "Cannot access a member of a non-struct");
             }
             if(!lt->def)
             {
-                semantic_fatal("Cannot access a member of an undefined struct");
+                semantic_fatal(ctx,
+                               "Cannot access a member of an undefined struct");
             }
 
-            aggr_el = lt->def;
-            lt = 0;
-            while(aggr_el)
+            aggr_el = get_struct_member(lt, expr->id);
+            if(!aggr_el)
             {
-                if(aggr_el->id == expr->id)
-                {
-                    lt = aggr_el->type;
-                    break;
-                }
-                aggr_el = aggr_el->next;
-            }
-            if(!lt)
-            {
-                semantic_fatal("Tried to access an invalid struct member");
+                semantic_fatal(ctx, "Tried to access an invalid struct member");
             }
+            lt = aggr_el->type;
         } break;
 
         case EXPR_MEMB_ACCESS_PTR:
         {
-            lt = resolve_expr_type(expr->l, 0);
+            lt = resolve_expr_type(ctx, expr->l, 0);
             if(!lt || lt->kind != TYPE_PTR || lt->base_type->kind != TYPE_STRUCT)
             {
-                semantic_fatal("Cannot access a member of a non-pointer-to-struct");
+                semantic_fatal(ctx, "Cannot access a member of a non-pointer-to-struct");
             }
             if(!lt->base_type->def)
             {
-                semantic_fatal("Cannot access a member of an undefined struct");
+                semantic_fatal(ctx,
+                               "Cannot access a member of an undefined struct");
             }
 
-            aggr_el = lt->base_type->def;
-            lt = 0;
-            while(aggr_el)
-            {
-                if(aggr_el->id == expr->id)
-                {
-                    lt = aggr_el->type;
-                    break;
-                }
-                aggr_el = aggr_el->next;
-            }
-            if(!lt)
+            aggr_el = get_struct_member(lt->base_type, expr->id);
+            if(!aggr_el)
             {
-                semantic_fatal("Tried to access an invalid struct member");
+                semantic_fatal(ctx, "Tried to access an invalid struct member");
             }
+            lt = aggr_el->type;
         } break;
 
         case EXPR_INC_PRE:
         {
             if(!check_lvalue(expr->l))
             {
-                semantic_fatal("Invalid lvalue (operand of pre-increment '++')");
+                semantic_fatal(ctx, "Invalid lvalue (operand of pre-increment '++')");
             }
         } break;
 
@@ -3295,31 +4344,31 @@ check_expr(Expr *expr)
         {
             if(!check_lvalue(expr->l))
             {
-                semantic_fatal("Invalid lvalue (operand of pre-decrement '--')");
+                semantic_fatal(ctx, "Invalid lvalue (operand of pre-decrement '--')");
             }
         } break;
 
         case EXPR_NEG:
         {
-            lt = resolve_expr_type(expr->l, 0);
+            lt = resolve_expr_type(ctx, expr->l, 0);
 
             if(!type_is_arithmetic(lt))
             {
-                semantic_fatal("Invalid arithmetic expression operand");
+                semantic_fatal(ctx, "Invalid arithmetic expression operand");
             }
         } break;
 
         case EXPR_CAST:
         {
-            lt = resolve_expr_type(expr->l, 0);
+            lt = resolve_expr_type(ctx, expr->l, 0);
         } break;
 
         case EXPR_DEREF:
         {
-            type = resolve_expr_type(expr->l, 0);
+            type = resolve_expr_type(ctx, expr->l, 0);
             if(type->kind != TYPE_PTR)
             {
-                semantic_fatal("Invalid pointer for dereference");
+                semantic_fatal(ctx, "Invalid pointer for dereference");
             }
         } break;
 
@@ -3327,26 +4376,26 @@ check_expr(Expr *expr)
         {
             if(!check_lvalue(expr->l))
             {
-                semantic_fatal("Invalid lvalue (operand of unary '&')");
+                semantic_fatal(ctx, "Invalid lvalue (operand of unary '&')");
             }
         } break;
 
         case EXPR_ADD: case EXPR_SUB:
         {
-            lt = resolve_expr_type(expr->l, 0);
-            rt = resolve_expr_type(expr->r, lt);
+            lt = resolve_expr_type(ctx, expr->l, 0);
+            rt = resolve_expr_type(ctx, expr->r, lt);
 
             if(lt->kind == TYPE_PTR && rt->kind == TYPE_PTR)
             {
-                semantic_fatal("Cannot add or subtract 2 pointers");
+                semantic_fatal(ctx, "Cannot add or subtract 2 pointers");
             }
             else if(lt->kind == TYPE_PTR && rt != type_char() && rt != type_int())
             {
-                semantic_fatal("Pointer can added or subtracted only with integers or chars");
+                semantic_fatal(ctx, "Pointer can added or subtracted only with integers or chars");
             }
             else if(rt->kind == TYPE_PTR && lt != type_char() && lt != type_int())
             {
-                semantic_fatal("Pointer can added or subtracted only with integers or chars");
+                semantic_fatal(ctx, "Pointer can added or subtracted only with integers or chars");
             }
         } break;
 
@@ -3354,29 +4403,29 @@ check_expr(Expr *expr)
         case EXPR_LT: case EXPR_LE:
         case EXPR_GT: case EXPR_GE:
         {
-            lt = resolve_expr_type(expr->l, 0);
-            rt = resolve_expr_type(expr->r, lt);
+            lt = resolve_expr_type(ctx, expr->l, 0);
+            rt = resolve_expr_type(ctx, expr->r, lt);
 
             if((!type_is_arithmetic(lt) && lt->kind != TYPE_PTR) ||
                (!type_is_arithmetic(rt) && rt->kind != TYPE_PTR))
             {
-                semantic_fatal("Invalid arithmetic expression operand");
+                semantic_fatal(ctx, "Invalid arithmetic expression operand");
             }
         } break;
 
         case EXPR_TERNARY:
         {
-            lt = resolve_expr_type(expr->l, 0);
+            lt = resolve_expr_type(ctx, expr->l, 0);
             if(lt != type_char() && lt != type_int() && lt->kind != TYPE_PTR)
             {
-                semantic_fatal("Invalid condition for ternary expression");
+                semantic_fatal(ctx, "Invalid condition for ternary expression");
             }
 
-            mt = resolve_expr_type(expr->m, 0);
-            rt = resolve_expr_type(expr->r, mt);
+            mt = resolve_expr_type(ctx, expr->m, 0);
+            rt = resolve_expr_type(ctx, expr->r, mt);
             if(mt != rt)
             {
-                semantic_fatal("Type mismatch in ternary expression");
+                semantic_fatal(ctx, "Type mismatch in ternary expression");
             }
         } break;
 
@@ -3384,19 +4433,20 @@ check_expr(Expr *expr)
         {
             if(!check_lvalue(expr->l))
             {
-                semantic_fatal("Invalid lvalue (left operand of assignment)");
+                semantic_fatal(ctx,
+                               "Invalid lvalue (left operand of assignment)");
             }
 
-            lt = resolve_expr_type(expr->l, 0);
+            lt = resolve_expr_type(ctx, expr->l, 0);
             if(lt->kind == TYPE_ARRAY)
             {
-                semantic_fatal("Cannot assign to an array variable (only to its elements)");
+                semantic_fatal(ctx, "Cannot assign to an array variable (only to its elements)");
             }
 
-            rt = resolve_expr_type(expr->r, lt);
+            rt = resolve_expr_type(ctx, expr->r, lt);
             if(lt != rt)
             {
-                semantic_fatal("Invalid assignment expression (types mismatch)");
+                semantic_fatal(ctx, "Invalid assignment expression (types mismatch)");
             }
         } break;
 
@@ -3405,22 +4455,22 @@ check_expr(Expr *expr)
             arg = expr->l;
             while(arg)
             {
-                check_expr(arg);
+                check_expr(ctx, arg);
                 arg = arg->next;
             }
         } break;
 
         default:
         {
-            assert(0);
+            semantic_fatal(ctx, "Invalid expression");
         } break;
     }
 
-    resolve_expr_type(expr, 0);
+    resolve_expr_type(ctx, expr, 0);
 }
 
 void
-check_stmt(Stmt *stmt)
+check_stmt(EzcCtx *ctx, Stmt *stmt)
 {
     Type *type;
     Decl *decl;
@@ -3436,18 +4486,18 @@ check_stmt(Stmt *stmt)
 
             if(decl->type == type_void())
             {
-                semantic_fatal("You cannot declare a void type variable");
+                semantic_fatal(ctx, "You cannot declare a void type variable");
             }
 
-            sym = sym_add(decl->id, decl->type);
+            sym = sym_add(ctx, decl->id, decl->type);
             sym->global = 0;
-            func_var_offset -= decl->type->size;
-            sym->offset = func_var_offset;
+            ctx->func_var_offset -= decl->type->size;
+            sym->offset = ctx->func_var_offset;
         } break;
 
         case STMT_EXPR:
         {
-            check_expr(stmt->u.expr);
+            check_expr(ctx, stmt->u.expr);
         } break;
 
         case STMT_BLOCK:
@@ -3455,7 +4505,7 @@ check_stmt(Stmt *stmt)
             curr = stmt->u.block;
             while(curr)
             {
-                check_stmt(curr);
+                check_stmt(ctx, curr);
                 curr = curr->next;
             }
         } break;
@@ -3464,74 +4514,75 @@ check_stmt(Stmt *stmt)
         {
             if(stmt->u.expr)
             {
-                type = resolve_expr_type(stmt->u.expr, curr_func->type->base_type);
+                type = resolve_expr_type(ctx, stmt->u.expr, ctx->curr_func_type->base_type);
             }
             else
             {
                 type = type_void();
             }
 
-            if(type != curr_func->type->base_type)
+            if(type != ctx->curr_func_type->base_type)
             {
-                semantic_fatal("Return expression does not match function return type");
+                semantic_fatal(ctx, "Return expression does not match function return type");
             }
         } break;
 
         case STMT_LABEL:
         {
-            lbl = label_get(stmt->u.label);
+            lbl = label_get(ctx, stmt->u.label);
             if(lbl)
             {
                 if(lbl->status == LABEL_DEFINED)
                 {
-                    semantic_fatal("Cannot redefine the label '%s'", lbl->id);
+                    semantic_fatal(ctx,
+                                   "Cannot redefine the label '%s'", lbl->id);
                 }
             }
             else
             {
-                lbl = label_add(stmt->u.label);
+                lbl = label_add(ctx, stmt->u.label);
                 lbl->status = LABEL_DEFINED;
             }
         } break;
 
         case STMT_GOTO:
         {
-            label_get_or_add(stmt->u.label);
+            label_get_or_add(ctx, stmt->u.label);
         } break;
 
         case STMT_IF:
         {
-            check_expr(stmt->cond);
-            check_stmt(stmt->then_stmt);
+            check_expr(ctx, stmt->cond);
+            check_stmt(ctx, stmt->then_stmt);
             if(stmt->else_stmt)
             {
-                check_stmt(stmt->else_stmt);
+                check_stmt(ctx, stmt->else_stmt);
             }
         } break;
 
         case STMT_WHILE:
         {
-            check_expr(stmt->cond);
-            check_stmt(stmt->then_stmt);
+            check_expr(ctx, stmt->cond);
+            check_stmt(ctx, stmt->then_stmt);
         } break;
 
         case STMT_FOR:
         {
-            check_expr(stmt->init);
-            check_expr(stmt->cond);
-            check_expr(stmt->post);
-            check_stmt(stmt->then_stmt);
+            check_expr(ctx, stmt->init);
+            check_expr(ctx, stmt->cond);
+            check_expr(ctx, stmt->post);
+            check_stmt(ctx, stmt->then_stmt);
         } break;
 
         default:
         {
-            assert(0);
+            semantic_fatal(ctx, "Invalid statement");
         } break;
     }
 }
 
 void
-check_glob_decl(GlobDecl *decl)
+check_glob_decl(EzcCtx *ctx, GlobDecl *decl)
 {
     Sym *sym;
     FuncParam *param;
@@ -3542,1863 +4593,5650 @@ check_glob_decl(GlobDecl *decl)
     {
         case GLOB_DECL_VAR:
         {
-            sym = sym_get(decl->id);
+            sym = sym_get(ctx, decl->id);
             if(sym)
             {
-                semantic_fatal("Global variable '%s' already declared", decl->id);
+                semantic_fatal(ctx, "Global variable '%s' already declared", decl->id);
             }
 
-            sym = sym_add(decl->id, decl->type);
+            sym = sym_add(ctx, decl->id, decl->type);
             sym->global = 1;
         } break;
 
         case GLOB_DECL_FUNC:
         {
-            sym = sym_get(decl->id);
+            sym = sym_get(ctx, decl->id);
             if(sym)
             {
-                semantic_fatal("Function '%s' already declared", decl->id);
+                semantic_fatal(ctx, "Function '%s' already declared", decl->id);
             }
 
-            sym = sym_add(decl->id, decl->type);
+            sym = sym_add(ctx, decl->id, decl->type);
             sym->global = 1;
+            sym->regparm = decl->regparm;
 
-            curr_func = sym;
+            ctx->curr_func_type = sym->type;
 
             if(decl->func_def)
             {
-                func_var_offset = -4;
+                ctx->func_var_offset = -4;
 
-                sym_count = sym_table_count;
-                param = decl->type->params;
+                sym_count = ctx->sym_table_count;
+                param = decl->params;
                 offset = 8;
                 while(param)
                 {
-                    sym_add_func_param(param->id, param->type, offset);
+                    sym_add_func_param(ctx, param->id, param->type, offset);
                     offset += ALIGN(param->type->size, 4);
                     param = param->next;
                 }
 
-                check_stmt(decl->func_def);
+                check_stmt(ctx, decl->func_def);
 
-                sym_table_count = sym_count;
+                sym_pop(ctx, sym_count);
             }
         } break;
 
         default:
         {
-            assert(0);
+            semantic_fatal(ctx, "Invalid global declaration");
         } break;
     }
 }
 
 void
-check_unit(GlobDecl *unit)
+check_unit(EzcCtx *ctx, GlobDecl *unit)
 {
     GlobDecl *curr;
     int i;
     Label *lbl;
 
-    sym_reset();
+    sym_reset(ctx);
 
     curr = unit;
     while(curr)
     {
-        check_glob_decl(curr);
+        check_glob_decl(ctx, curr);
         curr = curr->next;
     }
 
     for(i = 0;
-        i < label_table_count;
+        i < ctx->label_table_count;
         ++i)
     {
-        lbl = &(label_table[i]);
+        lbl = &(ctx->label_table[i]);
         if(lbl->status != LABEL_DEFINED)
         {
-            semantic_error("Label '%s' used but not defined", lbl->id);
+            semantic_error(ctx, "Label '%s' used but not defined", lbl->id);
         }
     }
 }
 
 /******************************************************************************/
-/**                              AST -> IR-C                                 **/
+/**                            CONSTANT FOLDING                              **/
 /******************************************************************************/
 
 /*
- * We use the AST to represent our Intermediate Representation tree since
- * our IR language is a subset of the C language (hence IR-C).
- *
- * IR-C Description:
- *
- * There are only 5 kinds of statement:
- * 1. Return statements
- * 2. Expressions
- * 3. Jumps
- * 4. Labels definition
- * 5. Branches
- *
- * Sources:
- * [1] https://ls12-www.cs.tu-dortmund.de/daes/media/documents/publications/downloads/2003-samosIII.pdf
+ * Runs on the checked AST, before the lowering. Constant subexpressions
+ * become literals, x*1, x/1, x*0, x+0, x-0 and x-x are simplified when x
+ * is an int, and constant chains like (x + 1) + 2 are reassociated into
+ * x + 3. The types are the ones the checker resolved: an operand whose
+ * type was never resolved is left as it is. A node which is rewritten in
+ * place drops its type, the lowering resolves it again.
  */
 
-int lbl_count = 0;
+#include <limits.h>
 
-char *
-lbl_gen()
+int
+expr_is_int(Expr *expr)
 {
-    char *res;
-    char lbl[128];
-    int n;
-
-    lbl[0] = '_';
-    lbl[1] = '_';
-    lbl[2] = '_';
-    lbl[3] = 'L';
-    n = sprintf(lbl+4, "%d", lbl_count);
-    lbl[n+4] = 0;
-    ++lbl_count;
-
-    res = str_intern(lbl);
-    return(res);
+    return(expr->type == type_int());
 }
 
-char tmp_var_buff[64];
-int tmp_vars_count = 0;
-
-char *
-tmp_var()
+int
+expr_is_intlit(Expr *expr, int value)
 {
-    int n;
-
-    tmp_var_buff[0] = '_';
-    tmp_var_buff[1] = '_';
-    tmp_var_buff[2] = '_';
-    tmp_var_buff[3] = 't';
-    n = sprintf(tmp_var_buff+4, "%d", tmp_vars_count);
-    tmp_var_buff[n+4] = 0;
-    ++tmp_vars_count;
-
-    return(str_intern(tmp_var_buff));
+    return(expr->kind == EXPR_INTLIT && expr->value == value);
 }
 
-Stmt *curr_block;
-
-void
-add_stmt(Stmt *stmt)
+int
+expr_has_side_effects(Expr *expr)
 {
-    Stmt *last;
+    int res = 0;
+    Expr *curr;
 
-    last = curr_block->u.block;
-    while(last && last->next)
+    if(expr->kind == EXPR_INTLIT || expr->kind == EXPR_ID)
     {
-        last = last->next;
+        res = 0;
     }
-
-    if(last)
+    else if(expr->kind == EXPR_CALL || expr->kind == EXPR_ASSIGN ||
+            expr->kind == EXPR_INC_PRE || expr->kind == EXPR_DEC_PRE)
+    {
+        res = 1;
+    }
+    else if(expr->kind == EXPR_COMPOUND)
+    {
+        curr = expr->l;
+        while(curr && !res)
+        {
+            res = expr_has_side_effects(curr);
+            curr = curr->next;
+        }
+    }
+    else if((expr->kind >= EXPR_UNARY && expr->kind < EXPR_UNARY_END) ||
+            expr->kind == EXPR_MEMB_ACCESS || expr->kind == EXPR_MEMB_ACCESS_PTR)
     {
-        last->next = stmt;
+        res = expr_has_side_effects(expr->l);
+    }
+    else if(expr->kind == EXPR_TERNARY)
+    {
+        res = expr_has_side_effects(expr->l) ||
+              expr_has_side_effects(expr->m) ||
+              expr_has_side_effects(expr->r);
     }
     else
     {
-        curr_block->u.block = stmt;
+        res = expr_has_side_effects(expr->l) || expr_has_side_effects(expr->r);
     }
-}
 
-#define TMP_VARS_POOL_SIZE 100
-Sym tmp_vars_pool[TMP_VARS_POOL_SIZE];
-int tmp_vars_pool_count;
-
-void
-tmp_vars_pool_reset()
-{
-    tmp_vars_pool_count = 0;
+    return(res);
 }
 
-void
-tmp_vars_free()
+/* Returns 0 if the operation cannot be done at compile time */
+int
+fold_binary(int kind, int l, int r, int *value)
 {
-    int i;
+    int res = 1;
 
-    for(i = tmp_vars_pool_count - 1;
-        i >= 0;
-        --i)
+    switch(kind)
     {
-        tmp_vars_pool[i].value = 0;
-    }
-}
-
-char *
-declare_tmp_var(Type *type)
-{
-    char *res;
-    Stmt *stmt;
-    int i;
-    Sym *sym;
+        /* Wrap around like the machine does */
+        case EXPR_MUL: { *value = (int)((unsigned int)l*(unsigned int)r); } break;
+        case EXPR_ADD: { *value = (int)((unsigned int)l + (unsigned int)r); } break;
+        case EXPR_SUB: { *value = (int)((unsigned int)l - (unsigned int)r); } break;
 
-    sym = 0;
-    for(i = tmp_vars_pool_count - 1;
-        i >= 0;
-        --i)
-    {
-        if(tmp_vars_pool[i].type == type && tmp_vars_pool[i].value == 0)
+        case EXPR_DIV: case EXPR_MOD:
         {
-            sym = &(tmp_vars_pool[i]);
-        }
-    }
+            /* Left to trap at run time */
+            if(r == 0 || (l == INT_MIN && r == -1))
+            {
+                res = 0;
+            }
+            else if(kind == EXPR_DIV)
+            {
+                *value = l/r;
+            }
+            else
+            {
+                *value = l%r;
+            }
+        } break;
 
-    if(sym)
-    {
-        res = sym->id;
-    }
-    else
-    {
-        res = tmp_var();
-        assert(type);
-        stmt = make_stmt_decl(make_decl(type, res));
-        stmt->next = 0;
-        add_stmt(stmt);
+        case EXPR_LT: { *value = ((l<r)?(1):0); } break;
+        case EXPR_LE: { *value = ((l<=r)?(1):0); } break;
+        case EXPR_GT: { *value = ((l>r)?(1):0); } break;
+        case EXPR_GE: { *value = ((l>=r)?(1):0); } break;
 
-        sym = &(tmp_vars_pool[tmp_vars_pool_count]);
-        sym->id = res;
-        sym->type = type;
-        ++tmp_vars_pool_count;
+        default:
+        {
+            res = 0;
+        } break;
     }
-    sym->value = 1;
 
     return(res);
 }
 
-void block_to_irc(Stmt *block);
-Stmt *func_def_to_irc(Stmt *block);
-
-int
-expr_is_atom(Expr *expr)
+/* (x + c1) + c2 => x + (c1 + c2), the same with - and with * */
+Expr *
+fold_reassoc(EzcCtx *ctx, Expr *expr)
 {
-    if(expr->kind == EXPR_INTLIT || expr->kind == EXPR_ID)
+    Expr *res;
+    Expr *inner;
+    int value;
+
+    res = expr;
+    inner = expr->l;
+    if(inner->kind >= EXPR_BINARY && inner->kind < EXPR_BINARY_END &&
+       inner->r->kind == EXPR_INTLIT && expr_is_int(inner))
     {
-        return(1);
+        if((expr->kind == EXPR_ADD || expr->kind == EXPR_SUB) &&
+           (inner->kind == EXPR_ADD || inner->kind == EXPR_SUB))
+        {
+            fold_binary(inner->kind == EXPR_ADD ? EXPR_ADD : EXPR_SUB,
+                        0, inner->r->value, &value);
+            fold_binary(expr->kind, value, expr->r->value, &value);
+            if(inner->kind == EXPR_SUB)
+            {
+                fold_binary(EXPR_SUB, 0, value, &value);
+            }
+            inner->r = make_expr_intlit(ctx, value);
+            inner->type = 0;
+            res = (value == 0) ? inner->l : inner;
+        }
+        else if(expr->kind == EXPR_MUL && inner->kind == EXPR_MUL)
+        {
+            fold_binary(EXPR_MUL, inner->r->value, expr->r->value, &value);
+            inner->r = make_expr_intlit(ctx, value);
+            inner->type = 0;
+            res = (value == 1) ? inner->l : inner;
+        }
     }
-    return(0);
+
+    return(res);
 }
 
-void expr_to_irc(Expr *expr);
-Expr *reduce_expr_to_atom(Expr *expr);
+Expr *fold_expr(EzcCtx *ctx, Expr *expr);
 
-char *
-store_expr_temp_var(Expr *expr)
+/* Folds every expression of a list, keeping the links */
+Expr *
+fold_expr_list(EzcCtx *ctx, Expr *list)
 {
-    char *res;
-    Stmt *stmt;
-    Expr *rvalue;
-
-    Expr *l;
-    Expr *m;
-    Expr *r;
+    Expr *res;
+    Expr *curr;
+    Expr *last;
+    Expr *next;
 
-    Expr *arg;
-    Expr *args;
-    Expr *tmp;
+    res = 0;
+    last = 0;
+    curr = list;
+    while(curr)
+    {
+        next = curr->next;
+        curr = fold_expr(ctx, curr);
+        curr->next = next;
+        if(last)
+        {
+            last->next = curr;
+        }
+        else
+        {
+            res = curr;
+        }
+        last = curr;
+        curr = next;
+    }
 
-    Type *type;
-    Type *lt;
-    Type *mt;
-    Type *rt;
-    char *t1;
-    char *t2;
-    char *t3;
-    AggrElement *aggr_el;
+    return(res);
+}
 
-    char *lbl1;
-    char *lbl2;
-    char *lbl3;
+Expr *
+fold_expr(EzcCtx *ctx, Expr *expr)
+{
+    Expr *res;
+    Expr *l;
+    Expr *r;
+    int value;
 
-    type = resolve_expr_type(expr, 0);
-    if(expr->kind == EXPR_ID && type->kind == TYPE_ARRAY)
+    res = expr;
+    if(expr->kind == EXPR_INTLIT || expr->kind == EXPR_ID)
     {
-        type = type_ptr(type->base_type);
+        /* Nothing */
     }
-
-    res = declare_tmp_var(type);
-
-    rvalue = 0;
-    if(expr_is_atom(expr))
+    else if(expr->kind == EXPR_CALL)
     {
-        if(expr->kind == EXPR_ID)
+        expr->l = fold_expr(ctx, expr->l);
+        expr->r = fold_expr_list(ctx, expr->r);
+    }
+    else if(expr->kind == EXPR_COMPOUND)
+    {
+        expr->l = fold_expr_list(ctx, expr->l);
+    }
+    else if(expr->kind == EXPR_TERNARY)
+    {
+        expr->l = fold_expr(ctx, expr->l);
+        expr->m = fold_expr(ctx, expr->m);
+        expr->r = fold_expr(ctx, expr->r);
+        if(expr->l->kind == EXPR_INTLIT)
         {
-            lt = resolve_expr_type(expr, 0);
-
-            /* Array decays into a pointer */
-            if(lt->kind == TYPE_ARRAY)
-            {
-                rvalue = make_expr_id(expr->id);
-            }
-            else
-            {
-                rvalue = dup_expr(expr);
-            }
+            res = expr->l->value ? expr->m : expr->r;
         }
-        else
+    }
+    else if((expr->kind >= EXPR_UNARY && expr->kind < EXPR_UNARY_END) ||
+            expr->kind == EXPR_MEMB_ACCESS || expr->kind == EXPR_MEMB_ACCESS_PTR)
+    {
+        expr->l = fold_expr(ctx, expr->l);
+        if(expr->kind == EXPR_NEG && expr->l->kind == EXPR_INTLIT)
         {
-            rvalue = dup_expr(expr);
+            fold_binary(EXPR_SUB, 0, expr->l->value, &value);
+            res = make_expr_intlit(ctx, value);
         }
     }
-    else if(expr->kind == EXPR_CALL)
+    else if(expr->kind >= EXPR_BINARY && expr->kind < EXPR_BINARY_END)
     {
-        l = reduce_expr_to_atom(expr->l);
-
-        args = 0;
-        arg = 0;
+        expr->l = fold_expr(ctx, expr->l);
+        expr->r = fold_expr(ctx, expr->r);
+        l = expr->l;
         r = expr->r;
-        while(r)
-        {
-            tmp = reduce_expr_to_atom(r);
-            tmp->next = 0;
 
-            if(arg)
+        if(l->kind == EXPR_INTLIT && r->kind == EXPR_INTLIT)
+        {
+            if(fold_binary(expr->kind, l->value, r->value, &value))
             {
-                arg->next = tmp;
-                arg = arg->next;
+                res = make_expr_intlit(ctx, value);
+            }
+        }
+        else if(r->kind == EXPR_INTLIT && expr_is_int(l))
+        {
+            if(((expr->kind == EXPR_ADD || expr->kind == EXPR_SUB) && r->value == 0) ||
+               ((expr->kind == EXPR_MUL || expr->kind == EXPR_DIV) && r->value == 1))
+            {
+                res = l;
+            }
+            else if(expr->kind == EXPR_MUL && r->value == 0 &&
+                    !expr_has_side_effects(l))
+            {
+                res = r;
             }
             else
             {
-                arg = tmp;
-                args = arg;
+                res = fold_reassoc(ctx, expr);
             }
-
-            r = r->next;
         }
-
-        rvalue = make_expr_binary(EXPR_CALL, l, args);
+        else if(l->kind == EXPR_INTLIT && expr_is_int(r))
+        {
+            if((expr->kind == EXPR_ADD && l->value == 0) ||
+               (expr->kind == EXPR_MUL && l->value == 1))
+            {
+                res = r;
+            }
+            else if(expr->kind == EXPR_MUL && l->value == 0 &&
+                    !expr_has_side_effects(r))
+            {
+                res = l;
+            }
+            else if(expr->kind == EXPR_ADD || expr->kind == EXPR_MUL)
+            {
+                /* Constants go to the right, where the chains are folded */
+                expr->l = r;
+                expr->r = l;
+                expr->type = type_int();
+                res = fold_reassoc(ctx, expr);
+            }
+        }
+        else if(expr->kind == EXPR_SUB && l->kind == EXPR_ID &&
+                r->kind == EXPR_ID && l->id == r->id && expr_is_int(l))
+        {
+            res = make_expr_intlit(ctx, 0);
+        }
     }
-    else if(expr->kind == EXPR_ARR_SUB)
+    else if(expr->kind == EXPR_ARR_SUB || expr->kind == EXPR_ASSIGN)
     {
-        lt = resolve_expr_type(expr->l, 0);
-
-        t1 = store_expr_temp_var(expr->r);
-        stmt = make_stmt(STMT_EXPR);
-        stmt->u.expr = make_expr_binary(
-            EXPR_ASSIGN,
-            make_expr_id(t1), 
-            make_expr_binary(
-                EXPR_MUL,
-                make_expr_id(t1),
-                make_expr_intlit(lt->base_type->size)));
-        stmt->next = 0;
-        add_stmt(stmt);
-
-        t2 = store_expr_temp_var(expr->l);
-
-        t3 = declare_tmp_var(type_ptr(type_char()));
-
-        stmt = make_stmt(STMT_EXPR);
-        stmt->u.expr = make_expr_binary(
-            EXPR_ASSIGN,
-            make_expr_id(t3),
-            make_expr_cast(make_expr_id(t2), type_ptr(type_char())));
-        stmt->next = 0;
-        add_stmt(stmt);
-
-        stmt = make_stmt(STMT_EXPR);
-        stmt->u.expr = make_expr_binary(
-            EXPR_ASSIGN,
-            make_expr_id(t3),
-            make_expr_binary(
-                EXPR_ADD,
-                make_expr_id(t3),
-                make_expr_id(t1)));
-        stmt->next = 0;
-        add_stmt(stmt);
-
-        stmt = make_stmt(STMT_EXPR);
-        stmt->u.expr = make_expr_binary(
-            EXPR_ASSIGN,
-            make_expr_id(t2),
-            make_expr_cast(make_expr_id(t3), type_ptr(lt->base_type)));
-        stmt->next = 0;
-        add_stmt(stmt);
-
-        rvalue = make_expr_unary(EXPR_DEREF, make_expr_id(t2));
+        expr->l = fold_expr(ctx, expr->l);
+        expr->r = fold_expr(ctx, expr->r);
     }
-    else if(expr->kind == EXPR_MEMB_ACCESS)
+    else
     {
-        lt = resolve_expr_type(expr->l, 0);
-        assert(lt->kind == TYPE_STRUCT);
-        l = reduce_expr_to_atom(expr->l);
-
-        t1 = declare_tmp_var(type_ptr(lt));
-
-        stmt = make_stmt_expr(make_expr_binary(
-            EXPR_ASSIGN,
-            make_expr_id(t1),
-            make_expr_unary(EXPR_ADDR_OF, dup_expr(l))));
-        add_stmt(stmt);
-
-        t2 = declare_tmp_var(type_ptr(type_char()));
-
-        stmt = make_stmt_expr(make_expr_binary(
-            EXPR_ASSIGN,
-            make_expr_id(t2),
-            make_expr_cast(make_expr_id(t1), type_ptr(type_char()))));
-        add_stmt(stmt);
-
-        stmt = make_stmt_expr(make_expr_binary(
-            EXPR_ASSIGN,
-            make_expr_id(t2),
-            make_expr_binary(
-                EXPR_ADD,
-                make_expr_id(t2),
-                make_expr_intlit(get_struct_member_offset(lt, expr->id)))));
-        add_stmt(stmt);
-
-        aggr_el = get_struct_member(lt, expr->id);
-        assert(aggr_el);
-
-        t3 = declare_tmp_var(type_ptr(aggr_el->type));
-
-        stmt = make_stmt_expr(make_expr_binary(
-            EXPR_ASSIGN,
-            make_expr_id(t3),
-            make_expr_cast(make_expr_id(t2), type_ptr(aggr_el->type))));
-        add_stmt(stmt);
-
-        rvalue = make_expr_unary(EXPR_DEREF, make_expr_id(t3));
+        fatal(ctx, "Invalid expression to fold");
     }
-    else if(expr->kind == EXPR_MEMB_ACCESS_PTR)
-    {
-        lt = resolve_expr_type(expr->l, 0);
-        assert(lt->kind == TYPE_PTR && lt->base_type->kind == TYPE_STRUCT);
-        l = reduce_expr_to_atom(expr->l);
-
-        t1 = declare_tmp_var(type_ptr(type_char()));
-
-        stmt = make_stmt_expr(make_expr_binary(
-            EXPR_ASSIGN,
-            make_expr_id(t1),
-            make_expr_cast(dup_expr(l), type_ptr(type_char()))));
-        add_stmt(stmt);
-
-        stmt = make_stmt_expr(make_expr_binary(
-            EXPR_ASSIGN,
-            make_expr_id(t1),
-            make_expr_binary(
-                EXPR_ADD,
-                make_expr_id(t1),
-                make_expr_intlit(get_struct_member_offset(lt, expr->id)))));
-        add_stmt(stmt);
 
-        aggr_el = get_struct_member(lt, expr->id);
-        assert(aggr_el);
-
-        t2 = declare_tmp_var(type_ptr(aggr_el->type));
+    return(res);
+}
 
-        stmt = make_stmt_expr(make_expr_binary(
-            EXPR_ASSIGN,
-            make_expr_id(t2),
-            make_expr_cast(make_expr_id(t1), type_ptr(aggr_el->type))));
-        add_stmt(stmt);
+void
+fold_stmt(EzcCtx *ctx, Stmt *stmt)
+{
+    Stmt *curr;
 
-        rvalue = make_expr_unary(EXPR_DEREF, make_expr_id(t2));
-    }
-    else if(expr->kind >= EXPR_UNARY && expr->kind < EXPR_UNARY_END)
-    {
-        l = reduce_expr_to_atom(expr->l);
-        rvalue = make_expr_unary(expr->kind, l);
-    }
-    else if(expr->kind == EXPR_ADD || expr->kind == EXPR_SUB)
+    switch(stmt->kind)
     {
-        lt = resolve_expr_type(expr->l, 0);
-        rt = resolve_expr_type(expr->r, 0);
+        case STMT_EXPR:
+        case STMT_RET:
+        {
+            if(stmt->u.expr)
+            {
+                stmt->u.expr = fold_expr(ctx, stmt->u.expr);
+            }
+        } break;
 
-        if(lt->kind == TYPE_PTR || rt->kind == TYPE_PTR)
+        case STMT_BLOCK:
         {
-            /* TODO: HERE */
-            if(lt->kind == TYPE_PTR)
+            curr = stmt->u.block;
+            while(curr)
             {
-                l = reduce_expr_to_atom(expr->l);
-                r = reduce_expr_to_atom(expr->r);
+                fold_stmt(ctx, curr);
+                curr = curr->next;
             }
-            else
+        } break;
+
+        case STMT_IF:
+        {
+            stmt->cond = fold_expr(ctx, stmt->cond);
+            fold_stmt(ctx, stmt->then_stmt);
+            if(stmt->else_stmt)
             {
-                l = reduce_expr_to_atom(expr->r);
-                r = reduce_expr_to_atom(expr->l);
-                mt = rt;
-                rt = lt;
-                lt = mt;
+                fold_stmt(ctx, stmt->else_stmt);
             }
+        } break;
 
-            t1 = declare_tmp_var(type_ptr(type_char()));
-            t2 = declare_tmp_var(lt);
-            t3 = declare_tmp_var(type_int());
+        case STMT_WHILE:
+        {
+            stmt->cond = fold_expr(ctx, stmt->cond);
+            fold_stmt(ctx, stmt->then_stmt);
+        } break;
 
-            stmt = make_stmt_expr(make_expr_binary(
-                EXPR_ASSIGN,
-                make_expr_id(t3),
-                make_expr_binary(
-                    EXPR_MUL,
-                    dup_expr(r),
-                    make_expr_intlit(lt->base_type->size))));
-            add_stmt(stmt);
+        case STMT_FOR:
+        {
+            stmt->init = fold_expr(ctx, stmt->init);
+            stmt->cond = fold_expr(ctx, stmt->cond);
+            stmt->post = fold_expr(ctx, stmt->post);
+            fold_stmt(ctx, stmt->then_stmt);
+        } break;
 
-            stmt = make_stmt_expr(make_expr_binary(
-                EXPR_ASSIGN,
-                make_expr_id(t1),
-                make_expr_cast(dup_expr(l), type_ptr(type_char()))));
-            add_stmt(stmt);
+        default:
+        {
+            /* Nothing */
+        } break;
+    }
+}
 
-            stmt = make_stmt_expr(make_expr_binary(
-                EXPR_ASSIGN,
-                make_expr_id(t1),
-                make_expr_binary(
-                    EXPR_ADD,
-                    make_expr_id(t1),
-                    make_expr_id(t3))));
-            add_stmt(stmt);
+void
+fold_unit(EzcCtx *ctx, GlobDecl *unit)
+{
+    GlobDecl *curr;
 
-            rvalue = make_expr_cast(make_expr_id(t1), lt);
-        }
-        else
+    curr = unit;
+    while(curr)
+    {
+        if(curr->kind == GLOB_DECL_FUNC && curr->func_def)
         {
-            l = reduce_expr_to_atom(expr->l);
-            r = reduce_expr_to_atom(expr->r);
-            rvalue = make_expr_binary(expr->kind, l, r);
+            fold_stmt(ctx, curr->func_def);
         }
+        curr = curr->next;
     }
-    else if(expr->kind >= EXPR_BINARY && expr->kind < EXPR_BINARY_END)
-    {
-        l = reduce_expr_to_atom(expr->l);
-        r = reduce_expr_to_atom(expr->r);
-        rvalue = make_expr_binary(expr->kind, l, r);
-    }
-    else if(expr->kind == EXPR_TERNARY)
-    {
-        lbl1 = lbl_gen();
-        lbl2 = lbl_gen();
-        lbl3 = lbl_gen();
-
-        l = reduce_expr_to_atom(expr->l);
-
-        stmt = make_stmt_if(l, 0, 0);
-        stmt->u.label = lbl1;
-        add_stmt(stmt);
-
-        stmt = make_stmt(STMT_GOTO);
-        stmt->u.label = lbl2;
-        stmt->next = 0;
-        add_stmt(stmt);
-
-        stmt = make_stmt(STMT_LABEL);
-        stmt->u.label = lbl1;
-        stmt->next = 0;
-        add_stmt(stmt);
+}
 
-        m = reduce_expr_to_atom(expr->m);
+/******************************************************************************/
+/**                              AST -> IR-C                                 **/
+/******************************************************************************/
 
-        stmt = make_stmt(STMT_EXPR);
-        stmt->u.expr = make_expr_binary(EXPR_ASSIGN, make_expr_id(res), m);
-        stmt->next = 0;
-        add_stmt(stmt);
+/*
+ * We use the AST to represent our Intermediate Representation tree since
+ * our IR language is a subset of the C language (hence IR-C).
+ *
+ * IR-C Description:
+ *
+ * There are only 5 kinds of statement:
+ * 1. Return statements
+ * 2. Expressions
+ * 3. Jumps
+ * 4. Labels definition
+ * 5. Branches
+ *
+ * Sources:
+ * [1] https://ls12-www.cs.tu-dortmund.de/daes/media/documents/publications/downloads/2003-samosIII.pdf
+ */
 
-        stmt = make_stmt(STMT_GOTO);
-        stmt->u.label = lbl3;
-        stmt->next = 0;
-        add_stmt(stmt);
+/*
+ * A backend worker (lbl_local) numbers the labels of its function from 0
+ * and writes them as "@<n>": the real numbers are only known once the
+ * functions before it are done (see backend_emit).
+ */
+char *
+lbl_gen(EzcCtx *ctx)
+{
+    char *res;
+    char lbl[128];
+    int n;
 
-        stmt = make_stmt(STMT_LABEL);
-        stmt->u.label = lbl2;
-        stmt->next = 0;
-        add_stmt(stmt);
+    if(ctx->lbl_local)
+    {
+        n = sprintf(lbl, "@%d", ctx->lbl_count);
+    }
+    else
+    {
+        lbl[0] = '_';
+        lbl[1] = '_';
+        lbl[2] = '_';
+        lbl[3] = 'L';
+        n = sprintf(lbl+4, "%d", ctx->lbl_count);
+        lbl[n+4] = 0;
+    }
+    ++ctx->lbl_count;
 
-        r = reduce_expr_to_atom(expr->r);
+    res = str_intern(ctx, lbl);
+    return(res);
+}
 
-        stmt = make_stmt(STMT_EXPR);
-        stmt->u.expr = make_expr_binary(EXPR_ASSIGN, make_expr_id(res), m);
-        stmt->next = 0;
-        add_stmt(stmt);
+char *
+tmp_var(EzcCtx *ctx)
+{
+    int n;
 
-        stmt = make_stmt(STMT_LABEL);
-        stmt->u.label = lbl3;
-        stmt->next = 0;
-        add_stmt(stmt);
-    }
-    else if(expr->kind == EXPR_ASSIGN)
-    {
-        l = reduce_expr_to_atom(expr->l);
-        r = reduce_expr_to_atom(expr->r);
+    ctx->tmp_var_buff[0] = '_';
+    ctx->tmp_var_buff[1] = '_';
+    ctx->tmp_var_buff[2] = '_';
+    ctx->tmp_var_buff[3] = 't';
+    n = sprintf(ctx->tmp_var_buff+4, "%d", ctx->tmp_vars_count);
+    ctx->tmp_var_buff[n+4] = 0;
+    ++ctx->tmp_vars_count;
 
-        stmt = make_stmt(STMT_EXPR);
-        stmt->u.expr = make_expr_binary(EXPR_ASSIGN, l, r);
-        add_stmt(stmt);
+    return(str_intern(ctx, ctx->tmp_var_buff));
+}
 
-        rvalue = l;
-    }
-    else if(expr->kind == EXPR_COMPOUND)
+void
+add_stmt(EzcCtx *ctx, Stmt *stmt)
+{
+    if(ctx->curr_block_last)
     {
-        l = expr->l;
-        while(l)
-        {
-            if(l->next)
-            {
-                expr_to_irc(l);
-            }
-            else
-            {
-                rvalue = reduce_expr_to_atom(l);
-            }
-            l = l->next;
-        }
+        ctx->curr_block_last->next = stmt;
     }
     else
     {
-        assert(0);
+        ctx->curr_block->u.block = stmt;
     }
 
-    if(rvalue)
+    ctx->curr_block_last = stmt;
+    while(ctx->curr_block_last->next)
     {
-        stmt = make_stmt(STMT_EXPR);
-        stmt->u.expr = make_expr_binary(EXPR_ASSIGN, make_expr_id(res), rvalue);
-        add_stmt(stmt);
+        ctx->curr_block_last = ctx->curr_block_last->next;
     }
+}
 
-    return(res);
+#define TMP_VARS_POOL_SIZE 100
+
+void
+tmp_vars_pool_reset(EzcCtx *ctx)
+{
+    ctx->tmp_vars_pool_count = 0;
 }
 
-Expr *
-reduce_expr_to_atom(Expr *expr)
+void
+tmp_vars_free(EzcCtx *ctx)
 {
-    Expr *res = 0;
+    int i;
+
+    for(i = ctx->tmp_vars_pool_count - 1;
+        i >= 0;
+        --i)
+    {
+        ctx->tmp_vars_pool[i].value = 0;
+    }
+}
 
+char *
+declare_tmp_var(EzcCtx *ctx, Type *type)
+{
+    char *res;
     Stmt *stmt;
-    Expr *l;
-    Type *lt;
-    char *t1;
-    char *t2;
-    char *t3;
-    AggrElement *aggr_el;
+    int i;
+    Sym *sym;
 
-    if(expr_is_atom(expr))
+    sym = 0;
+    for(i = ctx->tmp_vars_pool_count - 1;
+        i >= 0;
+        --i)
     {
-        res = dup_expr(expr);
+        if(ctx->tmp_vars_pool[i].type == type && ctx->tmp_vars_pool[i].value == 0)
+        {
+            sym = &(ctx->tmp_vars_pool[i]);
+        }
     }
-    else if(expr->kind == EXPR_DEREF)
+
+    if(sym)
     {
-        res = dup_expr(expr);
+        res = sym->id;
     }
-    else if(expr->kind == EXPR_ARR_SUB)
+    else
     {
-        lt = resolve_expr_type(expr->l, 0);
-
-        t1 = store_expr_temp_var(expr->r);
-        stmt = make_stmt(STMT_EXPR);
-        stmt->u.expr = make_expr_binary(
-            EXPR_ASSIGN,
-            make_expr_id(t1), 
-            make_expr_binary(
-                EXPR_MUL,
-                make_expr_id(t1),
-                make_expr_intlit(lt->base_type->size)));
-        stmt->next = 0;
-        add_stmt(stmt);
-
-        t2 = store_expr_temp_var(expr->l);
-
-        t3 = declare_tmp_var(type_ptr(type_char()));
-
-        stmt = make_stmt(STMT_EXPR);
-        stmt->u.expr = make_expr_binary(
-            EXPR_ASSIGN,
-            make_expr_id(t3),
-            make_expr_cast(make_expr_id(t2), type_ptr(type_char())));
-        stmt->next = 0;
-        add_stmt(stmt);
-
-        stmt = make_stmt(STMT_EXPR);
-        stmt->u.expr = make_expr_binary(
-            EXPR_ASSIGN,
-            make_expr_id(t3),
-            make_expr_binary(
-                EXPR_ADD,
-                make_expr_id(t3),
-                make_expr_id(t1)));
-        stmt->next = 0;
-        add_stmt(stmt);
-
-        stmt = make_stmt(STMT_EXPR);
-        stmt->u.expr = make_expr_binary(
-            EXPR_ASSIGN,
-            make_expr_id(t2),
-            make_expr_cast(make_expr_id(t3), type_ptr(lt->base_type)));
+        res = tmp_var(ctx);
+        assert(type);
+        stmt = make_stmt_decl(ctx, make_decl(ctx, type, res));
         stmt->next = 0;
-        add_stmt(stmt);
+        add_stmt(ctx, stmt);
 
-        res = make_expr_unary(EXPR_DEREF, make_expr_id(t2));
+        sym = &(ctx->tmp_vars_pool[ctx->tmp_vars_pool_count]);
+        sym->id = res;
+        sym->type = type;
+        ++ctx->tmp_vars_pool_count;
     }
-    else if(expr->kind == EXPR_MEMB_ACCESS)
-    {
-        lt = resolve_expr_type(expr->l, 0);
-        assert(lt->kind == TYPE_STRUCT);
-        l = reduce_expr_to_atom(expr->l);
-
-        t1 = declare_tmp_var(type_ptr(lt));
-
-        stmt = make_stmt_expr(make_expr_binary(
-            EXPR_ASSIGN,
-            make_expr_id(t1),
-            make_expr_unary(EXPR_ADDR_OF, dup_expr(l))));
-        add_stmt(stmt);
-
-        t2 = declare_tmp_var(type_ptr(type_char()));
+    sym->value = 1;
 
-        stmt = make_stmt_expr(make_expr_binary(
-            EXPR_ASSIGN,
-            make_expr_id(t2),
-            make_expr_cast(make_expr_id(t1), type_ptr(type_char()))));
-        add_stmt(stmt);
+    return(res);
+}
 
-        stmt = make_stmt_expr(make_expr_binary(
-            EXPR_ASSIGN,
-            make_expr_id(t2),
-            make_expr_binary(
-                EXPR_ADD,
-                make_expr_id(t2),
-                make_expr_intlit(get_struct_member_offset(lt, expr->id)))));
-        add_stmt(stmt);
+void block_to_irc(EzcCtx *ctx, Stmt *block);
+Stmt *func_def_to_irc(EzcCtx *ctx, Stmt *block);
 
-        aggr_el = get_struct_member(lt, expr->id);
-        assert(aggr_el);
+int
+expr_is_atom(Expr *expr)
+{
+    if(expr->kind == EXPR_INTLIT || expr->kind == EXPR_ID)
+    {
+        return(1);
+    }
+    return(0);
+}
 
-        t3 = declare_tmp_var(type_ptr(aggr_el->type));
+void expr_to_irc(EzcCtx *ctx, Expr *expr);
+Expr *reduce_expr_to_atom(EzcCtx *ctx, Expr *expr);
 
-        stmt = make_stmt_expr(make_expr_binary(
-            EXPR_ASSIGN,
-            make_expr_id(t3),
-            make_expr_cast(make_expr_id(t2), type_ptr(aggr_el->type))));
-        add_stmt(stmt);
+/* index*size, with the multiplication folded when it is known */
+Expr *
+make_expr_scaled(EzcCtx *ctx, Expr *index, int size)
+{
+    Expr *res;
 
-        res = make_expr_unary(EXPR_DEREF, make_expr_id(t3));
+    if(index->kind == EXPR_INTLIT)
+    {
+        res = make_expr_intlit(ctx, index->value*size);
     }
-    else if(expr->kind == EXPR_MEMB_ACCESS_PTR)
+    else if(size == 1)
     {
-        lt = resolve_expr_type(expr->l, 0);
-        assert(lt->kind == TYPE_PTR && lt->base_type->kind == TYPE_STRUCT);
-        l = reduce_expr_to_atom(expr->l);
-
-        t1 = declare_tmp_var(type_ptr(type_char()));
-
-        stmt = make_stmt_expr(make_expr_binary(
-            EXPR_ASSIGN,
-            make_expr_id(t1),
-            make_expr_cast(dup_expr(l), type_ptr(type_char()))));
-        add_stmt(stmt);
-
-        stmt = make_stmt_expr(make_expr_binary(
-            EXPR_ASSIGN,
-            make_expr_id(t1),
-            make_expr_binary(
-                EXPR_ADD,
-                make_expr_id(t1),
-                make_expr_intlit(get_struct_member_offset(lt, expr->id)))));
-        add_stmt(stmt);
+        res = dup_expr(ctx, index);
+    }
+    else
+    {
+        res = make_expr_binary(ctx, EXPR_MUL, dup_expr(ctx, index), make_expr_intlit(ctx, size));
+    }
 
-        aggr_el = get_struct_member(lt, expr->id);
-        assert(aggr_el);
+    return(res);
+}
 
-        t2 = declare_tmp_var(type_ptr(aggr_el->type));
+char *store_expr_temp_var(EzcCtx *ctx, Expr *expr);
 
-        stmt = make_stmt_expr(make_expr_binary(
-            EXPR_ASSIGN,
-            make_expr_id(t2),
-            make_expr_cast(make_expr_id(t1), type_ptr(aggr_el->type))));
-        add_stmt(stmt);
+/* Stores the byte offset of an array element in a new temporary */
+char *
+store_expr_index(EzcCtx *ctx, Expr *index, int size)
+{
+    char *res;
+    Stmt *stmt;
 
-        res = make_expr_unary(EXPR_DEREF, make_expr_id(t2));
+    if(index->kind == EXPR_INTLIT)
+    {
+        res = store_expr_temp_var(ctx, make_expr_scaled(ctx, index, size));
     }
     else
     {
-        res = make_expr_id(store_expr_temp_var(expr));
+        res = store_expr_temp_var(ctx, index);
+        if(size != 1)
+        {
+            stmt = make_stmt_expr(ctx, make_expr_binary(ctx,
+                EXPR_ASSIGN,
+                make_expr_id(ctx, res),
+                make_expr_binary(ctx,
+                    EXPR_MUL,
+                    make_expr_id(ctx, res),
+                    make_expr_intlit(ctx, size))));
+            add_stmt(ctx, stmt);
+        }
     }
 
-    assert(res);
-
     return(res);
 }
 
-void
-expr_to_irc(Expr *expr)
+char *
+store_expr_temp_var(EzcCtx *ctx, Expr *expr)
 {
+    char *res;
     Stmt *stmt;
+    Expr *rvalue;
+
     Expr *l;
     Expr *m;
     Expr *r;
-    Expr *final;
+
     Expr *arg;
     Expr *args;
     Expr *tmp;
-    int op;
-    int i;
+
+    Type *type;
     Type *lt;
-    char *t1, *t2, *t3, *t4;
+    Type *mt;
+    Type *rt;
+    char *t1;
+    char *t2;
+    char *t3;
+    AggrElement *aggr_el;
+    int offset;
 
-    final = 0;
-    if(expr->kind == EXPR_INTLIT)
+    char *lbl1;
+    char *lbl2;
+    char *lbl3;
+
+    type = resolve_expr_type(ctx, expr, 0);
+    if(expr->kind == EXPR_ID && type->kind == TYPE_ARRAY)
     {
-        /* Nothing */
+        type = type_ptr(ctx, type->base_type);
     }
-    else if(expr->kind == EXPR_ID)
+
+    res = declare_tmp_var(ctx, type);
+
+    rvalue = 0;
+    if(expr_is_atom(expr))
     {
-        /* Nothing */
+        if(expr->kind == EXPR_ID)
+        {
+            lt = resolve_expr_type(ctx, expr, 0);
+
+            /* Array decays into a pointer */
+            if(lt->kind == TYPE_ARRAY)
+            {
+                rvalue = make_expr_id(ctx, expr->id);
+            }
+            else
+            {
+                rvalue = dup_expr(ctx, expr);
+            }
+        }
+        else
+        {
+            rvalue = dup_expr(ctx, expr);
+        }
     }
     else if(expr->kind == EXPR_CALL)
     {
-        l = reduce_expr_to_atom(expr->l);
+        l = reduce_expr_to_atom(ctx, expr->l);
 
         args = 0;
         arg = 0;
         r = expr->r;
         while(r)
         {
-            printf("A");
-            tmp = reduce_expr_to_atom(r);
+            tmp = reduce_expr_to_atom(ctx, r);
             tmp->next = 0;
 
             if(arg)
             {
-                arg->next = dup_expr(tmp);
+                arg->next = tmp;
                 arg = arg->next;
             }
             else
             {
-                arg = dup_expr(tmp);
+                arg = tmp;
                 args = arg;
             }
 
             r = r->next;
         }
 
-        final = make_expr_binary(EXPR_CALL, l, args);
+        rvalue = make_expr_binary(ctx, EXPR_CALL, l, args);
     }
     else if(expr->kind == EXPR_ARR_SUB)
     {
-        final = reduce_expr_to_atom(expr);
+        lt = resolve_expr_type(ctx, expr->l, 0);
+
+        t1 = store_expr_index(ctx, expr->r, lt->base_type->size);
+
+        t2 = store_expr_temp_var(ctx, expr->l);
+
+        t3 = declare_tmp_var(ctx, type_ptr(ctx, type_char()));
+
+        stmt = make_stmt(ctx, STMT_EXPR);
+        stmt->u.expr = make_expr_binary(ctx,
+            EXPR_ASSIGN,
+            make_expr_id(ctx, t3),
+            make_expr_cast(ctx,
+                make_expr_id(ctx, t2),
+                type_ptr(ctx, type_char())));
+        stmt->next = 0;
+        add_stmt(ctx, stmt);
+
+        stmt = make_stmt(ctx, STMT_EXPR);
+        stmt->u.expr = make_expr_binary(ctx,
+            EXPR_ASSIGN,
+            make_expr_id(ctx, t3),
+            make_expr_binary(ctx,
+                EXPR_ADD,
+                make_expr_id(ctx, t3),
+                make_expr_id(ctx, t1)));
+        stmt->next = 0;
+        add_stmt(ctx, stmt);
+
+        stmt = make_stmt(ctx, STMT_EXPR);
+        stmt->u.expr = make_expr_binary(ctx,
+            EXPR_ASSIGN,
+            make_expr_id(ctx, t2),
+            make_expr_cast(ctx,
+                make_expr_id(ctx, t3),
+                type_ptr(ctx, lt->base_type)));
+        stmt->next = 0;
+        add_stmt(ctx, stmt);
+
+        rvalue = make_expr_unary(ctx, EXPR_DEREF, make_expr_id(ctx, t2));
     }
     else if(expr->kind == EXPR_MEMB_ACCESS)
     {
-        final = reduce_expr_to_atom(expr);
-    }
-    else if(expr->kind == EXPR_MEMB_ACCESS_PTR)
-    {
-        final = reduce_expr_to_atom(expr);
-    }
-    else if(expr->kind == EXPR_INC_PRE || expr->kind == EXPR_DEC_PRE)
-    {
-        if(expr->kind == EXPR_INC_PRE)
+        lt = resolve_expr_type(ctx, expr->l, 0);
+        if(lt->kind != TYPE_STRUCT)
         {
-            op = EXPR_ADD;
+            fatal(ctx, "Invalid member access");
         }
-        else
+        l = reduce_expr_to_atom(ctx, expr->l);
+
+        t1 = declare_tmp_var(ctx, type_ptr(ctx, lt));
+
+        stmt = make_stmt_expr(ctx, make_expr_binary(ctx,
+            EXPR_ASSIGN,
+            make_expr_id(ctx, t1),
+            make_expr_unary(ctx, EXPR_ADDR_OF, dup_expr(ctx, l))));
+        add_stmt(ctx, stmt);
+
+        t2 = declare_tmp_var(ctx, type_ptr(ctx, type_char()));
+
+        stmt = make_stmt_expr(ctx, make_expr_binary(ctx,
+            EXPR_ASSIGN,
+            make_expr_id(ctx, t2),
+            make_expr_cast(ctx,
+                make_expr_id(ctx, t1),
+                type_ptr(ctx, type_char()))));
+        add_stmt(ctx, stmt);
+
+        offset = get_struct_member_offset(lt, expr->id);
+        if(offset)
         {
-            op = EXPR_SUB;
+            stmt = make_stmt_expr(ctx, make_expr_binary(ctx,
+                EXPR_ASSIGN,
+                make_expr_id(ctx, t2),
+                make_expr_binary(ctx,
+                    EXPR_ADD,
+                    make_expr_id(ctx, t2),
+                    make_expr_intlit(ctx, offset))));
+            add_stmt(ctx, stmt);
+        }
+
+        aggr_el = get_struct_member(lt, expr->id);
+        if(!aggr_el)
+        {
+            fatal(ctx, "Invalid struct member '%s'", expr->id);
         }
-        l = reduce_expr_to_atom(expr->l);
-        final = make_expr_binary(
+
+        t3 = declare_tmp_var(ctx, type_ptr(ctx, aggr_el->type));
+
+        stmt = make_stmt_expr(ctx, make_expr_binary(ctx,
             EXPR_ASSIGN,
-            l,
-            make_expr_binary(op, l, make_expr_intlit(1)));
-    }
-    else if(expr->kind >= EXPR_UNARY && expr->kind < EXPR_UNARY_END)
-    {
-        l = reduce_expr_to_atom(expr->l);
-        final = make_expr_unary(expr->kind, l);
+            make_expr_id(ctx, t3),
+            make_expr_cast(ctx,
+                make_expr_id(ctx, t2),
+                type_ptr(ctx, aggr_el->type))));
+        add_stmt(ctx, stmt);
+
+        rvalue = make_expr_unary(ctx, EXPR_DEREF, make_expr_id(ctx, t3));
     }
-    else if(expr->kind >= EXPR_BINARY && expr->kind < EXPR_BINARY_END)
+    else if(expr->kind == EXPR_MEMB_ACCESS_PTR)
     {
-        l = reduce_expr_to_atom(expr->l);
-        r = reduce_expr_to_atom(expr->r);
-        final = make_expr_binary(expr->kind, l, r);
+        lt = resolve_expr_type(ctx, expr->l, 0);
+        if(lt->kind != TYPE_PTR || lt->base_type->kind != TYPE_STRUCT)
+        {
+            fatal(ctx, "Invalid member access");
+        }
+        l = reduce_expr_to_atom(ctx, expr->l);
+
+        t1 = declare_tmp_var(ctx, type_ptr(ctx, type_char()));
+
+        stmt = make_stmt_expr(ctx, make_expr_binary(ctx,
+            EXPR_ASSIGN,
+            make_expr_id(ctx, t1),
+            make_expr_cast(ctx, dup_expr(ctx, l), type_ptr(ctx, type_char()))));
+        add_stmt(ctx, stmt);
+
+        offset = get_struct_member_offset(lt, expr->id);
+        if(offset)
+        {
+            stmt = make_stmt_expr(ctx, make_expr_binary(ctx,
+                EXPR_ASSIGN,
+                make_expr_id(ctx, t1),
+                make_expr_binary(ctx,
+                    EXPR_ADD,
+                    make_expr_id(ctx, t1),
+                    make_expr_intlit(ctx, offset))));
+            add_stmt(ctx, stmt);
+        }
+
+        aggr_el = get_struct_member(lt, expr->id);
+        if(!aggr_el)
+        {
+            fatal(ctx, "Invalid struct member '%s'", expr->id);
+        }
+
+        t2 = declare_tmp_var(ctx, type_ptr(ctx, aggr_el->type));
+
+        stmt = make_stmt_expr(ctx, make_expr_binary(ctx,
+            EXPR_ASSIGN,
+            make_expr_id(ctx, t2),
+            make_expr_cast(ctx,
+                make_expr_id(ctx, t1),
+                type_ptr(ctx, aggr_el->type))));
+        add_stmt(ctx, stmt);
+
+        rvalue = make_expr_unary(ctx, EXPR_DEREF, make_expr_id(ctx, t2));
     }
-    else if(expr->kind == EXPR_TERNARY)
+    else if(expr->kind >= EXPR_UNARY && expr->kind < EXPR_UNARY_END)
     {
-        l = reduce_expr_to_atom(expr->l);
-        m = reduce_expr_to_atom(expr->m);
-        r = reduce_expr_to_atom(expr->r);
-        final = make_expr_ternary(l, m, r);
+        l = reduce_expr_to_atom(ctx, expr->l);
+        rvalue = make_expr_unary(ctx, expr->kind, l);
     }
-    else if(expr->kind == EXPR_ASSIGN)
+    else if(expr->kind == EXPR_ADD || expr->kind == EXPR_SUB)
     {
-        lt = resolve_expr_type(expr->l, 0);
-        if(lt->kind == TYPE_STRUCT)
-        {
-            assert(expr->l->kind == EXPR_ID);
+        lt = resolve_expr_type(ctx, expr->l, 0);
+        rt = resolve_expr_type(ctx, expr->r, 0);
 
-            l = reduce_expr_to_atom(expr->l);
-            r = reduce_expr_to_atom(expr->r);
+        if(lt->kind == TYPE_PTR || rt->kind == TYPE_PTR)
+        {
+            /* TODO: HERE */
+            if(lt->kind == TYPE_PTR)
+            {
+                l = reduce_expr_to_atom(ctx, expr->l);
+                r = reduce_expr_to_atom(ctx, expr->r);
+            }
+            else
+            {
+                l = reduce_expr_to_atom(ctx, expr->r);
+                r = reduce_expr_to_atom(ctx, expr->l);
+                mt = rt;
+                rt = lt;
+                lt = mt;
+            }
 
-            t1 = declare_tmp_var(type_ptr(lt));
-            t2 = declare_tmp_var(type_ptr(lt));
-            t3 = declare_tmp_var(type_ptr(type_char()));
-            t4 = declare_tmp_var(type_ptr(type_char()));
+            t1 = declare_tmp_var(ctx, type_ptr(ctx, type_char()));
+            t2 = declare_tmp_var(ctx, lt);
+            t3 = declare_tmp_var(ctx, type_int());
 
-            stmt = make_stmt_expr(make_expr_binary(
+            stmt = make_stmt_expr(ctx, make_expr_binary(ctx,
                 EXPR_ASSIGN,
-                make_expr_id(t1),
-                make_expr_unary(EXPR_ADDR_OF, dup_expr(l))));
-            add_stmt(stmt);
+                make_expr_id(ctx, t3),
+                make_expr_scaled(ctx, r, lt->base_type->size)));
+            add_stmt(ctx, stmt);
 
-            stmt = make_stmt_expr(make_expr_binary(
+            stmt = make_stmt_expr(ctx, make_expr_binary(ctx,
                 EXPR_ASSIGN,
-                make_expr_id(t2),
-                make_expr_unary(EXPR_ADDR_OF, dup_expr(r))));
-            add_stmt(stmt);
+                make_expr_id(ctx, t1),
+                make_expr_cast(ctx,
+                    dup_expr(ctx, l),
+                    type_ptr(ctx, type_char()))));
+            add_stmt(ctx, stmt);
 
-            stmt = make_stmt_expr(make_expr_binary(
+            stmt = make_stmt_expr(ctx, make_expr_binary(ctx,
                 EXPR_ASSIGN,
-                make_expr_id(t3),
-                make_expr_cast(make_expr_id(t1), type_ptr(type_char()))));
-            add_stmt(stmt);
+                make_expr_id(ctx, t1),
+                make_expr_binary(ctx,
+                    EXPR_ADD,
+                    make_expr_id(ctx, t1),
+                    make_expr_id(ctx, t3))));
+            add_stmt(ctx, stmt);
 
-            stmt = make_stmt_expr(make_expr_binary(
-                EXPR_ASSIGN,
-                make_expr_id(t4),
-                make_expr_cast(make_expr_id(t2), type_ptr(type_char()))));
-            add_stmt(stmt);
+            rvalue = make_expr_cast(ctx, make_expr_id(ctx, t1), lt);
+        }
+        else
+        {
+            l = reduce_expr_to_atom(ctx, expr->l);
+            r = reduce_expr_to_atom(ctx, expr->r);
+            rvalue = make_expr_binary(ctx, expr->kind, l, r);
+        }
+    }
+    else if(expr->kind >= EXPR_BINARY && expr->kind < EXPR_BINARY_END)
+    {
+        l = reduce_expr_to_atom(ctx, expr->l);
+        r = reduce_expr_to_atom(ctx, expr->r);
+        rvalue = make_expr_binary(ctx, expr->kind, l, r);
+    }
+    else if(expr->kind == EXPR_TERNARY)
+    {
+        lbl1 = lbl_gen(ctx);
+        lbl2 = lbl_gen(ctx);
+        lbl3 = lbl_gen(ctx);
 
-            t1 = declare_tmp_var(type_ptr(type_int()));
-            t2 = declare_tmp_var(type_ptr(type_int()));
+        l = reduce_expr_to_atom(ctx, expr->l);
 
-            stmt = make_stmt_expr(make_expr_binary(
-                EXPR_ASSIGN,
-                make_expr_id(t1),
-                make_expr_cast(make_expr_id(t3), type_ptr(type_int()))));
-            add_stmt(stmt);
+        stmt = make_stmt_if(ctx, l, 0, 0);
+        stmt->u.label = lbl1;
+        add_stmt(ctx, stmt);
 
-            stmt = make_stmt_expr(make_expr_binary(
-                EXPR_ASSIGN,
-                make_expr_id(t2),
-                make_expr_cast(make_expr_id(t4), type_ptr(type_int()))));
-            add_stmt(stmt);
+        stmt = make_stmt(ctx, STMT_GOTO);
+        stmt->u.label = lbl2;
+        stmt->next = 0;
+        add_stmt(ctx, stmt);
 
-            assert(lt->size % 4 == 0);
-            for(i = 0;
-                i < lt->size/4;
-                ++i)
-            {
-                stmt = make_stmt_expr(make_expr_binary(
-                    EXPR_ASSIGN,
-                    make_expr_unary(EXPR_DEREF, make_expr_id(t1)),
-                    make_expr_unary(EXPR_DEREF, make_expr_id(t2))));
-                add_stmt(stmt);
+        stmt = make_stmt(ctx, STMT_LABEL);
+        stmt->u.label = lbl1;
+        stmt->next = 0;
+        add_stmt(ctx, stmt);
 
-                stmt = make_stmt_expr(make_expr_binary(
-                    EXPR_ASSIGN,
-                    make_expr_id(t3),
-                    make_expr_binary(
-                        EXPR_ADD,
-                        make_expr_id(t3),
-                        make_expr_intlit(4))));
-                add_stmt(stmt);
+        m = reduce_expr_to_atom(ctx, expr->m);
 
-                stmt = make_stmt_expr(make_expr_binary(
-                    EXPR_ASSIGN,
-                    make_expr_id(t4),
-                    make_expr_binary(
-                        EXPR_ADD,
-                        make_expr_id(t4),
-                        make_expr_intlit(4))));
-                add_stmt(stmt);
-                
-                stmt = make_stmt_expr(make_expr_binary(
-                    EXPR_ASSIGN,
-                    make_expr_id(t1),
-                    make_expr_cast(make_expr_id(t3), type_ptr(type_int()))));
-                add_stmt(stmt);
+        stmt = make_stmt(ctx, STMT_EXPR);
+        stmt->u.expr = make_expr_binary(ctx,
+            EXPR_ASSIGN,
+            make_expr_id(ctx, res),
+            m);
+        stmt->next = 0;
+        add_stmt(ctx, stmt);
 
-                stmt = make_stmt_expr(make_expr_binary(
-                    EXPR_ASSIGN,
-                    make_expr_id(t2),
-                    make_expr_cast(make_expr_id(t4), type_ptr(type_int()))));
-                add_stmt(stmt);
-            }
-        }
-        else
-        {
-            l = reduce_expr_to_atom(expr->l);
-            r = reduce_expr_to_atom(expr->r);
-            final = make_expr_binary(expr->kind, l, r);
-        }
+        stmt = make_stmt(ctx, STMT_GOTO);
+        stmt->u.label = lbl3;
+        stmt->next = 0;
+        add_stmt(ctx, stmt);
+
+        stmt = make_stmt(ctx, STMT_LABEL);
+        stmt->u.label = lbl2;
+        stmt->next = 0;
+        add_stmt(ctx, stmt);
+
+        r = reduce_expr_to_atom(ctx, expr->r);
+
+        stmt = make_stmt(ctx, STMT_EXPR);
+        stmt->u.expr = make_expr_binary(ctx,
+            EXPR_ASSIGN,
+            make_expr_id(ctx, res),
+            m);
+        stmt->next = 0;
+        add_stmt(ctx, stmt);
+
+        stmt = make_stmt(ctx, STMT_LABEL);
+        stmt->u.label = lbl3;
+        stmt->next = 0;
+        add_stmt(ctx, stmt);
+    }
+    else if(expr->kind == EXPR_ASSIGN)
+    {
+        l = reduce_expr_to_atom(ctx, expr->l);
+        r = reduce_expr_to_atom(ctx, expr->r);
+
+        stmt = make_stmt(ctx, STMT_EXPR);
+        stmt->u.expr = make_expr_binary(ctx, EXPR_ASSIGN, l, r);
+        add_stmt(ctx, stmt);
+
+        rvalue = l;
     }
     else if(expr->kind == EXPR_COMPOUND)
     {
         l = expr->l;
         while(l)
         {
-            expr_to_irc(l);
+            if(l->next)
+            {
+                expr_to_irc(ctx, l);
+            }
+            else
+            {
+                rvalue = reduce_expr_to_atom(ctx, l);
+            }
             l = l->next;
         }
     }
     else
     {
-        assert(0);
+        fatal(ctx, "Invalid expression to store");
     }
 
-    if(final)
+    if(rvalue)
     {
-        stmt = make_stmt(STMT_EXPR);
-        stmt->u.expr = final;
-        add_stmt(stmt);
+        stmt = make_stmt(ctx, STMT_EXPR);
+        stmt->u.expr = make_expr_binary(ctx,
+            EXPR_ASSIGN,
+            make_expr_id(ctx, res),
+            rvalue);
+        add_stmt(ctx, stmt);
     }
+
+    return(res);
 }
 
-void
-stmt_to_irc(Stmt *stmt)
+Expr *
+reduce_expr_to_atom(EzcCtx *ctx, Expr *expr)
 {
-    Stmt *irc_stmt;
-    Sym *sym;
+    Expr *res = 0;
 
-    Expr *cond;
-    char *lbl1;
-    char *lbl2;
-    char *lbl3;
+    Stmt *stmt;
+    Expr *l;
+    Type *lt;
+    char *t1;
+    char *t2;
+    char *t3;
+    AggrElement *aggr_el;
+    int offset;
 
-    switch(stmt->kind)
+    if(expr_is_atom(expr))
     {
-        case STMT_DECL:
-        {
-            irc_stmt = dup_stmt(stmt);
-            irc_stmt->next = 0;
-            add_stmt(irc_stmt);
+        res = dup_expr(ctx, expr);
+    }
+    else if(expr->kind == EXPR_DEREF)
+    {
+        res = dup_expr(ctx, expr);
+    }
+    else if(expr->kind == EXPR_ARR_SUB)
+    {
+        lt = resolve_expr_type(ctx, expr->l, 0);
 
-            sym = sym_add(stmt->u.decl->id, stmt->u.decl->type);
-            sym->global = 0;
-            func_var_offset -= stmt->u.decl->type->size;
-            sym->offset = func_var_offset;
-        } break;
+        t1 = store_expr_index(ctx, expr->r, lt->base_type->size);
 
-        case STMT_EXPR:
-        {
-            expr_to_irc(stmt->u.expr);
-        } break;
+        t2 = store_expr_temp_var(ctx, expr->l);
 
-        case STMT_BLOCK:
-        {
-            block_to_irc(stmt);
-        } break;
+        t3 = declare_tmp_var(ctx, type_ptr(ctx, type_char()));
 
-        case STMT_RET:
-        {
-            irc_stmt = make_stmt(STMT_RET);
-            irc_stmt->next = 0;
-            if(stmt->u.expr)
-            {
-                if(expr_is_atom(stmt->u.expr))
-                {
-                    irc_stmt->u.expr = dup_expr(stmt->u.expr);
-                }
-                else
-                {
-                    irc_stmt->u.expr = reduce_expr_to_atom(stmt->u.expr);
-                }
-            }
-            else
-            {
-                irc_stmt->u.expr = 0;
-            }
-            add_stmt(irc_stmt);
-        } break;
+        stmt = make_stmt(ctx, STMT_EXPR);
+        stmt->u.expr = make_expr_binary(ctx,
+            EXPR_ASSIGN,
+            make_expr_id(ctx, t3),
+            make_expr_cast(ctx,
+                make_expr_id(ctx, t2),
+                type_ptr(ctx, type_char())));
+        stmt->next = 0;
+        add_stmt(ctx, stmt);
 
-        case STMT_LABEL:
-        {
-            irc_stmt = dup_stmt(stmt);
-            irc_stmt->next = 0;
-            add_stmt(irc_stmt);
-        } break;
+        stmt = make_stmt(ctx, STMT_EXPR);
+        stmt->u.expr = make_expr_binary(ctx,
+            EXPR_ASSIGN,
+            make_expr_id(ctx, t3),
+            make_expr_binary(ctx,
+                EXPR_ADD,
+                make_expr_id(ctx, t3),
+                make_expr_id(ctx, t1)));
+        stmt->next = 0;
+        add_stmt(ctx, stmt);
 
-        case STMT_GOTO:
-        {
-            irc_stmt = dup_stmt(stmt);
-            irc_stmt->next = 0;
-            add_stmt(irc_stmt);
-        } break;
+        stmt = make_stmt(ctx, STMT_EXPR);
+        stmt->u.expr = make_expr_binary(ctx,
+            EXPR_ASSIGN,
+            make_expr_id(ctx, t2),
+            make_expr_cast(ctx,
+                make_expr_id(ctx, t3),
+                type_ptr(ctx, lt->base_type)));
+        stmt->next = 0;
+        add_stmt(ctx, stmt);
 
-        case STMT_IF:
+        res = make_expr_unary(ctx, EXPR_DEREF, make_expr_id(ctx, t2));
+    }
+    else if(expr->kind == EXPR_MEMB_ACCESS)
+    {
+        lt = resolve_expr_type(ctx, expr->l, 0);
+        if(lt->kind != TYPE_STRUCT)
         {
-            lbl1 = lbl_gen();
-            lbl2 = lbl_gen();
-            if(stmt->else_stmt)
-            {
-                lbl3 = lbl_gen();
-            }
-
-            cond = reduce_expr_to_atom(stmt->cond);
+            fatal(ctx, "Invalid member access");
+        }
+        l = reduce_expr_to_atom(ctx, expr->l);
 
-            irc_stmt = make_stmt_if(cond, 0, 0);
-            irc_stmt->u.label = lbl1;
-            add_stmt(irc_stmt);
+        t1 = declare_tmp_var(ctx, type_ptr(ctx, lt));
 
-            irc_stmt = make_stmt(STMT_GOTO);
-            irc_stmt->u.label = lbl2;
-            irc_stmt->next = 0;
-            add_stmt(irc_stmt);
+        stmt = make_stmt_expr(ctx, make_expr_binary(ctx,
+            EXPR_ASSIGN,
+            make_expr_id(ctx, t1),
+            make_expr_unary(ctx, EXPR_ADDR_OF, dup_expr(ctx, l))));
+        add_stmt(ctx, stmt);
 
-            irc_stmt = make_stmt(STMT_LABEL);
-            irc_stmt->u.label = lbl1;
-            irc_stmt->next = 0;
-            add_stmt(irc_stmt);
+        t2 = declare_tmp_var(ctx, type_ptr(ctx, type_char()));
 
-            stmt_to_irc(stmt->then_stmt);
+        stmt = make_stmt_expr(ctx, make_expr_binary(ctx,
+            EXPR_ASSIGN,
+            make_expr_id(ctx, t2),
+            make_expr_cast(ctx,
+                make_expr_id(ctx, t1),
+                type_ptr(ctx, type_char()))));
+        add_stmt(ctx, stmt);
 
-            irc_stmt = make_stmt(STMT_GOTO);
-            if(stmt->else_stmt)
-            {
-                irc_stmt->u.label = lbl3;
-            }
-            else
-            {
-                irc_stmt->u.label = lbl2;
-            }
-            irc_stmt->next = 0;
-            add_stmt(irc_stmt);
+        offset = get_struct_member_offset(lt, expr->id);
+        if(offset)
+        {
+            stmt = make_stmt_expr(ctx, make_expr_binary(ctx,
+                EXPR_ASSIGN,
+                make_expr_id(ctx, t2),
+                make_expr_binary(ctx,
+                    EXPR_ADD,
+                    make_expr_id(ctx, t2),
+                    make_expr_intlit(ctx, offset))));
+            add_stmt(ctx, stmt);
+        }
 
-            irc_stmt = make_stmt(STMT_LABEL);
-            irc_stmt->u.label = lbl2;
-            irc_stmt->next = 0;
-            add_stmt(irc_stmt);
+        aggr_el = get_struct_member(lt, expr->id);
+        if(!aggr_el)
+        {
+            fatal(ctx, "Invalid struct member '%s'", expr->id);
+        }
 
-            if(stmt->else_stmt)
-            {
-                stmt_to_irc(stmt->else_stmt);
+        t3 = declare_tmp_var(ctx, type_ptr(ctx, aggr_el->type));
 
-                irc_stmt = make_stmt(STMT_LABEL);
-                irc_stmt->u.label = lbl3;
-                irc_stmt->next = 0;
-                add_stmt(irc_stmt);
-            }
-        } break;
+        stmt = make_stmt_expr(ctx, make_expr_binary(ctx,
+            EXPR_ASSIGN,
+            make_expr_id(ctx, t3),
+            make_expr_cast(ctx,
+                make_expr_id(ctx, t2),
+                type_ptr(ctx, aggr_el->type))));
+        add_stmt(ctx, stmt);
 
-        case STMT_WHILE:
+        res = make_expr_unary(ctx, EXPR_DEREF, make_expr_id(ctx, t3));
+    }
+    else if(expr->kind == EXPR_MEMB_ACCESS_PTR)
+    {
+        lt = resolve_expr_type(ctx, expr->l, 0);
+        if(lt->kind != TYPE_PTR || lt->base_type->kind != TYPE_STRUCT)
         {
-            lbl1 = lbl_gen();
-            lbl2 = lbl_gen();
-            lbl3 = lbl_gen();
+            fatal(ctx, "Invalid member access");
+        }
+        l = reduce_expr_to_atom(ctx, expr->l);
 
-            irc_stmt = make_stmt(STMT_LABEL);
-            irc_stmt->u.label = lbl1;
-            irc_stmt->next = 0;
-            add_stmt(irc_stmt);
+        t1 = declare_tmp_var(ctx, type_ptr(ctx, type_char()));
 
-            cond = reduce_expr_to_atom(stmt->cond);
+        stmt = make_stmt_expr(ctx, make_expr_binary(ctx,
+            EXPR_ASSIGN,
+            make_expr_id(ctx, t1),
+            make_expr_cast(ctx, dup_expr(ctx, l), type_ptr(ctx, type_char()))));
+        add_stmt(ctx, stmt);
 
-            irc_stmt = make_stmt_if(cond, 0, 0);
-            irc_stmt->u.label = lbl2;
-            add_stmt(irc_stmt);
+        offset = get_struct_member_offset(lt, expr->id);
+        if(offset)
+        {
+            stmt = make_stmt_expr(ctx, make_expr_binary(ctx,
+                EXPR_ASSIGN,
+                make_expr_id(ctx, t1),
+                make_expr_binary(ctx,
+                    EXPR_ADD,
+                    make_expr_id(ctx, t1),
+                    make_expr_intlit(ctx, offset))));
+            add_stmt(ctx, stmt);
+        }
 
-            irc_stmt = make_stmt(STMT_GOTO);
-            irc_stmt->u.label = lbl3;
-            irc_stmt->next = 0;
-            add_stmt(irc_stmt);
+        aggr_el = get_struct_member(lt, expr->id);
+        if(!aggr_el)
+        {
+            fatal(ctx, "Invalid struct member '%s'", expr->id);
+        }
 
-            irc_stmt = make_stmt(STMT_LABEL);
-            irc_stmt->u.label = lbl2;
-            irc_stmt->next = 0;
-            add_stmt(irc_stmt);
-
-            stmt_to_irc(stmt->then_stmt);
-
-            irc_stmt = make_stmt(STMT_GOTO);
-            irc_stmt->u.label = lbl1;
-            irc_stmt->next = 0;
-            add_stmt(irc_stmt);
-
-            irc_stmt = make_stmt(STMT_LABEL);
-            irc_stmt->u.label = lbl3;
-            irc_stmt->next = 0;
-            add_stmt(irc_stmt);
-        } break;
-
-        case STMT_FOR:
-        {
-            lbl1 = lbl_gen();
-            lbl2 = lbl_gen();
-            lbl3 = lbl_gen();
-
-            expr_to_irc(stmt->init);
-
-            irc_stmt = make_stmt(STMT_LABEL);
-            irc_stmt->u.label = lbl1;
-            irc_stmt->next = 0;
-            add_stmt(irc_stmt);
-
-            cond = reduce_expr_to_atom(stmt->cond);
-
-            irc_stmt = make_stmt_if(cond, 0, 0);
-            irc_stmt->u.label = lbl2;
-            add_stmt(irc_stmt);
-
-            irc_stmt = make_stmt(STMT_GOTO);
-            irc_stmt->u.label = lbl3;
-            irc_stmt->next = 0;
-            add_stmt(irc_stmt);
-
-            irc_stmt = make_stmt(STMT_LABEL);
-            irc_stmt->u.label = lbl2;
-            irc_stmt->next = 0;
-            add_stmt(irc_stmt);
-
-            stmt_to_irc(stmt->then_stmt);
-
-            expr_to_irc(stmt->post);
+        t2 = declare_tmp_var(ctx, type_ptr(ctx, aggr_el->type));
 
-            irc_stmt = make_stmt(STMT_GOTO);
-            irc_stmt->u.label = lbl1;
-            irc_stmt->next = 0;
-            add_stmt(irc_stmt);
-
-            irc_stmt = make_stmt(STMT_LABEL);
-            irc_stmt->u.label = lbl3;
-            irc_stmt->next = 0;
-            add_stmt(irc_stmt);
-        } break;
+        stmt = make_stmt_expr(ctx, make_expr_binary(ctx,
+            EXPR_ASSIGN,
+            make_expr_id(ctx, t2),
+            make_expr_cast(ctx,
+                make_expr_id(ctx, t1),
+                type_ptr(ctx, aggr_el->type))));
+        add_stmt(ctx, stmt);
 
-        default:
-        {
-            assert(0);
-        } break;
+        res = make_expr_unary(ctx, EXPR_DEREF, make_expr_id(ctx, t2));
+    }
+    else
+    {
+        res = make_expr_id(ctx, store_expr_temp_var(ctx, expr));
     }
 
-    tmp_vars_free();
+    assert(res);
+
+    return(res);
 }
 
 void
-block_to_irc(Stmt *block)
+expr_to_irc(EzcCtx *ctx, Expr *expr)
 {
     Stmt *stmt;
-    int tmp_vars_old_count;
+    Expr *l;
+    Expr *m;
+    Expr *r;
+    Expr *final;
+    Expr *arg;
+    Expr *args;
+    Expr *tmp;
+    int op;
+    int i;
+    Type *lt;
+    char *t1, *t2, *t3, *t4;
 
-    tmp_vars_old_count = tmp_vars_pool_count;
-    stmt = block->u.block;
-    while(stmt)
+    final = 0;
+    if(expr->kind == EXPR_INTLIT)
     {
-        stmt_to_irc(stmt);
-        stmt = stmt->next;
+        /* Nothing */
     }
-    tmp_vars_pool_count = tmp_vars_old_count;
-}
-
-Stmt *
-func_def_to_irc(Stmt *block)
-{
-    Stmt *irc_block;
-    Stmt *stmt;
-    Stmt *parent_block;
-    int tmp_vars_old_count;
-
-    tmp_vars_old_count = tmp_vars_pool_count;
-    irc_block = make_stmt(STMT_BLOCK);
-    irc_block->u.block = 0;
-    parent_block = curr_block;
-    curr_block = irc_block;
-    stmt = block->u.block;
-    while(stmt)
+    else if(expr->kind == EXPR_ID)
     {
-        stmt_to_irc(stmt);
-        stmt = stmt->next;
+        /* Nothing */
     }
+    else if(expr->kind == EXPR_CALL)
+    {
+        l = reduce_expr_to_atom(ctx, expr->l);
 
-    curr_block = parent_block;
-    tmp_vars_pool_count = tmp_vars_old_count;
-
-    return(irc_block);
-}
+        args = 0;
+        arg = 0;
+        r = expr->r;
+        while(r)
+        {
+            tmp = reduce_expr_to_atom(ctx, r);
+            tmp->next = 0;
 
-GlobDecl *
-unit_to_irc(GlobDecl *unit)
-{
-    GlobDecl *irc_unit;
-    GlobDecl *irc_curr;
-    GlobDecl *decl;
-    Sym *sym;
-    int offset;
-    int sym_count;
-    FuncParam *param;
+            if(arg)
+            {
+                arg->next = dup_expr(ctx, tmp);
+                arg = arg->next;
+            }
+            else
+            {
+                arg = dup_expr(ctx, tmp);
+                args = arg;
+            }
 
-    sym_reset();
-    tmp_vars_pool_reset();
+            r = r->next;
+        }
 
-    irc_unit = 0;
-    irc_curr = 0;
-    decl = unit;
-    while(decl)
+        final = make_expr_binary(ctx, EXPR_CALL, l, args);
+    }
+    else if(expr->kind == EXPR_ARR_SUB)
     {
-        if(irc_unit)
+        final = reduce_expr_to_atom(ctx, expr);
+    }
+    else if(expr->kind == EXPR_MEMB_ACCESS)
+    {
+        final = reduce_expr_to_atom(ctx, expr);
+    }
+    else if(expr->kind == EXPR_MEMB_ACCESS_PTR)
+    {
+        final = reduce_expr_to_atom(ctx, expr);
+    }
+    else if(expr->kind == EXPR_INC_PRE || expr->kind == EXPR_DEC_PRE)
+    {
+        if(expr->kind == EXPR_INC_PRE)
         {
-            irc_curr->next = DUP_OBJ(GlobDecl, irc_curr->next, decl);
-            irc_curr = irc_curr->next;
+            op = EXPR_ADD;
         }
         else
         {
-            irc_unit = DUP_OBJ(GlobDecl, irc_unit, decl);
-            irc_curr = irc_unit;
+            op = EXPR_SUB;
         }
-        irc_curr->next = 0;
-
-        switch(decl->kind)
+        l = reduce_expr_to_atom(ctx, expr->l);
+        final = make_expr_binary(ctx,
+            EXPR_ASSIGN,
+            l,
+            make_expr_binary(ctx, op, l, make_expr_intlit(ctx, 1)));
+    }
+    else if(expr->kind >= EXPR_UNARY && expr->kind < EXPR_UNARY_END)
+    {
+        l = reduce_expr_to_atom(ctx, expr->l);
+        final = make_expr_unary(ctx, expr->kind, l);
+    }
+    else if(expr->kind >= EXPR_BINARY && expr->kind < EXPR_BINARY_END)
+    {
+        l = reduce_expr_to_atom(ctx, expr->l);
+        r = reduce_expr_to_atom(ctx, expr->r);
+        final = make_expr_binary(ctx, expr->kind, l, r);
+    }
+    else if(expr->kind == EXPR_TERNARY)
+    {
+        l = reduce_expr_to_atom(ctx, expr->l);
+        m = reduce_expr_to_atom(ctx, expr->m);
+        r = reduce_expr_to_atom(ctx, expr->r);
+        final = make_expr_ternary(ctx, l, m, r);
+    }
+    else if(expr->kind == EXPR_ASSIGN)
+    {
+        lt = resolve_expr_type(ctx, expr->l, 0);
+        if(lt->kind == TYPE_STRUCT)
         {
-            case GLOB_DECL_VAR:
+            if(expr->l->kind != EXPR_ID)
             {
-                sym = sym_add(decl->id, decl->type);
-                sym->global = 1;
-            } break;
+                fatal(ctx, "Structures can only be assigned to variables");
+            }
 
-            case GLOB_DECL_FUNC:
-            {
-                sym = sym_add(decl->id, decl->type);
-                sym->global = 1;
+            l = reduce_expr_to_atom(ctx, expr->l);
+            r = reduce_expr_to_atom(ctx, expr->r);
 
-                sym_count = sym_table_count;
-                param = decl->type->params;
-                offset = 8;
-                while(param)
-                {
-                    sym_add_func_param(param->id, param->type, offset);
-                    offset += ALIGN(param->type->size, 4);
-                    param = param->next;
-                }
+            t1 = declare_tmp_var(ctx, type_ptr(ctx, lt));
+            t2 = declare_tmp_var(ctx, type_ptr(ctx, lt));
+            t3 = declare_tmp_var(ctx, type_ptr(ctx, type_char()));
+            t4 = declare_tmp_var(ctx, type_ptr(ctx, type_char()));
 
-                if(decl->func_def)
-                {
-                    irc_curr->func_def = func_def_to_irc(decl->func_def);
-                }
+            stmt = make_stmt_expr(ctx, make_expr_binary(ctx,
+                EXPR_ASSIGN,
+                make_expr_id(ctx, t1),
+                make_expr_unary(ctx, EXPR_ADDR_OF, dup_expr(ctx, l))));
+            add_stmt(ctx, stmt);
 
-                sym_table_count = sym_count;
-            } break;
+            stmt = make_stmt_expr(ctx, make_expr_binary(ctx,
+                EXPR_ASSIGN,
+                make_expr_id(ctx, t2),
+                make_expr_unary(ctx, EXPR_ADDR_OF, dup_expr(ctx, r))));
+            add_stmt(ctx, stmt);
 
-            default:
+            stmt = make_stmt_expr(ctx, make_expr_binary(ctx,
+                EXPR_ASSIGN,
+                make_expr_id(ctx, t3),
+                make_expr_cast(ctx,
+                    make_expr_id(ctx, t1),
+                    type_ptr(ctx, type_char()))));
+            add_stmt(ctx, stmt);
+
+            stmt = make_stmt_expr(ctx, make_expr_binary(ctx,
+                EXPR_ASSIGN,
+                make_expr_id(ctx, t4),
+                make_expr_cast(ctx,
+                    make_expr_id(ctx, t2),
+                    type_ptr(ctx, type_char()))));
+            add_stmt(ctx, stmt);
+
+            t1 = declare_tmp_var(ctx, type_ptr(ctx, type_int()));
+            t2 = declare_tmp_var(ctx, type_ptr(ctx, type_int()));
+
+            stmt = make_stmt_expr(ctx, make_expr_binary(ctx,
+                EXPR_ASSIGN,
+                make_expr_id(ctx, t1),
+                make_expr_cast(ctx,
+                    make_expr_id(ctx, t3),
+                    type_ptr(ctx, type_int()))));
+            add_stmt(ctx, stmt);
+
+            stmt = make_stmt_expr(ctx, make_expr_binary(ctx,
+                EXPR_ASSIGN,
+                make_expr_id(ctx, t2),
+                make_expr_cast(ctx,
+                    make_expr_id(ctx, t4),
+                    type_ptr(ctx, type_int()))));
+            add_stmt(ctx, stmt);
+
+            assert(lt->size % 4 == 0);
+            for(i = 0;
+                i < lt->size/4;
+                ++i)
             {
-                semantic_fatal("invalid global declaration");
-            } break;
-        }
-        decl = decl->next;
-    }
+                stmt = make_stmt_expr(ctx, make_expr_binary(ctx,
+                    EXPR_ASSIGN,
+                    make_expr_unary(ctx, EXPR_DEREF, make_expr_id(ctx, t1)),
+                    make_expr_unary(ctx, EXPR_DEREF, make_expr_id(ctx, t2))));
+                add_stmt(ctx, stmt);
 
-    return(irc_unit);
-}
+                stmt = make_stmt_expr(ctx, make_expr_binary(ctx,
+                    EXPR_ASSIGN,
+                    make_expr_id(ctx, t3),
+                    make_expr_binary(ctx,
+                        EXPR_ADD,
+                        make_expr_id(ctx, t3),
+                        make_expr_intlit(ctx, 4))));
+                add_stmt(ctx, stmt);
 
-/******************************************************************************/
-/**                               CODE GEN                                   **/
-/******************************************************************************/
+                stmt = make_stmt_expr(ctx, make_expr_binary(ctx,
+                    EXPR_ASSIGN,
+                    make_expr_id(ctx, t4),
+                    make_expr_binary(ctx,
+                        EXPR_ADD,
+                        make_expr_id(ctx, t4),
+                        make_expr_intlit(ctx, 4))));
+                add_stmt(ctx, stmt);
+                
+                stmt = make_stmt_expr(ctx, make_expr_binary(ctx,
+                    EXPR_ASSIGN,
+                    make_expr_id(ctx, t1),
+                    make_expr_cast(ctx,
+                        make_expr_id(ctx, t3),
+                        type_ptr(ctx, type_int()))));
+                add_stmt(ctx, stmt);
 
-#include <assert.h>
+                stmt = make_stmt_expr(ctx, make_expr_binary(ctx,
+                    EXPR_ASSIGN,
+                    make_expr_id(ctx, t2),
+                    make_expr_cast(ctx,
+                        make_expr_id(ctx, t4),
+                        type_ptr(ctx, type_int()))));
+                add_stmt(ctx, stmt);
+            }
+        }
+        else
+        {
+            l = reduce_expr_to_atom(ctx, expr->l);
+            r = reduce_expr_to_atom(ctx, expr->r);
+            final = make_expr_binary(ctx, expr->kind, l, r);
+        }
+    }
+    else if(expr->kind == EXPR_COMPOUND)
+    {
+        l = expr->l;
+        while(l)
+        {
+            expr_to_irc(ctx, l);
+            l = l->next;
+        }
+    }
+    else
+    {
+        fatal(ctx, "Invalid expression to lower");
+    }
 
-void compile_expr(FILE *fout, Expr *expr);
+    if(final)
+    {
+        stmt = make_stmt(ctx, STMT_EXPR);
+        stmt->u.expr = final;
+        add_stmt(ctx, stmt);
+    }
+}
 
 void
-compile_lvalue(FILE *fout, Expr *expr)
+stmt_to_irc(EzcCtx *ctx, Stmt *stmt)
 {
+    Stmt *irc_stmt;
     Sym *sym;
 
-    switch(expr->kind)
+    Expr *cond;
+    char *lbl1;
+    char *lbl2;
+    char *lbl3;
+
+    switch(stmt->kind)
     {
-        case EXPR_ID:
+        case STMT_DECL:
         {
-            sym = sym_get(expr->id);
-            if(!sym)
-            {
-                fatal("Invalid symbol %s", expr->id);
-            }
+            irc_stmt = dup_stmt(ctx, stmt);
+            irc_stmt->next = 0;
+            add_stmt(ctx, irc_stmt);
 
-            if(sym->global)
-            {
-                fprintf(fout, "\tmovl %s,%%eax\n", sym->id);
-            }
-            else
-            {
-                fprintf(fout, "\tmovl %%ebp,%%eax\n");
-                fprintf(fout, "\taddl $%d,%%eax\n", sym->offset);
-            }
+            sym = sym_add(ctx, stmt->u.decl->id, stmt->u.decl->type);
+            sym->global = 0;
+            ctx->func_var_offset -= stmt->u.decl->type->size;
+            sym->offset = ctx->func_var_offset;
         } break;
 
-        case EXPR_DEREF:
+        case STMT_EXPR:
         {
-            compile_lvalue(fout, expr->l);
-            fprintf(fout, "\tmovl (%%eax),%%eax\n");
+            expr_to_irc(ctx, stmt->u.expr);
         } break;
 
-        default:
+        case STMT_BLOCK:
         {
-            assert(0);
+            block_to_irc(ctx, stmt);
         } break;
-    }
-}
 
-void
-compile_expr(FILE *fout, Expr *expr)
-{
-    Sym *sym = 0;
-    Expr *arg;
-    FuncParam *param;
-    int argc;
-    int params_size;
-    Type *type;
-    char *ins;
-    char *lbl1, *lbl2;
-
-    ins = 0;
-    switch(expr->kind)
-    {
-        case EXPR_INTLIT:
-        {
-            fprintf(fout, "\tmovl $%d,%%eax\n", expr->value);
-        } break;
-
-        case EXPR_ID:
-        {
-            sym = sym_get(expr->id);
-            if(!sym)
-            {
-                fatal("Invalid symbol %s", expr->id);
-            }
-
-            type = resolve_expr_type(expr, 0);
-            if(type->size == 1)
-            {
-                ins = "movzbl";
-            }
-            else if(type->size == 2)
-            {
-                ins = "movzwl";
-            }
-            else if(type->size == 4)
-            {
-                ins = "movl";
-            }
-            else
-            {
-                assert(0);
-            }
-
-            if(sym->type->kind == TYPE_ARRAY)
-            {
-                compile_lvalue(fout, expr);
-            }
-            else if(sym->global)
-            {
-                fprintf(fout, "\tmovl %s,%%ebx\n", sym->id);
-                fprintf(fout, "\t%s (%%ebx),%%eax\n", ins);
-            }
-            else
-            {
-                fprintf(fout, "\t%s %d(%%ebp),%%eax\n", ins, sym->offset);
-            }
-        } break;
-
-        case EXPR_CALL:
+        case STMT_RET:
         {
-            if(expr->l->kind == EXPR_ID)
+            irc_stmt = make_stmt(ctx, STMT_RET);
+            irc_stmt->next = 0;
+            if(stmt->u.expr)
             {
-                sym = sym_get(expr->l->id);
-                if(!sym)
-                {
-                    fatal("Invalid symbol %s", expr->l->id);
-                }
-
-                assert(sym->type->kind == TYPE_FUNC);
-
-                argc = 0;
-                arg = expr->r;
-                params_size = 0;
-                param = sym->type->params;
-                while(arg)
+                if(expr_is_atom(stmt->u.expr))
                 {
-                    ++argc;
-                    compile_expr(fout, arg);
-                    /* TODO: Push based on args sizes */
-                    fprintf(fout, "\tpushl %%eax\n");
-                    params_size += ALIGN(param->type->size, 4);
-                    arg = arg->next;
-                    param = param->next;
+                    irc_stmt->u.expr = dup_expr(ctx, stmt->u.expr);
                 }
-
-                fprintf(fout, "\tcall %s\n", expr->l->id);
-
-                while(argc > 0)
+                else
                 {
-                    fprintf(fout, "\taddl $%d,%%esp\n", params_size);
-                    --argc;
+                    irc_stmt->u.expr = reduce_expr_to_atom(ctx, stmt->u.expr);
                 }
             }
             else
             {
-                fatal("We don't handle \"complex\" function calls");
+                irc_stmt->u.expr = 0;
             }
+            add_stmt(ctx, irc_stmt);
         } break;
 
-        case EXPR_DEREF:
+        case STMT_LABEL:
         {
-            compile_expr(fout, expr->l);
-            fprintf(fout, "\tmovl (%%eax),%%eax\n");
+            irc_stmt = dup_stmt(ctx, stmt);
+            irc_stmt->next = 0;
+            add_stmt(ctx, irc_stmt);
         } break;
 
-        case EXPR_ADDR_OF:
+        case STMT_GOTO:
         {
-            compile_lvalue(fout, expr->l);
+            irc_stmt = dup_stmt(ctx, stmt);
+            irc_stmt->next = 0;
+            add_stmt(ctx, irc_stmt);
         } break;
 
-        case EXPR_NEG:
+        case STMT_IF:
         {
-            compile_expr(fout, expr->l);
-            fprintf(fout, "\tnegl %%eax\n");
-        } break;
+            lbl1 = lbl_gen(ctx);
+            lbl2 = lbl_gen(ctx);
+            if(stmt->else_stmt)
+            {
+                lbl3 = lbl_gen(ctx);
+            }
 
-        case EXPR_CAST:
-        {
-            type = resolve_expr_type(expr->l, 0);
-            if(type->size >= expr->cast_to->size)
+            cond = reduce_expr_to_atom(ctx, stmt->cond);
+
+            irc_stmt = make_stmt_if(ctx, cond, 0, 0);
+            irc_stmt->u.label = lbl1;
+            add_stmt(ctx, irc_stmt);
+
+            irc_stmt = make_stmt(ctx, STMT_GOTO);
+            irc_stmt->u.label = lbl2;
+            irc_stmt->next = 0;
+            add_stmt(ctx, irc_stmt);
+
+            irc_stmt = make_stmt(ctx, STMT_LABEL);
+            irc_stmt->u.label = lbl1;
+            irc_stmt->next = 0;
+            add_stmt(ctx, irc_stmt);
+
+            stmt_to_irc(ctx, stmt->then_stmt);
+
+            irc_stmt = make_stmt(ctx, STMT_GOTO);
+            if(stmt->else_stmt)
             {
-                /* Nothing */
+                irc_stmt->u.label = lbl3;
             }
-            else if(type->size < expr->cast_to->size)
+            else
             {
-                if(type->size == 1 && expr->cast_to->size == 2)
-                {
-                    ins = "movzbw";
-                }
-                else if(type->size == 1 && expr->cast_to->size == 4)
-                {
-                    ins = "movzbl";
-                }
-                else if(type->size == 2 && expr->cast_to->size == 4)
-                {
-                    ins = "movzwl";
-                }
-                else
-                {
-                    assert(0);
-                }
+                irc_stmt->u.label = lbl2;
             }
+            irc_stmt->next = 0;
+            add_stmt(ctx, irc_stmt);
 
-            compile_expr(fout, expr->l);
-            if(ins)
+            irc_stmt = make_stmt(ctx, STMT_LABEL);
+            irc_stmt->u.label = lbl2;
+            irc_stmt->next = 0;
+            add_stmt(ctx, irc_stmt);
+
+            if(stmt->else_stmt)
             {
-                fprintf(fout, "\t%s %%eax,%%eax\n", ins);
+                stmt_to_irc(ctx, stmt->else_stmt);
+
+                irc_stmt = make_stmt(ctx, STMT_LABEL);
+                irc_stmt->u.label = lbl3;
+                irc_stmt->next = 0;
+                add_stmt(ctx, irc_stmt);
             }
         } break;
 
-        case EXPR_MUL:
+        case STMT_WHILE:
         {
-            compile_expr(fout, expr->r);
-            fprintf(fout, "\tmovl %%eax,%%ecx\n");
-            compile_expr(fout, expr->l);
-            fprintf(fout, "\timull %%ecx\n");
-        } break;
+            lbl1 = lbl_gen(ctx);
+            lbl2 = lbl_gen(ctx);
+            lbl3 = lbl_gen(ctx);
 
-        case EXPR_DIV:
-        {
-            compile_expr(fout, expr->r);
-            fprintf(fout, "\tmovl %%eax,%%ecx\n");
-            compile_expr(fout, expr->l);
-            fprintf(fout, "\tcltd\n");
-            fprintf(fout, "\tidivl %%ecx\n");
-        } break;
+            irc_stmt = make_stmt(ctx, STMT_LABEL);
+            irc_stmt->u.label = lbl1;
+            irc_stmt->next = 0;
+            add_stmt(ctx, irc_stmt);
 
-        case EXPR_ADD:
-        {
-            compile_expr(fout, expr->r);
-            fprintf(fout, "\tmovl %%eax,%%ecx\n");
-            compile_expr(fout, expr->l);
-            fprintf(fout, "\taddl %%ecx,%%eax\n");
-        } break;
+            cond = reduce_expr_to_atom(ctx, stmt->cond);
 
-        case EXPR_SUB:
-        {
-            compile_expr(fout, expr->r);
-            fprintf(fout, "\tmovl %%eax,%%ecx\n");
-            compile_expr(fout, expr->l);
-            fprintf(fout, "\tsubl %%ecx,%%eax\n");
-        } break;
+            irc_stmt = make_stmt_if(ctx, cond, 0, 0);
+            irc_stmt->u.label = lbl2;
+            add_stmt(ctx, irc_stmt);
 
-        case EXPR_LT:
-        case EXPR_LE:
-        case EXPR_GT:
-        case EXPR_GE:
-        {
-            if(expr->kind == EXPR_LT)
-            {
-                ins = "jl";
-            }
-            else if(expr->kind == EXPR_LE)
-            {
-                ins = "jle";
-            }
-            else if(expr->kind == EXPR_GT)
-            {
-                ins = "jg";
-            }
-            else if(expr->kind == EXPR_GE)
-            {
-                ins = "jge";
-            }
+            irc_stmt = make_stmt(ctx, STMT_GOTO);
+            irc_stmt->u.label = lbl3;
+            irc_stmt->next = 0;
+            add_stmt(ctx, irc_stmt);
+
+            irc_stmt = make_stmt(ctx, STMT_LABEL);
+            irc_stmt->u.label = lbl2;
+            irc_stmt->next = 0;
+            add_stmt(ctx, irc_stmt);
 
-            assert(ins);
+            stmt_to_irc(ctx, stmt->then_stmt);
 
-            lbl1 = lbl_gen();
-            lbl2 = lbl_gen();
+            irc_stmt = make_stmt(ctx, STMT_GOTO);
+            irc_stmt->u.label = lbl1;
+            irc_stmt->next = 0;
+            add_stmt(ctx, irc_stmt);
 
-            compile_expr(fout, expr->r);
-            fprintf(fout, "\tmovl %%eax,%%ecx\n");
-            compile_expr(fout, expr->l);
-            fprintf(fout, "\tcmpl %%ecx,%%eax\n");
-            fprintf(fout, "\t%s %s\n", ins, lbl1);
-            fprintf(fout, "\tmovl $0,%%eax\n");
-            fprintf(fout, "\tjmp %s\n", lbl2);
-            fprintf(fout, "%s:\n", lbl1);
-            fprintf(fout, "\tmovl $1,%%eax\n");
-            fprintf(fout, "%s:\n", lbl2);
+            irc_stmt = make_stmt(ctx, STMT_LABEL);
+            irc_stmt->u.label = lbl3;
+            irc_stmt->next = 0;
+            add_stmt(ctx, irc_stmt);
         } break;
 
-        case EXPR_ASSIGN:
+        case STMT_FOR:
         {
-            type = resolve_expr_type(expr, 0);
-            if(type->size == 1)
-            {
-                ins = "movb";
-            }
-            else if(type->size == 2)
-            {
-                ins = "movw";
-            }
-            else if(type->size == 4)
-            {
-                ins = "movl";
-            }
-            else
-            {
-                assert(0);
-            }
+            lbl1 = lbl_gen(ctx);
+            lbl2 = lbl_gen(ctx);
+            lbl3 = lbl_gen(ctx);
 
-            compile_expr(fout, expr->r);
-            fprintf(fout, "\tmovl %%eax,%%ecx\n");
-            compile_lvalue(fout, expr->l);
-            fprintf(fout, "\t%s %%ecx,(%%eax)\n", ins);
-        } break;
+            expr_to_irc(ctx, stmt->init);
 
-        case EXPR_COMPOUND:
-        {
-            arg = expr->l;
-            while(arg)
-            {
-                compile_expr(fout, arg);
-                arg = arg->next;
-            }
+            irc_stmt = make_stmt(ctx, STMT_LABEL);
+            irc_stmt->u.label = lbl1;
+            irc_stmt->next = 0;
+            add_stmt(ctx, irc_stmt);
+
+            cond = reduce_expr_to_atom(ctx, stmt->cond);
+
+            irc_stmt = make_stmt_if(ctx, cond, 0, 0);
+            irc_stmt->u.label = lbl2;
+            add_stmt(ctx, irc_stmt);
+
+            irc_stmt = make_stmt(ctx, STMT_GOTO);
+            irc_stmt->u.label = lbl3;
+            irc_stmt->next = 0;
+            add_stmt(ctx, irc_stmt);
+
+            irc_stmt = make_stmt(ctx, STMT_LABEL);
+            irc_stmt->u.label = lbl2;
+            irc_stmt->next = 0;
+            add_stmt(ctx, irc_stmt);
+
+            stmt_to_irc(ctx, stmt->then_stmt);
+
+            expr_to_irc(ctx, stmt->post);
+
+            irc_stmt = make_stmt(ctx, STMT_GOTO);
+            irc_stmt->u.label = lbl1;
+            irc_stmt->next = 0;
+            add_stmt(ctx, irc_stmt);
+
+            irc_stmt = make_stmt(ctx, STMT_LABEL);
+            irc_stmt->u.label = lbl3;
+            irc_stmt->next = 0;
+            add_stmt(ctx, irc_stmt);
         } break;
 
         default:
         {
-            assert(0);
+            fatal(ctx, "Invalid statement to lower");
         } break;
     }
+
+    tmp_vars_free(ctx);
+}
+
+void
+block_to_irc(EzcCtx *ctx, Stmt *block)
+{
+    Stmt *stmt;
+    int tmp_vars_old_count;
+
+    tmp_vars_old_count = ctx->tmp_vars_pool_count;
+    stmt = block->u.block;
+    while(stmt)
+    {
+        stmt_to_irc(ctx, stmt);
+        stmt = stmt->next;
+    }
+    ctx->tmp_vars_pool_count = tmp_vars_old_count;
+}
+
+Stmt *
+func_def_to_irc(EzcCtx *ctx, Stmt *block)
+{
+    Stmt *irc_block;
+    Stmt *stmt;
+    Stmt *parent_block;
+    Stmt *parent_block_last;
+    int tmp_vars_old_count;
+
+    tmp_vars_old_count = ctx->tmp_vars_pool_count;
+    irc_block = make_stmt(ctx, STMT_BLOCK);
+    irc_block->u.block = 0;
+    parent_block = ctx->curr_block;
+    parent_block_last = ctx->curr_block_last;
+    ctx->curr_block = irc_block;
+    ctx->curr_block_last = 0;
+    stmt = block->u.block;
+    while(stmt)
+    {
+        stmt_to_irc(ctx, stmt);
+        stmt = stmt->next;
+    }
+
+    ctx->curr_block = parent_block;
+    ctx->curr_block_last = parent_block_last;
+    ctx->tmp_vars_pool_count = tmp_vars_old_count;
+
+    return(irc_block);
+}
+
+GlobDecl *
+unit_to_irc(EzcCtx *ctx, GlobDecl *unit)
+{
+    GlobDecl *irc_unit;
+    GlobDecl *irc_curr;
+    GlobDecl *decl;
+    Sym *sym;
+    int offset;
+    int sym_count;
+    FuncParam *param;
+
+    sym_reset(ctx);
+    tmp_vars_pool_reset(ctx);
+
+    irc_unit = 0;
+    irc_curr = 0;
+    decl = unit;
+    while(decl)
+    {
+        if(irc_unit)
+        {
+            irc_curr->next = DUP_OBJ(GlobDecl, irc_curr->next, decl);
+            irc_curr = irc_curr->next;
+        }
+        else
+        {
+            irc_unit = DUP_OBJ(GlobDecl, irc_unit, decl);
+            irc_curr = irc_unit;
+        }
+        irc_curr->next = 0;
+
+        switch(decl->kind)
+        {
+            case GLOB_DECL_VAR:
+            {
+                sym = sym_add(ctx, decl->id, decl->type);
+                sym->global = 1;
+            } break;
+
+            case GLOB_DECL_FUNC:
+            {
+                sym = sym_add(ctx, decl->id, decl->type);
+                sym->global = 1;
+                sym->regparm = decl->regparm;
+
+                sym_count = ctx->sym_table_count;
+                param = decl->params;
+                offset = 8;
+                while(param)
+                {
+                    sym_add_func_param(ctx, param->id, param->type, offset);
+                    offset += ALIGN(param->type->size, 4);
+                    param = param->next;
+                }
+
+                if(decl->func_def)
+                {
+                    irc_curr->func_def = func_def_to_irc(ctx, decl->func_def);
+                }
+
+                sym_pop(ctx, sym_count);
+            } break;
+
+            default:
+            {
+                semantic_fatal(ctx, "invalid global declaration");
+            } break;
+        }
+        decl = decl->next;
+    }
+
+    return(irc_unit);
+}
+
+/******************************************************************************/
+/**                               CODE GEN                                   **/
+/******************************************************************************/
+
+/*
+ * The assembler is linked in: the code generation appends its lines (an
+ * opcode table entry and the operands) to a struct Asm, which is then
+ * either laid out into the executable or printed as text (-S).
+ */
+#define ASMORG_API
+#include "asmorg.c"
+
+#include <assert.h>
+
+/*
+ * Register allocation
+ *
+ * A linear scan over the IR-C of a function. The statements are numbered
+ * in order (the parameters are defined at 0) and every int or pointer
+ * local whose address is never taken gets a live interval from its first
+ * to its last mention. An interval overlapping a loop (a jump back to an
+ * earlier label) is stretched over the whole loop if the local is declared
+ * before it, since its value has to survive the back edge; one declared
+ * inside is indeterminate again at each iteration, as the IR-C temporaries
+ * of the loop are. %esi and %edi are saved by the function; %edx is
+ * only given to an interval without calls, multiplications or divisions.
+ * When every register is taken the interval with the lowest weight (its
+ * uses, each counting 8 times more per enclosing loop) is spilled: the
+ * local just stays in its frame slot.
+ */
+
+struct
+RegLive
+{
+    int *reg;       /* Where the result goes (null if not allocatable) */
+    int decl;
+    int start;
+    int end;
+    int weight;
+    int clobbered;
+    int order;
+    int assigned;
+};
+
+enum
+{
+    REG_MARK_LABEL,
+    REG_MARK_JUMP,
+    REG_MARK_CLOBBER,
+    REG_MARK_USE
+};
+
+struct
+RegMark
+{
+    int kind;
+    char *label;
+    int live;
+    int pos;
+};
+
+typedef struct
+RegLoop
+{
+    int start;
+    int end;
+} RegLoop;
+
+#define REG_ALLOC_COUNT 3
+int reg_alloc_order[REG_ALLOC_COUNT] = { REG_EDX, REG_ESI, REG_EDI };
+
+void
+regalloc_live(EzcCtx *ctx, Sym *sym, int *reg, int pos)
+{
+    RegLive *lives;
+    RegLive *live;
+
+    *reg = -1;
+    if(sym->type->kind != TYPE_INT && sym->type->kind != TYPE_PTR)
+    {
+        return;
+    }
+
+    if(ctx->reg_lives_count == ctx->reg_lives_cap)
+    {
+        ctx->reg_lives_cap = ctx->reg_lives_cap ? 2*ctx->reg_lives_cap : 64;
+        lives = (RegLive *)realloc(ctx->reg_lives, ctx->reg_lives_cap*sizeof(RegLive));
+        if(!lives)
+        {
+            fatal(ctx, "Cannot allocate memory for the register allocator");
+        }
+        ctx->reg_lives = lives;
+    }
+
+    live = &(ctx->reg_lives[ctx->reg_lives_count]);
+    live->reg = reg;
+    live->decl = pos;
+    live->start = -1;
+    live->end = -1;
+    live->weight = 0;
+    live->clobbered = 0;
+    live->order = ctx->reg_lives_count;
+    live->assigned = -1;
+    sym->live = ctx->reg_lives_count;
+    ++ctx->reg_lives_count;
+}
+
+void
+regalloc_mark(EzcCtx *ctx, int kind, char *label, int live, int pos)
+{
+    RegMark *marks;
+    RegMark *mark;
+
+    if(ctx->reg_marks_count == ctx->reg_marks_cap)
+    {
+        ctx->reg_marks_cap = ctx->reg_marks_cap ? 2*ctx->reg_marks_cap : 64;
+        marks = (RegMark *)realloc(ctx->reg_marks, ctx->reg_marks_cap*sizeof(RegMark));
+        if(!marks)
+        {
+            fatal(ctx, "Cannot allocate memory for the register allocator");
+        }
+        ctx->reg_marks = marks;
+    }
+
+    mark = &(ctx->reg_marks[ctx->reg_marks_count]);
+    mark->kind = kind;
+    mark->label = label;
+    mark->live = live;
+    mark->pos = pos;
+    ++ctx->reg_marks_count;
+}
+
+void
+regalloc_expr(EzcCtx *ctx, Expr *expr, int pos)
+{
+    Sym *sym;
+    RegLive *live;
+    Expr *arg;
+
+    switch(expr->kind)
+    {
+        case EXPR_ID:
+        {
+            sym = sym_get(ctx, expr->id);
+            if(sym && sym->live >= 0)
+            {
+                live = &(ctx->reg_lives[sym->live]);
+                if(live->start < 0)
+                {
+                    live->start = pos;
+                }
+                live->end = pos;
+                regalloc_mark(ctx, REG_MARK_USE, 0, sym->live, pos);
+            }
+        } break;
+
+        case EXPR_ADDR_OF:
+        {
+            if(expr->l->kind == EXPR_ID)
+            {
+                sym = sym_get(ctx, expr->l->id);
+                if(sym && sym->live >= 0)
+                {
+                    ctx->reg_lives[sym->live].reg = 0;
+                    sym->live = -1;
+                }
+            }
+            else
+            {
+                regalloc_expr(ctx, expr->l, pos);
+            }
+        } break;
+
+        case EXPR_CALL:
+        {
+            regalloc_mark(ctx, REG_MARK_CLOBBER, 0, -1, pos);
+            arg = expr->r;
+            while(arg)
+            {
+                regalloc_expr(ctx, arg, pos);
+                arg = arg->next;
+            }
+        } break;
+
+        case EXPR_COMPOUND:
+        {
+            arg = expr->l;
+            while(arg)
+            {
+                regalloc_expr(ctx, arg, pos);
+                arg = arg->next;
+            }
+        } break;
+
+        case EXPR_DEREF:
+        case EXPR_NEG:
+        case EXPR_CAST:
+        {
+            regalloc_expr(ctx, expr->l, pos);
+        } break;
+
+        case EXPR_MUL:
+        case EXPR_DIV:
+        case EXPR_ADD:
+        case EXPR_SUB:
+        case EXPR_LT:
+        case EXPR_LE:
+        case EXPR_GT:
+        case EXPR_GE:
+        case EXPR_ASSIGN:
+        {
+            if(expr->kind == EXPR_MUL || expr->kind == EXPR_DIV)
+            {
+                regalloc_mark(ctx, REG_MARK_CLOBBER, 0, -1, pos);
+            }
+            regalloc_expr(ctx, expr->l, pos);
+            regalloc_expr(ctx, expr->r, pos);
+        } break;
+
+        default:
+        {
+            /* Nothing */
+        } break;
+    }
+}
+
+/* Numbers the statements from pos on, returns the next position */
+int
+regalloc_stmt(EzcCtx *ctx, Stmt *stmt, int pos)
+{
+    int scope;
+    Stmt *substmt;
+    Sym *sym;
+
+    switch(stmt->kind)
+    {
+        case STMT_DECL:
+        {
+            sym = sym_add(ctx, stmt->u.decl->id, stmt->u.decl->type);
+            regalloc_live(ctx, sym, &(stmt->u.decl->reg), pos);
+        } break;
+
+        case STMT_EXPR:
+        {
+            regalloc_expr(ctx, stmt->u.expr, pos);
+        } break;
+
+        case STMT_BLOCK:
+        {
+            scope = ctx->sym_table_count;
+            substmt = stmt->u.block;
+            while(substmt)
+            {
+                pos = regalloc_stmt(ctx, substmt, pos);
+                substmt = substmt->next;
+            }
+            sym_pop(ctx, scope);
+        } break;
+
+        case STMT_RET:
+        {
+            if(stmt->u.expr)
+            {
+                regalloc_expr(ctx, stmt->u.expr, pos);
+            }
+        } break;
+
+        case STMT_LABEL:
+        {
+            regalloc_mark(ctx, REG_MARK_LABEL, stmt->u.label, -1, pos);
+        } break;
+
+        case STMT_GOTO:
+        {
+            regalloc_mark(ctx, REG_MARK_JUMP, stmt->u.label, -1, pos);
+        } break;
+
+        case STMT_IF:
+        {
+            regalloc_expr(ctx, stmt->cond, pos);
+            regalloc_mark(ctx, REG_MARK_JUMP, stmt->u.label, -1, pos);
+        } break;
+
+        default:
+        {
+            /* Nothing */
+        } break;
+    }
+
+    return(pos + 1);
+}
+
+int
+regalloc_live_cmp(const void *a, const void *b)
+{
+    int res;
+
+    res = ((RegLive *)a)->start - ((RegLive *)b)->start;
+    if(res == 0)
+    {
+        res = ((RegLive *)a)->order - ((RegLive *)b)->order;
+    }
+
+    return(res);
+}
+
+/*
+ * Allocates the registers of a function: sets the reg of the Decls of its
+ * locals, returns those of its parameters (in order) and sets func_regs
+ * to the callee-saved registers it uses.
+ */
+int *
+regalloc_func(EzcCtx *ctx, GlobDecl *decl)
+{
+    int *res;
+    int sym_count;
+    FuncParam *param;
+    int params_count;
+    int *labels;
+    int labels_cap;
+    RegLoop *loops;
+    int loops_count;
+    int *clobbers;
+    int clobbers_count;
+    int *depth;
+    int pos_count;
+    RegMark *mark;
+    RegLive *live;
+    int active[REG_COUNT];
+    int victim;
+    int reg;
+    int changed;
+    int i, j, k;
+
+    ctx->reg_lives_count = 0;
+    ctx->reg_marks_count = 0;
+    ctx->func_regs = 0;
+
+    params_count = 0;
+    param = decl->params;
+    while(param)
+    {
+        ++params_count;
+        param = param->next;
+    }
+    res = (int *)arena_alloc(ctx, ctx->arena, (params_count + 1)*sizeof(int));
+
+    /* Live intervals */
+    sym_count = ctx->sym_table_count;
+    param = decl->params;
+    i = 0;
+    while(param)
+    {
+        regalloc_live(ctx, sym_add(ctx, param->id, param->type), &(res[i]), 0);
+        param = param->next;
+        ++i;
+    }
+    pos_count = regalloc_stmt(ctx, decl->func_def, 1);
+    sym_pop(ctx, sym_count);
+
+    /* Loops (the back edges) and clobbers */
+    labels_cap = 16;
+    while(labels_cap < 2*ctx->reg_marks_count)
+    {
+        labels_cap *= 2;
+    }
+    labels = (int *)arena_alloc(ctx, ctx->arena, labels_cap*sizeof(int));
+    memset(labels, 0, labels_cap*sizeof(int));
+    loops = (RegLoop *)arena_alloc(ctx, ctx->arena, (ctx->reg_marks_count + 1)*sizeof(RegLoop));
+    loops_count = 0;
+    clobbers = (int *)arena_alloc(ctx, ctx->arena, (ctx->reg_marks_count + 1)*sizeof(int));
+    clobbers_count = 0;
+    for(i = 0;
+        i < ctx->reg_marks_count;
+        ++i)
+    {
+        mark = &(ctx->reg_marks[i]);
+        if(mark->kind == REG_MARK_CLOBBER)
+        {
+            clobbers[clobbers_count++] = mark->pos;
+            continue;
+        }
+        else if(mark->kind == REG_MARK_USE)
+        {
+            continue;
+        }
+
+        j = str_intern_hash(mark->label) & (labels_cap - 1);
+        while(labels[j] && ctx->reg_marks[labels[j] - 1].label != mark->label)
+        {
+            j = (j + 1) & (labels_cap - 1);
+        }
+
+        if(mark->kind == REG_MARK_LABEL)
+        {
+            labels[j] = i + 1;
+        }
+        else if(labels[j])
+        {
+            loops[loops_count].start = ctx->reg_marks[labels[j] - 1].pos;
+            loops[loops_count].end = mark->pos;
+            ++loops_count;
+        }
+    }
+
+    /* Weights: the loop depth of each position, then the uses */
+    depth = (int *)arena_alloc(ctx, ctx->arena, (pos_count + 1)*sizeof(int));
+    memset(depth, 0, (pos_count + 1)*sizeof(int));
+    for(k = 0;
+        k < loops_count;
+        ++k)
+    {
+        ++depth[loops[k].start];
+        --depth[loops[k].end + 1];
+    }
+    for(i = 1;
+        i <= pos_count;
+        ++i)
+    {
+        depth[i] += depth[i - 1];
+    }
+    for(i = 0;
+        i < ctx->reg_marks_count;
+        ++i)
+    {
+        mark = &(ctx->reg_marks[i]);
+        if(mark->kind == REG_MARK_USE)
+        {
+            j = depth[mark->pos] < 4 ? depth[mark->pos] : 4;
+            ctx->reg_lives[mark->live].weight += 1 << (3*j);
+        }
+    }
+
+    /* Intervals stretched over the loops and checked for clobbers */
+    for(i = 0;
+        i < ctx->reg_lives_count;
+        ++i)
+    {
+        live = &(ctx->reg_lives[i]);
+        if(!live->reg || live->weight == 0)
+        {
+            live->reg = 0;
+            continue;
+        }
+
+        /* The parameters are defined on entry */
+        if(live->decl == 0)
+        {
+            live->start = 0;
+        }
+
+        /* Stretching over a loop can make it overlap another one */
+        do
+        {
+            changed = 0;
+            for(k = 0;
+                k < loops_count;
+                ++k)
+            {
+                if(live->decl < loops[k].start &&
+                   live->start <= loops[k].end && live->end >= loops[k].start &&
+                   (live->start > loops[k].start || live->end < loops[k].end))
+                {
+                    if(loops[k].start < live->start)
+                    {
+                        live->start = loops[k].start;
+                    }
+                    if(loops[k].end > live->end)
+                    {
+                        live->end = loops[k].end;
+                    }
+                    changed = 1;
+                }
+            }
+        } while(changed);
+
+        for(k = 0;
+            k < clobbers_count && clobbers[k] <= live->end;
+            ++k)
+        {
+            if(clobbers[k] >= live->start)
+            {
+                live->clobbered = 1;
+                break;
+            }
+        }
+    }
+
+    /* Linear scan (reg_lives is null until a function has a candidate) */
+    if(ctx->reg_lives_count > 1)
+    {
+        qsort(ctx->reg_lives, ctx->reg_lives_count, sizeof(RegLive), regalloc_live_cmp);
+    }
+    for(i = 0;
+        i < REG_COUNT;
+        ++i)
+    {
+        active[i] = -1;
+    }
+    for(i = 0;
+        i < ctx->reg_lives_count;
+        ++i)
+    {
+        live = &(ctx->reg_lives[i]);
+        if(!live->reg)
+        {
+            continue;
+        }
+
+        for(j = 0;
+            j < REG_COUNT;
+            ++j)
+        {
+            if(active[j] >= 0 && ctx->reg_lives[active[j]].end < live->start)
+            {
+                active[j] = -1;
+            }
+        }
+
+        reg = -1;
+        victim = i;
+        for(j = 0;
+            j < REG_ALLOC_COUNT;
+            ++j)
+        {
+            k = reg_alloc_order[j];
+            if(k == REG_EDX && live->clobbered)
+            {
+                continue;
+            }
+
+            if(active[k] < 0)
+            {
+                reg = k;
+                victim = -1;
+                break;
+            }
+
+            if(ctx->reg_lives[active[k]].weight < ctx->reg_lives[victim].weight)
+            {
+                reg = k;
+                victim = active[k];
+            }
+        }
+
+        if(victim == i)
+        {
+            continue;
+        }
+        if(victim >= 0)
+        {
+            ctx->reg_lives[victim].assigned = -1;
+        }
+        active[reg] = i;
+        live->assigned = reg;
+    }
+
+    for(i = 0;
+        i < ctx->reg_lives_count;
+        ++i)
+    {
+        live = &(ctx->reg_lives[i]);
+        if(live->reg)
+        {
+            *live->reg = live->assigned;
+            if(live->assigned == REG_ESI || live->assigned == REG_EDI)
+            {
+                ctx->func_regs |= 1 << live->assigned;
+            }
+        }
+    }
+
+    return(res);
+}
+
+void compile_expr(EzcCtx *ctx, struct Asm *as, Expr *expr);
+
+void
+compile_lvalue(EzcCtx *ctx, struct Asm *as, Expr *expr)
+{
+    Sym *sym;
+
+    switch(expr->kind)
+    {
+        case EXPR_ID:
+        {
+            sym = sym_get(ctx, expr->id);
+            if(!sym)
+            {
+                fatal(ctx, "Invalid symbol %s", expr->id);
+            }
+
+            if(sym->reg >= 0)
+            {
+                fatal(ctx, "Cannot take the address of '%s'", expr->id);
+            }
+            if(sym->global)
+            {
+                asmins2(as, "movl", oplbl(as, sym->id), opreg(REG_EAX));
+            }
+            else
+            {
+                asmins2(as, "movl", opreg(REG_EBP), opreg(REG_EAX));
+                asmins2(as, "addl", opimm(sym->offset), opreg(REG_EAX));
+            }
+        } break;
+
+        case EXPR_DEREF:
+        {
+            sym = 0;
+            if(expr->l->kind == EXPR_ID)
+            {
+                sym = sym_get(ctx, expr->l->id);
+            }
+
+            if(sym && sym->reg >= 0)
+            {
+                asmins2(as, "movl", opreg(sym->reg), opreg(REG_EAX));
+            }
+            else
+            {
+                compile_lvalue(ctx, as, expr->l);
+                asmins2(as, "movl", opind(REG_EAX, 0), opreg(REG_EAX));
+            }
+        } break;
+
+        default:
+        {
+            fatal(ctx, "Invalid lvalue");
+        } break;
+    }
+}
+
+/*
+ * Calling convention. Arguments are pushed from the last one, so the first
+ * one is at 8(%ebp) in the callee, and the caller pops them. A function
+ * with regparm n (the regparm attribute, or -mregparm for every function
+ * defined in the unit) takes instead its first n arguments in %eax, %edx
+ * and %ecx, as GCC's regparm does, as long as they fit in 4 bytes. Its
+ * other arguments are still pushed.
+ */
+
+int regparm_regs[REGPARM_MAX] = { REG_EAX, REG_EDX, REG_ECX };
+
+/* Register of argument i of a function (-1 if it is on the stack) */
+int
+param_reg(int regparm, int i, Type *type)
+{
+    if(i >= regparm ||
+       (type->kind != TYPE_CHAR && type->kind != TYPE_INT &&
+        type->kind != TYPE_PTR))
+    {
+        return(-1);
+    }
+
+    return(regparm_regs[i]);
+}
+
+/*
+ * The arguments are IR-C atoms: loading one only needs %eax (and %ebx for
+ * a global), so the register arguments are loaded after the stack ones,
+ * the first one (in %eax) last. The argument list runs from the last
+ * argument to the first.
+ */
+void
+compile_call(EzcCtx *ctx, struct Asm *as, Expr *expr)
+{
+    Sym *sym;
+    Expr *arg;
+    FuncParam *param;
+    int argc;
+    int params_size;
+    int reg;
+    int i;
+
+    if(expr->l->kind != EXPR_ID)
+    {
+        fatal(ctx, "We don't handle \"complex\" function calls");
+    }
+
+    sym = sym_get(ctx, expr->l->id);
+    if(!sym)
+    {
+        fatal(ctx, "Invalid symbol %s", expr->l->id);
+    }
+
+    if(sym->type->kind != TYPE_FUNC)
+    {
+        fatal(ctx, "'%s' is not a function", expr->l->id);
+    }
+
+    argc = 0;
+    arg = expr->r;
+    while(arg)
+    {
+        ++argc;
+        arg = arg->next;
+    }
+
+    params_size = 0;
+    arg = expr->r;
+    param = sym->type->params;
+    i = argc - 1;
+    while(arg)
+    {
+        if(param_reg(sym->regparm, i, param->type) < 0)
+        {
+            compile_expr(ctx, as, arg);
+            /* TODO: Push based on args sizes */
+            asmins1(as, "pushl", opreg(REG_EAX));
+            params_size += ALIGN(param->type->size, 4);
+        }
+        arg = arg->next;
+        param = param->next;
+        --i;
+    }
+
+    arg = expr->r;
+    param = sym->type->params;
+    i = argc - 1;
+    while(arg)
+    {
+        reg = param_reg(sym->regparm, i, param->type);
+        if(reg >= 0)
+        {
+            compile_expr(ctx, as, arg);
+            if(reg != REG_EAX)
+            {
+                asmins2(as, "movl", opreg(REG_EAX), opreg(reg));
+            }
+        }
+        arg = arg->next;
+        param = param->next;
+        --i;
+    }
+
+    asmins1(as, "call", oplbl(as, sym->id));
+
+    if(params_size > 0)
+    {
+        asmins2(as, "addl", opimm(params_size), opreg(REG_ESP));
+    }
+}
+
+void
+compile_expr(EzcCtx *ctx, struct Asm *as, Expr *expr)
+{
+    Sym *sym = 0;
+    Expr *arg;
+    Type *type;
+    char *ins;
+    char *lbl1, *lbl2;
+
+    ins = 0;
+    switch(expr->kind)
+    {
+        case EXPR_INTLIT:
+        {
+            asmins2(as, "movl", opimm(expr->value), opreg(REG_EAX));
+        } break;
+
+        case EXPR_ID:
+        {
+            sym = sym_get(ctx, expr->id);
+            if(!sym)
+            {
+                fatal(ctx, "Invalid symbol %s", expr->id);
+            }
+
+            type = resolve_expr_type(ctx, expr, 0);
+            if(type->size == 1)
+            {
+                ins = "movzbl";
+            }
+            else if(type->size == 2)
+            {
+                ins = "movzwl";
+            }
+            else if(type->size == 4)
+            {
+                ins = "movl";
+            }
+            else
+            {
+                fatal(ctx, "Cannot load a value of %d bytes", type->size);
+            }
+
+            if(sym->type->kind == TYPE_ARRAY)
+            {
+                compile_lvalue(ctx, as, expr);
+            }
+            else if(sym->reg >= 0)
+            {
+                asmins2(as, "movl", opreg(sym->reg), opreg(REG_EAX));
+            }
+            else if(sym->global)
+            {
+                asmins2(as, "movl", oplbl(as, sym->id), opreg(REG_EBX));
+                asmins2(as, ins, opind(REG_EBX, 0), opreg(REG_EAX));
+            }
+            else
+            {
+                asmins2(as, ins, opind(REG_EBP, sym->offset), opreg(REG_EAX));
+            }
+        } break;
+
+        case EXPR_CALL:
+        {
+            compile_call(ctx, as, expr);
+        } break;
+
+        case EXPR_DEREF:
+        {
+            compile_expr(ctx, as, expr->l);
+            asmins2(as, "movl", opind(REG_EAX, 0), opreg(REG_EAX));
+        } break;
+
+        case EXPR_ADDR_OF:
+        {
+            compile_lvalue(ctx, as, expr->l);
+        } break;
+
+        case EXPR_NEG:
+        {
+            compile_expr(ctx, as, expr->l);
+            asmins1(as, "negl", opreg(REG_EAX));
+        } break;
+
+        case EXPR_CAST:
+        {
+            type = resolve_expr_type(ctx, expr->l, 0);
+            if(type->size >= expr->cast_to->size)
+            {
+                /* Nothing */
+            }
+            else if(type->size < expr->cast_to->size)
+            {
+                if(type->size == 1 && expr->cast_to->size == 2)
+                {
+                    ins = "movzbw";
+                }
+                else if(type->size == 1 && expr->cast_to->size == 4)
+                {
+                    ins = "movzbl";
+                }
+                else if(type->size == 2 && expr->cast_to->size == 4)
+                {
+                    ins = "movzwl";
+                }
+                else
+                {
+                    fatal(ctx, "Unsupported cast");
+                }
+            }
+
+            compile_expr(ctx, as, expr->l);
+            if(ins)
+            {
+                asmins2(as, ins, opreg(REG_EAX), opreg(REG_EAX));
+            }
+        } break;
+
+        case EXPR_MUL:
+        {
+            compile_expr(ctx, as, expr->r);
+            asmins2(as, "movl", opreg(REG_EAX), opreg(REG_ECX));
+            compile_expr(ctx, as, expr->l);
+            asmins1(as, "imull", opreg(REG_ECX));
+        } break;
+
+        case EXPR_DIV:
+        {
+            compile_expr(ctx, as, expr->r);
+            asmins2(as, "movl", opreg(REG_EAX), opreg(REG_ECX));
+            compile_expr(ctx, as, expr->l);
+            asmins0(as, "cltd");
+            asmins1(as, "idivl", opreg(REG_ECX));
+        } break;
+
+        case EXPR_ADD:
+        {
+            compile_expr(ctx, as, expr->r);
+            asmins2(as, "movl", opreg(REG_EAX), opreg(REG_ECX));
+            compile_expr(ctx, as, expr->l);
+            asmins2(as, "addl", opreg(REG_ECX), opreg(REG_EAX));
+        } break;
+
+        case EXPR_SUB:
+        {
+            compile_expr(ctx, as, expr->r);
+            asmins2(as, "movl", opreg(REG_EAX), opreg(REG_ECX));
+            compile_expr(ctx, as, expr->l);
+            asmins2(as, "subl", opreg(REG_ECX), opreg(REG_EAX));
+        } break;
+
+        case EXPR_LT:
+        case EXPR_LE:
+        case EXPR_GT:
+        case EXPR_GE:
+        {
+            if(expr->kind == EXPR_LT)
+            {
+                ins = "jl";
+            }
+            else if(expr->kind == EXPR_LE)
+            {
+                ins = "jle";
+            }
+            else if(expr->kind == EXPR_GT)
+            {
+                ins = "jg";
+            }
+            else if(expr->kind == EXPR_GE)
+            {
+                ins = "jge";
+            }
+
+            if(!ins)
+            {
+                fatal(ctx, "Invalid comparison");
+            }
+
+            lbl1 = lbl_gen(ctx);
+            lbl2 = lbl_gen(ctx);
+
+            compile_expr(ctx, as, expr->r);
+            asmins2(as, "movl", opreg(REG_EAX), opreg(REG_ECX));
+            compile_expr(ctx, as, expr->l);
+            asmins2(as, "cmpl", opreg(REG_ECX), opreg(REG_EAX));
+            asmins1(as, ins, oplbl(as, lbl1));
+            asmins2(as, "movl", opimm(0), opreg(REG_EAX));
+            asmins1(as, "jmp", oplbl(as, lbl2));
+            asmlabel(as, lbl1);
+            asmins2(as, "movl", opimm(1), opreg(REG_EAX));
+            asmlabel(as, lbl2);
+        } break;
+
+        case EXPR_ASSIGN:
+        {
+            type = resolve_expr_type(ctx, expr, 0);
+            if(type->size == 1)
+            {
+                ins = "movb";
+            }
+            else if(type->size == 2)
+            {
+                ins = "movw";
+            }
+            else if(type->size == 4)
+            {
+                ins = "movl";
+            }
+            else
+            {
+                fatal(ctx, "Cannot store a value of %d bytes", type->size);
+            }
+
+            sym = 0;
+            if(expr->l->kind == EXPR_ID)
+            {
+                sym = sym_get(ctx, expr->l->id);
+            }
+
+            compile_expr(ctx, as, expr->r);
+            if(sym && sym->reg >= 0)
+            {
+                asmins2(as, "movl", opreg(REG_EAX), opreg(sym->reg));
+            }
+            else
+            {
+                asmins2(as, "movl", opreg(REG_EAX), opreg(REG_ECX));
+                compile_lvalue(ctx, as, expr->l);
+                asmins2(as, ins, opreg(REG_ECX), opind(REG_EAX, 0));
+            }
+        } break;
+
+        case EXPR_COMPOUND:
+        {
+            arg = expr->l;
+            while(arg)
+            {
+                compile_expr(ctx, as, arg);
+                arg = arg->next;
+            }
+        } break;
+
+        default:
+        {
+            fatal(ctx, "Unsupported expression");
+        } break;
+    }
+}
+
+void
+compile_decl(EzcCtx *ctx, struct Asm *as, Decl *decl)
+{
+    Sym *sym;
+    int size;
+
+    if(!decl->type || decl->type->size <= 0)
+    {
+        fatal(ctx, "Invalid type for '%s'", decl->id);
+    }
+
+    sym = sym_add(ctx, decl->id, decl->type);
+    sym->global = 0;
+    sym->reg = decl->reg;
+    if(sym->reg >= 0)
+    {
+        return;
+    }
+
+    size = ALIGN(decl->type->size, 4);
+    asmins2(as, "subl", opimm(size), opreg(REG_ESP));
+
+    ctx->func_var_offset -= decl->type->size;
+    sym->offset = ctx->func_var_offset;
+}
+
+/* Restores the callee-saved registers and returns */
+void
+compile_ret(EzcCtx *ctx, struct Asm *as)
+{
+    int offset;
+    int reg;
+
+    offset = -8;
+    for(reg = REG_ESI;
+        reg <= REG_EDI;
+        ++reg)
+    {
+        if(ctx->func_regs & (1 << reg))
+        {
+            asmins2(as, "movl", opind(REG_EBP, offset), opreg(reg));
+            offset -= 4;
+        }
+    }
+
+    asmins1(as, "popl", opreg(REG_EBX));
+    asmins0(as, "leave");
+    asmins0(as, "ret");
+}
+
+void
+compile_stmt(EzcCtx *ctx, struct Asm *as, Stmt *stmt)
+{
+    int scope;
+    Stmt *substmt;
+
+    switch(stmt->kind)
+    {
+        case STMT_DECL:
+        {
+            compile_decl(ctx, as, stmt->u.decl);
+        } break;
+
+        case STMT_EXPR:
+        {
+            compile_expr(ctx, as, stmt->u.expr);
+        } break;
+
+        case STMT_BLOCK:
+        {
+            scope = ctx->sym_table_count;
+            substmt = stmt->u.block;
+            while(substmt)
+            {
+                compile_stmt(ctx, as, substmt);
+                substmt = substmt->next;
+            }
+            sym_pop(ctx, scope);
+        } break;
+
+        case STMT_RET:
+        {
+            if(stmt->u.expr)
+            {
+                compile_expr(ctx, as, stmt->u.expr);
+            }
+            compile_ret(ctx, as);
+        } break;
+
+        case STMT_LABEL:
+        {
+            asmlabel(as, stmt->u.label);
+        } break;
+
+        case STMT_GOTO:
+        {
+            asmins1(as, "jmp", oplbl(as, stmt->u.label));
+        } break;
+
+        case STMT_IF:
+        {
+            compile_expr(ctx, as, stmt->cond);
+            asmins2(as, "cmpl", opimm(0), opreg(REG_EAX));
+            asmins1(as, "jne", oplbl(as, stmt->u.label));
+        } break;
+
+        default:
+        {
+            fatal(ctx, "Invalid statement");
+        } break;
+    }
+}
+
+void
+compile_glob_decl(EzcCtx *ctx, struct Asm *as, GlobDecl *decl)
+{
+    Sym *sym;
+    int size;
+    FuncParam *param;
+    FuncParam **params;
+    int params_count;
+    int sym_count;
+    int offset;
+    int *param_regs;
+    int reg;
+    int i;
+
+    switch(decl->kind)
+    {
+        case GLOB_DECL_VAR:
+        {
+            size = ALIGN(decl->type->size, 4);
+            asmlabel(as, decl->id);
+            asmdir(as, DIR_ZERO, size);
+
+            sym = sym_add(ctx, decl->id, decl->type);
+            sym->global = 1;
+        } break;
+
+        case GLOB_DECL_FUNC:
+        {
+            ctx->func_var_offset = -4;
+
+            if(decl->func_def)
+            {
+                param_regs = regalloc_func(ctx, decl);
+
+                asmlabel(as, decl->id);
+                asmins1(as, "pushl", opreg(REG_EBP));
+                asmins2(as, "movl", opreg(REG_ESP), opreg(REG_EBP));
+                asmins1(as, "pushl", opreg(REG_EBX));
+                for(reg = REG_ESI;
+                    reg <= REG_EDI;
+                    ++reg)
+                {
+                    if(ctx->func_regs & (1 << reg))
+                    {
+                        asmins1(as, "pushl", opreg(reg));
+                        ctx->func_var_offset -= 4;
+                    }
+                }
+
+                /* The parameters in argument order (the list is reversed) */
+                params_count = 0;
+                param = decl->params;
+                while(param)
+                {
+                    ++params_count;
+                    param = param->next;
+                }
+                params = (FuncParam **)arena_alloc(ctx, ctx->arena, (params_count + 1)*sizeof(FuncParam *));
+                i = params_count;
+                param = decl->params;
+                while(param)
+                {
+                    params[--i] = param;
+                    param = param->next;
+                }
+
+                sym_count = ctx->sym_table_count;
+                offset = 8;
+                for(i = 0;
+                    i < params_count;
+                    ++i)
+                {
+                    param = params[i];
+                    sym = sym_add_func_param(ctx, param->id, param->type,
+                                             offset);
+                    sym->reg = param_regs[params_count - 1 - i];
+                    if(param_reg(decl->regparm, i, param->type) < 0)
+                    {
+                        offset += ALIGN(param->type->size, 4);
+                    }
+                }
+
+                /*
+                 * A register parameter the allocator left in memory gets a
+                 * frame slot. The others go to their registers, %edx (an
+                 * argument register the allocator also hands out) emptied
+                 * first, then the stack parameters are loaded.
+                 */
+                for(i = 0;
+                    i < params_count;
+                    ++i)
+                {
+                    sym = &(ctx->sym_table[sym_count + i]);
+                    reg = param_reg(decl->regparm, i, sym->type);
+                    if(reg >= 0 && sym->reg < 0)
+                    {
+                        asmins1(as, "pushl", opreg(reg));
+                        ctx->func_var_offset -= 4;
+                        sym->offset = ctx->func_var_offset;
+                    }
+                }
+                for(i = 0;
+                    i < params_count;
+                    ++i)
+                {
+                    sym = &(ctx->sym_table[sym_count + i]);
+                    reg = param_reg(decl->regparm, i, sym->type);
+                    if(reg == REG_EDX && sym->reg >= 0 && sym->reg != REG_EDX)
+                    {
+                        asmins2(as, "movl", opreg(reg), opreg(sym->reg));
+                    }
+                }
+                for(i = 0;
+                    i < params_count;
+                    ++i)
+                {
+                    sym = &(ctx->sym_table[sym_count + i]);
+                    reg = param_reg(decl->regparm, i, sym->type);
+                    if(sym->reg < 0 || reg == REG_EDX)
+                    {
+                        continue;
+                    }
+
+                    if(reg >= 0)
+                    {
+                        asmins2(as, "movl", opreg(reg), opreg(sym->reg));
+                    }
+                    else
+                    {
+                        asmins2(as, "movl", opind(REG_EBP, sym->offset), opreg(sym->reg));
+                    }
+                }
+
+                compile_stmt(ctx, as, decl->func_def);
+                compile_ret(ctx, as);
+
+                sym_pop(ctx, sym_count);
+            }
+
+            sym = sym_add(ctx, decl->id, decl->type);
+            sym->global = 1;
+            sym->regparm = decl->regparm;
+        } break;
+
+        default:
+        {
+            fatal(ctx, "Invalid global declaration");
+        } break;
+    }
+}
+
+/* Program entry point (and libc in DEBUG builds) */
+void
+compile_entry(EzcCtx *ctx, struct Asm *as)
+{
+#ifdef DEBUG
+    char *libc;
+#if 0
+    FuncParam *params;
+#endif
+#endif
+
+    asmlabel(as, "___entry");
+    asmins1(as, "pushl", opreg(REG_EBP));
+    asmins2(as, "movl", opreg(REG_ESP), opreg(REG_EBP));
+    asmins1(as, "call", oplbl(as, "main"));
+    asmins2(as, "movl", opreg(REG_EAX), opreg(REG_EBX));
+    asmins2(as, "movl", opimm(1), opreg(REG_EAX));
+    asmins0(as, "syscall");
+    asmins0(as, "leave");
+    asmins0(as, "ret");
+
+#ifdef DEBUG
+    /* libc.asm is text: it goes through the parser of the assembler */
+    libc = mapsrc("libc.asm", 0);
+    if(libc)
+    {
+        asmtext(as, libc);
+    }
+
+#if 0
+    params = make_func_param(ctx, str_intern(ctx, "c"), type_int());
+    params->next = 0;
+    sym_add(ctx, str_intern(ctx, "putchar"),
+            type_func(ctx, type_int(), params));
+
+    params = make_func_param(ctx, str_intern(ctx, "nbytes"), type_int());
+    params->next = make_func_param(ctx, str_intern(ctx, "src"),
+                                   type_ptr(ctx, type_void()));
+    params->next->next = make_func_param(ctx, str_intern(ctx, "dst"),
+                                         type_ptr(ctx, type_void()));
+    params->next->next->next = 0;
+    sym_add(ctx, str_intern(ctx, "___memcpy_aligned"),
+            type_func(ctx, type_int(), params));
+#endif
+#else
+    /* TODO: Hardcode libc into a C string */
+#endif
+}
+
+void
+compile_unit(EzcCtx *ctx, struct Asm *as, GlobDecl *unit)
+{
+    GlobDecl *curr;
+
+    sym_reset(ctx);
+    compile_entry(ctx, as);
+
+    curr = unit;
+    while(curr)
+    {
+        compile_glob_decl(ctx, as, curr);
+        curr = curr->next;
+    }
+}
+
+/******************************************************************************/
+/**                                PEEPHOLE                                  **/
+/******************************************************************************/
+
+/*
+ * A pattern-driven pass over the lines of the unit, between the code
+ * generation and the assembler. The accumulator code generation leaves a
+ * lot of redundant sequences: a value copied to %ecx and loaded back, a
+ * store through an address computed in %eax, movl $0, jumps to the next
+ * line, the second epilogue after a return.
+ *
+ * The lines are put in an array, and at each of them the rules of the
+ * table are tried in order on a window of the lines that follow (the
+ * removed ones leave holes which the window skips). Passes are made until
+ * no rule fires. Every rule removes a line, or turns one into a form no
+ * rule matches, so this ends.
+ *
+ * Most rules need a register (or the flags) not to be read after the
+ * window. peep_live follows the lines, and the jumps, for at most
+ * PEEP_LIVE_STEPS lines, and when it runs out the value is taken as read.
+ * A line already reached with the same registers is not followed again,
+ * so a loop costs its length once.
+ */
+
+enum
+{
+    PEEP_OP_OTHER,
+    PEEP_OP_MOVL,
+    PEEP_OP_MOVZ,
+    PEEP_OP_ADDL,
+    PEEP_OP_SUBL,
+    PEEP_OP_CMPL,
+    PEEP_OP_PUSHL,
+    PEEP_OP_JMP,
+    PEEP_OP_JCC,
+    PEEP_OP_RET
+};
+
+/* Operands an instruction reads and writes */
+enum
+{
+    PEEP_R1 = 1,
+    PEEP_W1 = 2,
+    PEEP_R2 = 4,
+    PEEP_W2 = 8,
+
+    /* xorl %r,%r: op2 does not depend on itself */
+    PEEP_CLEAR = 16
+};
+
+/* Sets of registers, the flags after them */
+#define PEEP_REG(r) (1 << (r))
+#define PEEP_FLAGS (1 << REG_COUNT)
+#define PEEP_ALL ((1 << (REG_COUNT + 1)) - 1)
+
+#define PEEP_CALLER (PEEP_REG(REG_EAX) | PEEP_REG(REG_ECX) | PEEP_REG(REG_EDX))
+#define PEEP_CALLEE (PEEP_REG(REG_EBX) | PEEP_REG(REG_ESI) | PEEP_REG(REG_EDI) |\
+                     PEEP_REG(REG_EBP) | PEEP_REG(REG_ESP))
+
+typedef struct
+{
+    char *mnem;
+    int op;
+    int ops;
+    int reads;
+    int writes;
+
+    /* A conditional jump on the opposite condition */
+    char *inverse;
+} PeepIns;
+
+PeepIns peep_table[] =
+{
+    { "movl",    PEEP_OP_MOVL,  PEEP_R1 | PEEP_W2, 0, 0, 0 },
+    { "movzbl",  PEEP_OP_MOVZ,  PEEP_R1 | PEEP_W2, 0, 0, 0 },
+    { "movzwl",  PEEP_OP_MOVZ,  PEEP_R1 | PEEP_W2, 0, 0, 0 },
+    { "movzbw",  PEEP_OP_OTHER, PEEP_R1 | PEEP_R2 | PEEP_W2, 0, 0, 0 },
+    { "movb",    PEEP_OP_OTHER, PEEP_R1 | PEEP_W2, 0, 0, 0 },
+    { "movw",    PEEP_OP_OTHER, PEEP_R1 | PEEP_W2, 0, 0, 0 },
+    { "addl",    PEEP_OP_ADDL,  PEEP_R1 | PEEP_R2 | PEEP_W2, 0, PEEP_FLAGS, 0 },
+    { "subl",    PEEP_OP_SUBL,  PEEP_R1 | PEEP_R2 | PEEP_W2, 0, PEEP_FLAGS, 0 },
+    { "cmpl",    PEEP_OP_CMPL,  PEEP_R1 | PEEP_R2, 0, PEEP_FLAGS, 0 },
+    { "xorl",    PEEP_OP_OTHER, PEEP_R1 | PEEP_R2 | PEEP_W2 | PEEP_CLEAR, 0, PEEP_FLAGS, 0 },
+    { "negl",    PEEP_OP_OTHER, PEEP_R1 | PEEP_W1, 0, PEEP_FLAGS, 0 },
+    { "notl",    PEEP_OP_OTHER, PEEP_R1 | PEEP_W1, 0, 0, 0 },
+    { "incl",    PEEP_OP_OTHER, PEEP_R1 | PEEP_W1, 0, PEEP_FLAGS, 0 },
+    { "decl",    PEEP_OP_OTHER, PEEP_R1 | PEEP_W1, 0, PEEP_FLAGS, 0 },
+    { "sall",    PEEP_OP_OTHER, PEEP_R1 | PEEP_W1, 0, PEEP_FLAGS, 0 },
+    { "sarl",    PEEP_OP_OTHER, PEEP_R1 | PEEP_W1, 0, PEEP_FLAGS, 0 },
+    { "imull",   PEEP_OP_OTHER, PEEP_R1, PEEP_REG(REG_EAX),
+      PEEP_REG(REG_EAX) | PEEP_REG(REG_EDX) | PEEP_FLAGS, 0 },
+    { "idivl",   PEEP_OP_OTHER, PEEP_R1, PEEP_REG(REG_EAX) | PEEP_REG(REG_EDX),
+      PEEP_REG(REG_EAX) | PEEP_REG(REG_EDX) | PEEP_FLAGS, 0 },
+    { "cltd",    PEEP_OP_OTHER, 0, PEEP_REG(REG_EAX), PEEP_REG(REG_EDX), 0 },
+    { "cdq",     PEEP_OP_OTHER, 0, PEEP_REG(REG_EAX), PEEP_REG(REG_EDX), 0 },
+    { "pushl",   PEEP_OP_PUSHL, PEEP_R1, PEEP_REG(REG_ESP), PEEP_REG(REG_ESP), 0 },
+    { "popl",    PEEP_OP_OTHER, PEEP_W1, PEEP_REG(REG_ESP), PEEP_REG(REG_ESP), 0 },
+    { "leave",   PEEP_OP_OTHER, 0, PEEP_REG(REG_EBP),
+      PEEP_REG(REG_ESP) | PEEP_REG(REG_EBP), 0 },
+    { "nop",     PEEP_OP_OTHER, 0, 0, 0, 0 },
+
+    /* The callee may take its arguments in registers (regparm) */
+    { "call",    PEEP_OP_OTHER, 0, PEEP_CALLER | PEEP_REG(REG_ESP),
+      PEEP_CALLER | PEEP_FLAGS, 0 },
+    { "ret",     PEEP_OP_RET,   0, PEEP_REG(REG_EAX) | PEEP_CALLEE, 0, 0 },
+    { "syscall", PEEP_OP_OTHER, 0, PEEP_ALL, 0, 0 },
+    { "hlt",     PEEP_OP_OTHER, 0, PEEP_ALL, 0, 0 },
+
+    { "jmp",     PEEP_OP_JMP,   0, 0, 0, 0 },
+    { "je",      PEEP_OP_JCC,   0, PEEP_FLAGS, 0, "jne" },
+    { "jne",     PEEP_OP_JCC,   0, PEEP_FLAGS, 0, "je" },
+    { "jz",      PEEP_OP_JCC,   0, PEEP_FLAGS, 0, "jnz" },
+    { "jnz",     PEEP_OP_JCC,   0, PEEP_FLAGS, 0, "jz" },
+    { "jl",      PEEP_OP_JCC,   0, PEEP_FLAGS, 0, "jge" },
+    { "jge",     PEEP_OP_JCC,   0, PEEP_FLAGS, 0, "jl" },
+    { "jle",     PEEP_OP_JCC,   0, PEEP_FLAGS, 0, "jg" },
+    { "jg",      PEEP_OP_JCC,   0, PEEP_FLAGS, 0, "jle" },
+    { "jb",      PEEP_OP_JCC,   0, PEEP_FLAGS, 0, "jae" },
+    { "jae",     PEEP_OP_JCC,   0, PEEP_FLAGS, 0, "jb" },
+    { "jbe",     PEEP_OP_JCC,   0, PEEP_FLAGS, 0, "ja" },
+    { "ja",      PEEP_OP_JCC,   0, PEEP_FLAGS, 0, "jbe" },
+    { 0 }
+};
+
+/* Anything else: it could read everything */
+PeepIns peep_other = { "", PEEP_OP_OTHER, 0, PEEP_ALL, 0, 0 };
+
+/* The other conditional jumps (jc, jnae, ...), which are not inverted */
+PeepIns peep_jcc = { "", PEEP_OP_JCC, 0, PEEP_FLAGS, 0, 0 };
+
+/* The entry of every instruction of the opcode table */
+PeepIns *peep_ins[ISASZ];
+
+/* Fills peep_ins once the opcode table is built (see ezc_init) */
+void
+peep_init()
+{
+    PeepIns *pi;
+    int i;
+
+    for(i = 0;
+        i < isasz;
+        ++i)
+    {
+        peep_ins[i] = &peep_other;
+        for(pi = peep_table;
+            pi->mnem;
+            ++pi)
+        {
+            if(!strcmp(pi->mnem, isa[i].mnem))
+            {
+                peep_ins[i] = pi;
+                break;
+            }
+        }
+
+        if(!pi->mnem && isa[i].mnem[0] == 'j')
+        {
+            peep_ins[i] = &peep_jcc;
+        }
+    }
+}
+
+#define PEEP_WINDOW 3
+#define PEEP_LIVE_STEPS 256
+
+typedef struct
+{
+    /* The lines, with a null one after them, and holes for removed ones */
+    struct Line **lines;
+    int count;
+
+    /* Label -> index of its line */
+    struct Lbl **lbls;
+    int *lbl_lines;
+    int lbls_cap;
+
+    /* Registers followed from each line by the query number query */
+    int *seen;
+    int *seen_query;
+    int query;
+} Peep;
+
+typedef struct
+{
+    char *name;
+
+    /* Lines the rule needs in the window */
+    int window;
+
+    /* Tries the rule on the lines w[0..PEEP_WINDOW), returns 1 if it fired */
+    int (*apply)(Peep *p, int *w);
+} PeepRule;
+
+PeepIns *
+peep_of(struct Line *l)
+{
+    if(!l || !l->ins)
+    {
+        return(&peep_other);
+    }
+
+    return(peep_ins[l->ins - isa]);
+}
+
+int
+peep_op(struct Line *l)
+{
+    if(!l || !l->ins)
+    {
+        return(PEEP_OP_OTHER);
+    }
+
+    return(peep_ins[l->ins - isa]->op);
+}
+
+/* The next line after i which is left (count if none) */
+int
+peep_next(Peep *p, int i)
+{
+    if(i < p->count)
+    {
+        ++i;
+    }
+    while(i < p->count && !p->lines[i])
+    {
+        ++i;
+    }
+
+    return(i);
+}
+
+unsigned int
+peep_lbl_hash(struct Lbl *lbl)
+{
+    return((unsigned int)((size_t)lbl >> 3)*2654435761u);
+}
+
+/* The line of the label an operand jumps to (-1 if unknown) */
+int
+peep_target(Peep *p, struct Op *op)
+{
+    unsigned int i;
+
+    if(op->type != OP_IMM || op->subtype != OP_LBL)
+    {
+        return(-1);
+    }
+
+    i = peep_lbl_hash(op->lbl) & (p->lbls_cap - 1);
+    while(p->lbls[i])
+    {
+        if(p->lbls[i] == op->lbl)
+        {
+            return(p->lbl_lines[i]);
+        }
+        i = (i + 1) & (p->lbls_cap - 1);
+    }
+
+    return(-1);
+}
+
+void
+peep_op_effect(struct Op *op, int read, int write, int *reads, int *writes)
+{
+    if(op->type == OP_REG)
+    {
+        if(read)
+        {
+            *reads |= PEEP_REG(op->val);
+        }
+        if(write)
+        {
+            *writes |= PEEP_REG(op->val);
+        }
+    }
+    else if((op->type == OP_IND || op->type == OP_IND_DISP) && (read || write))
+    {
+        /* The address */
+        *reads |= PEEP_REG(op->val);
+    }
+}
+
+/* The registers (and flags) a line reads and writes */
+void
+peep_effect(struct Line *l, int *reads, int *writes)
+{
+    PeepIns *pi;
+
+    if(!l->ins)
+    {
+        /* A directive is data we should never reach */
+        *reads = (l->dir == DIR_LABEL) ? 0 : PEEP_ALL;
+        *writes = 0;
+        return;
+    }
+
+    pi = peep_of(l);
+    *reads = pi->reads;
+    *writes = pi->writes;
+    if((pi->ops & PEEP_CLEAR) &&
+       l->op1.type == OP_REG && l->op2.type == OP_REG && l->op1.val == l->op2.val)
+    {
+        *writes |= PEEP_REG(l->op2.val);
+        return;
+    }
+    if(l->ins->numop >= 1)
+    {
+        peep_op_effect(&l->op1, pi->ops & PEEP_R1, pi->ops & PEEP_W1, reads, writes);
+    }
+    if(l->ins->numop >= 2)
+    {
+        peep_op_effect(&l->op2, pi->ops & PEEP_R2, pi->ops & PEEP_W2, reads, writes);
+    }
+}
+
+/* Whether a register of mask can be read from line i on */
+int
+peep_live(Peep *p, int i, int mask, int *steps)
+{
+    struct Line *l;
+    int reads;
+    int writes;
+    int op;
+    int target;
+
+    while(i < p->count)
+    {
+        l = p->lines[i];
+        if(!l)
+        {
+            ++i;
+            continue;
+        }
+        if(--*steps < 0)
+        {
+            return(1);
+        }
+
+        if(p->seen_query[i] != p->query)
+        {
+            p->seen_query[i] = p->query;
+            p->seen[i] = 0;
+        }
+        if(!(mask & ~p->seen[i]))
+        {
+            return(0);
+        }
+        p->seen[i] |= mask;
+
+        peep_effect(l, &reads, &writes);
+        if(reads & mask)
+        {
+            return(1);
+        }
+        mask &= ~writes;
+        if(!mask)
+        {
+            return(0);
+        }
+
+        op = peep_op(l);
+        if(op == PEEP_OP_RET)
+        {
+            return(0);
+        }
+        else if(op == PEEP_OP_JMP || op == PEEP_OP_JCC)
+        {
+            target = peep_target(p, &l->op1);
+            if(target < 0)
+            {
+                return(1);
+            }
+            if(op == PEEP_OP_JMP)
+            {
+                i = target;
+                continue;
+            }
+            if(peep_live(p, target, mask, steps))
+            {
+                return(1);
+            }
+        }
+        ++i;
+    }
+
+    return(1);
+}
+
+/* Whether no register of mask is read after line i */
+int
+peep_dead(Peep *p, int i, int mask)
+{
+    int steps;
+
+    steps = PEEP_LIVE_STEPS;
+    ++p->query;
+
+    return(!peep_live(p, peep_next(p, i), mask, &steps));
+}
+
+int
+peep_op_eq(struct Op *a, struct Op *b)
+{
+    return(a->type == b->type && a->subtype == b->subtype &&
+           a->val == b->val && a->disp == b->disp && a->lbl == b->lbl);
+}
+
+int
+peep_is_reg(struct Op *op, int reg)
+{
+    return(op->type == OP_REG && op->val == reg);
+}
+
+/* Whether op is a memory operand addressed through reg */
+int
+peep_is_mem(struct Op *op, int reg)
+{
+    return((op->type == OP_IND || op->type == OP_IND_DISP) && op->val == reg);
+}
+
+int
+peep_is_imm(struct Op *op)
+{
+    return(op->type == OP_IMM && op->subtype == OP_IMM);
+}
+
+/*
+ * Changes a line into mnem op1,op2 (with as many operands as it had), if
+ * the opcode table has that form
+ */
+int
+peep_set(struct Line *l, char *mnem, struct Op op1, struct Op op2)
+{
+    struct AsmIns *ins;
+    int numop;
+
+    numop = l->ins->numop;
+    ins = getins(mnem, numop,
+                 (numop >= 1) ? op1.type : 0,
+                 (numop >= 2) ? op2.type : 0);
+    if(!ins)
+    {
+        return(0);
+    }
+
+    l->ins = ins;
+    l->op1 = op1;
+    l->op2 = op2;
+
+    return(1);
+}
+
+/* movl %r,%r */
+int
+peep_self_move(Peep *p, int *w)
+{
+    struct Line *l0;
+
+    l0 = p->lines[w[0]];
+    if(peep_op(l0) == PEEP_OP_MOVL && l0->op1.type == OP_REG &&
+       peep_op_eq(&l0->op1, &l0->op2))
+    {
+        p->lines[w[0]] = 0;
+        return(1);
+    }
+
+    return(0);
+}
+
+/* An instruction after jmp or ret, before any label */
+int
+peep_unreachable(Peep *p, int *w)
+{
+    struct Line *l1;
+    int op;
+
+    op = peep_op(p->lines[w[0]]);
+    l1 = p->lines[w[1]];
+    if((op == PEEP_OP_JMP || op == PEEP_OP_RET) && l1->ins)
+    {
+        p->lines[w[1]] = 0;
+        return(1);
+    }
+
+    return(0);
+}
+
+/* A jump to one of the labels right after it */
+int
+peep_jump_next(Peep *p, int *w)
+{
+    struct Line *l0;
+    struct Line *l;
+    int op;
+    int i;
+
+    l0 = p->lines[w[0]];
+    op = peep_op(l0);
+    if((op != PEEP_OP_JMP && op != PEEP_OP_JCC) || l0->op1.subtype != OP_LBL)
+    {
+        return(0);
+    }
+
+    for(i = w[1];
+        i < p->count;
+        i = peep_next(p, i))
+    {
+        l = p->lines[i];
+        if(l->ins || l->dir != DIR_LABEL)
+        {
+            break;
+        }
+        if(l->op1.lbl == l0->op1.lbl)
+        {
+            p->lines[w[0]] = 0;
+            return(1);
+        }
+    }
+
+    return(0);
+}
+
+/* jcc L1; jmp L2; L1: -> jncc L2; L1: */
+int
+peep_branch_over(Peep *p, int *w)
+{
+    struct Line *l0;
+    struct Line *l1;
+    struct Line *l;
+    struct AsmIns *ins;
+    char *inverse;
+    int i;
+
+    l0 = p->lines[w[0]];
+    l1 = p->lines[w[1]];
+    inverse = peep_of(l0)->inverse;
+    if(!inverse || peep_op(l1) != PEEP_OP_JMP || l0->op1.subtype != OP_LBL)
+    {
+        return(0);
+    }
+
+    for(i = w[2];
+        i < p->count;
+        i = peep_next(p, i))
+    {
+        l = p->lines[i];
+        if(l->ins || l->dir != DIR_LABEL)
+        {
+            break;
+        }
+        if(l->op1.lbl == l0->op1.lbl)
+        {
+            ins = getins(inverse, 1, OP_IMM, 0);
+            if(!ins)
+            {
+                return(0);
+            }
+            l0->ins = ins;
+            l0->op1 = l1->op1;
+            p->lines[w[1]] = 0;
+            return(1);
+        }
+    }
+
+    return(0);
+}
+
+/*
+ * movl a,b; movl b,a -> movl a,b
+ * movl %r,m; movl m,%s -> movl %r,m; movl %r,%s
+ */
+int
+peep_reload(Peep *p, int *w)
+{
+    struct Line *l0;
+    struct Line *l1;
+
+    l0 = p->lines[w[0]];
+    l1 = p->lines[w[1]];
+    if(peep_op(l0) != PEEP_OP_MOVL || peep_op(l1) != PEEP_OP_MOVL ||
+       !peep_op_eq(&l0->op2, &l1->op1))
+    {
+        return(0);
+    }
+
+    if(peep_op_eq(&l0->op1, &l1->op2))
+    {
+        /* movl 4(%eax),%eax; movl %eax,4(%eax) stores somewhere else */
+        if(l0->op2.type == OP_REG && peep_is_mem(&l0->op1, l0->op2.val))
+        {
+            return(0);
+        }
+
+        p->lines[w[1]] = 0;
+        return(1);
+    }
+
+    if(l0->op1.type == OP_REG &&
+       (l0->op2.type == OP_IND || l0->op2.type == OP_IND_DISP) &&
+       l1->op2.type == OP_REG)
+    {
+        return(peep_set(l1, "movl", l0->op1, l1->op2));
+    }
+
+    return(0);
+}
+
+/*
+ * movl %ebp,%r; addl $n,%r; ... (%r) ... -> ... n(%ebp) ...
+ * The address of a local, as compile_lvalue makes it, used right away.
+ */
+int
+peep_frame_address(Peep *p, int *w)
+{
+    struct Line *l0;
+    struct Line *l1;
+    struct Line *l2;
+    struct Op op1;
+    struct Op op2;
+    int reg;
+    int reads;
+    int writes;
+
+    l0 = p->lines[w[0]];
+    l1 = p->lines[w[1]];
+    l2 = p->lines[w[2]];
+    if(peep_op(l0) != PEEP_OP_MOVL || !peep_is_reg(&l0->op1, REG_EBP) ||
+       l0->op2.type != OP_REG || peep_op(l1) != PEEP_OP_ADDL ||
+       !peep_is_imm(&l1->op1) || l1->op1.val == 0 ||
+       !peep_op_eq(&l0->op2, &l1->op2) || !l2->ins)
+    {
+        return(0);
+    }
+
+    reg = l0->op2.val;
+    op1 = l2->op1;
+    op2 = l2->op2;
+    if(op1.type == OP_IND && op1.val == reg &&
+       (l2->ins->numop < 2 || !peep_is_reg(&op2, reg)))
+    {
+        op1 = opind(REG_EBP, l1->op1.val);
+    }
+    else if(l2->ins->numop >= 2 && op2.type == OP_IND && op2.val == reg &&
+            !peep_is_reg(&op1, reg))
+    {
+        op2 = opind(REG_EBP, l1->op1.val);
+    }
+    else
+    {
+        return(0);
+    }
+
+    peep_effect(l2, &reads, &writes);
+    if(!peep_dead(p, w[2], (PEEP_REG(reg) | PEEP_FLAGS) & ~writes) ||
+       !peep_set(l2, l2->ins->mnem, op1, op2))
+    {
+        return(0);
+    }
+
+    p->lines[w[0]] = 0;
+    p->lines[w[1]] = 0;
+
+    return(1);
+}
+
+/*
+ * movl x,%r; movl %r,y -> movl x,y
+ * movl x,%r; pushl %r -> pushl x
+ * if %r is dead
+ */
+int
+peep_copy_forward(Peep *p, int *w)
+{
+    struct Line *l0;
+    struct Line *l1;
+    int reg;
+
+    l0 = p->lines[w[0]];
+    l1 = p->lines[w[1]];
+    if((peep_op(l0) != PEEP_OP_MOVL && peep_op(l0) != PEEP_OP_MOVZ) ||
+       l0->op2.type != OP_REG)
+    {
+        return(0);
+    }
+
+    reg = l0->op2.val;
+    if(!peep_is_reg(&l1->op1, reg) || !peep_dead(p, w[1], PEEP_REG(reg)))
+    {
+        return(0);
+    }
+
+    if(peep_op(l1) == PEEP_OP_PUSHL && peep_op(l0) == PEEP_OP_MOVL)
+    {
+        /* The pushed value, l1 goes instead of l0 */
+        if(!peep_set(l1, "pushl", l0->op1, l1->op2))
+        {
+            return(0);
+        }
+        p->lines[w[0]] = 0;
+        return(1);
+    }
+
+    if(peep_op(l1) != PEEP_OP_MOVL ||
+       peep_is_reg(&l1->op2, reg) || peep_is_mem(&l1->op2, reg) ||
+       (peep_op(l0) == PEEP_OP_MOVZ && l1->op2.type != OP_REG) ||
+       !peep_set(l0, l0->ins->mnem, l0->op1, l1->op2))
+    {
+        return(0);
+    }
+
+    p->lines[w[1]] = 0;
+
+    return(1);
+}
+
+/* movl %a,%r; addl/subl x,%r; movl %r,%a -> addl/subl x,%a if %r is dead */
+int
+peep_in_place(Peep *p, int *w)
+{
+    struct Line *l0;
+    struct Line *l1;
+    struct Line *l2;
+    int reg;
+    int op;
+
+    l0 = p->lines[w[0]];
+    l1 = p->lines[w[1]];
+    l2 = p->lines[w[2]];
+    op = peep_op(l1);
+    if(peep_op(l0) != PEEP_OP_MOVL || l0->op1.type != OP_REG ||
+       l0->op2.type != OP_REG || (op != PEEP_OP_ADDL && op != PEEP_OP_SUBL) ||
+       peep_op(l2) != PEEP_OP_MOVL)
+    {
+        return(0);
+    }
+
+    reg = l0->op2.val;
+    if(!peep_is_reg(&l1->op2, reg) || peep_is_reg(&l1->op1, reg) ||
+       peep_is_mem(&l1->op1, reg) || !peep_is_reg(&l2->op1, reg) ||
+       !peep_op_eq(&l2->op2, &l0->op1) ||
+       !peep_dead(p, w[2], PEEP_REG(reg)) ||
+       !peep_set(l1, l1->ins->mnem, l1->op1, l0->op1))
+    {
+        return(0);
+    }
+
+    p->lines[w[0]] = 0;
+    p->lines[w[2]] = 0;
+
+    return(1);
+}
+
+/*
+ * movl $n,%r; [an instruction without %r]; op %r,%s -> ...; op $n,%s
+ * for addl, subl and cmpl, if %r is dead
+ */
+int
+peep_immediate(Peep *p, int *w)
+{
+    struct Line *l0;
+    struct Line *l;
+    int at;
+    int reg;
+    int reads;
+    int writes;
+    int op;
+
+    l0 = p->lines[w[0]];
+    if(peep_op(l0) != PEEP_OP_MOVL || !peep_is_imm(&l0->op1) ||
+       l0->op2.type != OP_REG)
+    {
+        return(0);
+    }
+
+    reg = l0->op2.val;
+    at = w[1];
+    op = peep_op(p->lines[at]);
+    if(op != PEEP_OP_ADDL && op != PEEP_OP_SUBL && op != PEEP_OP_CMPL)
+    {
+        /* One instruction in between, which leaves %r alone */
+        l = p->lines[at];
+        if(!l->ins || op == PEEP_OP_JMP || op == PEEP_OP_JCC || op == PEEP_OP_RET)
+        {
+            return(0);
+        }
+        peep_effect(l, &reads, &writes);
+        if((reads | writes) & PEEP_REG(reg))
+        {
+            return(0);
+        }
+        at = w[2];
+        op = peep_op(p->lines[at]);
+        if(op != PEEP_OP_ADDL && op != PEEP_OP_SUBL && op != PEEP_OP_CMPL)
+        {
+            return(0);
+        }
+    }
+
+    l = p->lines[at];
+    if(!peep_is_reg(&l->op1, reg) || l->op2.type != OP_REG ||
+       l->op2.val == reg ||
+       !peep_dead(p, at, PEEP_REG(reg)) ||
+       !peep_set(l, l->ins->mnem, l0->op1, l->op2))
+    {
+        return(0);
+    }
+
+    p->lines[w[0]] = 0;
+
+    return(1);
+}
+
+/* A register loaded and never read */
+int
+peep_dead_move(Peep *p, int *w)
+{
+    struct Line *l0;
+    int op;
+
+    l0 = p->lines[w[0]];
+    op = peep_op(l0);
+    if((op != PEEP_OP_MOVL && op != PEEP_OP_MOVZ) || l0->op2.type != OP_REG ||
+       l0->op2.val == REG_ESP || l0->op2.val == REG_EBP ||
+       !peep_dead(p, w[0], PEEP_REG(l0->op2.val)))
+    {
+        return(0);
+    }
+
+    p->lines[w[0]] = 0;
+
+    return(1);
+}
+
+/* addl/subl $a,%esp; addl/subl $b,%esp -> one adjustment (or none) */
+int
+peep_stack_adjust(Peep *p, int *w)
+{
+    struct Line *l0;
+    struct Line *l1;
+    int op0;
+    int op1;
+    int n;
+
+    l0 = p->lines[w[0]];
+    l1 = p->lines[w[1]];
+    op0 = peep_op(l0);
+    op1 = peep_op(l1);
+    if((op0 != PEEP_OP_ADDL && op0 != PEEP_OP_SUBL) ||
+       (op1 != PEEP_OP_ADDL && op1 != PEEP_OP_SUBL) ||
+       !peep_is_imm(&l0->op1) || !peep_is_reg(&l0->op2, REG_ESP) ||
+       !peep_is_imm(&l1->op1) || !peep_is_reg(&l1->op2, REG_ESP) ||
+       !peep_dead(p, w[1], PEEP_FLAGS))
+    {
+        return(0);
+    }
+
+    n = (op0 == PEEP_OP_ADDL) ? l0->op1.val : -l0->op1.val;
+    n += (op1 == PEEP_OP_ADDL) ? l1->op1.val : -l1->op1.val;
+    if(n == 0)
+    {
+        p->lines[w[0]] = 0;
+    }
+    else if(!peep_set(l0, n > 0 ? "addl" : "subl",
+                      opimm(n > 0 ? n : -n), opreg(REG_ESP)))
+    {
+        return(0);
+    }
+    p->lines[w[1]] = 0;
+
+    return(1);
+}
+
+/* movl $0,%r -> xorl %r,%r if the flags are dead */
+int
+peep_zero(Peep *p, int *w)
+{
+    struct Line *l0;
+
+    l0 = p->lines[w[0]];
+    if(peep_op(l0) != PEEP_OP_MOVL || !peep_is_imm(&l0->op1) ||
+       l0->op1.val != 0 || l0->op2.type != OP_REG ||
+       !peep_dead(p, w[0], PEEP_FLAGS))
+    {
+        return(0);
+    }
+
+    return(peep_set(l0, "xorl", l0->op2, l0->op2));
+}
+
+PeepRule peep_rules[PEEP_RULES_COUNT] =
+{
+    { "self-move",     1, peep_self_move },
+    { "unreachable",   2, peep_unreachable },
+    { "jump-next",     2, peep_jump_next },
+    { "branch-over",   3, peep_branch_over },
+    { "reload",        2, peep_reload },
+    { "frame-address", 3, peep_frame_address },
+    { "copy-forward",  2, peep_copy_forward },
+    { "in-place",      3, peep_in_place },
+    { "immediate",     2, peep_immediate },
+    { "dead-move",     1, peep_dead_move },
+    { "stack-adjust",  2, peep_stack_adjust },
+    { "zero",          1, peep_zero }
+};
+
+/* Runs the rules over the lines of as until none fires */
+void
+peephole(EzcCtx *ctx, struct Asm *as)
+{
+    Peep p;
+    struct Line *l;
+    struct Line *last;
+    int w[PEEP_WINDOW];
+    int changed;
+    int n;
+    int i, j, k;
+
+    p.count = 0;
+    for(l = as->firstline;
+        l;
+        l = l->next)
+    {
+        ++p.count;
+    }
+
+    p.lines = (struct Line **)arena_alloc(ctx, ctx->arena, (p.count + 1)*sizeof(struct Line *));
+    p.lbls_cap = 16;
+    while(p.lbls_cap < 2*p.count)
+    {
+        p.lbls_cap *= 2;
+    }
+    p.lbls = (struct Lbl **)arena_alloc(ctx, ctx->arena, p.lbls_cap*sizeof(struct Lbl *));
+    p.lbl_lines = (int *)arena_alloc(ctx, ctx->arena, p.lbls_cap*sizeof(int));
+    memset(p.lbls, 0, p.lbls_cap*sizeof(struct Lbl *));
+    p.seen = (int *)arena_alloc(ctx, ctx->arena, (p.count + 1)*sizeof(int));
+    p.seen_query = (int *)arena_alloc(ctx, ctx->arena,
+                                      (p.count + 1)*sizeof(int));
+    memset(p.seen_query, 0, (p.count + 1)*sizeof(int));
+    p.query = 0;
+
+    i = 0;
+    for(l = as->firstline;
+        l;
+        l = l->next)
+    {
+        p.lines[i] = l;
+        if(!l->ins && l->dir == DIR_LABEL)
+        {
+            j = peep_lbl_hash(l->op1.lbl) & (p.lbls_cap - 1);
+            while(p.lbls[j])
+            {
+                j = (j + 1) & (p.lbls_cap - 1);
+            }
+            p.lbls[j] = l->op1.lbl;
+            p.lbl_lines[j] = i;
+        }
+        ++i;
+    }
+    p.lines[p.count] = 0;
+
+    do
+    {
+        changed = 0;
+        for(i = 0;
+            i < p.count;
+            ++i)
+        {
+            if(!p.lines[i])
+            {
+                continue;
+            }
+
+            w[0] = i;
+            n = 1;
+            for(k = 1;
+                k < PEEP_WINDOW;
+                ++k)
+            {
+                w[k] = peep_next(&p, w[k - 1]);
+                if(w[k] < p.count)
+                {
+                    ++n;
+                }
+            }
+
+            for(k = 0;
+                k < PEEP_RULES_COUNT;
+                ++k)
+            {
+                if(peep_rules[k].window <= n && peep_rules[k].apply(&p, w))
+                {
+                    ++ctx->peep_fired[k];
+                    changed = 1;
+
+                    /* The window has changed: try again from its start */
+                    --i;
+                    break;
+                }
+            }
+        }
+    } while(changed);
+
+    /* Relink what is left and lay it out again */
+    as->firstline = 0;
+    last = 0;
+    for(i = 0;
+        i < p.count;
+        ++i)
+    {
+        l = p.lines[i];
+        if(!l)
+        {
+            continue;
+        }
+        if(last)
+        {
+            last->next = l;
+        }
+        else
+        {
+            as->firstline = l;
+        }
+        last = l;
+    }
+    if(last)
+    {
+        last->next = 0;
+    }
+    asmlayout(as);
+}
+
+/******************************************************************************/
+/**                               WORKER POOL                                **/
+/******************************************************************************/
+
+/*
+ * The jobs are dealt round-robin to the deques of the workers: a worker
+ * pops from the bottom of its own deque and, once it is empty, steals from
+ * the top of the others. Nothing is queued after the start, so a worker
+ * which finds every deque empty is done. Every worker runs its jobs on its
+ * own context.
+ */
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    int *jobs;
+    int top;
+    int bottom;
+} EzcDeque;
+
+typedef struct EzcPool EzcPool;
+
+struct
+EzcPool
+{
+    /* Runs job number job on the context of a worker */
+    void (*run)(EzcPool *pool, EzcCtx *ctx, int job);
+    void *data;
+
+    EzcDeque *deques;
+    int workers_count;
+};
+
+typedef struct
+{
+    EzcPool *pool;
+    int id;
+} EzcWorker;
+
+EzcCtx *ezc_ctx_create();
+void ezc_ctx_destroy(EzcCtx *ctx);
+void ezc_ctx_reset(EzcCtx *ctx);
+
+/* Returns the next job of the deque (-1 if empty) */
+int
+ezc_deque_pop(EzcDeque *d, int steal)
+{
+    int res;
+
+    res = -1;
+    pthread_mutex_lock(&d->lock);
+    if(d->top < d->bottom)
+    {
+        if(steal)
+        {
+            res = d->jobs[d->top++];
+        }
+        else
+        {
+            res = d->jobs[--d->bottom];
+        }
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return(res);
+}
+
+void *
+ezc_worker(void *arg)
+{
+    EzcWorker *w;
+    EzcPool *pool;
+    EzcCtx *ctx;
+    int job;
+    int i;
+
+    w = (EzcWorker *)arg;
+    pool = w->pool;
+    ctx = ezc_ctx_create();
+    for(;;)
+    {
+        job = ezc_deque_pop(&pool->deques[w->id], 0);
+        for(i = 1;
+            job < 0 && i < pool->workers_count;
+            ++i)
+        {
+            job = ezc_deque_pop(
+                &pool->deques[(w->id + i) % pool->workers_count], 1);
+        }
+
+        if(job < 0)
+        {
+            break;
+        }
+
+        pool->run(pool, ctx, job);
+    }
+    ezc_ctx_destroy(ctx);
+
+    return(0);
+}
+
+/*
+ * Runs jobs_count jobs on (at most) workers_count threads, the calling one
+ * included, and waits for all of them.
+ */
+void
+ezc_pool_run(EzcCtx *ctx, EzcPool *pool, int jobs_count, int workers_count)
+{
+    EzcDeque *d;
+    EzcWorker *workers;
+    pthread_t *threads;
+    int *started;
+    int i;
+
+    if(workers_count > jobs_count)
+    {
+        workers_count = jobs_count;
+    }
+    if(workers_count < 1)
+    {
+        workers_count = 1;
+    }
+
+    pool->workers_count = workers_count;
+    pool->deques = (EzcDeque *)calloc(workers_count, sizeof(EzcDeque));
+    workers = (EzcWorker *)calloc(workers_count, sizeof(EzcWorker));
+    threads = (pthread_t *)calloc(workers_count, sizeof(pthread_t));
+    started = (int *)calloc(workers_count, sizeof(int));
+    if(!pool->deques || !workers || !threads || !started)
+    {
+        fatal(ctx, "Cannot allocate memory for the workers");
+    }
+
+    for(i = 0;
+        i < workers_count;
+        ++i)
+    {
+        pthread_mutex_init(&pool->deques[i].lock, 0);
+        pool->deques[i].jobs = (int *)malloc((jobs_count + 1)*sizeof(int));
+        if(!pool->deques[i].jobs)
+        {
+            fatal(ctx, "Cannot allocate memory for the workers");
+        }
+        workers[i].pool = pool;
+        workers[i].id = i;
+    }
+
+    for(i = 0;
+        i < jobs_count;
+        ++i)
+    {
+        d = &pool->deques[i % workers_count];
+        d->jobs[d->bottom++] = i;
+    }
+
+    /*
+     * The calling thread is worker 0. If a thread cannot be started its
+     * deque is simply emptied by the others.
+     */
+    for(i = 1;
+        i < workers_count;
+        ++i)
+    {
+        started[i] = !pthread_create(&threads[i], 0, ezc_worker, &workers[i]);
+    }
+    ezc_worker(&workers[0]);
+    for(i = 1;
+        i < workers_count;
+        ++i)
+    {
+        if(started[i])
+        {
+            pthread_join(threads[i], 0);
+        }
+    }
+
+    for(i = 0;
+        i < workers_count;
+        ++i)
+    {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].jobs);
+    }
+    free(pool->deques);
+    free(workers);
+    free(threads);
+    free(started);
+
+    pool->deques = 0;
+}
+
+/******************************************************************************/
+/**                            PARALLEL BACKEND                              **/
+/******************************************************************************/
+
+/*
+ * Once the global declarations are known, the body of every function can
+ * be lowered to IR-C and compiled on its own. Each function is a job:
+ * the worker lowers it, seeing the global symbols declared before it, and
+ * compiles it into its own lines. The lines are then appended to the unit
+ * in declaration order, so the output is the same as the serial one.
+ *
+ * The workers read the interned strings and the types of the unit without
+ * locking, the unit's context is idle until they are done, and keep what
+ * they add in their own contexts: none of it outlives the function's
+ * lines, since asmorg copies label names. Labels are numbered per function
+ * (see lbl_gen) and get their final number when the lines are appended:
+ * the serial backend first lowers all the functions and then compiles
+ * them, so labels made by the lowering come before the ones made by the
+ * code generation.
+ */
+
+typedef struct
+{
+    GlobDecl *decl;
+    GlobDecl *irc_decl;
+    int globals_count;
+
+    int lbls_irc_count;
+    int lbls_count;
+    struct Asm *code;
+    int res;
+} BackendFunc;
+
+typedef struct
+{
+    EzcCtx *unit_ctx;
+    struct Asm *unit_as;
+    BackendFunc *funcs;
+} Backend;
+
+void
+backend_func_job(EzcPool *pool, EzcCtx *ctx, int job)
+{
+    Backend *backend;
+    BackendFunc *func;
+    ArenaMark mark;
+    jmp_buf on_fatal;
+    FuncParam *param;
+    int offset;
+
+    backend = (Backend *)pool->data;
+    func = &backend->funcs[job];
+
+    ezc_ctx_reset(ctx);
+    ctx->diag = backend->unit_ctx->diag;
+    ctx->shared = backend->unit_ctx->shared;
+    ctx->lbl_local = 1;
+
+    /* The IR-C of the function is scratch: it is gone once emitted */
+    ctx->arena = &ctx->irc_arena;
+    mark = arena_mark(ctx->arena);
+
+    ctx->on_fatal = &on_fatal;
+    if(setjmp(on_fatal) == 0)
+    {
+        /* Global symbols up to the function itself (see sym_get) */
+        ctx->shared_syms_count = func->globals_count + 1;
+
+        param = func->decl->params;
+        offset = 8;
+        while(param)
+        {
+            sym_add_func_param(ctx, param->id, param->type, offset);
+            offset += ALIGN(param->type->size, 4);
+            param = param->next;
+        }
+        func->irc_decl->func_def = func_def_to_irc(ctx, func->decl->func_def);
+        func->lbls_irc_count = ctx->lbl_count;
+
+        /* The code generation adds the function after its body */
+        sym_pop(ctx, 0);
+        ctx->shared_syms_count = func->globals_count;
+        func->code = asmnew(backend->unit_as->srcf, diag_stream(ctx));
+        if(!func->code)
+        {
+            fatal(ctx, "Cannot allocate memory for the output");
+        }
+        func->code->onfatal = &on_fatal;
+        compile_glob_decl(ctx, func->code, func->irc_decl);
+        func->code->onfatal = 0;
+        func->lbls_count = ctx->lbl_count;
+        func->res = 0;
+    }
+    ctx->on_fatal = 0;
+
+    func->irc_decl->func_def = 0;
+    arena_reset(ctx->arena, mark);
+
+    ctx->diag = 0;
+    ctx->shared = ctx;
+    ctx->shared_syms_count = 0;
+    ctx->lbl_local = 0;
+}
+
+/* An operand of a function: its labels "@n" get their final number */
+struct Op
+backend_op(struct Asm *as, BackendFunc *func, struct Op *op,
+           int lbl_irc_base, int lbl_base)
+{
+    char lbl[32];
+    int n;
+
+    if(op->type != OP_IMM || op->subtype != OP_LBL)
+    {
+        return(*op);
+    }
+    if(op->lbl->name[0] != '@')
+    {
+        return(oplbl(as, op->lbl->name));
+    }
+
+    n = atoi(op->lbl->name + 1);
+    if(n < func->lbls_irc_count)
+    {
+        sprintf(lbl, "___L%d", lbl_irc_base + n);
+    }
+    else
+    {
+        sprintf(lbl, "___L%d", lbl_base + n - func->lbls_irc_count);
+    }
+
+    return(oplbl(as, lbl));
+}
+
+/* Appends the lines of a function, giving its labels their numbers */
+void
+backend_emit(struct Asm *as, BackendFunc *func, int lbl_irc_base, int lbl_base)
+{
+    struct Line *l;
+    struct Op op1;
+    struct Op op2;
+
+    l = func->code->firstline;
+    while(l)
+    {
+        op1 = backend_op(as, func, &l->op1, lbl_irc_base, lbl_base);
+        op2 = backend_op(as, func, &l->op2, lbl_irc_base, lbl_base);
+        if(l->ins)
+        {
+            putins(as, l->ins, op1, op2);
+        }
+        else if(l->dir == DIR_LABEL)
+        {
+            asmlabel(as, op1.lbl->name);
+        }
+        else
+        {
+            asmdir(as, l->dir, l->val);
+        }
+        l = l->next;
+    }
+}
+
+/* Same as unit_to_irc + compile_unit, on ctx->backend_jobs threads */
+GlobDecl *
+backend_compile_unit(EzcCtx *ctx, struct Asm *as, GlobDecl *unit)
+{
+    Backend backend;
+    BackendFunc *func;
+    EzcPool pool;
+    GlobDecl *irc_unit;
+    GlobDecl *irc_curr;
+    GlobDecl *decl;
+    Sym *sym;
+    int funcs_count;
+    int lbl_irc_base;
+    int lbl_base;
+    int failed;
+    int i;
+
+    sym_reset(ctx);
+    tmp_vars_pool_reset(ctx);
+
+    funcs_count = 0;
+    decl = unit;
+    while(decl)
+    {
+        if(decl->kind == GLOB_DECL_FUNC && decl->func_def)
+        {
+            ++funcs_count;
+        }
+        decl = decl->next;
+    }
+
+    backend.unit_ctx = ctx;
+    backend.unit_as = as;
+    backend.funcs = (BackendFunc *)calloc(funcs_count + 1, sizeof(BackendFunc));
+    if(!backend.funcs)
+    {
+        fatal(ctx, "Cannot allocate memory for the backend");
+    }
+
+    /* Global symbols, in declaration order */
+    irc_unit = 0;
+    irc_curr = 0;
+    funcs_count = 0;
+    decl = unit;
+    while(decl)
+    {
+        if(irc_unit)
+        {
+            irc_curr->next = DUP_OBJ(GlobDecl, irc_curr->next, decl);
+            irc_curr = irc_curr->next;
+        }
+        else
+        {
+            irc_unit = DUP_OBJ(GlobDecl, irc_unit, decl);
+            irc_curr = irc_unit;
+        }
+        irc_curr->next = 0;
+
+        if(decl->kind != GLOB_DECL_VAR && decl->kind != GLOB_DECL_FUNC)
+        {
+            semantic_fatal(ctx, "invalid global declaration");
+        }
+
+        if(decl->kind == GLOB_DECL_FUNC && decl->func_def)
+        {
+            func = &backend.funcs[funcs_count++];
+            func->decl = decl;
+            func->irc_decl = irc_curr;
+            func->globals_count = ctx->sym_table_count;
+            func->res = 1;
+        }
+
+        sym = sym_add(ctx, decl->id, decl->type);
+        sym->global = 1;
+        sym->regparm = decl->regparm;
+
+        decl = decl->next;
+    }
+
+    pool.run = backend_func_job;
+    pool.data = &backend;
+    ezc_pool_run(ctx, &pool, funcs_count, ctx->backend_jobs);
+
+    failed = 0;
+    lbl_base = ctx->lbl_count;
+    for(i = 0;
+        i < funcs_count;
+        ++i)
+    {
+        failed |= backend.funcs[i].res;
+        lbl_base += backend.funcs[i].lbls_irc_count;
+    }
+
+    if(!failed)
+    {
+        sym_reset(ctx);
+        compile_entry(ctx, as);
+
+        lbl_irc_base = ctx->lbl_count;
+        func = backend.funcs;
+        irc_curr = irc_unit;
+        while(irc_curr)
+        {
+            if(func < backend.funcs + funcs_count && irc_curr == func->irc_decl)
+            {
+                backend_emit(as, func, lbl_irc_base, lbl_base);
+                lbl_irc_base += func->lbls_irc_count;
+                lbl_base += func->lbls_count - func->lbls_irc_count;
+                ++func;
+            }
+            else
+            {
+                compile_glob_decl(ctx, as, irc_curr);
+            }
+            irc_curr = irc_curr->next;
+        }
+        ctx->lbl_count = lbl_base;
+    }
+
+    for(i = 0;
+        i < funcs_count;
+        ++i)
+    {
+        asmfree(backend.funcs[i].code);
+    }
+    free(backend.funcs);
+
+    if(failed)
+    {
+        ezc_abort(ctx);
+    }
+
+    return(irc_unit);
+}
+
+/******************************************************************************/
+/**                                  API                                     **/
+/******************************************************************************/
+
+/*
+ * Usage:
+ *
+ *   ezc_init();              once per process, before any other call
+ *   ctx = ezc_ctx_create();  one per thread (or per compilation)
+ *   as = asmnew(name, diag); the lines of the unit
+ *   ezc_compile(ctx, src, len, as);
+ *   asmwrite(as, fname);     the executable (or asmprint(as, fout))
+ *   asmfree(as);
+ *   ezc_ctx_destroy(ctx);
+ *
+ * A context can be reused for any number of compilations. It keeps its
+ * interned strings between them, everything else is reset.
+ */
+
+#ifdef BENCH
+#include <time.h>
+
+/* Lexer microbenchmark: re-lexes the whole source for about one second */
+void
+bench_lexer(EzcCtx *ctx, char *src, long size)
+{
+    clock_t start;
+    double secs;
+    int runs;
+
+    runs = 0;
+    start = clock();
+    do
+    {
+        ctx->source = src;
+        ctx->source_line = 1;
+        tok_lex_all(ctx);
+        ++runs;
+        secs = (double)(clock() - start)/CLOCKS_PER_SEC;
+    }
+    while(secs < 1.0);
+
+    printf("[BENCH] lexer: %ld bytes, %d tokens, %.3f GB/s\n",
+           size, ctx->tokens_count, (double)size*runs/secs/1e9);
+
+    ctx->source_line = 1;
+}
+
+/* Times the parser over the token array */
+GlobDecl *
+bench_parser(EzcCtx *ctx)
+{
+    GlobDecl *res;
+    clock_t start;
+    double secs;
+
+    start = clock();
+    res = parse_unit(ctx);
+    secs = (double)(clock() - start)/CLOCKS_PER_SEC;
+
+    printf("[BENCH] parser: %d tokens in %.3f s (%d bytes per token)\n",
+           ctx->tokens_count, secs, (int)sizeof(Token));
+
+    return(res);
+}
+
+#include <sys/resource.h>
+
+/*
+ * Arena statistics of the unit. Before the arenas every allocation was a
+ * malloc call of its own.
+ */
+void
+bench_arenas(EzcCtx *ctx)
+{
+    struct rusage usage;
+    Arena *arenas[3];
+    long allocs_count;
+    long allocs_size;
+    long mallocs_count;
+    int i;
+
+    arenas[0] = &ctx->ast_arena;
+    arenas[1] = &ctx->irc_arena;
+    arenas[2] = &ctx->str_arena;
+    allocs_count = 0;
+    allocs_size = 0;
+    mallocs_count = 0;
+    for(i = 0;
+        i < 3;
+        ++i)
+    {
+        allocs_count += arenas[i]->allocs_count;
+        allocs_size += arenas[i]->allocs_size;
+        mallocs_count += arenas[i]->mallocs_count;
+    }
+
+    getrusage(RUSAGE_SELF, &usage);
+    printf("[BENCH] arenas: %ld allocations, %ld KB, %ld mallocs, "
+           "max RSS %ld KB\n",
+           allocs_count, allocs_size/1024, mallocs_count, usage.ru_maxrss);
+}
+
+/* Times the AST -> IR-C lowering of the unit */
+GlobDecl *
+bench_lowering(EzcCtx *ctx, GlobDecl *unit)
+{
+    GlobDecl *res;
+    GlobDecl *decl;
+    Stmt *stmt;
+    clock_t start;
+    double secs;
+    long count;
+
+    start = clock();
+    res = unit_to_irc(ctx, unit);
+    secs = (double)(clock() - start)/CLOCKS_PER_SEC;
+
+    count = 0;
+    decl = res;
+    while(decl)
+    {
+        if(decl->kind == GLOB_DECL_FUNC && decl->func_def)
+        {
+            stmt = decl->func_def->u.block;
+            while(stmt)
+            {
+                ++count;
+                stmt = stmt->next;
+            }
+        }
+        decl = decl->next;
+    }
+
+    printf("[BENCH] lowering: %ld IR-C statements in %.3f s\n", count, secs);
+
+    return(res);
+}
+
+/*
+ * Times the peephole pass, shows the instructions and the bytes of code
+ * it saved and how often each rule fired
+ */
+void
+bench_peephole(EzcCtx *ctx, struct Asm *as)
+{
+    struct Line *l;
+    clock_t start;
+    double secs;
+    long before;
+    long after;
+    unsigned int size;
+    int i;
+
+    before = 0;
+    for(l = as->firstline;
+        l;
+        l = l->next)
+    {
+        before += (l->ins != 0);
+    }
+
+    size = as->csize;
+    start = clock();
+    peephole(ctx, as);
+    secs = (double)(clock() - start)/CLOCKS_PER_SEC;
+
+    after = 0;
+    for(l = as->firstline;
+        l;
+        l = l->next)
+    {
+        after += (l->ins != 0);
+    }
+
+    printf("[BENCH] peephole: %ld -> %ld instructions, %u -> %u bytes "
+           "in %.3f s\n", before, after, size, as->csize, secs);
+    for(i = 0;
+        i < PEEP_RULES_COUNT;
+        ++i)
+    {
+        printf("[BENCH]   %-14s %d\n", peep_rules[i].name, ctx->peep_fired[i]);
+    }
+}
+#endif
+
+/* Initializes the process-wide read-only tables */
+void
+ezc_init()
+{
+    char_class_init();
+    isainit();
+    peep_init();
+}
+
+EzcCtx *
+ezc_ctx_create()
+{
+    EzcCtx *res;
+
+    res = (EzcCtx *)calloc(1, sizeof(EzcCtx));
+    if(res)
+    {
+        res->shared = res;
+        res->arena = &res->ast_arena;
+        res->peephole = 1;
+        res->label_table = (Label *)calloc(LBL_TABLE_SIZE, sizeof(Label));
+        res->label_table_cap = LBL_TABLE_SIZE;
+        res->label_index = (int *)calloc(2*LBL_TABLE_SIZE, sizeof(int));
+        res->label_index_cap = 2*LBL_TABLE_SIZE;
+        res->sym_table = (Sym *)calloc(SYM_TABLE_SIZE, sizeof(Sym));
+        res->sym_table_cap = SYM_TABLE_SIZE;
+        res->tmp_vars_pool = (Sym *)calloc(TMP_VARS_POOL_SIZE, sizeof(Sym));
+        if(!res->label_table || !res->label_index ||
+           !res->sym_table || !res->tmp_vars_pool)
+        {
+            fatal(0, "Cannot allocate memory for the compiler context");
+        }
+    }
+
+    return(res);
+}
+
+void
+ezc_ctx_destroy(EzcCtx *ctx)
+{
+    if(ctx)
+    {
+        arena_free(&ctx->str_arena);
+        arena_free(&ctx->ast_arena);
+        arena_free(&ctx->irc_arena);
+
+        free(ctx->type_table);
+        free(ctx->label_table);
+        free(ctx->label_index);
+        free(ctx->sym_table);
+        free(ctx->sym_index);
+        free(ctx->tmp_vars_pool);
+        free(ctx->reg_lives);
+        free(ctx->reg_marks);
+        free(ctx->tokens);
+        free(ctx->str_intern_table);
+        free(ctx);
+    }
+}
+
+/* Resets everything which belongs to a single unit */
+void
+ezc_ctx_reset(EzcCtx *ctx)
+{
+    ArenaMark empty;
+
+    empty.chunk = 0;
+    empty.ptr = 0;
+    arena_reset(&ctx->ast_arena, empty);
+    arena_reset(&ctx->irc_arena, empty);
+    ctx->arena = &ctx->ast_arena;
+
+    if(ctx->type_table)
+    {
+        memset(ctx->type_table, 0, ctx->type_table_cap*sizeof(Type *));
+    }
+    ctx->type_table_count = 0;
+
+    ctx->label_table_count = 0;
+    memset(ctx->label_index, 0, ctx->label_index_cap*sizeof(int));
+    ctx->sym_table_count = 0;
+    if(ctx->sym_index)
+    {
+        memset(ctx->sym_index, 0, ctx->sym_index_cap*sizeof(SymSlot));
+    }
+    ctx->sym_index_count = 0;
+
+    ctx->tokens_count = 0;
+    ctx->tok_pos = 0;
+
+    ctx->curr_func_type = 0;
+    ctx->lbl_count = 0;
+    ctx->tmp_vars_count = 0;
+    ctx->curr_block = 0;
+    ctx->curr_block_last = 0;
+    ctx->tmp_vars_pool_count = 0;
+    memset(ctx->peep_fired, 0, sizeof(ctx->peep_fired));
+}
+
+/*
+ * Compiles the unit in src (len bytes, followed by a NUL byte as mapsrc
+ * guarantees) and appends its code to as. Diagnostics go to ctx->diag.
+ * Returns 0 on success.
+ */
+int
+ezc_compile(EzcCtx *ctx, char *src, long len, struct Asm *as)
+{
+    jmp_buf on_fatal;
+    GlobDecl *unit;
+    int res;
+
+    ezc_ctx_reset(ctx);
+
+    ctx->on_fatal = &on_fatal;
+    as->onfatal = &on_fatal;
+    if(setjmp(on_fatal) == 0)
+    {
+        parser_init(ctx, src);
+#ifdef BENCH
+        bench_lexer(ctx, src, len);
+        unit = bench_parser(ctx);
+#else
+        (void)len;
+        unit = parse_unit(ctx);
+#endif
+        check_unit(ctx, unit);
+        fold_unit(ctx, unit);
+#ifdef PRINT
+        print_unit(ctx, unit);
+#endif
+        ctx->arena = &ctx->irc_arena;
+        if(ctx->backend_jobs > 1)
+        {
+            backend_compile_unit(ctx, as, unit);
+        }
+        else
+        {
+#ifdef BENCH
+            unit = bench_lowering(ctx, unit);
+#else
+            unit = unit_to_irc(ctx, unit);
+#endif
+#ifdef PRINT
+            printf("\n\n+++++++++++++++\nIRC\n+++++++++++++++\n\n");
+            print_unit(ctx, unit);
+            printf("\n\n+++++++++++++++\nx86\n+++++++++++++++\n\n");
+#endif
+            compile_unit(ctx, as, unit);
+        }
+        if(ctx->peephole)
+        {
+#ifdef BENCH
+            bench_peephole(ctx, as);
+#else
+            peephole(ctx, as);
+#endif
+        }
+#ifdef BENCH
+        bench_arenas(ctx);
+#endif
+        res = 0;
+    }
+    else
+    {
+        res = 1;
+    }
+    ctx->on_fatal = 0;
+    as->onfatal = 0;
+
+    return(res);
+}
+
+/*
+ * Compiles the file in_name into the executable out_name (the assembly
+ * text if ctx->emit_asm is set). If lines is not null it receives the
+ * number of lines of the source. Returns 0 on success.
+ */
+int
+ezc_compile_file(EzcCtx *ctx, char *in_name, char *out_name, long *lines)
+{
+    struct Asm *as;
+    FILE *fout;
+    char *src;
+    char *p;
+    long size;
+    int res;
+
+    res = 1;
+    src = mapsrc(in_name, &size);
+    if(!src)
+    {
+        fprintf(ctx->diag ? ctx->diag : stdout,
+                "[!] ERROR: Cannot read from file '%s'\n", in_name);
+        return(res);
+    }
+
+    if(lines)
+    {
+        *lines = 0;
+        for(p = src;
+            p < src + size;
+            ++p)
+        {
+            if(*p == '\n')
+            {
+                ++*lines;
+            }
+        }
+    }
+
+    as = asmnew(in_name, ctx->diag ? ctx->diag : stdout);
+    if(as)
+    {
+        res = ezc_compile(ctx, src, size, as);
+    }
+    else
+    {
+        fprintf(ctx->diag ? ctx->diag : stdout,
+                "[!] ERROR: Cannot allocate memory\n");
+    }
+    unmapsrc(src, size);
+
+    if(!res && ctx->emit_asm)
+    {
+        fout = fopen(out_name, "w");
+        if(fout)
+        {
+            asmprint(as, fout);
+            fclose(fout);
+        }
+        else
+        {
+            fprintf(ctx->diag ? ctx->diag : stdout,
+                    "[!] ERROR: Cannot write to file '%s'\n", out_name);
+            res = 1;
+        }
+    }
+    else if(!res)
+    {
+        res = asmwrite(as, out_name);
+    }
+    asmfree(as);
+
+    return(res);
+}
+
+/*
+ * Multi-file compilation: one job per unit. Every unit collects its
+ * diagnostics in memory, so they can be shown per file, in command line
+ * order, once all the workers are done.
+ */
+
+typedef struct
+{
+    char *in_name;
+    char *out_name;
+    long lines;
+    int res;
+    char *diag;
+    size_t diag_size;
+} EzcUnit;
+
+typedef struct
+{
+    EzcUnit *units;
+    int backend_jobs;
+    int emit_asm;
+    int regparm;
+    int peephole;
+} EzcUnits;
+
+void
+ezc_unit_job(EzcPool *pool, EzcCtx *ctx, int job)
+{
+    EzcUnits *units;
+    EzcUnit *unit;
+    FILE *diag;
+
+    units = (EzcUnits *)pool->data;
+    unit = &units->units[job];
+    diag = open_memstream(&unit->diag, &unit->diag_size);
+    ctx->diag = diag;
+    ctx->backend_jobs = units->backend_jobs;
+    ctx->emit_asm = units->emit_asm;
+    ctx->regparm = units->regparm;
+    ctx->peephole = units->peephole;
+    unit->res = ezc_compile_file(ctx, unit->in_name, unit->out_name,
+                                 &unit->lines);
+    ctx->diag = 0;
+    if(diag)
+    {
+        fclose(diag);
+    }
+}
+
+/*
+ * Compiles units_count units with (at most) workers_count threads, the
+ * calling one included, each unit with backend_jobs threads and regparm
+ * register arguments, through the peephole pass if peephole is set.
+ * Returns the number of units which failed.
+ */
+int
+ezc_compile_units(EzcUnit *units, int units_count,
+                  int workers_count, int backend_jobs, int emit_asm,
+                  int regparm, int peephole)
+{
+    EzcPool pool;
+    EzcUnits data;
+    int res;
+    int i;
+
+    for(i = 0;
+        i < units_count;
+        ++i)
+    {
+        units[i].res = 1;
+        units[i].lines = 0;
+        units[i].diag = 0;
+        units[i].diag_size = 0;
+    }
+
+    data.units = units;
+    data.backend_jobs = backend_jobs;
+    data.emit_asm = emit_asm;
+    data.regparm = regparm;
+    data.peephole = peephole;
+    pool.run = ezc_unit_job;
+    pool.data = &data;
+    ezc_pool_run(0, &pool, units_count, workers_count);
+
+    res = 0;
+    for(i = 0;
+        i < units_count;
+        ++i)
+    {
+        if(units[i].res)
+        {
+            ++res;
+        }
+    }
+
+    return(res);
+}
+
+/*
+ * Output name of a unit: the input name without ".c", followed by ".asm"
+ * for the assembly text. An executable of an input without ".c" gets
+ * ".out", so it never replaces its own source.
+ */
+char *
+ezc_out_name(char *in_name, int emit_asm)
+{
+    char *ext;
+    char *res;
+    int len;
+
+    len = strlen(in_name);
+    ext = emit_asm ? ".asm" : "";
+    if(len > 2 && !strcmp(in_name + len - 2, ".c"))
+    {
+        len -= 2;
+    }
+    else if(!emit_asm)
+    {
+        ext = ".out";
+    }
+
+    res = (char *)malloc(len + strlen(ext) + 1);
+    if(res)
+    {
+        memcpy(res, in_name, len);
+        strcpy(res + len, ext);
+    }
+
+    return(res);
+}
+
+#include <time.h>
+
+double
+ezc_time()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return((double)ts.tv_sec + (double)ts.tv_nsec/1e9);
+}
+
+/******************************************************************************/
+/**                                 SERVER                                   **/
+/******************************************************************************/
+
+/*
+ * `ezc --serve <socket>` listens on a Unix domain socket and compiles one
+ * unit per connection, up to EZC_SERVE_CHILDREN at the same time. A
+ * request is the input path, the output path, what to write there ("exe"
+ * or "asm") and the options "<backend_jobs> <regparm> <peephole>" (0 or
+ * -1 for the ones of the server), each terminated by a NUL byte. The
+ * reply is the exit status on its own line followed by the diagnostics.
+ *
+ * Every connection is handled by a child forked from the server, which
+ * compiles the request in a child of its own, on a copy of the context
+ * and of the tables set up at start (keywords included): if the compiler
+ * dies on a request (a crash on a malformed program, say), the first
+ * child replies with an error. The server only reaps the children which
+ * are done, so a slow request does not hold the others. A client has
+ * EZC_REQUEST_TIMEOUT seconds to send its request.
+ *
+ * `ezc --connect <socket> <input_file>...` is the client: it sends absolute
+ * paths (the server has its own working directory) and the options given
+ * on its command line, and behaves like the normal command line.
+ */
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define EZC_REQUEST_SIZE 8192
+#define EZC_REQUEST_TIMEOUT 10
+#define EZC_SERVE_CHILDREN 16
+
+int
+ezc_socket(char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr->sun_path))
+    {
+        return(-1);
+    }
+    strcpy(addr->sun_path, path);
+
+    return(socket(AF_UNIX, SOCK_STREAM, 0));
+}
+
+int
+ezc_write_all(int fd, char *buff, long size)
+{
+    long n;
+
+    while(size > 0)
+    {
+        n = write(fd, buff, size);
+        if(n <= 0)
+        {
+            return(1);
+        }
+        buff += n;
+        size -= n;
+    }
+
+    return(0);
+}
+
+/* Reads the request on conn, compiles it on c and replies */
+void
+ezc_serve_request(EzcCtx *ctx, int conn)
+{
+    FILE *diag;
+    char *diag_buff;
+    size_t diag_size;
+    char req[EZC_REQUEST_SIZE];
+    char status[16];
+    char *in_name;
+    char *out_name;
+    char *mode;
+    char *opts;
+    int backend_jobs;
+    int regparm;
+    int peephole;
+    long size;
+    long n;
+    int res;
+
+    /* The client shuts down its side once the request is sent */
+    size = 0;
+    while(size < EZC_REQUEST_SIZE - 1)
+    {
+        n = read(conn, req + size, EZC_REQUEST_SIZE - 1 - size);
+        if(n <= 0)
+        {
+            break;
+        }
+        size += n;
+    }
+    req[size] = 0;
+
+    diag_buff = 0;
+    diag_size = 0;
+    diag = open_memstream(&diag_buff, &diag_size);
+    ctx->diag = diag;
+
+    in_name = req;
+    out_name = req + strlen(req) + 1;
+    mode = 0;
+    if(out_name < req + size)
+    {
+        mode = out_name + strlen(out_name) + 1;
+    }
+    if(mode && mode < req + size && *in_name && *out_name &&
+       (!strcmp(mode, "exe") || !strcmp(mode, "asm")))
+    {
+        /* The options apply to this child's copy of the context only */
+        backend_jobs = 0;
+        regparm = -1;
+        peephole = -1;
+        opts = mode + strlen(mode) + 1;
+        if(opts < req + size)
+        {
+            sscanf(opts, "%d %d %d", &backend_jobs, &regparm, &peephole);
+        }
+        if(backend_jobs > 0)
+        {
+            ctx->backend_jobs = backend_jobs;
+        }
+        if(regparm >= 0 && regparm <= REGPARM_MAX)
+        {
+            ctx->regparm = regparm;
+        }
+        if(peephole >= 0)
+        {
+            ctx->peephole = (peephole != 0);
+        }
+
+        ctx->emit_asm = !strcmp(mode, "asm");
+        res = ezc_compile_file(ctx, in_name, out_name, 0);
+    }
+    else
+    {
+        fprintf(ctx->diag ? ctx->diag : stdout, "[!] ERROR: Invalid request\n");
+        res = 1;
+    }
+
+    ctx->diag = 0;
+    if(diag)
+    {
+        fclose(diag);
+    }
+
+    sprintf(status, "%d\n", res);
+    if(!ezc_write_all(conn, status, strlen(status)) && diag_buff)
+    {
+        ezc_write_all(conn, diag_buff, diag_size);
+    }
+    free(diag_buff);
+}
+
+/* Serves the connection conn, the compilation in a child of its own */
+void
+ezc_serve_conn(EzcCtx *ctx, int conn)
+{
+    char *crashed;
+    pid_t pid;
+    int wstatus;
+
+    fflush(stdout);
+    pid = fork();
+    if(pid == 0)
+    {
+        ezc_serve_request(ctx, conn);
+        close(conn);
+        _exit(0);
+    }
+
+    crashed = 0;
+    if(pid < 0)
+    {
+        crashed = "1\n[!] ERROR: Cannot start the compilation\n";
+    }
+    else if(waitpid(pid, &wstatus, 0) != pid || !WIFEXITED(wstatus))
+    {
+        crashed = "1\n[!] ERROR: The compiler crashed\n";
+    }
+    if(crashed)
+    {
+        ezc_write_all(conn, crashed, strlen(crashed));
+    }
 }
 
 void
-compile_decl(FILE *fout, Decl *decl)
+ezc_serve(char *path, int backend_jobs, int regparm, int peephole)
 {
-    Sym *sym;
-    int size;
+    struct sockaddr_un addr;
+    struct stat st;
+    struct timeval timeout;
+    EzcCtx *ctx;
+    char *error;
+    pid_t pid;
+    int children;
+    int fd;
+    int conn;
 
-    assert(decl->type && decl->type->size > 0);
-
-    size = ALIGN(decl->type->size, 4);
-    fprintf(fout, "\tsubl $%d,%%esp\n", size);
+    /* Only a socket nobody listens on anymore is replaced */
+    if(!lstat(path, &st))
+    {
+        if(!S_ISSOCK(st.st_mode))
+        {
+            fatal(0, "'%s' exists and is not a socket", path);
+        }
+        fd = ezc_socket(path, &addr);
+        if(fd >= 0 && !connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+        {
+            fatal(0, "A server is already listening on '%s'", path);
+        }
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+        unlink(path);
+    }
 
-    sym = sym_add(decl->id, decl->type);
-    sym->global = 0;
-    func_var_offset -= decl->type->size;
-    sym->offset = func_var_offset;
-}
+    fd = ezc_socket(path, &addr);
+    if(fd < 0)
+    {
+        fatal(0, "Cannot create the socket '%s'", path);
+    }
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 16))
+    {
+        fatal(0, "Cannot listen on the socket '%s'", path);
+    }
+    signal(SIGPIPE, SIG_IGN);
 
-void
-compile_stmt(FILE *fout, Stmt *stmt)
-{
-    int scope;
-    Stmt *substmt;
+    ctx = ezc_ctx_create();
+    ctx->backend_jobs = backend_jobs;
+    ctx->regparm = regparm;
+    ctx->peephole = peephole;
+    kword_init(ctx);
 
-    switch(stmt->kind)
+    children = 0;
+    for(;;)
     {
-        case STMT_DECL:
+        while(children > 0 && waitpid(-1, 0, WNOHANG) > 0)
         {
-            compile_decl(fout, stmt->u.decl);
-        } break;
-
-        case STMT_EXPR:
-        {
-            compile_expr(fout, stmt->u.expr);
-        } break;
-
-        case STMT_BLOCK:
+            --children;
+        }
+        if(children >= EZC_SERVE_CHILDREN && waitpid(-1, 0, 0) > 0)
         {
-            scope = sym_table_count;
-            substmt = stmt->u.block;
-            while(substmt)
-            {
-                compile_stmt(fout, substmt);
-                substmt = substmt->next;
-            }
-            sym_table_count = scope;
-        } break;
+            --children;
+        }
 
-        case STMT_RET:
+        conn = accept(fd, 0, 0);
+        if(conn < 0)
         {
-            if(stmt->u.expr)
-            {
-                compile_expr(fout, stmt->u.expr);
-            }
-            fprintf(fout, "\tpopl %%ebx\n");
-            fprintf(fout, "\tleave\n");
-            fprintf(fout, "\tret\n");
-        } break;
+            continue;
+        }
 
-        case STMT_LABEL:
-        {
-            fprintf(fout, "%s:\n", stmt->u.label);
-        } break;
+        /* A client which sends nothing only holds the server so long */
+        timeout.tv_sec = EZC_REQUEST_TIMEOUT;
+        timeout.tv_usec = 0;
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 
-        case STMT_GOTO:
+        fflush(stdout);
+        pid = fork();
+        if(pid == 0)
         {
-            fprintf(fout, "\tjmp %s\n", stmt->u.label);
-        } break;
+            close(fd);
+            ezc_serve_conn(ctx, conn);
+            close(conn);
+            _exit(0);
+        }
 
-        case STMT_IF:
+        if(pid < 0)
         {
-            compile_expr(fout, stmt->cond);
-            fprintf(fout, "\tcmpl $0,%%eax\n");
-            fprintf(fout, "\tjne %s\n", stmt->u.label);
-        } break;
-
-        default:
+            error = "1\n[!] ERROR: Cannot start the compilation\n";
+            ezc_write_all(conn, error, strlen(error));
+        }
+        else
         {
-            fatal("Invalid statement");
-        } break;
+            ++children;
+        }
+        close(conn);
     }
 }
 
-void
-compile_glob_decl(FILE *fout, GlobDecl *decl)
-{
-    Sym *sym;
-    int size;
-    FuncParam *param;
-    int sym_count;
-    int offset;
+/*
+ * Asks the server to compile in_name into out_name (the executable, or
+ * the assembly text if emit_asm is set), returns the status. The options
+ * not given (0 or -1) are the ones of the server.
+ */
+int
+ezc_connect(char *path, char *in_name, char *out_name, int emit_asm,
+            int backend_jobs, int regparm, int peephole)
+{
+    struct sockaddr_un addr;
+    char req[EZC_REQUEST_SIZE];
+    char opts[64];
+    char reply[4096];
+    char *in_path;
+    char *p;
+    int fd;
+    int len;
+    long n;
+    int res;
+    int status_done;
 
-    switch(decl->kind)
+    fd = ezc_socket(path, &addr);
+    if(fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
     {
-        case GLOB_DECL_VAR:
+        printf("[!] ERROR: Cannot connect to the server '%s'\n", path);
+        if(fd >= 0)
         {
-            size = ALIGN(decl->type->size, 4);
-            fprintf(fout, "%s:\n", decl->id);
-            fprintf(fout, "\t.zero $%d\n", size);
-
-            sym = sym_add(decl->id, decl->type);
-            sym->global = 1;
-        } break;
+            close(fd);
+        }
+        return(1);
+    }
 
-        case GLOB_DECL_FUNC:
+    in_path = realpath(in_name, 0);
+    len = strlen(in_path ? in_path : in_name) + 1;
+    memcpy(req, in_path ? in_path : in_name, len);
+    free(in_path);
+    if(out_name[0] != '/')
+    {
+        if(!getcwd(req + len, EZC_REQUEST_SIZE - len - 1))
+        {
+            req[len] = 0;
+        }
+        else
         {
-            func_var_offset = -4;
+            strcat(req + len, "/");
+        }
+    }
+    else
+    {
+        req[len] = 0;
+    }
+    sprintf(opts, "%d %d %d", backend_jobs, regparm, peephole);
+    if(len + strlen(req + len) + strlen(out_name) + 5 + strlen(opts) + 1 >
+       EZC_REQUEST_SIZE)
+    {
+        printf("[!] ERROR: Path too long\n");
+        close(fd);
+        return(1);
+    }
+    strcat(req + len, out_name);
+    len += strlen(req + len) + 1;
+    memcpy(req + len, emit_asm ? "asm" : "exe", 4);
+    len += 4;
+    memcpy(req + len, opts, strlen(opts) + 1);
+    len += strlen(opts) + 1;
 
-            if(decl->func_def)
-            {
-                fprintf(fout, "%s:\n", decl->id);
-                fprintf(fout, "\tpushl %%ebp\n");
-                fprintf(fout, "\tmovl %%esp,%%ebp\n");
-                fprintf(fout, "\tpushl %%ebx\n");
+    res = 1;
+    if(!ezc_write_all(fd, req, len))
+    {
+        shutdown(fd, SHUT_WR);
 
-                sym_count = sym_table_count;
-                param = decl->type->params;
-                offset = 8;
-                while(param)
+        /* Status line, then the diagnostics go straight to stdout */
+        res = 0;
+        status_done = 0;
+        while((n = read(fd, reply, sizeof(reply))) > 0)
+        {
+            p = reply;
+            while(!status_done && p < reply + n)
+            {
+                if(*p == '\n')
                 {
-                    sym_add_func_param(param->id, param->type, offset);
-                    offset += ALIGN(param->type->size, 4);
-                    param = param->next;
+                    status_done = 1;
                 }
-
-                compile_stmt(fout, decl->func_def);
-
-                fprintf(fout, "\tpopl %%ebx\n");
-                fprintf(fout, "\tleave\n");
-                fprintf(fout, "\tret\n");
-
-                sym_table_count = sym_count;
+                else
+                {
+                    res = res*10 + (*p - '0');
+                }
+                ++p;
             }
-
-            sym = sym_add(decl->id, decl->type);
-            sym->global = 1;
-        } break;
-
-        default:
-        {
-            fatal("Invalid global declaration");
-        } break;
-    }
-}
-
-void
-compile_unit(FILE *fout, GlobDecl *unit)
-{
-    GlobDecl *curr;
-#ifdef DEBUG
-    FILE *flibc;
-    char ch;
-#if 0
-    FuncParam *params;
-#endif
-#endif
-
-    sym_reset();
-
-    fprintf(fout, "___entry:\n");
-    fprintf(fout, "\tpushl %%ebp\n");
-    fprintf(fout, "\tmovl %%esp,%%ebp\n");
-    fprintf(fout, "\tcall main\n");
-    fprintf(fout, "\tmovl %%eax,%%ebx\n");
-    fprintf(fout, "\tmovl $1,%%eax\n");
-    fprintf(fout, "\tsyscall\n");
-    fprintf(fout, "\tleave\n");
-    fprintf(fout, "\tret\n");
-
-#ifdef DEBUG
-    fprintf(fout, "\n");
-    flibc = fopen("libc.asm", "r");
-    if(flibc)
-    {
-        ch = (char)fgetc(flibc);
-        while(ch != EOF)
+            fwrite(p, 1, reply + n - p, stdout);
+        }
+        if(!status_done)
         {
-            fprintf(fout, "%c", ch);
-            ch = (char)fgetc(flibc);
+            printf("[!] ERROR: No reply from the server '%s'\n", path);
+            res = 1;
         }
-        fclose(flibc);
     }
+    close(fd);
 
-#if 0
-    params = make_func_param(str_intern("c"), type_int());
-    params->next = 0;
-    sym_add(str_intern("putchar"), type_func(type_int(), params));
-
-    params = make_func_param(str_intern("nbytes"), type_int());
-    params->next = make_func_param(str_intern("src"), type_ptr(type_void()));
-    params->next->next = make_func_param(str_intern("dst"), type_ptr(type_void()));
-    params->next->next->next = 0;
-    sym_add(str_intern("___memcpy_aligned"), type_func(type_int(), params));
-#endif
-#else
-    /* TODO: Hardcode libc into a C string */
-#endif
-
-    curr = unit;
-    while(curr)
-    {
-        compile_glob_decl(fout, curr);
-        curr = curr->next;
-    }
+    return(res);
 }
 
 /************************************************/
@@ -5408,71 +10246,256 @@ compile_unit(FILE *fout, GlobDecl *unit)
 /************************************************/
 
 
-#if 0
-#define ASMORG_API
-#include "asmorg.c"
-#endif
-
 #include <assert.h>
 
+#ifndef EZC_API
+
 int
 main(int argc, char *argv[])
 {
-    FILE *fin;
-    FILE *fout;
-    char *fin_name;
-    char *src;
-    GlobDecl *unit;
-    long fsize;
+    EzcUnit *units;
+    int units_count;
+    int jobs;
+    int backend_jobs;
+    int regparm;
+    int peephole;
+    char *serve;
+    char *server;
+    char *out_name;
+    int emit_asm;
+    char opt;
+    char *arg;
+    EzcCtx *ctx;
+    double start;
+    double secs;
+    long lines;
+    int res;
+    int i;
+
+    units = (EzcUnit *)calloc(argc, sizeof(EzcUnit));
+    if(!units)
+    {
+        return(1);
+    }
+    units_count = 0;
+    jobs = 0;
+    backend_jobs = 0;
+    regparm = -1;
+    peephole = -1;
+    serve = 0;
+    server = 0;
+    out_name = 0;
+    emit_asm = 0;
 
 #if DEBUG
-    fin_name = "tests/test.c";
+    units[units_count++].in_name = "tests/test.c";
 #else
-    if(argc <= 1)
+    for(i = 1;
+        i < argc;
+        ++i)
+    {
+        if(!strcmp(argv[i], "--serve") && i + 1 < argc)
+        {
+            serve = argv[++i];
+        }
+        else if(!strcmp(argv[i], "--connect") && i + 1 < argc)
+        {
+            server = argv[++i];
+        }
+        else if(!strcmp(argv[i], "-o") && i + 1 < argc)
+        {
+            out_name = argv[++i];
+        }
+        else if(!strncmp(argv[i], "-mregparm=", 10))
+        {
+            /* The first arguments of the unit's functions in registers */
+            regparm = atoi(argv[i] + 10);
+            if(regparm < 0 || regparm > REGPARM_MAX)
+            {
+                units_count = 0;
+                break;
+            }
+        }
+        else if(!strcmp(argv[i], "-O0") || !strcmp(argv[i], "-O1"))
+        {
+            /* -O0: the lines go to the assembler as they are generated */
+            peephole = (argv[i][2] == '1');
+        }
+        else if(!strcmp(argv[i], "-S"))
+        {
+            /* The assembly text, for debugging (and for asmorg) */
+            emit_asm = 1;
+        }
+        else if(!strncmp(argv[i], "-j", 2) || !strncmp(argv[i], "-J", 2))
+        {
+            opt = argv[i][1];
+            arg = argv[i] + 2;
+            if(!*arg && i + 1 < argc)
+            {
+                arg = argv[++i];
+            }
+            if(atoi(arg) <= 0)
+            {
+                units_count = 0;
+                break;
+            }
+
+            /* -j: files at the same time, -J: functions of a file */
+            if(opt == 'j')
+            {
+                jobs = atoi(arg);
+            }
+            else
+            {
+                backend_jobs = atoi(arg);
+            }
+        }
+        else if(argv[i][0] == '-')
+        {
+            if(!strcmp(argv[i], "--serve") || !strcmp(argv[i], "--connect") ||
+               !strcmp(argv[i], "-o"))
+            {
+                printf("[!] ERROR: Missing argument of '%s'\n", argv[i]);
+            }
+            else
+            {
+                printf("[!] ERROR: Unknown option '%s'\n", argv[i]);
+            }
+            units_count = 0;
+            break;
+        }
+        else
+        {
+            units[units_count++].in_name = argv[i];
+        }
+    }
+
+    /* The client sends the options not given as -1, for the server's */
+    if(!server)
+    {
+        regparm = (regparm < 0) ? 0 : regparm;
+        peephole = (peephole < 0) ? 1 : peephole;
+    }
+
+    if(serve)
+    {
+        ezc_init();
+        ezc_serve(serve, backend_jobs, regparm, peephole);
+    }
+
+    /* -o names the output of a single file, -j is for local compilations */
+    if(units_count <= 0 || (out_name && units_count > 1) || (server && jobs))
     {
-        printf("Usage: ./ezc <input_file> [<output_file>]\n");
+        printf("Usage: ./ezc [-S] [-O0] [-mregparm=<n>] [-o <output_file>] <input_file>\n"
+               "       ./ezc [-S] [-O0] [-mregparm=<n>] [-j <jobs>] [-J <jobs>] <input_file>...\n"
+               "       ./ezc [-J <jobs>] [-O0] [-mregparm=<n>] --serve <socket>\n"
+               "       ./ezc [-S] [-O0] [-mregparm=<n>] [-J <jobs>] "
+               "[-o <output_file>] --connect <socket> <input_file>...\n");
         return(1);
     }
-    fin_name = argv[1];
 #endif
 
-    fin = fopen(fin_name, "r");
-    fseek(fin, 0, SEEK_END);
-    fsize = ftell(fin);
-    fseek(fin, 0, SEEK_SET);
+    if(server)
+    {
+        res = 0;
+        for(i = 0;
+            i < units_count;
+            ++i)
+        {
+            if(units_count == 1)
+            {
+                res |= ezc_connect(server, units[i].in_name,
+                                   out_name ? out_name :
+                                   emit_asm ? "a.out.asm" : "a.out",
+                                   emit_asm, backend_jobs, regparm, peephole);
+            }
+            else
+            {
+                arg = ezc_out_name(units[i].in_name, emit_asm);
+                if(!arg)
+                {
+                    fatal(0, "Cannot allocate memory");
+                }
+                res |= ezc_connect(server, units[i].in_name, arg, emit_asm,
+                                   backend_jobs, regparm, peephole);
+                free(arg);
+            }
+        }
+        free(units);
 
-    src = (char *)malloc(fsize);
-    fread(src, fsize, 1, fin);
-    fclose(fin);
-    src[fsize - 1] = 0;
+        return(res);
+    }
 
-    fout = fopen("a.out.asm", "w");
+    ezc_init();
 
-#if 0
-    src = "int putchar(int c);\n"
-          "int ___memcpy_aligned(void *dst, void *src, int nbytes);\n"
-          "int main() {\n"
-          "    int i;\n"
-          "    for(i = 97; i < 123; ++i) putchar(i);\n"
-          "    return 9;\n"
-          "}";
-#endif
+    /* A single file: out_name, diagnostics on stdout */
+    if(units_count == 1 && !jobs)
+    {
+        ctx = ezc_ctx_create();
+        ctx->backend_jobs = backend_jobs;
+        ctx->emit_asm = emit_asm;
+        ctx->regparm = regparm;
+        ctx->peephole = peephole;
+        res = ezc_compile_file(ctx, units[0].in_name,
+                               out_name ? out_name :
+                               emit_asm ? "a.out.asm" : "a.out", 0);
+        ezc_ctx_destroy(ctx);
+        free(units);
 
-    parser_init(src);
-    unit = parse_unit();
-    check_unit(unit);
-#ifdef PRINT
-    print_unit(unit);
-#endif
-    unit = unit_to_irc(unit);
-#ifdef PRINT
-    printf("\n\n+++++++++++++++\nIRC\n+++++++++++++++\n\n");
-    print_unit(unit);
-    printf("\n\n+++++++++++++++\nx86\n+++++++++++++++\n\n");
-#endif
-    compile_unit(fout, unit);
+        return(res);
+    }
+
+    for(i = 0;
+        i < units_count;
+        ++i)
+    {
+        if(out_name)
+        {
+            units[i].out_name = (char *)malloc(strlen(out_name) + 1);
+            if(units[i].out_name)
+            {
+                strcpy(units[i].out_name, out_name);
+            }
+        }
+        else
+        {
+            units[i].out_name = ezc_out_name(units[i].in_name, emit_asm);
+        }
+        if(!units[i].out_name)
+        {
+            fatal(0, "Cannot allocate memory");
+        }
+    }
 
-    fclose(fout);
+    start = ezc_time();
+    res = ezc_compile_units(units, units_count, jobs ? jobs : 1, backend_jobs,
+                            emit_asm, regparm, peephole);
+    secs = ezc_time() - start;
 
-    return(0);
+    lines = 0;
+    for(i = 0;
+        i < units_count;
+        ++i)
+    {
+        if(units[i].diag_size)
+        {
+            printf("[*] %s:\n", units[i].in_name);
+            fwrite(units[i].diag, 1, units[i].diag_size, stdout);
+        }
+        lines += units[i].lines;
+        free(units[i].diag);
+        free(units[i].out_name);
+    }
+
+    printf("[*] %d files (%d failed), %ld lines in %.3fs: "
+           "%.1f files/s, %.0f lines/s\n",
+           units_count, res, lines, secs,
+           secs > 0.0 ? units_count/secs : 0.0,
+           secs > 0.0 ? lines/secs : 0.0);
+
+    free(units);
+
+    return(res ? 1 : 0);
 }
+
+#endif